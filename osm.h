@@ -17,8 +17,44 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#ifndef OSM_H
+#define OSM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
 #define OSM_TAG_SIZE 255 /**< Maximum length of key/value strings in OSM tags */
 
+/* Element types */
+#define OSM_NODE     0
+#define OSM_WAY      1
+#define OSM_RELATION 2
+
+/* Sets of element types, for osm_reader_open() */
+#define OSM_NODES     (1 << OSM_NODE)
+#define OSM_WAYS      (1 << OSM_WAY)
+#define OSM_RELATIONS (1 << OSM_RELATION)
+#define OSM_ALL_TYPES (OSM_NODES | OSM_WAYS | OSM_RELATIONS)
+
+/* Element fields that may be requested in a struct osm_projection */
+#define OSM_FIELD_TAGS    0x01 /**< Key/value attribute tags */
+#define OSM_FIELD_MEMBERS 0x02 /**< Member nodes of ways, member nodes and ways of relations */
+#define OSM_FIELD_ALL     (OSM_FIELD_TAGS | OSM_FIELD_MEMBERS)
+/** Version numbers of XML elements, which are otherwise only read from
+ * full-history files; not part of OSM_FIELD_ALL. PBF input always
+ * supplies them where present. */
+#define OSM_FIELD_VERSION 0x04
+
+/* Output formats */
+#define OSM_FORMAT_XML 0 /**< OSM XML (API v0.6) */
+#define OSM_FORMAT_PBF 1 /**< OSM PBF (protocol buffer binary format) */
+#define OSM_FORMAT_CHANGE 2 /**< osmChange XML, see osm_output_action() */
+
+/* Actions in osmChange output */
+#define OSM_ACTION_CREATE 0
+#define OSM_ACTION_MODIFY 1
+#define OSM_ACTION_DELETE 2
+
 /**
  * \brief Structure describing an OSM key/value attribute tag
  * 
@@ -53,6 +89,9 @@ struct osm_node
     struct osm_tag *tags; /**< Array of "tag_count" attribute tags attached to this node */
     int tag_count;        /**< Number of key/value attribute tags attached to this node */
     unsigned int id;      /**< Unique node ID. Should be upgraded to 64-bit integer soon. */
+    unsigned int version; /**< Version number, or 0 if not read; see OSM_FIELD_VERSION */
+    long long timestamp;  /**< Time of this version in seconds since 1970; only read from full-history files */
+    char deleted;         /**< Boolean; this version deletes the node (visible="false") */
 };
 
 /**
@@ -68,6 +107,9 @@ struct osm_way
     unsigned int *nodes;  /**< Array of "node_count" node IDs that form this way */
     struct osm_tag *tags; /**< Array of "tag_count" attribute tags attached to this way */
     unsigned int id;      /**< Unique way ID. 32-bit unsigned integer. */
+    unsigned int version; /**< Version number, or 0 if not read; see OSM_FIELD_VERSION */
+    long long timestamp;  /**< Time of this version in seconds since 1970; only read from full-history files */
+    char deleted;         /**< Boolean; this version deletes the way (visible="false") */
 };
 
 /**
@@ -90,6 +132,9 @@ struct osm_relation
     char (*way_roles)[OSM_TAG_SIZE + 1];
     struct osm_tag *tags; /**< Array of "tag_count" attribute tags attached to this way */
     unsigned int id;      /**< Unique relation ID. 32-bit unsigned integer. */
+    unsigned int version; /**< Version number, or 0 if not read; see OSM_FIELD_VERSION */
+    long long timestamp;  /**< Time of this version in seconds since 1970; only read from full-history files */
+    char deleted;         /**< Boolean; this version deletes the relation (visible="false") */
 };
 
 /** Callback for processing nodes */
@@ -98,6 +143,28 @@ typedef void osm_node_callback_t(struct osm_node *, void *);
 typedef void osm_way_callback_t(struct osm_way *, void *);
 /** Callback for processing relations */
 typedef void osm_relation_callback_t(struct osm_relation *, void *);
+/** 
+ * Callback for filtering elements on type (OSM_NODE, OSM_WAY or OSM_RELATION)
+ * and ID, before the rest of the element is parsed. Should return 1 if
+ * the element is of interest, otherwise 0.
+ */
+typedef int osm_filter_callback_t(int type, unsigned int id, void *);
+
+/**
+ * \brief Structure describing which parts of the OSM data are of interest
+ *
+ * Element types that have no callback registered are never parsed, and
+ * parsing of an element is abandoned as soon as its ID has been rejected
+ * by the filter callback. The bodies of skipped elements are scanned only
+ * for their closing tag.
+ */
+struct osm_projection
+{
+    /** OSM_FIELD_* flags giving the fields needed for each element type */
+    unsigned char fields[3];
+    /** Optional filter on element ID; NULL if all elements are of interest */
+    osm_filter_callback_t *filter;
+};
 
 /* osm_planet.c */
 
@@ -144,6 +211,154 @@ int osm_planet_readln(struct osm_planet *osf, char **line);
  */
 int osm_planet_close(struct osm_planet *osf);
 
+/**
+ * \brief Set the amount of compressed data read ahead by osm_planet_open()
+ *
+ * Applies to files opened after the call. The default is 4 reads of 4 MB.
+ *
+ * \param depth     Number of reads kept in flight
+ * \param read_size Size of each read in bytes
+ */
+void osm_planet_set_readahead(int depth, size_t read_size);
+
+/* bzip2 decoders for osm_planet_set_decoder() */
+#define OSM_BZIP2_BUILTIN 0 /**< The decoder in osm_bzip2.c */
+#define OSM_BZIP2_LIBBZ2  1 /**< libbz2 */
+
+/**
+ * \brief Choose the bzip2 decoder used by osm_planet_open()
+ *
+ * Applies to files opened after the call. The default is
+ * OSM_BZIP2_LIBBZ2.
+ *
+ * \param decoder OSM_BZIP2_BUILTIN or OSM_BZIP2_LIBBZ2
+ */
+void osm_planet_set_decoder(int decoder);
+
+/* osm_cache.c */
+
+/**
+ * \brief Set the memory available for caching decompressed input files
+ *
+ * While a limit is set, each compressed XML file opened with
+ * osm_planet_open() is recorded as it is decompressed the first time it
+ * is read, and later openings of it read the recording instead. Data
+ * beyond the limit is compressed with a fast LZ77 codec into temporary
+ * files in $TMPDIR, using at most half of the space free there. A file
+ * whose recording does not fit, or that is not compressed, is
+ * decompressed again each time. A file not read to the end is recorded
+ * again the next time it is read.
+ *
+ * \param limit
+ *   Limit in bytes, shared by all files. 0, the default, disables
+ *   caching and frees all recordings, and must only be set when no
+ *   cached file is open.
+ */
+void osm_cache_set_limit(size_t limit);
+
+/**
+ * \brief Open the cache of a file, either to record or to read it
+ *
+ * \param filename Full path to the file, as given to osm_planet_open()
+ * \param replay
+ *   Pointer to int set to 1 if the file has been recorded and should be
+ *   read with osm_cache_read(), or 0 if it is to be recorded with
+ *   osm_cache_write()
+ *
+ * \return
+ *   Pointer to a struct osm_cache object which should be passed in
+ *   subsequent calls to osm_cache_*() functions, or NULL if the file is
+ *   not to be cached
+ */
+struct osm_cache *osm_cache_open(const char *filename, int *replay);
+
+/**
+ * \brief Append the next chunk of decompressed data to a recording
+ *
+ * \return
+ *   0 on success, or 1 if the recording has been dropped, in which case
+ *   the cache should be closed
+ */
+int osm_cache_write(struct osm_cache *cache, const unsigned char *data, size_t len);
+
+/**
+ * \brief Read the next chunk of a recording
+ *
+ * Chunks are returned as they were written.
+ *
+ * \param buff Buffer for the data
+ * \param size Size of the buffer, at least that of the largest chunk written
+ * \param len  Pointer into which the number of bytes read is placed
+ *
+ * \return
+ *   0 if a chunk was read, 2 at the end of the recording, otherwise 1
+ */
+int osm_cache_read(struct osm_cache *cache, unsigned char *buff, size_t size, size_t *len);
+
+/* How a recording ends, for osm_cache_close() */
+#define OSM_CACHE_DROPPED  0 /**< Dropped for good; the file is not to be cached */
+#define OSM_CACHE_COMPLETE 1 /**< The whole file was written; it can be read from now on */
+#define OSM_CACHE_STOPPED  2 /**< Not read to the end; dropped, and recorded again next time */
+
+/**
+ * \brief Close the cache of a file
+ *
+ * \param end
+ *   OSM_CACHE_* value saying how a recording ends; ignored when reading
+ */
+void osm_cache_close(struct osm_cache *cache, int end);
+
+/* osm_readahead.c */
+
+/**
+ * \brief Open a file for sequential reading with several reads in flight
+ *
+ * Reads are submitted with io_uring where the kernel supports it, and
+ * otherwise performed with pread() by a pool of threads. Files that are
+ * not regular files, such as pipes, are read one chunk at a time.
+ *
+ * \param filename  Full path to the file
+ * \param depth     Number of reads to keep in flight (at most 64)
+ * \param read_size Size of each read in bytes
+ *
+ * \return
+ *   Pointer to a struct osm_readahead object which should be passed in
+ *   subsequent calls to osm_readahead_*() functions, or NULL on failure
+ *   to open the file
+ */
+struct osm_readahead *osm_readahead_open(const char *filename, int depth, size_t read_size);
+
+/**
+ * \brief Retrieve the next chunk of the file
+ *
+ * Waits for the read of the chunk to complete if necessary; the time
+ * spent waiting is reported by osm_readahead_close() in verbose mode.
+ *
+ * \param data Pointer to pointer into which the address of the data is
+ *             placed. The data remains valid until the next call.
+ * \param len  Pointer to variable into which the length of the data is placed
+ *
+ * \return
+ *   0 if a chunk was returned, 2 at end of file, otherwise 1
+ */
+int osm_readahead_next(struct osm_readahead *ra, const unsigned char **data, size_t *len);
+
+/**
+ * \brief Print the read statistics of each file when it is closed
+ *
+ * \param on Boolean; off by default
+ */
+void osm_readahead_set_verbose(int on);
+
+/**
+ * \brief Close the file, print the read statistics in verbose mode and
+ *        free the struct osm_readahead object
+ *
+ * \return
+ *   1 if there was an error closing the file, otherwise 0
+ */
+int osm_readahead_close(struct osm_readahead *ra);
+
 /* osm_parse.c */
 
 /**
@@ -165,6 +380,30 @@ int osm_planet_close(struct osm_planet *osf);
  */
 struct osm_parse *osm_parse_init(osm_node_callback_t *, osm_way_callback_t *, osm_relation_callback_t *, void *);
 
+/**
+ * \brief Restrict parsing to the elements and fields of interest
+ *
+ * By default all fields of every element type that has a callback are
+ * parsed and no filter is applied.
+ *
+ * \param parse
+ *   Pointer to struct osm_parse object as obtained from a previous call
+ *   to osm_parse_init()
+ * \param proj
+ *   Pointer to struct osm_projection describing the data of interest. The
+ *   structure is copied and need not remain valid after the call.
+ */
+void osm_parse_set_projection(struct osm_parse *parse, const struct osm_projection *proj);
+
+/**
+ * \brief Start parsing within the <osm> element
+ *
+ * For input that starts part way through a file, such as after a call to
+ * osm_seek_to(). Lines before the start of the first element are ignored
+ * as usual.
+ */
+void osm_parse_resume(struct osm_parse *parse);
+
 /**
  * \brief Ingest a single line of OpenStreetMap (API v0.6) XML data
  *
@@ -184,6 +423,111 @@ struct osm_parse *osm_parse_init(osm_node_callback_t *, osm_way_callback_t *, os
  */
 int osm_parse_ingest(struct osm_parse *parse, char *line);
 
+/**
+ * \brief Check whether an element is of interest before decoding it
+ *
+ * For use by readers of input formats other than XML, which should then
+ * decode only the fields given by osm_parse_fields() and pass the element
+ * to osm_parse_deliver_node(), osm_parse_deliver_way() or
+ * osm_parse_deliver_relation() as appropriate.
+ *
+ * \param parse
+ *   Pointer to struct osm_parse object as obtained from a previous call
+ *   to osm_parse_init()
+ * \param type
+ *   Element type (OSM_NODE, OSM_WAY or OSM_RELATION)
+ * \param id
+ *   Element ID
+ *
+ * \return
+ *   1 if the element is of interest, otherwise 0
+ */
+int osm_parse_wants(struct osm_parse *parse, int type, unsigned int id);
+
+/**
+ * \brief Retrieve the fields of interest for an element type
+ *
+ * \return
+ *   Bitwise OR of the OSM_FIELD_* flags set in the current projection
+ */
+unsigned char osm_parse_fields(struct osm_parse *parse, int type);
+
+/**
+ * \brief Collapse the versions of each element in a full-history file
+ *
+ * In full-history files every version of an element appears, one after
+ * the other in order of version. Once this is enabled, only one version
+ * of each element is passed to the callbacks: the latest, or the latest
+ * made at or before a given time. Elements whose chosen version is a
+ * deletion are not passed on at all. The version chosen is only known
+ * when the next element starts, so it is held until then; call
+ * osm_parse_flush() at the end of the data to deliver the last element.
+ *
+ * \param parse
+ *   Pointer to struct osm_parse object as obtained from a previous call
+ *   to osm_parse_init()
+ * \param as_of
+ *   Time in seconds since 1970 to take the state of the data at, or 0
+ *   for the latest versions
+ */
+void osm_parse_set_history(struct osm_parse *parse, long long as_of);
+
+/**
+ * \brief Deliver the element held back by osm_parse_set_history() mode
+ *
+ * Called automatically when the end of OSM XML data is ingested and at
+ * the end of a PBF file.
+ */
+void osm_parse_flush(struct osm_parse *parse);
+
+/**
+ * \brief Keep the XML text of each element as it appeared in the input
+ *
+ * The lines of each element not skipped by the projection's filter are
+ * copied as they are read, so that an element of interest can later be
+ * written out unchanged with osm_output_raw() rather than formatted
+ * again from its fields. Line endings are normalised to a single '\n'.
+ *
+ * \param parse
+ *   Pointer to struct osm_parse object as obtained from a previous call
+ *   to osm_parse_init()
+ * \param strip_metadata
+ *   Boolean; remove the version, timestamp, changeset, uid, user and
+ *   visible attributes from the opening tag of each element
+ */
+void osm_parse_set_raw(struct osm_parse *parse, int strip_metadata);
+
+/**
+ * \brief Retrieve the XML text of the element being passed to a callback
+ *
+ * May only be called from within a node, way or relation callback.
+ *
+ * \param len
+ *   Pointer to a size_t into which the length of the text is placed
+ *
+ * \return
+ *   Pointer to the text, which is not null-terminated, or NULL if it
+ *   was not kept (see osm_parse_set_raw()) or the element was not read
+ *   from XML
+ */
+const char *osm_parse_raw(struct osm_parse *parse, size_t *len);
+
+/**
+ * \brief Convert an OSM timestamp such as "2012-03-04T05:06:07Z" to
+ *        seconds since 1970
+ *
+ * \return
+ *   The time, or -1 if the string is not a valid timestamp
+ */
+long long osm_parse_timestamp(const char *str);
+
+/** \brief Pass a node decoded by an external reader to the node callback */
+void osm_parse_deliver_node(struct osm_parse *parse, struct osm_node *node);
+/** \brief Pass a way decoded by an external reader to the way callback */
+void osm_parse_deliver_way(struct osm_parse *parse, struct osm_way *way);
+/** \brief Pass a relation decoded by an external reader to the relation callback */
+void osm_parse_deliver_relation(struct osm_parse *parse, struct osm_relation *rel);
+
 /**
  * \brief Destroy a struct osm_parse object and free the memory used by it
  * 
@@ -192,3 +536,994 @@ int osm_parse_ingest(struct osm_parse *parse, char *line);
  *   to osm_parse_init
  */
 void osm_parse_destroy(struct osm_parse *parse);
+
+/* osm_escape.c */
+
+/**
+ * \brief Read an XML attribute value, decoding entities
+ *
+ * The five named entities and numeric character references, decimal or
+ * hexadecimal, are decoded, the latter to UTF-8. Unrecognised entities
+ * are left as they are. Values too long for the buffer are truncated
+ * without splitting a UTF-8 sequence.
+ *
+ * \param dest Buffer for the null-terminated value
+ * \param size Size of the buffer, at least 1
+ * \param src
+ *   Pointer to the first character of the value. Advanced past the
+ *   closing double quote, or to the end of the string if there is none.
+ *
+ * \return
+ *   Length of the value placed in dest
+ */
+size_t osm_xml_unescape(char *dest, size_t size, const char **src);
+
+/**
+ * \brief Escape a string for use as an XML attribute value
+ *
+ * Double quotes, ampersands, angle brackets and ASCII control characters
+ * are replaced by entities.
+ *
+ * \param dest
+ *   Buffer for the null-terminated result, of at least 6 times the length
+ *   of src plus 1 bytes
+ * \param src Null-terminated string
+ *
+ * \return
+ *   Length of the result placed in dest
+ */
+size_t osm_xml_escape(char *dest, const char *src);
+
+/* osm_pbf.c */
+
+/**
+ * \brief Open an OpenStreetMap PBF (protocol buffer binary format) file
+ *
+ * Blobs are decompressed and decoded in parallel by a pool of worker
+ * threads started here, one per online CPU.
+ *
+ * \param filename Full path to the PBF file
+ *
+ * \return
+ *   Pointer to a struct osm_pbf object which should be passed in subsequent
+ *   calls to osm_pbf_*() functions, or NULL on failure to open the file.
+ */
+struct osm_pbf *osm_pbf_open(const char *filename);
+
+/**
+ * \brief Deliver the elements of the next data block in the PBF file
+ *
+ * Blocks are delivered in file order. Elements of interest are passed
+ * through the callbacks registered with the parser, exactly as for XML
+ * input ingested with osm_parse_ingest().
+ *
+ * \param pbf
+ *   Pointer to struct osm_pbf object, as previously obtained from a call
+ *   to osm_pbf_open().
+ * \param parse
+ *   Pointer to struct osm_parse object holding the callbacks and projection
+ *
+ * \return
+ *   0 if a block was successfully delivered, 2 at end of file, otherwise 1
+ */
+int osm_pbf_ingest(struct osm_pbf *pbf, struct osm_parse *parse);
+
+/**
+ * \brief Close PBF file and stop the worker threads
+ *
+ * \return
+ *   1 if there was an error closing the file, otherwise 0
+ */
+int osm_pbf_close(struct osm_pbf *pbf);
+
+/* osm_seek.c */
+
+/**
+ * \brief Open an XML file sorted by type and ID for random access
+ *
+ * The file may be compressed with bzip2, or plain XML. It must hold
+ * elements in the order written by osmrail and found in planet files:
+ * nodes, then ways, then relations, each in order of ascending ID.
+ *
+ * \param filename    Full path to the file
+ * \param sample_file File in which the positions and keys found are kept
+ *                    between runs, or NULL. They are loaded if they were
+ *                    saved for a file of the same size and modification
+ *                    time, and saved again by osm_seek_close() when more
+ *                    were found and the file has not changed meanwhile.
+ *
+ * \return
+ *   Pointer to a struct osm_seek object which should be passed in
+ *   subsequent calls to osm_seek_*() functions, or NULL on failure
+ */
+struct osm_seek *osm_seek_open(const char *filename, const char *sample_file);
+
+/**
+ * \brief Position the file shortly before an element
+ *
+ * The file is bisected, reading up to the next block header and decoding
+ * a single block of bzip2 input at each step, and the keys found are
+ * kept to narrow later searches. Recently read parts of the file are
+ * kept in memory, and the block last probed is not decoded twice. Lines
+ * read afterwards start with the first element beginning in the bzip2
+ * block, or plain XML, that holds the element sought, if it is present.
+ *
+ * \return
+ *   1 if there was an error reading the file, otherwise 0
+ */
+int osm_seek_to(struct osm_seek *sk, int type, unsigned int id);
+
+/**
+ * \brief Check whether seeking to an element would skip part of the file
+ *
+ * \return
+ *   1 if the element is known from earlier searches to lie beyond a part
+ *   of the file not yet read, otherwise 0, in which case it is as quick
+ *   to read on
+ */
+int osm_seek_ahead(struct osm_seek *sk, int type, unsigned int id);
+
+/**
+ * \brief Read the next line of text from the current position
+ *
+ * \return
+ *   0 if a line was read, 2 at the end of the file, otherwise 1. The line
+ *   remains valid until the next call.
+ */
+int osm_seek_readln(struct osm_seek *sk, char **line);
+
+/** \brief Number of bytes of the file read so far, and its size */
+void osm_seek_stats(struct osm_seek *sk, long long *bytes_read, long long *size);
+
+/** \brief Close the file and free the struct osm_seek object */
+void osm_seek_close(struct osm_seek *sk);
+
+/* osm_reader.c */
+
+/**
+ * \brief Batch of parsed elements of a single type, in column form
+ *
+ * Element i of the batch has ID ids[i]. Its tags are numbered from
+ * tag_offsets[i] up to tag_offsets[i+1], and tag t has the key at
+ * strings + tag_keys[t] and the value at strings + tag_values[t]. Members
+ * of ways and relations are similarly numbered from member_offsets[i] up
+ * to member_offsets[i+1]. All strings are null-terminated and held in
+ * the single strings arena. Columns that do not apply to the element
+ * type may be NULL, and tags and members are only present if requested
+ * in the projection.
+ */
+struct osm_batch
+{
+    int type;                 /**< OSM_NODE, OSM_WAY or OSM_RELATION */
+    int count;                /**< Number of elements in the batch */
+    unsigned int *ids;        /**< "count" element IDs */
+    unsigned int *versions;   /**< "count" version numbers, 0 where not read; see OSM_FIELD_VERSION */
+    int32_t *lat;             /**< Nodes only; WGS84 latitudes in units of 1e-7 degrees */
+    int32_t *lon;             /**< Nodes only; WGS84 longitudes in units of 1e-7 degrees */
+    uint32_t *tag_offsets;    /**< "count" + 1 offsets into tag_keys and tag_values */
+    uint32_t *tag_keys;       /**< Offset into strings of each tag key */
+    uint32_t *tag_values;     /**< Offset into strings of each tag value */
+    uint32_t *member_offsets; /**< Ways and relations only; "count" + 1 offsets into member_ids */
+    unsigned int *member_ids; /**< IDs of member nodes of ways, or members of relations */
+    unsigned char *member_types; /**< Relations only; OSM_NODE or OSM_WAY for each member */
+    uint32_t *member_roles;   /**< Relations only; offset into strings of each member role */
+    char *strings;            /**< Arena holding all strings referenced by the batch */
+    size_t strings_len;       /**< Length of the strings arena in bytes */
+    uint32_t *raw_offsets;    /**< "count" + 1 offsets into raw, or NULL; see osm_reader_set_raw() */
+    char *raw;                /**< XML text of all elements, end to end */
+    size_t raw_len;           /**< Length of raw in bytes */
+    struct osm_batch_priv *priv; /**< Allocated sizes and other private data */
+};
+
+/**
+ * \brief Open an OpenStreetMap file for reading in batches
+ *
+ * The file may be bzip2-compressed XML, or PBF if the filename ends in
+ * ".pbf".
+ *
+ * \param filename Full path to the file
+ * \param types
+ *   Bitwise OR of OSM_NODES, OSM_WAYS and OSM_RELATIONS giving the element
+ *   types of interest. Elements of other types are never parsed.
+ * \param proj
+ *   Pointer to struct osm_projection describing the fields of interest
+ *   and an optional filter on element ID
+ * \param data
+ *   Pointer to private data that will be passed to the filter callback
+ *
+ * \return
+ *   Pointer to a struct osm_reader object which should be passed in
+ *   subsequent calls to osm_reader_*() functions, or NULL on failure to
+ *   open the file
+ */
+struct osm_reader *osm_reader_open(const char *filename, int types,
+                                   const struct osm_projection *proj, void *data);
+
+/**
+ * \brief Read batches from the current position of a struct osm_seek
+ *
+ * As osm_reader_open(), but the lines of XML come from a file opened with
+ * osm_seek_open() and positioned with osm_seek_to(). The struct osm_seek
+ * is not closed by osm_reader_close(), so it can be positioned again and
+ * read with a new reader.
+ */
+struct osm_reader *osm_reader_open_seek(struct osm_seek *sk, int types,
+                                        const struct osm_projection *proj, void *data);
+
+/**
+ * \brief Read the next batch of elements
+ *
+ * Batches hold up to a few thousand elements. Elements of each type are
+ * returned in file order, and a batch of one type is returned before any
+ * elements of the next type in the file.
+ *
+ * \param reader
+ *   Pointer to struct osm_reader object, as previously obtained from a
+ *   call to osm_reader_open()
+ * \param batch
+ *   Pointer to pointer to struct osm_batch, into which a pointer to the
+ *   batch is placed. The batch remains valid until the next call.
+ *
+ * \return
+ *   0 if a batch was returned, 2 at end of file, otherwise 1
+ */
+int osm_reader_next(struct osm_reader *reader, struct osm_batch **batch);
+
+/**
+ * \brief Read a full-history file as a snapshot, with one version of each
+ *        element
+ *
+ * Must be called before the first call to osm_reader_next(). See
+ * osm_parse_set_history().
+ *
+ * \param as_of
+ *   Time in seconds since 1970 to take the state of the data at, or 0
+ *   for the latest versions
+ */
+void osm_reader_set_history(struct osm_reader *reader, long long as_of);
+
+/**
+ * \brief Keep the XML text of each element in the batches
+ *
+ * Must be called before the first call to osm_reader_next(). The text is
+ * placed in the raw column of each batch; see osm_parse_set_raw(). It is
+ * not available for PBF input.
+ */
+void osm_reader_set_raw(struct osm_reader *reader, int strip_metadata);
+
+/**
+ * \brief Stop reading the file early
+ *
+ * May be called from the projection's filter callback. No more of the
+ * file is read; the elements already collected are returned by
+ * osm_reader_next() as at the end of the file, after which it returns 2.
+ */
+void osm_reader_stop(struct osm_reader *reader);
+
+/**
+ * \brief Close the file and free the struct osm_reader object
+ *
+ * \return
+ *   1 if there was an error closing the file, otherwise 0
+ */
+int osm_reader_close(struct osm_reader *reader);
+
+/**
+ * \brief Convert element i of a node batch to a struct osm_node
+ *
+ * For use with functions that process single elements, such as
+ * osm_output_node(). The returned structure belongs to the batch and
+ * remains valid until the next call to this function for the batch.
+ */
+struct osm_node *osm_batch_node(struct osm_batch *batch, int i);
+/** \brief Convert element i of a way batch to a struct osm_way */
+struct osm_way *osm_batch_way(struct osm_batch *batch, int i);
+/** \brief Convert element i of a relation batch to a struct osm_relation */
+struct osm_relation *osm_batch_relation(struct osm_batch *batch, int i);
+
+/**
+ * \brief Create an empty batch, to be filled with osm_batch_add_*()
+ *
+ * \param type OSM_NODE, OSM_WAY or OSM_RELATION
+ *
+ * \return
+ *   Pointer to the new struct osm_batch, which should be freed with
+ *   osm_batch_free()
+ */
+struct osm_batch *osm_batch_new(int type);
+
+/** \brief Append a node to a batch created with osm_batch_new(OSM_NODE) */
+void osm_batch_add_node(struct osm_batch *batch, struct osm_node *node);
+/** \brief Append a way to a batch created with osm_batch_new(OSM_WAY) */
+void osm_batch_add_way(struct osm_batch *batch, struct osm_way *way);
+/** \brief Append a relation to a batch created with osm_batch_new(OSM_RELATION) */
+void osm_batch_add_relation(struct osm_batch *batch, struct osm_relation *rel);
+
+/** \brief Remove all elements from a batch, keeping its allocated memory */
+void osm_batch_clear(struct osm_batch *batch);
+
+/**
+ * \brief Make a copy of a batch that remains valid after further reading
+ *
+ * \return
+ *   Pointer to the new struct osm_batch, which should be freed with
+ *   osm_batch_free()
+ */
+struct osm_batch *osm_batch_copy(const struct osm_batch *batch);
+
+/** \brief Free a batch obtained from osm_batch_new() or osm_batch_copy() */
+void osm_batch_free(struct osm_batch *batch);
+
+/* osm_output.c */
+
+/**
+ * \brief Start writing OpenStreetMap data to a file
+ *
+ * For OSM_FORMAT_PBF, blocks are compressed in parallel by a pool of worker
+ * threads started here, one per online CPU.
+ *
+ * \param fp
+ *   Stream to write to, which must remain open until osm_output_close()
+ *   has been called
+ * \param format
+ *   OSM_FORMAT_XML, OSM_FORMAT_CHANGE or OSM_FORMAT_PBF
+ *
+ * \return
+ *   Pointer to a struct osm_output object which should be passed in
+ *   subsequent calls to osm_output_*() functions, or NULL on failure
+ */
+struct osm_output *osm_output_open(FILE *fp, int format);
+
+/**
+ * \brief Start writing OpenStreetMap data to a file, with a given number
+ *        of compression threads
+ *
+ * As osm_output_open(), but for OSM_FORMAT_PBF starts nthreads compression
+ * threads, or one per online CPU if nthreads is negative. If nthreads is 0,
+ * blocks are compressed in the calling thread; this is useful when many
+ * outputs are written at once.
+ */
+struct osm_output *osm_output_open_threads(FILE *fp, int format, int nthreads);
+
+/**
+ * \brief Write a node
+ *
+ * Nodes, ways and relations should be written in that order, and within
+ * each type in order of ascending ID, as in the planet files. XML output
+ * includes the version of each element where it is not 0, and elements
+ * with nothing inside them are written as empty tags.
+ */
+void osm_output_node(struct osm_output *out, struct osm_node *node);
+/** \brief Write a way */
+void osm_output_way(struct osm_output *out, struct osm_way *way);
+/** \brief Write a relation */
+void osm_output_relation(struct osm_output *out, struct osm_relation *relation);
+
+/**
+ * \brief Set the action of the elements written next to OSM_FORMAT_CHANGE
+ *        output
+ *
+ * Elements are written inside a <create>, <modify> or <delete> block,
+ * and a new block is started whenever the action changes. Has no effect
+ * on other output formats.
+ *
+ * \param action OSM_ACTION_CREATE, OSM_ACTION_MODIFY or OSM_ACTION_DELETE
+ */
+void osm_output_action(struct osm_output *out, int action);
+
+/**
+ * \brief Write an element as XML text taken from the input
+ *
+ * The text, as returned by osm_parse_raw(), is copied to the output as
+ * it is, in place of a call to osm_output_node() etc. Only for
+ * OSM_FORMAT_XML and OSM_FORMAT_CHANGE output.
+ */
+void osm_output_raw(struct osm_output *out, const char *text, size_t len);
+
+/**
+ * \brief Offset in the output stream at which the next element will start
+ *
+ * Counts the bytes written so far, including those still buffered.
+ * Only meaningful for XML and osmChange output.
+ */
+long long osm_output_tell(struct osm_output *out);
+
+/**
+ * \brief Finish writing, flush all buffered data and free the struct osm_output
+ *
+ * The stream itself is flushed but not closed.
+ *
+ * \return
+ *   1 if there was an error writing any of the data, otherwise 0
+ */
+int osm_output_close(struct osm_output *out);
+
+/* osm_shard.c */
+
+/* Grids for osm_shard_open() */
+#define OSM_GRID_DEGREES 0 /**< Cells of equal size in degrees of latitude and longitude */
+#define OSM_GRID_TILES   1 /**< Web Mercator map tiles of one zoom level */
+
+/**
+ * \brief Start writing OpenStreetMap data split into grid cells
+ *
+ * Each cell is written to its own file, named from the prefix and the
+ * column and row of the cell in the grid, e.g. "prefix_12_7.osm". For
+ * OSM_GRID_DEGREES, columns are counted eastwards from 180 degrees west
+ * and rows northwards from 90 degrees south; for OSM_GRID_TILES they are
+ * the usual tile x and y numbers. The files are written in parallel by a
+ * pool of writer threads started here.
+ *
+ * \param prefix Start of the name of each output file
+ * \param format OSM_FORMAT_XML or OSM_FORMAT_PBF
+ * \param grid   OSM_GRID_DEGREES or OSM_GRID_TILES
+ * \param size   Size of cells in degrees, or tile zoom level (0 to 16)
+ *
+ * \return
+ *   Pointer to a struct osm_shard object which should be passed in
+ *   subsequent calls to osm_shard_*() functions, or NULL on failure
+ */
+struct osm_shard *osm_shard_open(const char *prefix, int format, int grid, double size);
+
+/**
+ * \brief Write a node to the file of the cell containing it
+ *
+ * Nodes must be written before the ways and relations that refer to them.
+ */
+void osm_shard_node(struct osm_shard *shard, struct osm_node *node);
+
+/**
+ * \brief Write a way to the file of every cell containing one of its nodes
+ *
+ * Ways none of whose nodes have been written are dropped.
+ */
+void osm_shard_way(struct osm_shard *shard, struct osm_way *way);
+
+/**
+ * \brief Write a relation to the file of every cell containing one of its
+ *        member nodes or ways
+ */
+void osm_shard_relation(struct osm_shard *shard, struct osm_relation *relation);
+
+/**
+ * \brief Finish writing all files and free the struct osm_shard
+ *
+ * \return
+ *   1 if there was an error writing any of the files, otherwise 0
+ */
+int osm_shard_close(struct osm_shard *shard);
+
+/* osm_graph.c */
+
+#define OSM_GRAPH_MAGIC   "OSMRCSR1" /**< First 8 bytes of a railway graph file */
+#define OSM_GRAPH_VERSION 1
+
+/* Values of struct osm_graph_edge "electrified" field, from the
+ * "electrified" tag of the way */
+#define OSM_ELECTRIFIED_UNKNOWN      0 /**< Not tagged */
+#define OSM_ELECTRIFIED_NO           1
+#define OSM_ELECTRIFIED_CONTACT_LINE 2 /**< Overhead line */
+#define OSM_ELECTRIFIED_RAIL         3 /**< Third or fourth rail */
+#define OSM_ELECTRIFIED_OTHER        4 /**< Any other electrification */
+
+/**
+ * \brief Header at the start of a railway graph file
+ *
+ * The graph file is designed to be mapped into memory and used in place.
+ * All values are in host byte order, and each section starts on an
+ * 8-byte boundary at the given offset from the start of the file:
+ *  - vertex_count struct osm_graph_vertex, one per junction
+ *  - vertex_count + 1 uint32_t row offsets; the edges leaving vertex v
+ *    are those numbered from row_offsets[v] up to row_offsets[v+1]
+ *  - edge_count uint32_t target vertex numbers
+ *  - edge_count struct osm_graph_edge attributes
+ *
+ * Every stretch of track appears twice, once in each direction.
+ */
+struct osm_graph_header
+{
+    char magic[8];               /**< OSM_GRAPH_MAGIC, not null-terminated */
+    uint32_t version;            /**< OSM_GRAPH_VERSION */
+    uint32_t reserved;
+    uint64_t vertex_count;
+    uint64_t edge_count;         /**< Number of directed edges */
+    uint64_t vertices_offset;
+    uint64_t row_offsets_offset;
+    uint64_t targets_offset;
+    uint64_t edges_offset;
+};
+
+/** \brief Graph vertex, located at a junction node or the end of a way */
+struct osm_graph_vertex
+{
+    uint32_t id;  /**< OSM node ID */
+    int32_t lat;  /**< WGS84 latitude in units of 1e-7 degrees */
+    int32_t lon;  /**< WGS84 longitude in units of 1e-7 degrees */
+};
+
+/** \brief Attributes of a directed graph edge */
+struct osm_graph_edge
+{
+    float length;          /**< Length along the way in metres */
+    uint32_t way_id;       /**< OSM ID of the way the edge is part of */
+    uint16_t gauge;        /**< Track gauge in mm, or 0 if not tagged */
+    uint16_t maxspeed;     /**< Maximum speed in km/h, or 0 if not tagged */
+    uint8_t electrified;   /**< OSM_ELECTRIFIED_* */
+    uint8_t reserved[3];
+};
+
+/**
+ * \brief Create an empty railway graph builder
+ *
+ * \return
+ *   Pointer to a struct osm_graph object which should be passed in
+ *   subsequent calls to osm_graph_*() functions
+ */
+struct osm_graph *osm_graph_init(void);
+
+/**
+ * \brief Record the location of a node
+ *
+ * All nodes referenced by the ways should be added, preferably in order
+ * of ascending ID.
+ */
+void osm_graph_add_node(struct osm_graph *graph, struct osm_node *node);
+
+/**
+ * \brief Add a way to the graph
+ *
+ * Ways that are not railway track (railway=rail, light_rail, narrow_gauge,
+ * subway, tram, monorail, funicular, miniature or preserved) are ignored.
+ * The way's gauge, maxspeed and electrified tags are recorded as edge
+ * attributes.
+ */
+void osm_graph_add_way(struct osm_graph *graph, struct osm_way *way);
+
+/**
+ * \brief Build the graph and write it to a file
+ *
+ * \return
+ *   1 if there was an error writing the file, otherwise 0
+ */
+int osm_graph_write(struct osm_graph *graph, const char *filename);
+
+/** \brief Free a struct osm_graph object and the memory used by it */
+void osm_graph_destroy(struct osm_graph *graph);
+
+/* osm_tiles.c */
+
+/**
+ * \brief Create an empty set of vector tiles of the railway ways
+ *
+ * \param dir Directory to write the tiles to, as DIR/Z/X/Y.mvt
+ * \param min_zoom Lowest zoom level to be written
+ * \param max_zoom Highest zoom level to be written, at most 22
+ *
+ * \return
+ *   Pointer to a struct osm_tiles object which should be passed in
+ *   subsequent calls to osm_tiles_*() functions
+ */
+struct osm_tiles *osm_tiles_init(const char *dir, int min_zoom, int max_zoom);
+
+/**
+ * \brief Record the location of a node
+ *
+ * All nodes referenced by the ways should be added, preferably in order
+ * of ascending ID.
+ */
+void osm_tiles_add_node(struct osm_tiles *tiles, struct osm_node *node);
+
+/** \brief Add a way, with all its tags, to the tiles */
+void osm_tiles_add_way(struct osm_tiles *tiles, struct osm_way *way);
+
+/**
+ * \brief Build the tiles and write them
+ *
+ * Each tile holds a single layer "rail" of version 2 Mapbox Vector Tile
+ * line features, one per way crossing the tile, with the way ID and its
+ * tags. The ways are simplified to a tolerance of one tile coordinate at
+ * each zoom level and clipped to the tile with a small buffer. Tiles are
+ * encoded and written in parallel, uncompressed, and a metadata.json file
+ * with the fields of the MBTiles metadata table is written alongside.
+ *
+ * \return
+ *   1 if there was an error writing any of the files, otherwise 0
+ */
+int osm_tiles_write(struct osm_tiles *tiles);
+
+/** \brief Free a struct osm_tiles object and the memory used by it */
+void osm_tiles_destroy(struct osm_tiles *tiles);
+
+/* osm_routes.c */
+
+/**
+ * \brief Create an empty collection of train routes
+ *
+ * \return
+ *   Pointer to a struct osm_routes object which should be passed in
+ *   subsequent calls to osm_routes_*() functions
+ */
+struct osm_routes *osm_routes_init(void);
+
+/**
+ * \brief Record the location of a node
+ *
+ * All nodes referenced by the ways should be added, preferably in order
+ * of ascending ID.
+ */
+void osm_routes_add_node(struct osm_routes *routes, struct osm_node *node);
+
+/**
+ * \brief Record the nodes of a way
+ *
+ * All ways that are members of the routes should be added, preferably in
+ * order of ascending ID.
+ */
+void osm_routes_add_way(struct osm_routes *routes, struct osm_way *way);
+
+/**
+ * \brief Add a relation, if it is tagged route=train
+ *
+ * Way members with roles starting "platform" or "stop" are left out of
+ * the route's geometry.
+ */
+void osm_routes_add_relation(struct osm_routes *routes, struct osm_relation *relation);
+
+/**
+ * \brief Join the ways of each route into lines and write the routes
+ *
+ * The member ways of each route are joined end to end through the nodes
+ * they share, reversed where necessary, following the order of the
+ * members where the route branches. A gap, or the end of a branch,
+ * starts a new line. Each route is written as a GeoJSON Feature with a
+ * MultiLineString geometry, the relation ID as its id and the relation's
+ * tags as its properties, in a single FeatureCollection. Routes are
+ * built in parallel.
+ *
+ * \return
+ *   1 if there was an error writing the file, otherwise 0
+ */
+int osm_routes_write(struct osm_routes *routes, const char *filename);
+
+/** \brief Free a struct osm_routes object and the memory used by it */
+void osm_routes_destroy(struct osm_routes *routes);
+
+/* osm_index.c */
+
+#define OSM_INDEX_MAGIC    "OSMRIDX1" /**< First 8 bytes of an index file */
+#define OSM_INDEX_VERSION  1
+#define OSM_INDEX_INTERVAL 64 /**< Default number of elements per index entry */
+
+/**
+ * \brief Header at the start of an index file
+ *
+ * The header is in host byte order, and is followed by entry_count
+ * entries, in order of type and then ID. Each entry is two unsigned
+ * LEB128 varints: the increase in the key (type << 32 | ID) of the
+ * element from the previous entry, and the increase in its offset in
+ * the extract. The first entry is relative to key and offset 0.
+ */
+struct osm_index_header
+{
+    char magic[8];        /**< OSM_INDEX_MAGIC, not null-terminated */
+    uint32_t version;     /**< OSM_INDEX_VERSION */
+    uint32_t interval;    /**< Elements per entry */
+    uint64_t entry_count;
+    uint64_t end_offset;  /**< Offset of the end of the last element */
+};
+
+/**
+ * \brief Start writing an index of an XML extract as it is written
+ *
+ * \param filename Name of the index file
+ * \param interval
+ *   Number of elements per entry, or 0 for OSM_INDEX_INTERVAL. The first
+ *   element of each type always has an entry of its own.
+ *
+ * \return
+ *   Pointer to a struct osm_index object which should be passed in
+ *   subsequent calls to osm_index_add() and osm_index_close(), or NULL
+ *   on failure
+ */
+struct osm_index *osm_index_create(const char *filename, int interval);
+
+/**
+ * \brief Record the position of the next element of the extract
+ *
+ * Must be called for every element, in the order written, with the
+ * offset from osm_output_tell() before the element is written. Elements
+ * must be in order of type and then ascending ID, as osmrail writes them;
+ * otherwise the index is abandoned.
+ */
+void osm_index_add(struct osm_index *idx, int type, unsigned int id, long long offset);
+
+/**
+ * \brief Finish writing the index and free the struct osm_index
+ *
+ * \param end_offset
+ *   Offset of the end of the last element, from osm_output_tell()
+ *
+ * \return
+ *   1 if the elements were not in order or there was an error writing the
+ *   file, otherwise 0
+ */
+int osm_index_close(struct osm_index *idx, long long end_offset);
+
+/**
+ * \brief Read an index file into memory for lookups
+ *
+ * \return
+ *   Pointer to a struct osm_index object to be passed to
+ *   osm_index_find(), or NULL on failure
+ */
+struct osm_index *osm_index_load(const char *filename);
+
+/**
+ * \brief Read the XML of a single element from an indexed extract
+ *
+ * Seeks once, to the index entry at or before the element, and reads up
+ * to the next entry, so at most one interval of elements is read.
+ *
+ * \param fp The uncompressed extract the index was written for
+ * \param text
+ *   Set to the text of the element, null-terminated, in memory allocated
+ *   with malloc() which the caller should free
+ * \param len Set to the length of the text
+ *
+ * \return
+ *   0 if the element was found, 1 if it is not in the extract, or -1 if
+ *   the extract could not be read
+ */
+int osm_index_find(struct osm_index *idx, FILE *fp, int type, unsigned int id,
+                   char **text, size_t *len);
+
+/** \brief Free a struct osm_index loaded with osm_index_load() */
+void osm_index_free(struct osm_index *idx);
+
+/* osm_order.c */
+
+/** Sort key of an element, and the element's position in the caller's arrays */
+struct osm_order_key
+{
+    uint64_t key;
+    uint32_t index;
+};
+
+/**
+ * \brief Distance along a Hilbert curve of a location
+ *
+ * The curve fills the whole longitude/latitude rectangle at a resolution
+ * of 2^32 steps in each direction, so locations that are close together
+ * usually have close indices.
+ *
+ * \param lat WGS84 latitude in units of 1e-7 degrees
+ * \param lon WGS84 longitude in units of 1e-7 degrees
+ */
+uint64_t osm_hilbert_index(int32_t lat, int32_t lon);
+
+/**
+ * \brief Sort an array of keys in place, in parallel
+ *
+ * Keys are sorted by key and then by index, so the order is fully
+ * determined however many threads are used.
+ */
+void osm_order_sort(struct osm_order_key *keys, size_t count);
+
+/* osm_diff.c */
+
+/**
+ * \brief Write the differences between two files as osmChange
+ *
+ * Both files are read in step, in a single pass, and must hold elements
+ * in the order written by osmrail: nodes, then ways, then relations, each
+ * in order of ascending ID. Elements present only in the new file are
+ * written as created, those only in the old file as deleted, and those
+ * whose tags, members or coordinates differ as modified. Elements are
+ * compared by a hash of their contents, so memory use does not depend on
+ * the size of the files.
+ *
+ * \param old_filename File holding the earlier data
+ * \param new_filename File holding the later data
+ * \param out
+ *   Pointer to struct osm_output opened with OSM_FORMAT_CHANGE
+ *
+ * \return
+ *   1 if either file could not be read or was not in order, otherwise 0
+ */
+int osm_diff(const char *old_filename, const char *new_filename, struct osm_output *out);
+
+/* osm_stats.c */
+
+/**
+ * \brief Create an empty set of tag statistics
+ *
+ * \param keys Keys whose values are to be counted
+ * \param key_count Number of keys
+ *
+ * \return
+ *   Pointer to a struct osm_stats object which should be passed in
+ *   subsequent calls to osm_stats_*() functions
+ */
+struct osm_stats *osm_stats_new(char **keys, int key_count);
+
+/**
+ * \brief Count the values of the keys of interest in a batch of elements
+ *
+ * A struct osm_stats object must not be used by more than one thread at
+ * once; give each thread its own and combine them with osm_stats_merge().
+ */
+void osm_stats_add_batch(struct osm_stats *stats, struct osm_batch *batch);
+
+/** \brief Add the length of a way in metres to the values of its tags */
+void osm_stats_add_length(struct osm_stats *stats, struct osm_way *way, double length);
+
+/** \brief Add the counts and lengths in "src" to those in "dest" */
+void osm_stats_merge(struct osm_stats *dest, struct osm_stats *src);
+
+/**
+ * \brief Write a report of the statistics as a table
+ *
+ * There is a line for each key and value, giving the number of nodes,
+ * ways and relations and the length of the ways in kilometres. Lines are
+ * in the order of the keys, and then with the most common values first.
+ *
+ * \return
+ *   1 if there was an error writing the report, otherwise 0
+ */
+int osm_stats_write(struct osm_stats *stats, FILE *fp);
+
+/** \brief Free a struct osm_stats object and the memory used by it */
+void osm_stats_free(struct osm_stats *stats);
+
+/* osm_server.c */
+
+/**
+ * \brief Load an OpenStreetMap file into memory and index it for queries
+ *
+ * Every element of the file is kept, with hash tables for finding nodes,
+ * ways and relations by ID and an R-tree over the bounding boxes of the
+ * ways. The file is typically an extract previously written by osmrail.
+ *
+ * \param filename Full path to the file, read with osm_reader_open()
+ *
+ * \return
+ *   Pointer to a struct osm_server object which should be passed in
+ *   subsequent calls to osm_server_*() functions, or NULL on failure
+ */
+struct osm_server *osm_server_load(const char *filename);
+
+/**
+ * \brief Answer queries on a Unix domain socket until osm_server_stop()
+ *        is called
+ *
+ * Each connection is served by a thread of its own. Queries are lines of
+ * text, each answered with a single line of JSON:
+ *  - "bbox MINLON MINLAT MAXLON MAXLAT": IDs of the ways whose bounding
+ *    boxes intersect the box, as {"ways":[...]}
+ *  - "node ID", "way ID", "relation ID": the element with its tags, and
+ *    its coordinates, member nodes or members with their roles
+ *  - "info": element counts and the bounding box of the data
+ *  - "stats": latency histograms for each type of query
+ *
+ * Errors are reported as {"error":"..."}.
+ *
+ * \param server Pointer to struct osm_server object from osm_server_load()
+ * \param path   Filename of the socket. An existing socket is replaced.
+ *
+ * \return
+ *   1 if the socket could not be created, otherwise 0 once the server
+ *   has stopped and all connections have been closed
+ */
+int osm_server_run(struct osm_server *server, const char *path);
+
+/**
+ * \brief Ask osm_server_run() to return
+ *
+ * May be called from a signal handler.
+ */
+void osm_server_stop(struct osm_server *server);
+
+/** \brief Print a summary of the query latencies recorded so far */
+void osm_server_print_stats(struct osm_server *server, FILE *fp);
+
+/** \brief Free a struct osm_server object and the data loaded into it */
+void osm_server_free(struct osm_server *server);
+
+/* osm_bzip2.c */
+
+/**
+ * \brief Start decoding a bzip2 file, which may hold several concatenated
+ *        streams
+ *
+ * \return
+ *   Pointer to a struct osm_bzip2 object which should be passed in
+ *   subsequent calls to osm_bzip2_*() functions, or NULL on failure
+ */
+struct osm_bzip2 *osm_bzip2_open(void);
+
+/**
+ * \brief Pass compressed data to the decoder
+ *
+ * The data is copied, so the buffer may be reused once the call returns.
+ */
+void osm_bzip2_feed(struct osm_bzip2 *bz, const unsigned char *data, size_t len);
+
+/**
+ * \brief Decode data passed to osm_bzip2_feed()
+ *
+ * Each block is decoded once all of it has been fed, so no output may
+ * be produced until several hundred kilobytes have been fed.
+ *
+ * \param buff Buffer for decompressed data
+ * \param size Size of buff
+ * \param len  Pointer to variable into which the decompressed length is placed
+ * \param eof  Boolean; all of the compressed data has been fed
+ *
+ * \return
+ *   0 if buff was filled or more data must be fed, 1 at the end of the
+ *   data (only when eof is set), or -1 if the data is corrupt
+ */
+int osm_bzip2_read(struct osm_bzip2 *bz, unsigned char *buff, size_t size, size_t *len, int eof);
+
+/**
+ * \brief Start decoding at a block in the middle of a stream
+ *
+ * Must be called before any data is fed. Blocks need not start on a byte
+ * boundary, so the first byte fed is the one holding the start of the
+ * block header. The CRC of the stream is not checked, as the blocks
+ * before this one are never seen.
+ *
+ * \param level Block size of the stream, 1 to 9, from the "BZh" header
+ * \param bit
+ *   Position of the start of the block header in the first byte fed,
+ *   0 being the most significant bit
+ */
+void osm_bzip2_start_block(struct osm_bzip2 *bz, int level, int bit);
+
+/** \brief Number of bits of the data fed that have been decoded */
+uint64_t osm_bzip2_tell(struct osm_bzip2 *bz);
+
+/** \brief Free a struct osm_bzip2 object */
+void osm_bzip2_close(struct osm_bzip2 *bz);
+
+/* osm_zlib.c */
+
+/**
+ * \brief Decompress a zlib (RFC 1950) stream held in memory
+ *
+ * \param src    Compressed data
+ * \param srclen Length of compressed data
+ * \param dst    Buffer for decompressed data
+ * \param dstlen Size of buffer for decompressed data
+ * \param outlen Pointer to variable into which the decompressed length is placed
+ *
+ * \return
+ *   0 on success, or -1 if the data is corrupt or would not fit in the buffer
+ */
+int osm_zlib_inflate(const unsigned char *src, size_t srclen,
+                     unsigned char *dst, size_t dstlen, size_t *outlen);
+
+/**
+ * \brief Calculate the buffer size needed by osm_zlib_deflate()
+ *
+ * \return
+ *   Maximum compressed length of srclen bytes of data
+ */
+size_t osm_zlib_bound(size_t srclen);
+
+/**
+ * \brief Compress data held in memory into a zlib (RFC 1950) stream
+ *
+ * \param src    Data to be compressed
+ * \param srclen Length of data to be compressed
+ * \param dst    Buffer for compressed data
+ * \param dstlen Size of buffer, at least osm_zlib_bound(srclen)
+ * \param outlen Pointer to variable into which the compressed length is placed
+ *
+ * \return
+ *   0 on success, or -1 if the buffer is too small
+ */
+int osm_zlib_deflate(const unsigned char *src, size_t srclen,
+                     unsigned char *dst, size_t dstlen, size_t *outlen);
+
+#endif /* OSM_H */
@@ -0,0 +1,751 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Decoder for bzip2 streams, as an alternative to libbz2. Compressed data
+ * is buffered until a whole block is available, and each block is then
+ * decoded in one go: Huffman symbols are decoded by table lookup and
+ * undone through move-to-front and the zero-run coding straight into the
+ * block array, which holds each byte and its inverse BWT link in one
+ * word. Following the links is a chain of cache misses, so the block is
+ * walked from both ends at once, forwards from the start and backwards
+ * from the end, to keep two misses in flight. The output stage then
+ * expands the initial run-length coding and updates the CRC in one linear
+ * pass. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include "osm.h"
+
+#define MAX_BLOCK     900000 /**< Largest block, at level 9 */
+#define MAX_GROUPS    6      /**< Number of Huffman tables of a block */
+#define MAX_ALPHA     258    /**< 256 MTF positions, RUNA/RUNB taking one, and EOB */
+#define MAX_CODE_LEN  20     /**< Longest Huffman code */
+#define MAX_SELECTORS 18002  /**< Selectors beyond this are never used */
+#define GROUP_SIZE    50     /**< Number of symbols coded with each selector */
+#define FAST_BITS     10     /**< Number of bits decoded by table lookup in one step */
+
+#define RUNA 0
+#define RUNB 1
+
+#define BLOCK_MAGIC  0x314159265359ULL
+#define STREAM_MAGIC 0x177245385090ULL
+
+/* Decoder states */
+#define STATE_STREAM 0 /**< Expecting a stream header, or the end of the input */
+#define STATE_BLOCK  1 /**< Expecting a block or the end-of-stream marker */
+#define STATE_OUTPUT 2 /**< Writing out the current block */
+
+/* Bit reader over the buffered input. Bits are consumed most significant
+ * first, from the top of the accumulator. */
+struct bit_reader
+{
+    const unsigned char *start, *in, *end;
+    uint64_t bits;   /**< Bit accumulator, left-aligned */
+    int nbits;       /**< Number of valid bits in accumulator */
+    int overrun;     /**< Number of bytes read past the end of the input */
+};
+
+/* Huffman decoding table. Codes of up to FAST_BITS bits are decoded with a
+ * single lookup; longer codes are decoded canonically by length. */
+struct huffman
+{
+    /** (length << 9) | symbol for each FAST_BITS-bit prefix, 0 if code is longer */
+    unsigned short fast[1 << FAST_BITS];
+    int first[MAX_CODE_LEN + 1];  /**< First code of each length */
+    int count[MAX_CODE_LEN + 1];  /**< Number of codes of each length */
+    int offs[MAX_CODE_LEN + 1];   /**< Index into symbol of the first code of each length */
+    int max_len;
+    unsigned short symbol[MAX_ALPHA]; /**< Symbols ordered by code */
+};
+
+struct osm_bzip2
+{
+    unsigned char *in;  /**< Compressed data fed but not yet consumed */
+    size_t in_len, max_in;
+    size_t bit_pos;     /**< Position in in of the next bit to be read */
+    uint64_t dropped;   /**< Number of bytes consumed and dropped from in */
+    size_t need;        /**< Input needed before a block is attempted again */
+    int state;          /**< STATE_* */
+    int streams;        /**< Number of complete streams decoded */
+    int block_max;      /**< Block size of the current stream */
+    uint32_t combined_crc;
+    int mid_stream;     /**< Boolean; decoding started after the start of the stream */
+
+    /* Current block. Each entry of tt holds a byte in its low 8 bits and
+     * the position of the next byte in the inverse BWT above them; each
+     * entry of lf holds the same byte and the position of the previous
+     * byte. */
+    uint32_t *tt, *lf;
+    unsigned char *block; /**< Bytes of the block in order, before run-length decoding */
+    int block_len;
+    int block_pos;      /**< Next byte of block to be written */
+    int last;           /**< Previous byte written, or -1 */
+    int run;            /**< Number of times last has been seen in a row, up to 4 */
+    int repeat;         /**< Copies of last still to be written for a run */
+    uint32_t block_crc, crc;
+
+    struct huffman tables[MAX_GROUPS];
+    unsigned char selectors[MAX_SELECTORS];
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void build_crc_table(void);
+static int read_stream_header(struct osm_bzip2 *, int eof);
+static int decode_block(struct osm_bzip2 *);
+static void inverse_bwt(struct osm_bzip2 *, int n, int orig_ptr, const int *counts);
+static size_t write_block(struct osm_bzip2 *, unsigned char *out, size_t size);
+
+struct osm_bzip2 *osm_bzip2_open(void)
+{
+    struct osm_bzip2 *bz = calloc(1, sizeof(struct osm_bzip2));
+
+    pthread_once(&crc_once, build_crc_table);
+    bz->tt = malloc(MAX_BLOCK * sizeof(uint32_t));
+    bz->lf = malloc(MAX_BLOCK * sizeof(uint32_t));
+    bz->block = malloc(MAX_BLOCK);
+    if( !bz->tt || !bz->lf || !bz->block)
+    {
+        fprintf(stderr, "osm_bzip2_open(): Unable to allocate block memory\n");
+        osm_bzip2_close(bz);
+        return NULL;
+    }
+    bz->state = STATE_STREAM;
+
+    return bz;
+}
+
+void osm_bzip2_feed(struct osm_bzip2 *bz, const unsigned char *data, size_t len)
+{
+    size_t used = bz->bit_pos / 8;
+
+    /* Drop the input already consumed */
+    if(used > 0)
+    {
+        memmove(bz->in, bz->in + used, bz->in_len - used);
+        bz->in_len -= used;
+        bz->dropped += used;
+        bz->bit_pos -= used * 8;
+        bz->need = bz->need > used ? bz->need - used : 0;
+    }
+
+    if(bz->in_len + len > bz->max_in)
+    {
+        while(bz->in_len + len > bz->max_in)
+            bz->max_in = bz->max_in ? bz->max_in * 2 : 1024 * 1024;
+        bz->in = realloc(bz->in, bz->max_in);
+    }
+    memcpy(bz->in + bz->in_len, data, len);
+    bz->in_len += len;
+
+    return;
+}
+
+int osm_bzip2_read(struct osm_bzip2 *bz, unsigned char *buff, size_t size, size_t *len, int eof)
+{
+    *len = 0;
+
+    while(*len < size)
+    {
+        int ret;
+
+        if(bz->state == STATE_OUTPUT)
+        {
+            *len += write_block(bz, buff + *len, size - *len);
+            if(bz->block_pos < bz->block_len || bz->repeat > 0)
+                continue;
+
+            /* End of block */
+            if(~bz->crc != bz->block_crc)
+            {
+                fprintf(stderr, "osm_bzip2_read(): Block CRC mismatch\n");
+                return -1;
+            }
+            bz->combined_crc = ((bz->combined_crc << 1) | (bz->combined_crc >> 31)) ^ bz->block_crc;
+            bz->state = STATE_BLOCK;
+            continue;
+        }
+
+        if(bz->state == STATE_STREAM)
+        {
+            if((ret = read_stream_header(bz, eof)) != 0)
+                return ret > 0 ? 0 : ret;
+            if(bz->state == STATE_STREAM) /* end of the input */
+                return 1;
+            continue;
+        }
+
+        /* Wait for enough input that the block is likely to be complete */
+        if( !eof && bz->in_len < bz->need)
+            return 0;
+        if((ret = decode_block(bz)) == 2)
+        {
+            if(eof)
+            {
+                fprintf(stderr, "osm_bzip2_read(): Unexpected end of input\n");
+                return -1;
+            }
+            bz->need = 2 * bz->in_len;
+            return 0;
+        }
+        if(ret < 0)
+            return -1;
+        bz->need = 0;
+    }
+
+    return 0;
+}
+
+void osm_bzip2_start_block(struct osm_bzip2 *bz, int level, int bit)
+{
+    bz->block_max = level * 100000;
+    bz->combined_crc = 0;
+    bz->mid_stream = 1;
+    bz->bit_pos = bit;
+    bz->state = STATE_BLOCK;
+
+    return;
+}
+
+uint64_t osm_bzip2_tell(struct osm_bzip2 *bz)
+{
+    return bz->dropped * 8 + bz->bit_pos;
+}
+
+void osm_bzip2_close(struct osm_bzip2 *bz)
+{
+    free(bz->in);
+    free(bz->tt);
+    free(bz->lf);
+    free(bz->block);
+    free(bz);
+
+    return;
+}
+
+static void build_crc_table(void)
+{
+    int i, k;
+
+    /* bzip2 uses the CRC-32 polynomial, most significant bit first */
+    for(i = 0; i < 256; i++)
+    {
+        uint32_t c = (uint32_t)i << 24;
+
+        for(k = 0; k < 8; k++)
+            c = (c & 0x80000000) ? (c << 1) ^ 0x04c11db7 : c << 1;
+        crc_table[i] = c;
+    }
+
+    return;
+}
+
+/* Bit reading */
+
+static void reader_init(struct bit_reader *br, struct osm_bzip2 *bz)
+{
+    br->start = bz->in;
+    br->in = bz->in + bz->bit_pos / 8;
+    br->end = bz->in + bz->in_len;
+    br->bits = 0;
+    br->nbits = 0;
+    br->overrun = 0;
+    if(bz->bit_pos % 8)
+    {
+        br->bits = (uint64_t)*br->in++ << (56 + bz->bit_pos % 8);
+        br->nbits = 8 - bz->bit_pos % 8;
+    }
+
+    return;
+}
+
+/* Position of the next bit to be read from the start of the input */
+static size_t reader_pos(struct bit_reader *br)
+{
+    return (br->in - br->start + br->overrun) * 8 - br->nbits;
+}
+
+/* Check whether more bits have been read than the input holds. Refilling
+ * may run ahead of the end without the bits having been used. */
+static int overran(struct bit_reader *br)
+{
+    return reader_pos(br) > (size_t)(br->end - br->start) * 8;
+}
+
+static inline void refill(struct bit_reader *br)
+{
+    if(br->end - br->in >= 8)
+    {
+        uint64_t v;
+        int bytes = (64 - br->nbits) / 8;
+
+        memcpy(&v, br->in, 8);
+        br->bits |= __builtin_bswap64(v) >> br->nbits;
+        br->in += bytes;
+        br->nbits += bytes * 8;
+        /* Clear the bits of any partial byte beyond the accumulator */
+        if(br->nbits < 64)
+            br->bits &= ~(~0ULL >> br->nbits);
+        return;
+    }
+
+    while(br->nbits <= 56)
+    {
+        if(br->in < br->end)
+            br->bits |= (uint64_t)*br->in++ << (56 - br->nbits);
+        else
+            br->overrun++;
+        br->nbits += 8;
+    }
+
+    return;
+}
+
+/* Read up to 32 bits */
+static inline uint32_t get_bits(struct bit_reader *br, int n)
+{
+    uint32_t val;
+
+    if(br->nbits < n)
+        refill(br);
+    val = br->bits >> (64 - n);
+    br->bits <<= n;
+    br->nbits -= n;
+
+    return val;
+}
+
+/* Build a decoding table from an array of code lengths. Returns 0 on
+ * success, or -1 if the set of lengths is over-subscribed. */
+static int build_huffman(struct huffman *h, const unsigned char *lengths, int n)
+{
+    int offs[MAX_CODE_LEN + 1];
+    int code = 0, len, s;
+
+    memset(h->count, 0, sizeof(h->count));
+    memset(h->fast, 0, sizeof(h->fast));
+    for(s = 0; s < n; s++)
+        h->count[lengths[s]]++;
+
+    h->max_len = 0;
+    h->offs[0] = 0;
+    for(len = 1; len <= MAX_CODE_LEN; len++)
+    {
+        h->first[len] = code;
+        h->offs[len] = (len > 1) ? h->offs[len - 1] + h->count[len - 1] : 0;
+        code += h->count[len];
+        if(code > (1 << len))
+            return -1;
+        code <<= 1;
+        if(h->count[len])
+            h->max_len = len;
+    }
+
+    /* Canonical codes are ordered by length, then by symbol */
+    memcpy(offs, h->offs, sizeof(offs));
+    for(s = 0; s < n; s++)
+        h->symbol[offs[lengths[s]]++] = s;
+
+    for(len = 1; len <= FAST_BITS; len++)
+    {
+        int i;
+
+        for(i = 0; i < h->count[len]; i++)
+        {
+            int start = (h->first[len] + i) << (FAST_BITS - len), j;
+            unsigned short entry = (len << 9) | h->symbol[h->offs[len] + i];
+
+            for(j = 0; j < (1 << (FAST_BITS - len)); j++)
+                h->fast[start + j] = entry;
+        }
+    }
+
+    return 0;
+}
+
+/* Decode one symbol, or return -1 for an invalid code */
+static inline int decode_symbol(struct bit_reader *br, const struct huffman *h)
+{
+    unsigned int entry, code;
+    int len;
+
+    if(br->nbits < MAX_CODE_LEN)
+        refill(br);
+    if((entry = h->fast[br->bits >> (64 - FAST_BITS)]))
+    {
+        len = entry >> 9;
+        br->bits <<= len;
+        br->nbits -= len;
+        return entry & 0x1ff;
+    }
+
+    code = br->bits >> (64 - MAX_CODE_LEN);
+    for(len = FAST_BITS + 1; len <= h->max_len; len++)
+    {
+        unsigned int c = (code >> (MAX_CODE_LEN - len)) - h->first[len];
+
+        if(c < (unsigned int)h->count[len])
+        {
+            br->bits <<= len;
+            br->nbits -= len;
+            return h->symbol[h->offs[len] + c];
+        }
+    }
+
+    return -1;
+}
+
+/* Read the "BZh" signature and block size at the start of a stream.
+ * Returns 0 if it was read or the input has ended cleanly after a stream,
+ * 1 if more input is needed, or -1 on error. */
+static int read_stream_header(struct osm_bzip2 *bz, int eof)
+{
+    size_t pos = bz->bit_pos / 8, avail = bz->in_len - pos;
+    const unsigned char *p = bz->in + pos;
+
+    if(avail < 4)
+    {
+        if( !eof)
+            return 1;
+        if(avail == 0 && bz->streams > 0)
+            return 0;
+        fprintf(stderr, "osm_bzip2_read(): Unexpected end of input\n");
+        return -1;
+    }
+    if(p[0] != 'B' || p[1] != 'Z' || p[2] != 'h' || p[3] < '1' || p[3] > '9')
+    {
+        fprintf(stderr, "osm_bzip2_read(): Not a bzip2 stream\n");
+        return -1;
+    }
+    bz->block_max = (p[3] - '0') * 100000;
+    bz->combined_crc = 0;
+    bz->mid_stream = 0;
+    bz->bit_pos += 32;
+    bz->state = STATE_BLOCK;
+
+    return 0;
+}
+
+/* Decode the next block of the stream into tt. Returns 0 if a block is
+ * ready to be written, 1 at the end of the stream, 2 if the input ends
+ * within the block, or -1 on error. */
+static int decode_block(struct osm_bzip2 *bz)
+{
+    struct bit_reader br;
+    unsigned char seq_to_unseq[256], mtf[256], lengths[MAX_ALPHA];
+    int counts[256];
+    uint64_t magic;
+    uint32_t crc, *tt = bz->tt;
+    int in_use = 0, alpha, groups, nsel, i, j, n = 0;
+    int group_left = 0, sel = 0, run_shift = 0, run_len = 0, orig_ptr, eob;
+    const struct huffman *h = NULL;
+
+    reader_init(&br, bz);
+    magic = (uint64_t)get_bits(&br, 24) << 24;
+    magic |= get_bits(&br, 24);
+    crc = get_bits(&br, 32);
+
+    if(magic == STREAM_MAGIC)
+    {
+        if(overran(&br))
+            return 2;
+        if( !bz->mid_stream && crc != bz->combined_crc)
+        {
+            fprintf(stderr, "osm_bzip2_read(): Stream CRC mismatch\n");
+            return -1;
+        }
+        /* The next stream, if any, starts on a byte boundary */
+        bz->bit_pos = (reader_pos(&br) + 7) & ~(size_t)7;
+        bz->streams++;
+        bz->state = STATE_STREAM;
+        return 1;
+    }
+    if(magic != BLOCK_MAGIC)
+    {
+        if(overran(&br))
+            return 2;
+        fprintf(stderr, "osm_bzip2_read(): Bad block header\n");
+        return -1;
+    }
+
+    if(get_bits(&br, 1))
+    {
+        /* Not written by any bzip2 since 0.9.5 */
+        fprintf(stderr, "osm_bzip2_read(): Randomised blocks are not supported\n");
+        return -1;
+    }
+    orig_ptr = get_bits(&br, 24);
+
+    /* Bitmap of the byte values used in the block */
+    j = get_bits(&br, 16);
+    for(i = 0; i < 16; i++)
+    {
+        if(j & (0x8000 >> i))
+        {
+            int used = get_bits(&br, 16), k;
+
+            for(k = 0; k < 16; k++)
+            {
+                if(used & (0x8000 >> k))
+                    seq_to_unseq[in_use++] = i * 16 + k;
+            }
+        }
+    }
+    if(in_use == 0)
+        goto corrupt;
+    alpha = in_use + 2;
+    eob = alpha - 1;
+
+    /* Selectors, move-to-front and unary coded */
+    groups = get_bits(&br, 3);
+    nsel = get_bits(&br, 15);
+    if(groups < 2 || groups > MAX_GROUPS || nsel < 1)
+        goto corrupt;
+    for(i = 0; i < groups; i++)
+        mtf[i] = i;
+    for(i = 0; i < nsel; i++)
+    {
+        unsigned char v;
+
+        for(j = 0; get_bits(&br, 1); j++)
+        {
+            if(j + 1 >= groups || overran(&br))
+                goto corrupt;
+        }
+        v = mtf[j];
+        memmove(mtf + 1, mtf, j);
+        mtf[0] = v;
+        if(i < MAX_SELECTORS)
+            bz->selectors[i] = v;
+    }
+    if(nsel > MAX_SELECTORS)
+        nsel = MAX_SELECTORS;
+
+    /* Code lengths of each table, delta coded */
+    for(i = 0; i < groups; i++)
+    {
+        int len = get_bits(&br, 5), s;
+
+        for(s = 0; s < alpha; s++)
+        {
+            while(1)
+            {
+                if(len < 1 || len > MAX_CODE_LEN || overran(&br))
+                    goto corrupt;
+                if( !get_bits(&br, 1))
+                    break;
+                len += get_bits(&br, 1) ? -1 : 1;
+            }
+            lengths[s] = len;
+        }
+        if(build_huffman(&bz->tables[i], lengths, alpha) != 0)
+            goto corrupt;
+    }
+
+    /* Symbols. Runs of the byte at the front of the MTF list are coded as
+     * a bijective base 2 number in RUNA and RUNB; other symbols move a byte
+     * to the front. Bytes go straight into tt and are counted for the
+     * inverse BWT. */
+    memset(counts, 0, sizeof(counts));
+    for(i = 0; i < 256; i++)
+        mtf[i] = i;
+    while(1)
+    {
+        int sym;
+
+        if(group_left == 0)
+        {
+            if(sel >= nsel)
+                goto corrupt;
+            h = &bz->tables[bz->selectors[sel++]];
+            group_left = GROUP_SIZE;
+        }
+        group_left--;
+        if((sym = decode_symbol(&br, h)) < 0)
+            goto corrupt;
+
+        if(sym <= RUNB)
+        {
+            if(run_shift > 20)
+                goto corrupt;
+            run_len += (sym + 1) << run_shift++;
+            continue;
+        }
+        if(run_len > 0)
+        {
+            unsigned char c = seq_to_unseq[mtf[0]];
+
+            if(n + run_len > bz->block_max)
+                goto corrupt;
+            counts[c] += run_len;
+            while(run_len--)
+                tt[n++] = c;
+            run_len = 0;
+            run_shift = 0;
+        }
+        if(sym == eob)
+            break;
+
+        if(n >= bz->block_max)
+            goto corrupt;
+        {
+            int pos = sym - 1;
+            unsigned char v = mtf[pos], c;
+
+            /* Positions are mostly small, so a byte-wise shift is quicker
+             * than a call to memmove() */
+            if(pos < 16)
+            {
+                while(pos > 0)
+                {
+                    mtf[pos] = mtf[pos - 1];
+                    pos--;
+                }
+            }
+            else
+                memmove(mtf + 1, mtf, pos);
+            mtf[0] = v;
+            c = seq_to_unseq[v];
+            counts[c]++;
+            tt[n++] = c;
+        }
+    }
+    if(overran(&br))
+        return 2;
+    if(orig_ptr >= n)
+        goto corrupt;
+
+    inverse_bwt(bz, n, orig_ptr, counts);
+    bz->block_pos = 0;
+    bz->last = -1;
+    bz->run = 0;
+    bz->repeat = 0;
+    bz->block_crc = crc;
+    bz->crc = 0xffffffff;
+    bz->bit_pos = reader_pos(&br);
+    bz->state = STATE_OUTPUT;
+
+    return 0;
+
+corrupt:
+    /* Reading zero bits past the end of the input can look like corruption */
+    if(overran(&br))
+        return 2;
+    fprintf(stderr, "osm_bzip2_read(): Corrupt block\n");
+    return -1;
+}
+
+/* Undo the Burrows-Wheeler transform of the n bytes in tt, placing them
+ * in order in block */
+static void inverse_bwt(struct osm_bzip2 *bz, int n, int orig_ptr, const int *counts)
+{
+    uint32_t *tt = bz->tt, *lf = bz->lf, fwd, back;
+    unsigned char *block = bz->block;
+    int cftab[256], i, k;
+
+    /* Link each position to the next byte of the output, and back */
+    cftab[0] = 0;
+    for(i = 1; i < 256; i++)
+        cftab[i] = cftab[i - 1] + counts[i - 1];
+    for(i = 0; i < n; i++)
+    {
+        unsigned char c = tt[i] & 0xff;
+        int dest = cftab[c]++;
+
+        tt[dest] |= (uint32_t)i << 8;
+        lf[i] = ((uint32_t)dest << 8) | c;
+    }
+
+    /* The first byte is at the position linked from orig_ptr, and the last
+     * byte at orig_ptr itself. Walk the two chains until they meet. */
+    fwd = tt[orig_ptr] >> 8;
+    back = orig_ptr;
+    for(k = 0; k < n / 2; k++)
+    {
+        uint32_t f = tt[fwd], b = lf[back];
+
+        block[k] = f & 0xff;
+        fwd = f >> 8;
+        block[n - 1 - k] = b & 0xff;
+        back = b >> 8;
+    }
+    if(n & 1)
+        block[k] = tt[fwd] & 0xff;
+    bz->block_len = n;
+
+    return;
+}
+
+/* Write out as much of the current block as fits, expanding runs: a run of
+ * four equal bytes is followed by a count of further copies. */
+static size_t write_block(struct osm_bzip2 *bz, unsigned char *out, size_t size)
+{
+    const unsigned char *block = bz->block;
+    uint32_t crc = bz->crc;
+    int pos = bz->block_pos, end = bz->block_len, last = bz->last, run = bz->run;
+    size_t len = 0;
+
+    while(len < size)
+    {
+        int c;
+
+        if(bz->repeat > 0)
+        {
+            while(bz->repeat > 0 && len < size)
+            {
+                out[len++] = last;
+                crc = (crc << 8) ^ crc_table[(crc >> 24) ^ last];
+                bz->repeat--;
+            }
+            continue;
+        }
+        if(pos == end)
+            break;
+
+        c = block[pos++];
+        if(run == 4)
+        {
+            bz->repeat = c;
+            run = 0;
+            continue;
+        }
+        if(c == last)
+            run++;
+        else
+        {
+            last = c;
+            run = 1;
+        }
+        out[len++] = c;
+        crc = (crc << 8) ^ crc_table[(crc >> 24) ^ c];
+    }
+
+    bz->block_pos = pos;
+    bz->crc = crc;
+    bz->last = last;
+    bz->run = run;
+
+    return len;
+}
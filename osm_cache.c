@@ -0,0 +1,537 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Cache of decompressed input files, so that a file read in several
+ * passes is decompressed only once. The data is recorded in the chunks
+ * it was decompressed in. Chunks are kept in memory while the memory
+ * limit allows, and after that are compressed with a simple LZ77 codec
+ * and appended to a temporary file in $TMPDIR. The codec is much faster
+ * than bzip2 in both directions, at the cost of a much lower ratio. A
+ * file whose cache would not fit in the memory and disk space available
+ * is dropped from the cache and decompressed again in each pass; one
+ * whose pass stopped before the end is recorded again in the next. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "osm.h"
+
+/* LZ codec. Each sequence is a token byte holding the number of literals
+ * in the high nibble and the match length less MIN_MATCH in the low one,
+ * either of which continues in following bytes if 15; then the literals;
+ * then the offset of the match as 2 bytes, little-endian. The last
+ * sequence has literals only. */
+#define MIN_MATCH  4
+#define MAX_OFFSET 65535
+#define HASH_BITS  14
+
+/* States of a cached file */
+#define CACHE_RECORDING 0
+#define CACHE_COMPLETE  1
+#define CACHE_DROPPED   2
+#define CACHE_STOPPED   3 /**< Dropped, but to be recorded again */
+
+struct cache_chunk
+{
+    unsigned char *data; /**< Uncompressed data, or NULL if on disk */
+    off_t offset;        /**< Offset of the compressed data in the temporary file */
+    size_t len;          /**< Uncompressed length */
+    size_t stored_len;   /**< Compressed length on disk */
+};
+
+struct cache_file
+{
+    char *filename;
+    int state;
+    struct cache_chunk *chunks;
+    size_t chunk_count, max_chunks;
+    size_t total_len;    /**< Bytes of uncompressed data */
+    size_t memory_len;   /**< Bytes of it held in memory */
+    int fd;              /**< Temporary file, or -1 */
+    off_t disk_len;      /**< Bytes written to it */
+};
+
+struct osm_cache
+{
+    struct cache_file *file;
+    char replay;            /**< Boolean; reading from the cache, not recording */
+    size_t next_chunk;      /**< Next chunk to be read */
+    unsigned char *scratch; /**< Compressed data being read or written */
+    size_t scratch_size;
+};
+
+/* Cached files and the limits shared between them */
+static struct cache_file **files;
+static int file_count;
+static size_t memory_limit, memory_used;
+static off_t disk_limit = -1, disk_used;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *temp_dir(void);
+static void drop_file(struct cache_file *, const char *reason);
+static void free_file(struct cache_file *);
+static unsigned char *scratch_buffer(struct osm_cache *, size_t size);
+static size_t lz_bound(size_t len);
+static size_t lz_compress(const unsigned char *src, size_t len, unsigned char *dest);
+static int lz_decompress(const unsigned char *src, size_t len, unsigned char *dest, size_t size, size_t *out_len);
+static unsigned char *put_length(unsigned char *op, size_t n);
+
+void osm_cache_set_limit(size_t limit)
+{
+    int i;
+
+    pthread_mutex_lock(&cache_mutex);
+    if(limit == 0)
+    {
+        for(i = 0; i < file_count; i++)
+            free_file(files[i]);
+        free(files);
+        files = NULL;
+        file_count = 0;
+        memory_used = 0;
+        disk_used = 0;
+    }
+    memory_limit = limit;
+    pthread_mutex_unlock(&cache_mutex);
+
+    return;
+}
+
+struct osm_cache *osm_cache_open(const char *filename, int *replay)
+{
+    struct cache_file *file = NULL;
+    struct osm_cache *cache;
+    struct stat st;
+    int i;
+
+    pthread_mutex_lock(&cache_mutex);
+    if(memory_limit == 0)
+    {
+        pthread_mutex_unlock(&cache_mutex);
+        return NULL;
+    }
+    for(i = 0; i < file_count; i++)
+    {
+        if(strcmp(files[i]->filename, filename) == 0)
+        {
+            file = files[i];
+            break;
+        }
+    }
+    if(file && file->state != CACHE_STOPPED)
+    {
+        /* Only a complete cache can be read, and a dropped one is not
+         * recorded again unless its pass stopped early */
+        pthread_mutex_unlock(&cache_mutex);
+        if(file->state != CACHE_COMPLETE)
+            return NULL;
+        cache = calloc(1, sizeof(struct osm_cache));
+        cache->file = file;
+        cache->replay = 1;
+        *replay = 1;
+        return cache;
+    }
+
+    if( !file)
+    {
+        file = calloc(1, sizeof(struct cache_file));
+        file->filename = strdup(filename);
+        file->fd = -1;
+        files = realloc(files, (file_count + 1) * sizeof(struct cache_file *));
+        files[file_count++] = file;
+    }
+    file->state = CACHE_RECORDING;
+    file->total_len = 0;
+
+    /* Up to half of the free space in $TMPDIR is used */
+    if(disk_limit < 0)
+    {
+        struct statvfs vfs;
+
+        disk_limit = statvfs(temp_dir(), &vfs) == 0 ? (off_t)vfs.f_bavail * vfs.f_frsize / 2 : 0;
+    }
+    /* Decompressed data never takes less room than the compressed file */
+    if(stat(filename, &st) == 0 && S_ISREG(st.st_mode)
+       && st.st_size > disk_limit - disk_used + (off_t)(memory_limit - memory_used))
+    {
+        file->state = CACHE_DROPPED;
+        pthread_mutex_unlock(&cache_mutex);
+        fprintf(stderr, "Not caching <%s>; too little memory and space in <%s>\n", filename, temp_dir());
+        return NULL;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    cache = calloc(1, sizeof(struct osm_cache));
+    cache->file = file;
+    *replay = 0;
+
+    return cache;
+}
+
+int osm_cache_write(struct osm_cache *cache, const unsigned char *data, size_t len)
+{
+    struct cache_file *file = cache->file;
+    struct cache_chunk *chunk;
+    int in_memory;
+
+    if(file->state != CACHE_RECORDING)
+        return 1;
+
+    if(file->chunk_count == file->max_chunks)
+    {
+        file->max_chunks += 1024;
+        file->chunks = realloc(file->chunks, file->max_chunks * sizeof(struct cache_chunk));
+    }
+    chunk = &file->chunks[file->chunk_count];
+    memset(chunk, 0, sizeof(struct cache_chunk));
+    chunk->len = len;
+
+    pthread_mutex_lock(&cache_mutex);
+    if((in_memory = memory_used + len <= memory_limit))
+        memory_used += len;
+    pthread_mutex_unlock(&cache_mutex);
+
+    if(in_memory)
+    {
+        chunk->data = malloc(len);
+        memcpy(chunk->data, data, len);
+        file->memory_len += len;
+    }
+    else
+    {
+        unsigned char *buff = scratch_buffer(cache, lz_bound(len));
+        size_t stored_len = lz_compress(data, len, buff);
+        int fits;
+
+        if(file->fd < 0)
+        {
+            char tempname[1024];
+
+            snprintf(tempname, sizeof(tempname), "%s/osmrail.XXXXXX", temp_dir());
+            if((file->fd = mkstemp(tempname)) < 0)
+            {
+                drop_file(file, "unable to create temporary file");
+                return 1;
+            }
+            /* The file is deleted as soon as it is closed */
+            unlink(tempname);
+        }
+
+        pthread_mutex_lock(&cache_mutex);
+        if((fits = disk_used + (off_t)stored_len <= disk_limit))
+            disk_used += stored_len;
+        pthread_mutex_unlock(&cache_mutex);
+        if( !fits)
+        {
+            drop_file(file, "too little memory and space");
+            return 1;
+        }
+        /* Counted already, so that drop_file() gives it back */
+        file->disk_len += stored_len;
+        if(pwrite(file->fd, buff, stored_len, file->disk_len - stored_len) != (ssize_t)stored_len)
+        {
+            drop_file(file, "error writing temporary file");
+            return 1;
+        }
+        chunk->offset = file->disk_len - stored_len;
+        chunk->stored_len = stored_len;
+    }
+    file->chunk_count++;
+    file->total_len += len;
+
+    return 0;
+}
+
+int osm_cache_read(struct osm_cache *cache, unsigned char *buff, size_t size, size_t *len)
+{
+    struct cache_file *file = cache->file;
+    struct cache_chunk *chunk;
+    unsigned char *stored;
+
+    *len = 0;
+    if(cache->next_chunk == file->chunk_count)
+        return 2;
+    chunk = &file->chunks[cache->next_chunk++];
+    if(chunk->len > size)
+    {
+        fprintf(stderr, "osm_cache_read(): Chunk of %zu bytes does not fit buffer\n", chunk->len);
+        return 1;
+    }
+
+    if(chunk->data)
+    {
+        memcpy(buff, chunk->data, chunk->len);
+        *len = chunk->len;
+        return 0;
+    }
+
+    stored = scratch_buffer(cache, chunk->stored_len);
+    if(pread(file->fd, stored, chunk->stored_len, chunk->offset) != (ssize_t)chunk->stored_len)
+    {
+        fprintf(stderr, "osm_cache_read(): Error reading temporary file\n");
+        return 1;
+    }
+    if(lz_decompress(stored, chunk->stored_len, buff, size, len) != 0 || *len != chunk->len)
+    {
+        fprintf(stderr, "osm_cache_read(): Temporary file is corrupt\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+void osm_cache_close(struct osm_cache *cache, int end)
+{
+    struct cache_file *file = cache->file;
+
+    if( !cache->replay && file->state == CACHE_RECORDING)
+    {
+        if(end == OSM_CACHE_COMPLETE)
+        {
+            file->state = CACHE_COMPLETE;
+            fprintf(stderr, "Cached %.1f MB of <%s>: %.1f MB in memory, %.1f MB compressed in <%s>\n",
+                    file->total_len / 1048576.0, file->filename, file->memory_len / 1048576.0,
+                    file->disk_len / 1048576.0, temp_dir());
+        }
+        else if(end == OSM_CACHE_STOPPED)
+        {
+            drop_file(file, "not read to the end, so recording it again when next read");
+            file->state = CACHE_STOPPED;
+        }
+        else
+            drop_file(file, NULL);
+    }
+    free(cache->scratch);
+    free(cache);
+
+    return;
+}
+
+static const char *temp_dir(void)
+{
+    const char *dir = getenv("TMPDIR");
+
+    return dir ? dir : "/tmp";
+}
+
+/* Give up recording a file, returning the memory and disk space it
+ * took. The reason is reported unless NULL. */
+static void drop_file(struct cache_file *file, const char *reason)
+{
+    size_t i;
+
+    if(reason)
+        fprintf(stderr, "Not caching <%s>; %s\n", file->filename, reason);
+    for(i = 0; i < file->chunk_count; i++)
+        free(file->chunks[i].data);
+    free(file->chunks);
+    file->chunks = NULL;
+    file->chunk_count = file->max_chunks = 0;
+    if(file->fd >= 0)
+        close(file->fd);
+    file->fd = -1;
+
+    pthread_mutex_lock(&cache_mutex);
+    memory_used -= file->memory_len;
+    disk_used -= file->disk_len;
+    pthread_mutex_unlock(&cache_mutex);
+    file->memory_len = 0;
+    file->disk_len = 0;
+    file->state = CACHE_DROPPED;
+
+    return;
+}
+
+static void free_file(struct cache_file *file)
+{
+    size_t i;
+
+    for(i = 0; i < file->chunk_count; i++)
+        free(file->chunks[i].data);
+    free(file->chunks);
+    if(file->fd >= 0)
+        close(file->fd);
+    free(file->filename);
+    free(file);
+
+    return;
+}
+
+static unsigned char *scratch_buffer(struct osm_cache *cache, size_t size)
+{
+    if(size > cache->scratch_size)
+    {
+        cache->scratch = realloc(cache->scratch, size);
+        cache->scratch_size = size;
+    }
+
+    return cache->scratch;
+}
+
+/* Largest compressed size of len bytes, if none of them match */
+static size_t lz_bound(size_t len)
+{
+    return len + len / 255 + 16;
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Compress len bytes from src into dest, which must hold lz_bound(len)
+ * bytes. Matches are found through a hash table of the last position at
+ * which each 4-byte sequence was seen, and the search steps faster
+ * through data that does not match. Returns the compressed length. */
+static size_t lz_compress(const unsigned char *src, size_t len, unsigned char *dest)
+{
+    uint32_t table[1 << HASH_BITS];
+    const unsigned char *ip = src, *anchor = src, *end = src + len;
+    const unsigned char *limit = len > MIN_MATCH ? end - MIN_MATCH : src;
+    unsigned char *op = dest;
+
+    memset(table, 0, sizeof(table));
+    while(ip < limit)
+    {
+        uint32_t seq = read32(ip);
+        uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+        const unsigned char *ref = src + table[h];
+        size_t lit_len, match_len;
+
+        table[h] = ip - src;
+        if(ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq)
+        {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        for(match_len = MIN_MATCH; ip + match_len < end && ref[match_len] == ip[match_len]; match_len++)
+            ;
+        lit_len = ip - anchor;
+
+        *op++ = (lit_len < 15 ? lit_len : 15) << 4 | (match_len - MIN_MATCH < 15 ? match_len - MIN_MATCH : 15);
+        if(lit_len >= 15)
+            op = put_length(op, lit_len - 15);
+        memcpy(op, anchor, lit_len);
+        op += lit_len;
+        *op++ = (ip - ref) & 0xff;
+        *op++ = (ip - ref) >> 8;
+        if(match_len - MIN_MATCH >= 15)
+            op = put_length(op, match_len - MIN_MATCH - 15);
+
+        ip += match_len;
+        anchor = ip;
+    }
+
+    /* The rest as literals */
+    *op++ = (end - anchor < 15 ? end - anchor : 15) << 4;
+    if(end - anchor >= 15)
+        op = put_length(op, end - anchor - 15);
+    memcpy(op, anchor, end - anchor);
+    op += end - anchor;
+
+    return op - dest;
+}
+
+/* Continuation of a length, as bytes of 255 and a final byte below it */
+static unsigned char *put_length(unsigned char *op, size_t n)
+{
+    while(n >= 255)
+    {
+        *op++ = 255;
+        n -= 255;
+    }
+    *op++ = n;
+
+    return op;
+}
+
+/* Decompress len bytes from src into dest, which holds size bytes, and
+ * store the decompressed length. Returns 1 if the data is not valid,
+ * otherwise 0. */
+static int lz_decompress(const unsigned char *src, size_t len, unsigned char *dest, size_t size, size_t *out_len)
+{
+    const unsigned char *ip = src, *end = src + len;
+    unsigned char *op = dest, *out_end = dest + size;
+
+    while(ip < end)
+    {
+        unsigned int token = *ip++;
+        size_t n = token >> 4, offset;
+
+        if(n == 15)
+        {
+            do
+            {
+                if(ip == end)
+                    return 1;
+                n += *ip;
+            } while(*ip++ == 255);
+        }
+        if(n > (size_t)(end - ip) || n > (size_t)(out_end - op))
+            return 1;
+        memcpy(op, ip, n);
+        op += n;
+        ip += n;
+        if(ip == end)
+            break;
+
+        if(end - ip < 2)
+            return 1;
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        n = (token & 15) + MIN_MATCH;
+        if((token & 15) == 15)
+        {
+            do
+            {
+                if(ip == end)
+                    return 1;
+                n += *ip;
+            } while(*ip++ == 255);
+        }
+        if(offset == 0 || offset > (size_t)(op - dest) || n > (size_t)(out_end - op))
+            return 1;
+        if(offset >= n)
+            memcpy(op, op - offset, n);
+        else
+        {
+            /* Overlapping copy, repeating the last offset bytes */
+            const unsigned char *ref = op - offset;
+            size_t i;
+
+            for(i = 0; i < n; i++)
+                op[i] = ref[i];
+        }
+        op += n;
+    }
+    *out_len = op - dest;
+
+    return 0;
+}
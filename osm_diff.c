@@ -0,0 +1,308 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Difference between two ID-sorted files as osmChange. Each file is read
+ * with its own osm_reader and the two are merged on (type, ID), so that
+ * only the current batch of each file is held in memory. Creations and
+ * modifications are written as they are found. Deletions are only noted,
+ * with their versions from the old file, and are written at the end with
+ * relations first and nodes last, so that no element is deleted while
+ * something still refers to it. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "osm.h"
+
+/* Position in one of the files */
+struct diff_cursor
+{
+    const char *filename;
+    struct osm_reader *reader;
+    struct osm_batch *batch;
+    int i;
+    int done;      /**< Boolean; end of file reached */
+    int type;      /**< Type and ID of the current element, for checking order */
+    unsigned int id;
+};
+
+/* Element deleted, as written in the <delete> block */
+struct deletion
+{
+    unsigned int id, version;
+    int32_t lat, lon; /**< Nodes only */
+};
+
+/* Deletions of one type */
+struct deletion_list
+{
+    struct deletion *items;
+    int count, max;
+};
+
+static int cursor_next(struct diff_cursor *);
+static int compare_cursors(struct diff_cursor *, struct diff_cursor *);
+static uint64_t element_hash(struct osm_batch *, int i);
+static void write_element(struct osm_output *, int action, struct diff_cursor *);
+static void add_deletion(struct deletion_list *, struct diff_cursor *);
+static void write_deletions(struct osm_output *, int type, struct deletion_list *);
+
+int osm_diff(const char *old_filename, const char *new_filename, struct osm_output *out)
+{
+    static const struct osm_projection proj = {
+        { OSM_FIELD_ALL | OSM_FIELD_VERSION, OSM_FIELD_ALL | OSM_FIELD_VERSION,
+          OSM_FIELD_ALL | OSM_FIELD_VERSION }, NULL
+    };
+    struct diff_cursor old = { old_filename }, new = { new_filename };
+    struct deletion_list deletions[3];
+    int created = 0, modified = 0, deleted = 0, unversioned = 0, ret = 1, ele;
+
+    if( !(old.reader = osm_reader_open(old_filename, OSM_ALL_TYPES, &proj, NULL)))
+        return 1;
+    if( !(new.reader = osm_reader_open(new_filename, OSM_ALL_TYPES, &proj, NULL)))
+    {
+        osm_reader_close(old.reader);
+        return 1;
+    }
+    memset(deletions, 0, sizeof(deletions));
+    old.type = new.type = -1;
+    old.i = new.i = -1;
+    if( !cursor_next(&old) || !cursor_next(&new))
+        goto finished;
+
+    while( !old.done || !new.done)
+    {
+        int cmp = compare_cursors(&old, &new);
+
+        if(cmp < 0)
+        {
+            add_deletion(&deletions[old.type], &old);
+            deleted++;
+            if(old.batch->versions[old.i] == 0)
+                unversioned++;
+            if( !cursor_next(&old))
+                goto finished;
+        }
+        else if(cmp > 0)
+        {
+            write_element(out, OSM_ACTION_CREATE, &new);
+            created++;
+            if( !cursor_next(&new))
+                goto finished;
+        }
+        else
+        {
+            if(element_hash(old.batch, old.i) != element_hash(new.batch, new.i))
+            {
+                write_element(out, OSM_ACTION_MODIFY, &new);
+                modified++;
+            }
+            if( !cursor_next(&old) || !cursor_next(&new))
+                goto finished;
+        }
+    }
+    for(ele = OSM_RELATION; ele >= OSM_NODE; ele--)
+    {
+        if(deletions[ele].count > 0)
+            write_deletions(out, ele, &deletions[ele]);
+    }
+    ret = 0;
+    fprintf(stderr, "Created %d, modified %d, deleted %d elements\n", created, modified, deleted);
+    if(unversioned > 0)
+        fprintf(stderr, "osm_diff(): %d deleted elements have no version in <%s>, "
+                "and are written without one\n", unversioned, old_filename);
+
+finished:
+    osm_reader_close(old.reader);
+    osm_reader_close(new.reader);
+    for(ele = OSM_NODE; ele <= OSM_RELATION; ele++)
+        free(deletions[ele].items);
+
+    return ret;
+}
+
+/* Move on to the next element of a file. Returns 0 on error, or if the
+ * file is not in order. */
+static int cursor_next(struct diff_cursor *cur)
+{
+    int ret;
+
+    if(cur->done)
+        return 1;
+
+    if( !cur->batch || ++cur->i >= cur->batch->count)
+    {
+        do
+        {
+            if((ret = osm_reader_next(cur->reader, &cur->batch)) == 2)
+            {
+                cur->done = 1;
+                return 1;
+            }
+            if(ret != 0)
+                return 0;
+        } while(cur->batch->count == 0);
+        cur->i = 0;
+    }
+
+    if(cur->batch->type < cur->type
+       || (cur->batch->type == cur->type && cur->batch->ids[cur->i] <= cur->id))
+    {
+        fprintf(stderr, "osm_diff(): <%s> is not sorted by type and ID\n", cur->filename);
+        return 0;
+    }
+    cur->type = cur->batch->type;
+    cur->id = cur->batch->ids[cur->i];
+
+    return 1;
+}
+
+/* Compare the current elements of two files in file order. A file at its
+ * end compares after any element. */
+static int compare_cursors(struct diff_cursor *a, struct diff_cursor *b)
+{
+    if(a->done || b->done)
+        return a->done - b->done;
+    if(a->type != b->type)
+        return a->type < b->type ? -1 : 1;
+    if(a->id != b->id)
+        return a->id < b->id ? -1 : 1;
+
+    return 0;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    /* 64-bit FNV-1a */
+    while(len--)
+        hash = (hash ^ *p++) * 0x100000001b3ULL;
+
+    return hash;
+}
+
+/* Hash of the contents of an element: coordinates, members in order with
+ * their roles, and tags */
+static uint64_t element_hash(struct osm_batch *batch, int i)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint32_t t, m;
+
+    if(batch->type == OSM_NODE)
+    {
+        hash = hash_bytes(hash, &batch->lat[i], sizeof(int32_t));
+        hash = hash_bytes(hash, &batch->lon[i], sizeof(int32_t));
+    }
+    else
+    {
+        for(m = batch->member_offsets[i]; m < batch->member_offsets[i + 1]; m++)
+        {
+            hash = hash_bytes(hash, &batch->member_ids[m], sizeof(unsigned int));
+            if(batch->type == OSM_RELATION)
+            {
+                const char *role = batch->strings + batch->member_roles[m];
+
+                hash = hash_bytes(hash, &batch->member_types[m], 1);
+                hash = hash_bytes(hash, role, strlen(role) + 1);
+            }
+        }
+    }
+
+    for(t = batch->tag_offsets[i]; t < batch->tag_offsets[i + 1]; t++)
+    {
+        const char *key = batch->strings + batch->tag_keys[t];
+        const char *value = batch->strings + batch->tag_values[t];
+
+        hash = hash_bytes(hash, key, strlen(key) + 1);
+        hash = hash_bytes(hash, value, strlen(value) + 1);
+    }
+
+    return hash;
+}
+
+static void write_element(struct osm_output *out, int action, struct diff_cursor *cur)
+{
+    osm_output_action(out, action);
+    if(cur->type == OSM_NODE)
+        osm_output_node(out, osm_batch_node(cur->batch, cur->i));
+    else if(cur->type == OSM_WAY)
+        osm_output_way(out, osm_batch_way(cur->batch, cur->i));
+    else
+        osm_output_relation(out, osm_batch_relation(cur->batch, cur->i));
+
+    return;
+}
+
+static void add_deletion(struct deletion_list *list, struct diff_cursor *cur)
+{
+    struct deletion *d;
+
+    if(list->count == list->max)
+    {
+        list->max = list->max ? list->max * 2 : 1024;
+        list->items = realloc(list->items, list->max * sizeof(struct deletion));
+    }
+    d = &list->items[list->count++];
+    d->id = cur->batch->ids[cur->i];
+    d->version = cur->batch->versions[cur->i];
+    d->lat = cur->type == OSM_NODE ? cur->batch->lat[cur->i] : 0;
+    d->lon = cur->type == OSM_NODE ? cur->batch->lon[cur->i] : 0;
+
+    return;
+}
+
+/* Write the deletions of one type in order of ID. Only the ID, version
+ * and, for nodes, location are given. */
+static void write_deletions(struct osm_output *out, int type, struct deletion_list *list)
+{
+    int i;
+
+    osm_output_action(out, OSM_ACTION_DELETE);
+    for(i = 0; i < list->count; i++)
+    {
+        struct deletion *d = &list->items[i];
+
+        if(type == OSM_NODE)
+        {
+            struct osm_node node = { d->lat / 1e7, d->lon / 1e7, NULL, 0, d->id, d->version };
+
+            osm_output_node(out, &node);
+        }
+        else if(type == OSM_WAY)
+        {
+            struct osm_way way = { 0, 0, NULL, NULL, d->id, d->version };
+
+            osm_output_way(out, &way);
+        }
+        else
+        {
+            struct osm_relation rel;
+
+            memset(&rel, 0, sizeof(rel));
+            rel.id = d->id;
+            rel.version = d->version;
+            osm_output_relation(out, &rel);
+        }
+    }
+
+    return;
+}
@@ -0,0 +1,314 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Escaping and unescaping of XML attribute values. Most strings contain
+ * nothing to be escaped, so the strings are scanned 16 bytes at a time
+ * with SSE2 for the characters that need attention, and the runs between
+ * them are copied in bulk. Where SSE2 is not available the scan is done
+ * a byte at a time. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "osm.h"
+
+#ifdef __SSE2__
+
+/* The scans use aligned loads, which cannot cross into the next page, so
+ * they may safely read past the terminating null byte. Bits for bytes
+ * before the start of the string are shifted out of the first mask. */
+
+/* Find the first '"', '&' or null byte */
+static const char *find_unescape(const char *p)
+{
+    uintptr_t misalign = (uintptr_t)p & 15;
+    const __m128i *block = (const __m128i *)(p - misalign);
+    const __m128i quote = _mm_set1_epi8('"'), amp = _mm_set1_epi8('&'), zero = _mm_setzero_si128();
+    __m128i v = _mm_load_si128(block);
+    unsigned int mask;
+
+    mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, amp)),
+                                          _mm_cmpeq_epi8(v, zero))) >> misalign;
+    if(mask)
+        return p + __builtin_ctz(mask);
+
+    while(1)
+    {
+        v = _mm_load_si128(++block);
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, amp)),
+                                              _mm_cmpeq_epi8(v, zero)));
+        if(mask)
+            return (const char *)block + __builtin_ctz(mask);
+    }
+}
+
+/* Bitmask of the bytes of a block that must be escaped: '"', '&', '<',
+ * '>', DEL and control characters, including the null byte */
+static inline unsigned int escape_mask(__m128i v)
+{
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+    __m128i m;
+
+    /* Unsigned v <= 0x1f */
+    m = _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl);
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+
+    return _mm_movemask_epi8(m);
+}
+
+/* Find the first byte that must be escaped, or the null byte */
+static const char *find_escape(const char *p)
+{
+    uintptr_t misalign = (uintptr_t)p & 15;
+    const __m128i *block = (const __m128i *)(p - misalign);
+    unsigned int mask = escape_mask(_mm_load_si128(block)) >> misalign;
+
+    if(mask)
+        return p + __builtin_ctz(mask);
+
+    while( !(mask = escape_mask(_mm_load_si128(++block))))
+        ;
+
+    return (const char *)block + __builtin_ctz(mask);
+}
+
+#else /* !__SSE2__ */
+
+static const char *find_unescape(const char *p)
+{
+    while(*p && *p != '"' && *p != '&')
+        p++;
+
+    return p;
+}
+
+static const char *find_escape(const char *p)
+{
+    unsigned char c;
+
+    while((c = *p) >= 0x20 && c != '"' && c != '&' && c != '<' && c != '>' && c != 0x7f)
+        p++;
+
+    return p;
+}
+
+#endif /* __SSE2__ */
+
+/* Decode the entity following an '&'. Returns the code point, or 0 if the
+ * entity is not recognised, and sets *end to the character after the ';'. */
+static unsigned int decode_entity(const char *p, const char **end)
+{
+    static const struct { const char *name; int len; unsigned int c; } named[] = {
+        { "amp;", 4, '&' }, { "lt;", 3, '<' }, { "gt;", 3, '>' },
+        { "quot;", 5, '"' }, { "apos;", 5, '\'' }
+    };
+    unsigned int c = 0;
+    int i, digits = 0;
+
+    if(*p != '#')
+    {
+        for(i = 0; i < (int)(sizeof(named) / sizeof(named[0])); i++)
+        {
+            if(strncmp(p, named[i].name, named[i].len) == 0)
+            {
+                *end = p + named[i].len;
+                return named[i].c;
+            }
+        }
+        return 0;
+    }
+
+    /* Numeric character reference, decimal or hexadecimal */
+    if(p[1] == 'x' || p[1] == 'X')
+    {
+        for(p += 2; digits < 7; p++, digits++)
+        {
+            if(*p >= '0' && *p <= '9')
+                c = 16 * c + (*p - '0');
+            else if((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f')
+                c = 16 * c + ((*p | 0x20) - 'a' + 10);
+            else
+                break;
+        }
+    }
+    else
+    {
+        for(p += 1; digits < 8 && *p >= '0' && *p <= '9'; p++, digits++)
+            c = 10 * c + (*p - '0');
+    }
+    if(digits == 0 || *p != ';' || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+        return 0;
+    *end = p + 1;
+
+    return c;
+}
+
+/* Encode a code point as UTF-8. Returns the number of bytes. */
+static int encode_utf8(unsigned int c, char *out)
+{
+    if(c < 0x80)
+    {
+        out[0] = c;
+        return 1;
+    }
+    if(c < 0x800)
+    {
+        out[0] = 0xc0 | (c >> 6);
+        out[1] = 0x80 | (c & 0x3f);
+        return 2;
+    }
+    if(c < 0x10000)
+    {
+        out[0] = 0xe0 | (c >> 12);
+        out[1] = 0x80 | ((c >> 6) & 0x3f);
+        out[2] = 0x80 | (c & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | (c >> 18);
+    out[1] = 0x80 | ((c >> 12) & 0x3f);
+    out[2] = 0x80 | ((c >> 6) & 0x3f);
+    out[3] = 0x80 | (c & 0x3f);
+
+    return 4;
+}
+
+size_t osm_xml_unescape(char *dest, size_t size, const char **src)
+{
+    const char *p = *src, *q;
+    size_t len = 0, room = size - 1;
+
+    while(1)
+    {
+        size_t run;
+        char utf8[4];
+        unsigned int c;
+        int n;
+
+        /* Copy up to the next character needing attention */
+        q = find_unescape(p);
+        run = q - p;
+        if(run > room - len)
+        {
+            /* Truncate, without splitting a UTF-8 sequence */
+            run = room - len;
+            while(run > 0 && (p[run] & 0xc0) == 0x80)
+                run--;
+            memcpy(dest + len, p, run);
+            len += run;
+            break;
+        }
+        memcpy(dest + len, p, run);
+        len += run;
+        p = q;
+
+        if(*p != '&')
+        {
+            if(*p == '"')
+                p++;
+            *src = p;
+            dest[len] = '\0';
+            return len;
+        }
+
+        /* Unrecognised entities are left as they are */
+        if((c = decode_entity(p + 1, &q)))
+            n = encode_utf8(c, utf8);
+        else
+        {
+            utf8[0] = '&';
+            n = 1;
+            q = p + 1;
+        }
+        if((size_t)n > room - len)
+            break;
+        memcpy(dest + len, utf8, n);
+        len += n;
+        p = q;
+    }
+
+    /* Truncated; skip the rest of the value */
+    while(*p && *p != '"')
+        p++;
+    if(*p == '"')
+        p++;
+    *src = p;
+    dest[len] = '\0';
+
+    return len;
+}
+
+size_t osm_xml_escape(char *dest, const char *src)
+{
+    char *out = dest;
+
+    while(1)
+    {
+        const char *q = find_escape(src);
+        unsigned char c = *q;
+
+        memcpy(out, src, q - src);
+        out += q - src;
+        if(c == '\0')
+            break;
+
+        switch(c)
+        {
+            case '"':
+                memcpy(out, "&quot;", 6);
+                out += 6;
+                break;
+            case '&':
+                memcpy(out, "&amp;", 5);
+                out += 5;
+                break;
+            case '<':
+                memcpy(out, "&lt;", 4);
+                out += 4;
+                break;
+            case '>':
+                memcpy(out, "&gt;", 4);
+                out += 4;
+                break;
+            default: /* ASCII non-printable */
+                *out++ = '&';
+                *out++ = '#';
+                if(c >= 100)
+                    *out++ = '0' + c / 100;
+                if(c >= 10)
+                    *out++ = '0' + c / 10 % 10;
+                *out++ = '0' + c % 10;
+                *out++ = ';';
+                break;
+        }
+        src = q + 1;
+    }
+    *out = '\0';
+
+    return out - dest;
+}
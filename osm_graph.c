@@ -0,0 +1,448 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Railway topology graph. Node locations and track ways are collected
+ * while the extract is written; the graph is then built with a vertex at
+ * every junction (a node shared by more than one way, or the end of a
+ * way; a way that passes a node twice counts only once there) and an edge for each stretch of way between two junctions, and
+ * written in compressed sparse row form. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "osm.h"
+
+#define EARTH_RADIUS 6371008.8 /**< Mean radius of the Earth in metres */
+
+/* Track way with its attributes, as stored until the graph is built */
+struct graph_way
+{
+    unsigned int id;
+    int node_start, node_count; /**< Node IDs in way_nodes[] */
+    unsigned short gauge, maxspeed;
+    unsigned char electrified;
+};
+
+/* Edge found while walking the ways, before conversion to CSR form */
+struct graph_edge
+{
+    int from, to;   /**< Vertex indices */
+    int way;        /**< Index in ways[] */
+    float length;
+};
+
+struct osm_graph
+{
+    /* Locations of all nodes in the extract */
+    unsigned int *node_ids;
+    int32_t *node_lat, *node_lon; /**< Fixed point, units of 1e-7 degrees */
+    int node_count, node_max;
+    char nodes_unsorted; /**< Boolean; nodes were not added in ID order */
+
+    struct graph_way *ways;
+    int way_count, way_max;
+    unsigned int *way_nodes;
+    int way_node_count, way_node_max;
+};
+
+static int cmp_node(const void *a, const void *b);
+
+struct osm_graph *osm_graph_init(void)
+{
+    return calloc(1, sizeof(struct osm_graph));
+}
+
+void osm_graph_add_node(struct osm_graph *graph, struct osm_node *node)
+{
+    if(graph->node_count >= graph->node_max)
+    {
+        graph->node_max += 100000;
+        graph->node_ids = realloc(graph->node_ids, graph->node_max * sizeof(unsigned int));
+        graph->node_lat = realloc(graph->node_lat, graph->node_max * sizeof(int32_t));
+        graph->node_lon = realloc(graph->node_lon, graph->node_max * sizeof(int32_t));
+    }
+
+    if(graph->node_count > 0 && node->id < graph->node_ids[graph->node_count - 1])
+        graph->nodes_unsorted = 1;
+    graph->node_ids[graph->node_count] = node->id;
+    graph->node_lat[graph->node_count] = lround(node->lat * 1e7);
+    graph->node_lon[graph->node_count] = lround(node->lon * 1e7);
+    graph->node_count++;
+
+    return;
+}
+
+/* Check whether a way is railway track, as opposed to a platform, station
+ * building or other railway-related feature */
+static int is_track(struct osm_way *way)
+{
+    static const char *track_types[] = {
+        "rail", "light_rail", "narrow_gauge", "subway", "tram", "monorail",
+        "funicular", "miniature", "preserved", NULL
+    };
+    int t, i;
+
+    for(t = 0; t < way->tag_count; t++)
+    {
+        if(strcmp(way->tags[t].key, "railway") != 0)
+            continue;
+        for(i = 0; track_types[i]; i++)
+            if(strcmp(way->tags[t].value, track_types[i]) == 0)
+                return 1;
+    }
+
+    return 0;
+}
+
+/* Parse a maxspeed tag value into km/h, allowing for values in mph */
+static unsigned short parse_maxspeed(const char *value)
+{
+    char *end;
+    double speed = strtod(value, &end);
+
+    if(end == value || speed <= 0)
+        return 0;
+    while(*end == ' ')
+        end++;
+    if(strcmp(end, "mph") == 0)
+        speed *= 1.609344;
+
+    return speed > 65535 ? 65535 : (unsigned short)(speed + 0.5);
+}
+
+static unsigned char parse_electrified(const char *value)
+{
+    if(strcmp(value, "no") == 0)
+        return OSM_ELECTRIFIED_NO;
+    if(strcmp(value, "contact_line") == 0)
+        return OSM_ELECTRIFIED_CONTACT_LINE;
+    if(strcmp(value, "rail") == 0)
+        return OSM_ELECTRIFIED_RAIL;
+
+    return OSM_ELECTRIFIED_OTHER;
+}
+
+void osm_graph_add_way(struct osm_graph *graph, struct osm_way *way)
+{
+    struct graph_way *gw;
+    int t;
+
+    if(way->node_count < 2 || !is_track(way))
+        return;
+
+    if(graph->way_count >= graph->way_max)
+    {
+        graph->way_max += 10000;
+        graph->ways = realloc(graph->ways, graph->way_max * sizeof(struct graph_way));
+    }
+    if(graph->way_node_count + way->node_count > graph->way_node_max)
+    {
+        graph->way_node_max += 100000 + way->node_count;
+        graph->way_nodes = realloc(graph->way_nodes, graph->way_node_max * sizeof(unsigned int));
+    }
+
+    gw = &graph->ways[graph->way_count++];
+    gw->id = way->id;
+    gw->node_start = graph->way_node_count;
+    gw->node_count = way->node_count;
+    gw->gauge = gw->maxspeed = 0;
+    gw->electrified = OSM_ELECTRIFIED_UNKNOWN;
+    memcpy(graph->way_nodes + graph->way_node_count, way->nodes, way->node_count * sizeof(unsigned int));
+    graph->way_node_count += way->node_count;
+
+    for(t = 0; t < way->tag_count; t++)
+    {
+        struct osm_tag *tag = way->tags + t;
+
+        /* Multiple gauges are separated by semicolons; the first is used */
+        if(strcmp(tag->key, "gauge") == 0)
+            gw->gauge = atoi(tag->value);
+        else if(strcmp(tag->key, "maxspeed") == 0)
+            gw->maxspeed = parse_maxspeed(tag->value);
+        else if(strcmp(tag->key, "electrified") == 0)
+            gw->electrified = parse_electrified(tag->value);
+    }
+
+    return;
+}
+
+/* Index of a node in the node arrays, or -1 if it is not present */
+static int node_index(struct osm_graph *graph, unsigned int id)
+{
+    int lo = 0, hi = graph->node_count - 1;
+
+    while(lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if(graph->node_ids[mid] < id)
+            lo = mid + 1;
+        else if(graph->node_ids[mid] > id)
+            hi = mid - 1;
+        else
+            return mid;
+    }
+
+    return -1;
+}
+
+/* Great-circle distance in metres between two nodes */
+static double distance(struct osm_graph *graph, int a, int b)
+{
+    double lat1 = graph->node_lat[a] * 1e-7 * M_PI / 180, lat2 = graph->node_lat[b] * 1e-7 * M_PI / 180;
+    double dlat = lat2 - lat1, dlon = (graph->node_lon[b] - graph->node_lon[a]) * 1e-7 * M_PI / 180;
+    double h = sin(dlat / 2) * sin(dlat / 2) + cos(lat1) * cos(lat2) * sin(dlon / 2) * sin(dlon / 2);
+
+    return 2 * EARTH_RADIUS * asin(sqrt(h));
+}
+
+/* Sort the node arrays by ID, if they were not added in order */
+static void sort_nodes(struct osm_graph *graph)
+{
+    struct { unsigned int id; int32_t lat, lon; } *tmp;
+    int n;
+
+    if(!graph->nodes_unsorted)
+        return;
+
+    tmp = malloc(graph->node_count * sizeof(*tmp));
+    for(n = 0; n < graph->node_count; n++)
+    {
+        tmp[n].id = graph->node_ids[n];
+        tmp[n].lat = graph->node_lat[n];
+        tmp[n].lon = graph->node_lon[n];
+    }
+    qsort(tmp, graph->node_count, sizeof(*tmp), cmp_node);
+    for(n = 0; n < graph->node_count; n++)
+    {
+        graph->node_ids[n] = tmp[n].id;
+        graph->node_lat[n] = tmp[n].lat;
+        graph->node_lon[n] = tmp[n].lon;
+    }
+    free(tmp);
+    graph->nodes_unsorted = 0;
+
+    return;
+}
+
+static int write_section(FILE *fp, const void *data, size_t len, uint64_t *offset)
+{
+    static const char padding[8];
+    size_t pad = (8 - len % 8) % 8;
+
+    *offset = ftell(fp);
+    if(fwrite(data, 1, len, fp) != len || fwrite(padding, 1, pad, fp) != pad)
+        return -1;
+
+    return 0;
+}
+
+int osm_graph_write(struct osm_graph *graph, const char *filename)
+{
+    struct osm_graph_header header;
+    struct osm_graph_vertex *vertices;
+    struct osm_graph_edge *edge_attrs;
+    struct graph_edge *edges = NULL;
+    uint32_t *row_offsets, *targets;
+    unsigned char *refs;
+    int *vertex, *way_idx, *last_way;
+    int edge_count = 0, edge_max = 0, vertex_count = 0, n, w, e, ret = 0;
+    FILE *fp;
+
+    sort_nodes(graph);
+
+    /* Resolve way node IDs to node indices, and count the number of
+     * distinct ways passing each node; way ends count as junctions in any
+     * case. The last way counted at each node is remembered, so that a
+     * way revisiting a node is not counted again. */
+    refs = calloc(graph->node_count, 1);
+    last_way = malloc(graph->node_count * sizeof(int));
+    for(n = 0; n < graph->node_count; n++)
+        last_way[n] = -1;
+    way_idx = malloc(graph->way_node_count * sizeof(int));
+    for(w = 0; w < graph->way_count; w++)
+    {
+        struct graph_way *gw = &graph->ways[w];
+
+        for(n = 0; n < gw->node_count; n++)
+        {
+            int idx = node_index(graph, graph->way_nodes[gw->node_start + n]);
+
+            way_idx[gw->node_start + n] = idx;
+            if(idx < 0)
+                continue;
+            if(n == 0 || n == gw->node_count - 1)
+                refs[idx] = 2;
+            else if(refs[idx] < 2 && last_way[idx] != w)
+                refs[idx]++;
+            last_way[idx] = w;
+        }
+    }
+    free(last_way);
+
+    /* Number the junctions, in node ID order */
+    vertex = malloc(graph->node_count * sizeof(int));
+    for(n = 0; n < graph->node_count; n++)
+        vertex[n] = refs[n] >= 2 ? vertex_count++ : -1;
+    free(refs);
+
+    /* Walk each way, splitting it into edges at junctions. Nodes missing
+     * from the extract are passed over. */
+    for(w = 0; w < graph->way_count; w++)
+    {
+        struct graph_way *gw = &graph->ways[w];
+        int from = -1, prev = -1;
+        double length = 0;
+
+        for(n = 0; n < gw->node_count; n++)
+        {
+            int idx = way_idx[gw->node_start + n];
+
+            if(idx < 0)
+                continue;
+            if(prev >= 0)
+                length += distance(graph, prev, idx);
+            prev = idx;
+
+            if(vertex[idx] < 0)
+                continue;
+            if(from >= 0)
+            {
+                if(edge_count >= edge_max)
+                {
+                    edge_max += 100000;
+                    edges = realloc(edges, edge_max * sizeof(struct graph_edge));
+                }
+                edges[edge_count].from = from;
+                edges[edge_count].to = vertex[idx];
+                edges[edge_count].way = w;
+                edges[edge_count].length = length;
+                edge_count++;
+            }
+            from = vertex[idx];
+            length = 0;
+        }
+    }
+    free(way_idx);
+
+    /* Convert to compressed sparse row form, with each edge stored once
+     * in each direction */
+    vertices = malloc((vertex_count + 1) * sizeof(struct osm_graph_vertex));
+    for(n = 0; n < graph->node_count; n++)
+    {
+        if(vertex[n] < 0)
+            continue;
+        vertices[vertex[n]].id = graph->node_ids[n];
+        vertices[vertex[n]].lat = graph->node_lat[n];
+        vertices[vertex[n]].lon = graph->node_lon[n];
+    }
+    free(vertex);
+
+    row_offsets = calloc(vertex_count + 1, sizeof(uint32_t));
+    for(e = 0; e < edge_count; e++)
+    {
+        row_offsets[edges[e].from + 1]++;
+        row_offsets[edges[e].to + 1]++;
+    }
+    for(n = 0; n < vertex_count; n++)
+        row_offsets[n + 1] += row_offsets[n];
+
+    targets = malloc((2 * edge_count + 1) * sizeof(uint32_t));
+    edge_attrs = calloc(2 * edge_count + 1, sizeof(struct osm_graph_edge));
+    for(e = 0; e < edge_count; e++)
+    {
+        struct graph_way *gw = &graph->ways[edges[e].way];
+        int dir;
+
+        for(dir = 0; dir < 2; dir++)
+        {
+            int u = dir ? edges[e].to : edges[e].from, v = dir ? edges[e].from : edges[e].to;
+            uint32_t slot = row_offsets[u]++;
+
+            targets[slot] = v;
+            edge_attrs[slot].length = edges[e].length;
+            edge_attrs[slot].way_id = gw->id;
+            edge_attrs[slot].gauge = gw->gauge;
+            edge_attrs[slot].maxspeed = gw->maxspeed;
+            edge_attrs[slot].electrified = gw->electrified;
+        }
+    }
+    /* Filling has advanced each row offset to the start of the next row */
+    memmove(row_offsets + 1, row_offsets, vertex_count * sizeof(uint32_t));
+    row_offsets[0] = 0;
+    free(edges);
+
+    fprintf(stderr, "Railway graph: %d vertices, %d edges\n", vertex_count, edge_count);
+
+    if( !(fp = fopen(filename, "wb")))
+    {
+        fprintf(stderr, "osm_graph_write(): Unable to open file <%s>\n", filename);
+        ret = 1;
+        goto write_done;
+    }
+
+    /* Header is written last, once section offsets are known */
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, OSM_GRAPH_MAGIC, sizeof(header.magic));
+    header.version = OSM_GRAPH_VERSION;
+    header.vertex_count = vertex_count;
+    header.edge_count = 2 * edge_count;
+    fseek(fp, sizeof(header), SEEK_SET);
+    if( write_section(fp, vertices, vertex_count * sizeof(struct osm_graph_vertex), &header.vertices_offset) != 0
+     || write_section(fp, row_offsets, (vertex_count + 1) * sizeof(uint32_t), &header.row_offsets_offset) != 0
+     || write_section(fp, targets, 2 * edge_count * sizeof(uint32_t), &header.targets_offset) != 0
+     || write_section(fp, edge_attrs, 2 * edge_count * sizeof(struct osm_graph_edge), &header.edges_offset) != 0
+     || fseek(fp, 0, SEEK_SET) != 0
+     || fwrite(&header, sizeof(header), 1, fp) != 1
+     || fclose(fp) != 0)
+    {
+        fprintf(stderr, "osm_graph_write(): Error writing file <%s>\n", filename);
+        ret = 1;
+    }
+
+write_done:
+    free(vertices);
+    free(row_offsets);
+    free(targets);
+    free(edge_attrs);
+
+    return ret;
+}
+
+void osm_graph_destroy(struct osm_graph *graph)
+{
+    free(graph->node_ids);
+    free(graph->node_lat);
+    free(graph->node_lon);
+    free(graph->ways);
+    free(graph->way_nodes);
+    free(graph);
+
+    return;
+}
+
+static int cmp_node(const void *a, const void *b)
+{
+    unsigned int aa = *(unsigned int *)a, bb = *(unsigned int *)b;
+
+    return aa < bb ? -1 : aa > bb;
+}
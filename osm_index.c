@@ -0,0 +1,354 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Sparse index of an XML extract by type and ID. While the extract is
+ * written, the output offset of every Nth element, and of the first
+ * element of each type, is recorded in a sidecar file as delta-encoded
+ * varints. A lookup finds the last entry at or before the element wanted
+ * and reads only the stretch of the extract up to the next entry. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include "osm.h"
+
+struct osm_index
+{
+    /* Writing */
+    FILE *fp;
+    const char *filename;
+    int interval;
+    int since;          /**< Elements added since the last entry */
+    int last_type;      /**< Type and ID of the last element added, or -1 */
+    unsigned int last_id;
+    int unsorted;       /**< Boolean; elements were not added in order */
+    uint64_t prev_key;  /**< Key and offset of the last entry written */
+    long long prev_offset;
+    uint64_t entry_count;
+
+    /* Reading; entry_count + 1 offsets, the last being the end offset */
+    uint64_t *keys;
+    long long *offsets;
+};
+
+static const char *element_names[] = { "node", "way", "relation" };
+
+static void write_varint(FILE *, uint64_t);
+static const unsigned char *read_varint(const unsigned char *p, const unsigned char *end, uint64_t *v);
+static int find_element(const char *text, size_t len, int type, unsigned int id,
+                        size_t *start, size_t *end);
+
+struct osm_index *osm_index_create(const char *filename, int interval)
+{
+    struct osm_index *idx = calloc(1, sizeof(struct osm_index));
+    struct osm_index_header header;
+
+    if( !(idx->fp = fopen(filename, "wb")))
+    {
+        fprintf(stderr, "osm_index_create(): Unable to open file <%s>\n", filename);
+        free(idx);
+        return NULL;
+    }
+    idx->filename = filename;
+    idx->interval = interval > 0 ? interval : OSM_INDEX_INTERVAL;
+    idx->last_type = -1;
+
+    /* Placeholder, rewritten by osm_index_close() */
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, idx->fp);
+
+    return idx;
+}
+
+void osm_index_add(struct osm_index *idx, int type, unsigned int id, long long offset)
+{
+    uint64_t key = (uint64_t)type << 32 | id;
+
+    if(idx->unsorted)
+        return;
+    if(type < idx->last_type || (type == idx->last_type && id <= idx->last_id))
+    {
+        fprintf(stderr, "osm_index_add(): %s %u follows %s %u; output is not sorted\n",
+                element_names[type], id, element_names[idx->last_type], idx->last_id);
+        idx->unsorted = 1;
+        return;
+    }
+
+    /* Each type starts a new entry, so that the stretch between two
+     * entries holds elements of a single type */
+    if(type != idx->last_type || ++idx->since >= idx->interval)
+    {
+        write_varint(idx->fp, key - idx->prev_key);
+        write_varint(idx->fp, offset - idx->prev_offset);
+        idx->prev_key = key;
+        idx->prev_offset = offset;
+        idx->entry_count++;
+        idx->since = 0;
+    }
+    idx->last_type = type;
+    idx->last_id = id;
+
+    return;
+}
+
+int osm_index_close(struct osm_index *idx, long long end_offset)
+{
+    struct osm_index_header header;
+    int ret = 0;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, OSM_INDEX_MAGIC, sizeof(header.magic));
+    header.version = OSM_INDEX_VERSION;
+    header.interval = idx->interval;
+    header.entry_count = idx->entry_count;
+    header.end_offset = end_offset;
+
+    if(idx->unsorted)
+    {
+        fprintf(stderr, "osm_index_close(): Index <%s> not written\n", idx->filename);
+        fclose(idx->fp);
+        remove(idx->filename);
+        ret = 1;
+    }
+    else if(ferror(idx->fp)
+     || fseek(idx->fp, 0, SEEK_SET) != 0
+     || fwrite(&header, sizeof(header), 1, idx->fp) != 1
+     || fclose(idx->fp) != 0)
+    {
+        fprintf(stderr, "osm_index_close(): Error writing file <%s>\n", idx->filename);
+        ret = 1;
+    }
+    free(idx);
+
+    return ret;
+}
+
+struct osm_index *osm_index_load(const char *filename)
+{
+    struct osm_index *idx;
+    struct osm_index_header header;
+    unsigned char *data;
+    const unsigned char *p, *end;
+    uint64_t e, key = 0, offset = 0;
+    long size;
+    FILE *fp;
+
+    if( !(fp = fopen(filename, "rb")))
+    {
+        fprintf(stderr, "osm_index_load(): Unable to open file <%s>\n", filename);
+        return NULL;
+    }
+    if(fread(&header, sizeof(header), 1, fp) != 1
+       || memcmp(header.magic, OSM_INDEX_MAGIC, sizeof(header.magic)) != 0
+       || header.version != OSM_INDEX_VERSION)
+    {
+        fprintf(stderr, "osm_index_load(): <%s> is not an index file\n", filename);
+        fclose(fp);
+        return NULL;
+    }
+
+    /* Each entry takes at least two bytes */
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp) - sizeof(header);
+    if(header.entry_count > (uint64_t)size / 2)
+    {
+        fprintf(stderr, "osm_index_load(): <%s> is truncated\n", filename);
+        fclose(fp);
+        return NULL;
+    }
+    data = malloc(size);
+    fseek(fp, sizeof(header), SEEK_SET);
+    if(fread(data, 1, size, fp) != (size_t)size)
+    {
+        fprintf(stderr, "osm_index_load(): Error reading file <%s>\n", filename);
+        free(data);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+
+    idx = calloc(1, sizeof(struct osm_index));
+    idx->entry_count = header.entry_count;
+    idx->keys = malloc((header.entry_count + 1) * sizeof(uint64_t));
+    idx->offsets = malloc((header.entry_count + 1) * sizeof(long long));
+    p = data;
+    end = data + size;
+    for(e = 0; e < header.entry_count; e++)
+    {
+        uint64_t key_delta, offset_delta;
+
+        if( !(p = read_varint(p, end, &key_delta)) || !(p = read_varint(p, end, &offset_delta)))
+        {
+            fprintf(stderr, "osm_index_load(): <%s> is truncated\n", filename);
+            free(data);
+            osm_index_free(idx);
+            return NULL;
+        }
+        key += key_delta;
+        offset += offset_delta;
+        idx->keys[e] = key;
+        idx->offsets[e] = offset;
+    }
+    idx->keys[e] = UINT64_MAX;
+    idx->offsets[e] = header.end_offset;
+    free(data);
+
+    return idx;
+}
+
+int osm_index_find(struct osm_index *idx, FILE *fp, int type, unsigned int id,
+                   char **text, size_t *len)
+{
+    uint64_t key = (uint64_t)type << 32 | id;
+    size_t lo = 0, hi = idx->entry_count, size, start, end;
+    char *block;
+
+    /* Find the last entry at or before the element */
+    if(idx->entry_count == 0 || idx->keys[0] > key)
+        return 1;
+    while(hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if(idx->keys[mid] <= key)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if((int)(idx->keys[lo] >> 32) != type)
+        return 1;
+
+    size = idx->offsets[lo + 1] - idx->offsets[lo];
+    block = malloc(size + 1);
+    if(fseeko(fp, idx->offsets[lo], SEEK_SET) != 0 || fread(block, 1, size, fp) != size)
+    {
+        fprintf(stderr, "osm_index_find(): Error reading extract\n");
+        free(block);
+        return -1;
+    }
+    block[size] = '\0';
+
+    if( !find_element(block, size, type, id, &start, &end))
+    {
+        free(block);
+        return 1;
+    }
+    memmove(block, block + start, end - start);
+    block[end - start] = '\0';
+    *text = block;
+    *len = end - start;
+
+    return 0;
+}
+
+void osm_index_free(struct osm_index *idx)
+{
+    free(idx->keys);
+    free(idx->offsets);
+    free(idx);
+
+    return;
+}
+
+/* Write errors are picked up by ferror() in osm_index_close() */
+static void write_varint(FILE *fp, uint64_t v)
+{
+    unsigned char buff[10];
+    int n = 0;
+
+    while(v >= 0x80)
+    {
+        buff[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    buff[n++] = v;
+    fwrite(buff, 1, n, fp);
+
+    return;
+}
+
+/* Returns the byte after the varint, or NULL if it runs past the end */
+static const unsigned char *read_varint(const unsigned char *p, const unsigned char *end, uint64_t *v)
+{
+    int shift = 0;
+
+    *v = 0;
+    while(p < end && shift < 64)
+    {
+        *v |= (uint64_t)(*p & 0x7f) << shift;
+        if( !(*p++ & 0x80))
+            return p;
+        shift += 7;
+    }
+
+    return NULL;
+}
+
+/* Find the text of an element in a stretch of the extract holding only
+ * elements of its type. Each element starts on a line of its own, and
+ * runs up to the start of the next. */
+static int find_element(const char *text, size_t len, int type, unsigned int id,
+                        size_t *start, size_t *end)
+{
+    const char *name = element_names[type];
+    size_t name_len = strlen(name), pos = 0;
+    int found = 0;
+
+    while(pos < len)
+    {
+        const char *line = text + pos, *p = line, *nl = memchr(line, '\n', len - pos);
+        size_t next = nl ? (size_t)(nl - text) + 1 : len;
+
+        while(*p == ' ' || *p == '\t')
+            p++;
+        if(*p == '<' && strncmp(p + 1, name, name_len) == 0
+           && (p[name_len + 1] == ' ' || p[name_len + 1] == '\t'))
+        {
+            const char *attr;
+
+            if(found)
+            {
+                *end = pos;
+                return 1;
+            }
+            /* The ID is the value of the id attribute of the start tag */
+            for(attr = p + name_len + 1; attr < text + next && *attr != '>'; attr++)
+            {
+                if((*attr == ' ' || *attr == '\t') && strncmp(attr + 1, "id=", 3) == 0
+                   && (attr[4] == '"' || attr[4] == '\''))
+                {
+                    if(strtoul(attr + 5, NULL, 10) == id)
+                    {
+                        *start = pos;
+                        found = 1;
+                    }
+                    break;
+                }
+            }
+        }
+        pos = next;
+    }
+    *end = len;
+
+    return found;
+}
@@ -0,0 +1,187 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Spatial ordering of elements. Locations are mapped to their distance
+ * along a Hilbert curve filling the longitude/latitude rectangle, and
+ * arrays of (key, index) pairs are sorted in parallel: each thread sorts
+ * a slice of the array, and the slices are then merged in pairs, the
+ * merges of each round also running in parallel. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "osm.h"
+
+#define MAX_THREADS  16
+#define MIN_SLICE    65536 /**< Smallest slice worth a thread of its own */
+
+/* Slice of the array to be sorted, or pair of adjacent slices to be merged */
+struct sort_task
+{
+    pthread_t thread;
+    struct osm_order_key *src, *dest;
+    size_t start, mid, end;
+};
+
+static int cmp_key(const void *a, const void *b);
+static void *start_sort_thread(void *);
+static void *start_merge_thread(void *);
+static void run_tasks(struct sort_task *, int count, void *(*func)(void *));
+
+uint64_t osm_hilbert_index(int32_t lat, int32_t lon)
+{
+    /* Scale each axis to the full 32-bit range */
+    uint32_t x = ((uint64_t)((int64_t)lon + 1800000000) * UINT32_MAX) / 3600000000u;
+    uint32_t y = ((uint64_t)((int64_t)lat + 900000000) * UINT32_MAX) / 1800000000u;
+    uint64_t d = 0;
+    uint32_t s;
+
+    for(s = 1u << 31; s > 0; s >>= 1)
+    {
+        unsigned int rx = (x & s) != 0, ry = (y & s) != 0;
+
+        d += (uint64_t)s * s * ((3 * rx) ^ ry);
+
+        /* Rotate the quadrant so that the curve is continuous */
+        if( !ry)
+        {
+            uint32_t t;
+
+            if(rx)
+            {
+                x = ~x;
+                y = ~y;
+            }
+            t = x;
+            x = y;
+            y = t;
+        }
+    }
+
+    return d;
+}
+
+void osm_order_sort(struct osm_order_key *keys, size_t count)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = 1, slices, i;
+    struct sort_task tasks[MAX_THREADS];
+    struct osm_order_key *tmp, *src, *dest;
+
+    /* A power of two of slices, so that they merge in pairs */
+    while(2 * nthreads <= ncpu && 2 * nthreads <= MAX_THREADS && count / (2 * nthreads) >= MIN_SLICE)
+        nthreads *= 2;
+    if(nthreads == 1)
+    {
+        qsort(keys, count, sizeof(struct osm_order_key), cmp_key);
+        return;
+    }
+
+    for(i = 0; i < nthreads; i++)
+    {
+        tasks[i].src = keys;
+        tasks[i].start = count * i / nthreads;
+        tasks[i].end = count * (i + 1) / nthreads;
+    }
+    run_tasks(tasks, nthreads, start_sort_thread);
+
+    tmp = malloc(count * sizeof(struct osm_order_key));
+    src = keys;
+    dest = tmp;
+    for(slices = nthreads; slices > 1; slices /= 2)
+    {
+        for(i = 0; i < slices / 2; i++)
+        {
+            tasks[i].src = src;
+            tasks[i].dest = dest;
+            tasks[i].start = count * (2 * i) / slices;
+            tasks[i].mid = count * (2 * i + 1) / slices;
+            tasks[i].end = count * (2 * i + 2) / slices;
+        }
+        run_tasks(tasks, slices / 2, start_merge_thread);
+        src = dest;
+        dest = (dest == tmp) ? keys : tmp;
+    }
+    if(src != keys)
+        memcpy(keys, src, count * sizeof(struct osm_order_key));
+    free(tmp);
+
+    return;
+}
+
+/* Order by key, and elements with equal keys by index, so that the
+ * result does not depend on the number of threads */
+static int cmp_key(const void *a, const void *b)
+{
+    const struct osm_order_key *ka = a, *kb = b;
+
+    if(ka->key != kb->key)
+        return ka->key < kb->key ? -1 : 1;
+
+    return ka->index < kb->index ? -1 : (ka->index > kb->index ? 1 : 0);
+}
+
+static void *start_sort_thread(void *data)
+{
+    struct sort_task *task = data;
+
+    qsort(task->src + task->start, task->end - task->start, sizeof(struct osm_order_key), cmp_key);
+
+    return NULL;
+}
+
+static void *start_merge_thread(void *data)
+{
+    struct sort_task *task = data;
+    struct osm_order_key *src = task->src, *out = task->dest + task->start;
+    size_t a = task->start, b = task->mid;
+
+    while(a < task->mid && b < task->end)
+        *out++ = cmp_key(&src[b], &src[a]) < 0 ? src[b++] : src[a++];
+    memcpy(out, src + a, (task->mid - a) * sizeof(struct osm_order_key));
+    out += task->mid - a;
+    memcpy(out, src + b, (task->end - b) * sizeof(struct osm_order_key));
+
+    return NULL;
+}
+
+/* Run tasks in parallel, one in this thread */
+static void run_tasks(struct sort_task *tasks, int count, void *(*func)(void *))
+{
+    int i, started;
+
+    for(started = 1; started < count; started++)
+    {
+        if(pthread_create(&tasks[started].thread, NULL, func, &tasks[started]) != 0)
+            break;
+    }
+    func(&tasks[0]);
+    /* Any that could not be started are run here too */
+    for(i = started; i < count; i++)
+        func(&tasks[i]);
+    for(i = 1; i < started; i++)
+        pthread_join(tasks[i].thread, NULL);
+
+    return;
+}
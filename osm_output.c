@@ -0,0 +1,994 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Writers for OSM XML, osmChange and OSM PBF output. XML is formatted
+ * into a buffer and written out in large chunks. PBF elements are collected into
+ * primitive blocks of up to 8000 elements of one type, which are encoded
+ * in the calling thread and compressed by a pool of worker threads. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "osm.h"
+
+#define XML_BUFF_SIZE   65536 /**< XML output is written out in chunks of this size */
+#define BLOCK_ELEMENTS  8000  /**< Maximum number of elements in a PBF primitive block */
+#define MAX_THREADS     16
+
+/* Job states */
+#define JOB_FREE     0
+#define JOB_PENDING  1
+#define JOB_BUSY     2
+#define JOB_DONE     3
+
+/* Growable byte buffer, used for building protocol buffer messages */
+struct pb_buf
+{
+    unsigned char *data;
+    size_t len, max;
+};
+
+/* PBF blob awaiting compression and output */
+struct pbf_job
+{
+    int state;            /**< JOB_* */
+    int is_header;        /**< Boolean; OSMHeader rather than OSMData */
+    struct pb_buf raw;    /**< Uncompressed block */
+    struct pb_buf blob;   /**< Length-prefixed BlobHeader and Blob ready for output */
+};
+
+struct pbf_writer
+{
+    int block_type;  /**< Element type of current block, or -1 if empty */
+    int count;       /**< Number of elements in current block */
+
+    /* String table of current block. Index 0 is always the empty string,
+     * which is reserved as a delimiter. */
+    struct pb_buf strings; /**< Null-terminated strings, end to end */
+    int *str_offset;       /**< Offset of each string in strings */
+    int str_count, str_max;
+    int *hash;             /**< Open-addressed hash table of string indices */
+    int hash_size;
+
+    /* Dense node columns, delta-encoded except for the versions */
+    struct pb_buf ids, lats, lons, keys_vals, versions;
+    int64_t last_id, last_lat, last_lon;
+    int dense_tags;  /**< Boolean; at least one node in block has tags */
+    int dense_versions; /**< Boolean; at least one node in block has a version */
+
+    /* Encoded ways or relations of current block */
+    struct pb_buf group;
+    struct pb_buf msg, keys, vals, packed, packed2, packed3;
+
+    /* Ring of blobs in the compression pipeline */
+    struct pbf_job *jobs;
+    int njobs;
+    long submitted;   /**< Number of jobs submitted for compression */
+    long compressed;  /**< Number of jobs taken by worker threads */
+    long written;     /**< Number of jobs written out */
+
+    pthread_t threads[MAX_THREADS];
+    int nthreads;
+    char exit_now;
+    pthread_mutex_t mutex;
+    pthread_cond_t pending_signal, done_signal;
+};
+
+struct osm_output
+{
+    int format;       /**< OSM_FORMAT_XML, OSM_FORMAT_CHANGE or OSM_FORMAT_PBF */
+    int action;       /**< osmChange block currently open (OSM_ACTION_*), or -1 */
+    FILE *fp;
+    int error;        /**< Boolean; a write error has occurred */
+    long long offset; /**< Number of bytes written so far */
+
+    char buff[XML_BUFF_SIZE]; /**< XML output buffer */
+    int buff_len;
+
+    struct pbf_writer *pbf;
+};
+
+static void write_out(struct osm_output *, const void *, size_t);
+static struct pbf_writer *pbf_writer_init(struct osm_output *, int nthreads);
+static void pbf_writer_node(struct osm_output *, struct osm_node *);
+static void pbf_writer_way(struct osm_output *, struct osm_way *);
+static void pbf_writer_relation(struct osm_output *, struct osm_relation *);
+static void pbf_writer_finish(struct osm_output *);
+
+static void xml_flush(struct osm_output *);
+static void xml_mem(struct osm_output *, const char *, int len);
+static void xml_str(struct osm_output *, const char *);
+static void xml_uint(struct osm_output *, unsigned int);
+static void xml_escaped(struct osm_output *, const char *);
+static void xml_tags(struct osm_output *, struct osm_tag *, int tag_count);
+static void xml_version(struct osm_output *, unsigned int version);
+
+struct osm_output *osm_output_open(FILE *fp, int format)
+{
+    return osm_output_open_threads(fp, format, -1);
+}
+
+struct osm_output *osm_output_open_threads(FILE *fp, int format, int nthreads)
+{
+    struct osm_output *out = calloc(1, sizeof(struct osm_output));
+
+    out->format = format;
+    out->fp = fp;
+    out->action = -1;
+
+    if(format == OSM_FORMAT_PBF)
+    {
+        if( !(out->pbf = pbf_writer_init(out, nthreads)))
+        {
+            free(out);
+            return NULL;
+        }
+    }
+    else if(format == OSM_FORMAT_CHANGE)
+    {
+        xml_str(out, "<?xml version='1.0' encoding='UTF-8'?>\n");
+        xml_str(out, "<osmChange version=\"0.6\" generator=\"osmrail by Paul Kelly\">\n");
+    }
+    else
+    {
+        xml_str(out, "<?xml version='1.0' encoding='UTF-8'?>\n");
+        xml_str(out, "<osm version=\"0.6\" generator=\"osmrail by Paul Kelly\">\n");
+    }
+
+    return out;
+}
+
+void osm_output_action(struct osm_output *out, int action)
+{
+    static const char *names[] = { "create", "modify", "delete" };
+
+    if(out->format != OSM_FORMAT_CHANGE || action == out->action)
+        return;
+
+    if(out->action >= 0)
+    {
+        xml_str(out, "</");
+        xml_str(out, names[out->action]);
+        xml_str(out, ">\n");
+    }
+    if(action >= 0)
+    {
+        xml_str(out, "<");
+        xml_str(out, names[action]);
+        xml_str(out, ">\n");
+    }
+    out->action = action;
+
+    return;
+}
+
+void osm_output_node(struct osm_output *out, struct osm_node *node)
+{
+    char coords[64];
+
+    if(out->format == OSM_FORMAT_PBF)
+    {
+        pbf_writer_node(out, node);
+        return;
+    }
+
+    xml_str(out, "  <node id=\"");
+    xml_uint(out, node->id);
+    xml_version(out, node->version);
+    snprintf(coords, sizeof(coords), "\" lat=\"%.7f\" lon=\"%.7f\"", node->lat, node->lon);
+    xml_str(out, coords);
+    if(node->tag_count == 0)
+    {
+        xml_str(out, "/>\n");
+        return;
+    }
+    else
+        xml_str(out, ">\n");
+
+    xml_tags(out, node->tags, node->tag_count);
+    xml_str(out, "  </node>\n");
+
+    return;
+}
+
+void osm_output_way(struct osm_output *out, struct osm_way *way)
+{
+    int n;
+
+    if(out->format == OSM_FORMAT_PBF)
+    {
+        pbf_writer_way(out, way);
+        return;
+    }
+
+    xml_str(out, "  <way id=\"");
+    xml_uint(out, way->id);
+    xml_version(out, way->version);
+    if(way->node_count == 0 && way->tag_count == 0)
+    {
+        xml_str(out, "\"/>\n");
+        return;
+    }
+    xml_str(out, "\">\n");
+
+    for(n = 0; n < way->node_count; n++)
+    {
+        xml_str(out, "    <nd ref=\"");
+        xml_uint(out, way->nodes[n]);
+        xml_str(out, "\"/>\n");
+    }
+
+    xml_tags(out, way->tags, way->tag_count);
+    xml_str(out, "  </way>\n");
+
+    return;
+}
+
+void osm_output_relation(struct osm_output *out, struct osm_relation *relation)
+{
+    int n, w;
+
+    if(out->format == OSM_FORMAT_PBF)
+    {
+        pbf_writer_relation(out, relation);
+        return;
+    }
+
+    xml_str(out, "  <relation id=\"");
+    xml_uint(out, relation->id);
+    xml_version(out, relation->version);
+    if(relation->node_count == 0 && relation->way_count == 0 && relation->tag_count == 0)
+    {
+        xml_str(out, "\"/>\n");
+        return;
+    }
+    xml_str(out, "\">\n");
+
+    for(n = 0; n < relation->node_count; n++)
+    {
+        xml_str(out, "    <member type=\"node\" ref=\"");
+        xml_uint(out, relation->nodes[n]);
+        xml_str(out, "\" role=\"");
+        xml_escaped(out, (char *)relation->node_roles[n]);
+        xml_str(out, "\"/>\n");
+    }
+
+    for(w = 0; w < relation->way_count; w++)
+    {
+        xml_str(out, "    <member type=\"way\" ref=\"");
+        xml_uint(out, relation->ways[w]);
+        xml_str(out, "\" role=\"");
+        xml_escaped(out, (char *)relation->way_roles[w]);
+        xml_str(out, "\"/>\n");
+    }
+
+    xml_tags(out, relation->tags, relation->tag_count);
+    xml_str(out, "  </relation>\n");
+
+    return;
+}
+
+void osm_output_raw(struct osm_output *out, const char *text, size_t len)
+{
+    if(out->format == OSM_FORMAT_PBF)
+        return;
+
+    xml_mem(out, text, len);
+
+    return;
+}
+
+long long osm_output_tell(struct osm_output *out)
+{
+    return out->offset + out->buff_len;
+}
+
+int osm_output_close(struct osm_output *out)
+{
+    int error;
+
+    if(out->format == OSM_FORMAT_PBF)
+        pbf_writer_finish(out);
+    else if(out->format == OSM_FORMAT_CHANGE)
+    {
+        osm_output_action(out, -1);
+        xml_str(out, "</osmChange>\n");
+        xml_flush(out);
+    }
+    else
+    {
+        xml_str(out, "</osm>\n");
+        xml_flush(out);
+    }
+
+    if(fflush(out->fp) != 0)
+        out->error = 1;
+    error = out->error;
+    if(error)
+        fprintf(stderr, "osm_output_close(): Error writing output\n");
+    free(out);
+
+    return error;
+}
+
+static void write_out(struct osm_output *out, const void *data, size_t len)
+{
+    if(fwrite(data, 1, len, out->fp) != len)
+        out->error = 1;
+    out->offset += len;
+
+    return;
+}
+
+/* XML formatting */
+
+static void xml_flush(struct osm_output *out)
+{
+    if(out->buff_len > 0)
+        write_out(out, out->buff, out->buff_len);
+    out->buff_len = 0;
+
+    return;
+}
+
+static void xml_mem(struct osm_output *out, const char *str, int len)
+{
+    if(out->buff_len + len > XML_BUFF_SIZE)
+    {
+        xml_flush(out);
+        if(len > XML_BUFF_SIZE)
+        {
+            write_out(out, str, len);
+            return;
+        }
+    }
+    memcpy(out->buff + out->buff_len, str, len);
+    out->buff_len += len;
+
+    return;
+}
+
+static void xml_str(struct osm_output *out, const char *str)
+{
+    xml_mem(out, str, strlen(str));
+
+    return;
+}
+
+static void xml_uint(struct osm_output *out, unsigned int val)
+{
+    char digits[16];
+    int pos = sizeof(digits);
+
+    do
+    {
+        digits[--pos] = '0' + val % 10;
+        val /= 10;
+    } while(val);
+    xml_mem(out, digits + pos, sizeof(digits) - pos);
+
+    return;
+}
+
+static void xml_tags(struct osm_output *out, struct osm_tag *tags, int tag_count)
+{
+    int t;
+
+    for(t = 0; t < tag_count; t++)
+    {
+        struct osm_tag *tag = tags+t;
+
+        xml_str(out, "    <tag k=\"");
+        xml_escaped(out, tag->key);
+        xml_str(out, "\" v=\"");
+        xml_escaped(out, tag->value);
+        xml_str(out, "\" />\n");
+    }
+
+    return;
+}
+
+/* Write the version attribute of an element, where known, so that the
+ * output can later be compared with --diff and the osmChange applied */
+static void xml_version(struct osm_output *out, unsigned int version)
+{
+    if(version == 0)
+        return;
+
+    xml_str(out, "\" version=\"");
+    xml_uint(out, version);
+
+    return;
+}
+
+static void xml_escaped(struct osm_output *out, const char *str)
+{
+    /* Each byte is escaped to at most 6 ("&quot;"), plus the null byte
+     * written at the end */
+    size_t max = 6 * strlen(str) + 1;
+
+    if(out->buff_len + max > XML_BUFF_SIZE)
+    {
+        xml_flush(out);
+        if(max > XML_BUFF_SIZE)
+        {
+            char *escaped = malloc(max);
+
+            write_out(out, escaped, osm_xml_escape(escaped, str));
+            free(escaped);
+            return;
+        }
+    }
+    out->buff_len += osm_xml_escape(out->buff + out->buff_len, str);
+
+    return;
+}
+
+/* Protocol buffer encoding */
+
+static void pb_reserve(struct pb_buf *buf, size_t len)
+{
+    if(buf->len + len > buf->max)
+    {
+        buf->max = 2 * buf->max + len + 1024;
+        buf->data = realloc(buf->data, buf->max);
+    }
+}
+
+static void pb_raw(struct pb_buf *buf, const void *data, size_t len)
+{
+    pb_reserve(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void pb_varint(struct pb_buf *buf, uint64_t v)
+{
+    pb_reserve(buf, 10);
+    while(v >= 0x80)
+    {
+        buf->data[buf->len++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    buf->data[buf->len++] = v;
+}
+
+static void pb_sint(struct pb_buf *buf, int64_t v)
+{
+    pb_varint(buf, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static void pb_key(struct pb_buf *buf, int field, int wiretype)
+{
+    pb_varint(buf, (field << 3) | wiretype);
+}
+
+static void pb_uint_field(struct pb_buf *buf, int field, uint64_t v)
+{
+    pb_key(buf, field, 0);
+    pb_varint(buf, v);
+}
+
+static void pb_bytes_field(struct pb_buf *buf, int field, const void *data, size_t len)
+{
+    pb_key(buf, field, 2);
+    pb_varint(buf, len);
+    pb_raw(buf, data, len);
+}
+
+static void pb_free(struct pb_buf *buf)
+{
+    free(buf->data);
+}
+
+/* PBF writing */
+
+static void *start_compress_thread(void *);
+static void submit_job(struct pbf_writer *, struct pbf_job *);
+static void compress_job(struct pbf_job *);
+
+static struct pbf_writer *pbf_writer_init(struct osm_output *out, int nthreads)
+{
+    struct pbf_writer *pbf = calloc(1, sizeof(struct pbf_writer));
+    struct pbf_job *job;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int t;
+
+    pbf->block_type = -1;
+    pbf->hash_size = 4096;
+    pbf->hash = malloc(pbf->hash_size * sizeof(int));
+    memset(pbf->hash, 0xff, pbf->hash_size * sizeof(int));
+
+    if(nthreads < 0)
+        nthreads = ncpu < 1 ? 1 : ncpu;
+    pbf->nthreads = nthreads > MAX_THREADS ? MAX_THREADS : nthreads;
+    pbf->njobs = 2 * pbf->nthreads + 2;
+    pbf->jobs = calloc(pbf->njobs, sizeof(struct pbf_job));
+
+    pthread_mutex_init(&pbf->mutex, NULL);
+    pthread_cond_init(&pbf->pending_signal, NULL);
+    pthread_cond_init(&pbf->done_signal, NULL);
+
+    for(t = 0; t < pbf->nthreads; t++)
+    {
+        if(pthread_create(&pbf->threads[t], NULL, start_compress_thread, pbf) != 0)
+        {
+            fprintf(stderr, "osm_output_open(): Unable to start compression thread\n");
+            pbf->nthreads = t;
+            pbf->exit_now = 1; /* nothing to flush */
+            out->pbf = pbf;
+            pbf_writer_finish(out);
+            return NULL;
+        }
+    }
+
+    /* The header block comes first and declares the features used */
+    out->pbf = pbf;
+    job = &pbf->jobs[0];
+    job->is_header = 1;
+    job->raw.len = 0;
+    pb_bytes_field(&job->raw, 4, "OsmSchema-V0.6", 14);
+    pb_bytes_field(&job->raw, 4, "DenseNodes", 10);
+    pb_bytes_field(&job->raw, 16, "osmrail", 7);
+    submit_job(pbf, job);
+
+    return pbf;
+}
+
+/* Pass a job to the compression threads, or compress it here if there
+ * are none */
+static void submit_job(struct pbf_writer *pbf, struct pbf_job *job)
+{
+    if(pbf->nthreads == 0)
+    {
+        compress_job(job);
+        job->state = JOB_DONE;
+        pbf->compressed++;
+        pbf->submitted++;
+        return;
+    }
+
+    pthread_mutex_lock(&pbf->mutex);
+    job->state = JOB_PENDING;
+    pbf->submitted++;
+    pthread_cond_broadcast(&pbf->pending_signal);
+    pthread_mutex_unlock(&pbf->mutex);
+
+    return;
+}
+
+/* Write out completed jobs in order, waiting until no more than 'keep'
+ * jobs remain outstanding */
+static void write_jobs(struct osm_output *out, long keep)
+{
+    struct pbf_writer *pbf = out->pbf;
+
+    while(pbf->written < pbf->submitted)
+    {
+        struct pbf_job *job = &pbf->jobs[pbf->written % pbf->njobs];
+
+        pthread_mutex_lock(&pbf->mutex);
+        if(job->state != JOB_DONE && pbf->submitted - pbf->written <= keep)
+        {
+            pthread_mutex_unlock(&pbf->mutex);
+            break;
+        }
+        while(job->state != JOB_DONE)
+            pthread_cond_wait(&pbf->done_signal, &pbf->mutex);
+        pthread_mutex_unlock(&pbf->mutex);
+
+        write_out(out, job->blob.data, job->blob.len);
+
+        pthread_mutex_lock(&pbf->mutex);
+        job->state = JOB_FREE;
+        pbf->written++;
+        pthread_mutex_unlock(&pbf->mutex);
+    }
+
+    return;
+}
+
+/* Look up a string in the block's string table, adding it if not present */
+static int string_index(struct pbf_writer *pbf, const char *str)
+{
+    uint32_t h = 2166136261u;
+    const unsigned char *p;
+    int slot;
+
+    if(*str == '\0')
+        return 0;
+
+    for(p = (const unsigned char *)str; *p; p++)
+        h = (h ^ *p) * 16777619u;
+
+    for(slot = h & (pbf->hash_size - 1); pbf->hash[slot] >= 0; slot = (slot + 1) & (pbf->hash_size - 1))
+        if(strcmp((char *)pbf->strings.data + pbf->str_offset[pbf->hash[slot]], str) == 0)
+            return pbf->hash[slot];
+
+    if(pbf->str_count >= pbf->str_max)
+    {
+        pbf->str_max = 2 * pbf->str_max + 1024;
+        pbf->str_offset = realloc(pbf->str_offset, pbf->str_max * sizeof(int));
+    }
+    if(pbf->str_count == 0) /* reserve index 0 */
+    {
+        pb_raw(&pbf->strings, "", 1);
+        pbf->str_offset[pbf->str_count++] = 0;
+    }
+    pbf->str_offset[pbf->str_count] = pbf->strings.len;
+    pb_raw(&pbf->strings, str, strlen(str) + 1);
+    pbf->hash[slot] = pbf->str_count;
+
+    /* Keep the hash table no more than half full */
+    if(2 * pbf->str_count >= pbf->hash_size)
+    {
+        int i;
+
+        pbf->hash_size *= 2;
+        pbf->hash = realloc(pbf->hash, pbf->hash_size * sizeof(int));
+        memset(pbf->hash, 0xff, pbf->hash_size * sizeof(int));
+        for(i = 1; i <= pbf->str_count; i++)
+        {
+            h = 2166136261u;
+            for(p = pbf->strings.data + pbf->str_offset[i]; *p; p++)
+                h = (h ^ *p) * 16777619u;
+            for(slot = h & (pbf->hash_size - 1); pbf->hash[slot] >= 0; slot = (slot + 1) & (pbf->hash_size - 1))
+                ;
+            pbf->hash[slot] = i;
+        }
+    }
+
+    return pbf->str_count++;
+}
+
+/* Encode the current block and pass it to the compression threads */
+static void flush_block(struct osm_output *out)
+{
+    struct pbf_writer *pbf = out->pbf;
+    struct pbf_job *job;
+    int s;
+
+    if(pbf->block_type < 0)
+        return;
+
+    /* Make sure the job slot is free, writing out earlier blobs as needed */
+    write_jobs(out, pbf->njobs - 1);
+    job = &pbf->jobs[pbf->submitted % pbf->njobs];
+    job->is_header = 0;
+    job->raw.len = 0;
+
+    /* String table */
+    pbf->msg.len = 0;
+    if(pbf->str_count == 0)
+        pb_bytes_field(&pbf->msg, 1, "", 0);
+    for(s = 0; s < pbf->str_count; s++)
+    {
+        const char *str = (char *)pbf->strings.data + pbf->str_offset[s];
+
+        pb_bytes_field(&pbf->msg, 1, str, strlen(str));
+    }
+    pb_bytes_field(&job->raw, 1, pbf->msg.data, pbf->msg.len);
+
+    /* Primitive group */
+    if(pbf->block_type == OSM_NODE)
+    {
+        pbf->msg.len = 0;
+        pb_bytes_field(&pbf->msg, 1, pbf->ids.data, pbf->ids.len);
+        pb_bytes_field(&pbf->msg, 8, pbf->lats.data, pbf->lats.len);
+        pb_bytes_field(&pbf->msg, 9, pbf->lons.data, pbf->lons.len);
+        if(pbf->dense_tags)
+            pb_bytes_field(&pbf->msg, 10, pbf->keys_vals.data, pbf->keys_vals.len);
+        if(pbf->dense_versions)
+        {
+            /* DenseInfo with the versions only */
+            pbf->packed.len = 0;
+            pb_bytes_field(&pbf->packed, 1, pbf->versions.data, pbf->versions.len);
+            pb_bytes_field(&pbf->msg, 5, pbf->packed.data, pbf->packed.len);
+        }
+        pbf->group.len = 0;
+        pb_bytes_field(&pbf->group, 2, pbf->msg.data, pbf->msg.len);
+    }
+    pb_bytes_field(&job->raw, 2, pbf->group.data, pbf->group.len);
+    submit_job(pbf, job);
+
+    /* Reset block state */
+    pbf->block_type = -1;
+    pbf->count = 0;
+    pbf->strings.len = 0;
+    pbf->str_count = 0;
+    memset(pbf->hash, 0xff, pbf->hash_size * sizeof(int));
+    pbf->ids.len = pbf->lats.len = pbf->lons.len = pbf->keys_vals.len = pbf->versions.len = 0;
+    pbf->last_id = pbf->last_lat = pbf->last_lon = 0;
+    pbf->dense_tags = pbf->dense_versions = 0;
+    pbf->group.len = 0;
+
+    /* Write out whatever has already been compressed */
+    write_jobs(out, pbf->submitted);
+
+    return;
+}
+
+static void start_element(struct osm_output *out, int type)
+{
+    struct pbf_writer *pbf = out->pbf;
+
+    if(pbf->block_type != type || pbf->count >= BLOCK_ELEMENTS)
+    {
+        flush_block(out);
+        pbf->block_type = type;
+    }
+    pbf->count++;
+
+    return;
+}
+
+/* Encode the Info message of a way or relation, holding its version
+ * only, where known */
+static void encode_info(struct pbf_writer *pbf, unsigned int version)
+{
+    if(version == 0)
+        return;
+
+    pbf->packed.len = 0;
+    pb_uint_field(&pbf->packed, 1, version);
+    pb_bytes_field(&pbf->msg, 4, pbf->packed.data, pbf->packed.len);
+
+    return;
+}
+
+/* Encode the keys and vals fields common to ways and relations */
+static void encode_tags(struct pbf_writer *pbf, struct osm_tag *tags, int tag_count)
+{
+    int t;
+
+    pbf->keys.len = pbf->vals.len = 0;
+    for(t = 0; t < tag_count; t++)
+    {
+        pb_varint(&pbf->keys, string_index(pbf, tags[t].key));
+        pb_varint(&pbf->vals, string_index(pbf, tags[t].value));
+    }
+    if(tag_count > 0)
+    {
+        pb_bytes_field(&pbf->msg, 2, pbf->keys.data, pbf->keys.len);
+        pb_bytes_field(&pbf->msg, 3, pbf->vals.data, pbf->vals.len);
+    }
+
+    return;
+}
+
+static void pbf_writer_node(struct osm_output *out, struct osm_node *node)
+{
+    struct pbf_writer *pbf = out->pbf;
+    int64_t lat = llround(node->lat * 1e7), lon = llround(node->lon * 1e7);
+    int t;
+
+    start_element(out, OSM_NODE);
+
+    pb_sint(&pbf->ids, (int64_t)node->id - pbf->last_id);
+    pb_sint(&pbf->lats, lat - pbf->last_lat);
+    pb_sint(&pbf->lons, lon - pbf->last_lon);
+    pbf->last_id = node->id;
+    pbf->last_lat = lat;
+    pbf->last_lon = lon;
+    pb_varint(&pbf->versions, node->version);
+    if(node->version != 0)
+        pbf->dense_versions = 1;
+
+    for(t = 0; t < node->tag_count; t++)
+    {
+        pb_varint(&pbf->keys_vals, string_index(pbf, node->tags[t].key));
+        pb_varint(&pbf->keys_vals, string_index(pbf, node->tags[t].value));
+        pbf->dense_tags = 1;
+    }
+    pb_varint(&pbf->keys_vals, 0);
+
+    return;
+}
+
+static void pbf_writer_way(struct osm_output *out, struct osm_way *way)
+{
+    struct pbf_writer *pbf = out->pbf;
+    int64_t last = 0;
+    int n;
+
+    start_element(out, OSM_WAY);
+
+    pbf->msg.len = 0;
+    pb_uint_field(&pbf->msg, 1, way->id);
+    encode_tags(pbf, way->tags, way->tag_count);
+    encode_info(pbf, way->version);
+
+    pbf->packed.len = 0;
+    for(n = 0; n < way->node_count; n++)
+    {
+        pb_sint(&pbf->packed, (int64_t)way->nodes[n] - last);
+        last = way->nodes[n];
+    }
+    pb_bytes_field(&pbf->msg, 8, pbf->packed.data, pbf->packed.len);
+
+    pb_bytes_field(&pbf->group, 3, pbf->msg.data, pbf->msg.len);
+
+    return;
+}
+
+static void pbf_writer_relation(struct osm_output *out, struct osm_relation *rel)
+{
+    struct pbf_writer *pbf = out->pbf;
+    int64_t last = 0;
+    int m;
+
+    start_element(out, OSM_RELATION);
+
+    pbf->msg.len = 0;
+    pb_uint_field(&pbf->msg, 1, rel->id);
+    encode_tags(pbf, rel->tags, rel->tag_count);
+    encode_info(pbf, rel->version);
+
+    /* Roles, member IDs (delta-encoded) and member types */
+    pbf->packed.len = pbf->packed2.len = pbf->packed3.len = 0;
+    for(m = 0; m < rel->node_count; m++)
+    {
+        pb_varint(&pbf->packed, string_index(pbf, rel->node_roles[m]));
+        pb_sint(&pbf->packed2, (int64_t)rel->nodes[m] - last);
+        pb_varint(&pbf->packed3, 0);
+        last = rel->nodes[m];
+    }
+    for(m = 0; m < rel->way_count; m++)
+    {
+        pb_varint(&pbf->packed, string_index(pbf, rel->way_roles[m]));
+        pb_sint(&pbf->packed2, (int64_t)rel->ways[m] - last);
+        pb_varint(&pbf->packed3, 1);
+        last = rel->ways[m];
+    }
+    if(rel->node_count + rel->way_count > 0)
+    {
+        pb_bytes_field(&pbf->msg, 8, pbf->packed.data, pbf->packed.len);
+        pb_bytes_field(&pbf->msg, 9, pbf->packed2.data, pbf->packed2.len);
+        pb_bytes_field(&pbf->msg, 10, pbf->packed3.data, pbf->packed3.len);
+    }
+
+    pb_bytes_field(&pbf->group, 4, pbf->msg.data, pbf->msg.len);
+
+    return;
+}
+
+static void pbf_writer_finish(struct osm_output *out)
+{
+    struct pbf_writer *pbf = out->pbf;
+    int t;
+
+    if( !pbf->exit_now)
+    {
+        flush_block(out);
+        write_jobs(out, 0);
+    }
+
+    pthread_mutex_lock(&pbf->mutex);
+    pbf->exit_now = 1;
+    pthread_cond_broadcast(&pbf->pending_signal);
+    pthread_mutex_unlock(&pbf->mutex);
+    for(t = 0; t < pbf->nthreads; t++)
+        pthread_join(pbf->threads[t], NULL);
+
+    pthread_mutex_destroy(&pbf->mutex);
+    pthread_cond_destroy(&pbf->pending_signal);
+    pthread_cond_destroy(&pbf->done_signal);
+
+    for(t = 0; t < pbf->njobs; t++)
+    {
+        pb_free(&pbf->jobs[t].raw);
+        pb_free(&pbf->jobs[t].blob);
+    }
+    free(pbf->jobs);
+    pb_free(&pbf->strings);
+    free(pbf->str_offset);
+    free(pbf->hash);
+    pb_free(&pbf->ids);
+    pb_free(&pbf->lats);
+    pb_free(&pbf->lons);
+    pb_free(&pbf->keys_vals);
+    pb_free(&pbf->versions);
+    pb_free(&pbf->group);
+    pb_free(&pbf->msg);
+    pb_free(&pbf->keys);
+    pb_free(&pbf->vals);
+    pb_free(&pbf->packed);
+    pb_free(&pbf->packed2);
+    pb_free(&pbf->packed3);
+    free(pbf);
+    out->pbf = NULL;
+
+    return;
+}
+
+/* Compress a block and wrap it in a Blob and BlobHeader */
+static void compress_job(struct pbf_job *job)
+{
+    struct pb_buf zdata = { NULL, 0, 0 }, blob = { NULL, 0, 0 }, header = { NULL, 0, 0 };
+    const char *type = job->is_header ? "OSMHeader" : "OSMData";
+    unsigned char lenbuf[4];
+    size_t zlen;
+
+    zdata.max = osm_zlib_bound(job->raw.len);
+    zdata.data = malloc(zdata.max);
+    if(osm_zlib_deflate(job->raw.data, job->raw.len, zdata.data, zdata.max, &zlen) == 0)
+    {
+        pb_uint_field(&blob, 2, job->raw.len);
+        pb_bytes_field(&blob, 3, zdata.data, zlen);
+    }
+    else
+        pb_bytes_field(&blob, 1, job->raw.data, job->raw.len);
+
+    pb_bytes_field(&header, 1, type, strlen(type));
+    pb_uint_field(&header, 3, blob.len);
+
+    lenbuf[0] = header.len >> 24;
+    lenbuf[1] = header.len >> 16;
+    lenbuf[2] = header.len >> 8;
+    lenbuf[3] = header.len;
+    job->blob.len = 0;
+    pb_raw(&job->blob, lenbuf, 4);
+    pb_raw(&job->blob, header.data, header.len);
+    pb_raw(&job->blob, blob.data, blob.len);
+
+    pb_free(&zdata);
+    pb_free(&blob);
+    pb_free(&header);
+
+    return;
+}
+
+/* Worker thread to compress blocks in the order they were submitted */
+static void *start_compress_thread(void *data)
+{
+    struct pbf_writer *pbf = data;
+
+    pthread_mutex_lock(&pbf->mutex);
+    while(1)
+    {
+        struct pbf_job *job;
+
+        if(pbf->compressed == pbf->submitted)
+        {
+            if(pbf->exit_now)
+                break;
+            pthread_cond_wait(&pbf->pending_signal, &pbf->mutex);
+            continue;
+        }
+
+        job = &pbf->jobs[pbf->compressed++ % pbf->njobs];
+        job->state = JOB_BUSY;
+        pthread_mutex_unlock(&pbf->mutex);
+
+        compress_job(job);
+
+        pthread_mutex_lock(&pbf->mutex);
+        job->state = JOB_DONE;
+        pthread_cond_broadcast(&pbf->done_signal);
+    }
+    pthread_mutex_unlock(&pbf->mutex);
+
+    return NULL;
+}
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <ctype.h>
 
 #include "osm.h"
@@ -30,6 +31,7 @@ struct osm_parse
     osm_way_callback_t *cb_way;           /**< Callback functions for ways */
     osm_relation_callback_t *cb_relation; /**< Callback functions for relations */
     void *priv_data; /**< Private data to be passed to callback functions */
+    struct osm_projection proj; /**< Element types and fields of interest */
 
     struct osm_node node;
     int max_node_tags;
@@ -40,11 +42,40 @@ struct osm_parse
 
     /* Parse state flags */
     char in_osm, in_node, in_way, in_relation;
+    const char *skip_end; /**< Closing tag of element being skipped, or NULL */
+
+    /* Full-history mode; see osm_parse_set_history() */
+    char history;         /**< Boolean; collapse versions of each element */
+    long long as_of;      /**< Ignore versions after this time, or 0 */
+    int held_type;        /**< Type of the element being held back, or -1 */
+    unsigned int held_id;
+    char held_valid;      /**< Boolean; a version of the held element has been kept */
+    struct osm_node held_node;
+    int max_held_node_tags;
+    struct osm_way held_way;
+    int max_held_way_nodes, max_held_way_tags;
+    struct osm_relation held_relation;
+    int max_held_relation_nodes, max_held_relation_ways, max_held_relation_tags;
+
+    /* XML text of elements; see osm_parse_set_raw() */
+    char keep_raw, strip_metadata; /**< Booleans */
+    char *raw;            /**< Lines of the current element */
+    size_t raw_len, max_raw;
+    char *held_raw;       /**< Text of the element being held back */
+    int held_raw_len, max_held_raw;
+    const char *raw_text; /**< Text of the element being delivered, or NULL */
+    size_t raw_text_len;
 };
 
 static int parse_tag(const char *text, struct osm_tag *);
+static const char *find_attr(const char *text, const char *name);
+static void read_version(const char *text, unsigned int *version, long long *timestamp, char *deleted);
+static int hold_element(struct osm_parse *, int type, unsigned int id, long long timestamp);
+static void *copy_array(void *dest, int *max, const void *src, int count, size_t size);
 static void read_string(char *dest, char **ptr);
-static char deescape_xml(char **str);
+static void append_raw(struct osm_parse *, const char *line);
+static void deliver_raw(struct osm_parse *, int held);
+static size_t strip_metadata(char *text, size_t len);
 
 struct osm_parse *osm_parse_init(osm_node_callback_t *cb_node, osm_way_callback_t *cb_way, 
                                  osm_relation_callback_t *cb_relation, void *priv_data)
@@ -56,14 +87,91 @@ struct osm_parse *osm_parse_init(osm_node_callback_t *cb_node, osm_way_callback_
     parse->cb_relation = cb_relation;
     parse->priv_data = priv_data;
 
+    parse->proj.fields[OSM_NODE] = OSM_FIELD_ALL;
+    parse->proj.fields[OSM_WAY] = OSM_FIELD_ALL;
+    parse->proj.fields[OSM_RELATION] = OSM_FIELD_ALL;
+    parse->held_type = -1;
+
     return parse;
 }
 
+void osm_parse_set_history(struct osm_parse *parse, long long as_of)
+{
+    parse->history = 1;
+    parse->as_of = as_of;
+
+    return;
+}
+
+void osm_parse_set_raw(struct osm_parse *parse, int strip_metadata)
+{
+    parse->keep_raw = 1;
+    parse->strip_metadata = strip_metadata;
+
+    return;
+}
+
+const char *osm_parse_raw(struct osm_parse *parse, size_t *len)
+{
+    *len = parse->raw_text_len;
+
+    return parse->raw_text;
+}
+
+void osm_parse_resume(struct osm_parse *parse)
+{
+    parse->in_osm = 1;
+
+    return;
+}
+
+void osm_parse_set_projection(struct osm_parse *parse, const struct osm_projection *proj)
+{
+    parse->proj = *proj;
+
+    return;
+}
+
+/* Decide whether the element whose header has just been read should be
+ * skipped. If so, arrange for the rest of its body (if any) to be
+ * ignored up to the closing tag. */
+static int skip_element(struct osm_parse *parse, int type, unsigned int id, 
+                        int single_line, const char *end_tag)
+{
+    if(parse->proj.filter && !parse->proj.filter(type, id, parse->priv_data))
+    {
+        if(!single_line)
+            parse->skip_end = end_tag;
+        return 1;
+    }
+
+    return 0;
+}
+
 int osm_parse_ingest(struct osm_parse *parse, char *line)
 {
     char *ptr, *tag;
     char end_tag = 0;
 
+    /* Scan the body of an element that is not of interest for its closing
+     * tag only, without tokenising it. */
+    if(parse->skip_end)
+    {
+        if(strstr(line, parse->skip_end))
+            parse->skip_end = NULL;
+        return 0;
+    }
+
+    /* Keep the lines of each element before they are tokenised. A line
+     * outside an element is kept until the next one replaces it, so that
+     * the opening line of an element is always kept. */
+    if(parse->keep_raw)
+    {
+        if( !parse->in_node && !parse->in_way && !parse->in_relation)
+            parse->raw_len = 0;
+        append_raw(parse, line);
+    }
+
     /* Locate opening angle bracket of XML tag */
     ptr = strchr(line, '<');
     if(!ptr) /* No XML tags on this line */
@@ -109,14 +217,13 @@ int osm_parse_ingest(struct osm_parse *parse, char *line)
             /* End of node; process using callback if specified */
             parse->in_node = 0;
 
-            if(parse->cb_node)
-                parse->cb_node(node, parse->priv_data);
+            osm_parse_deliver_node(parse, node);
 
             return 0;
         }
 
         /* Attribute tag for node */
-        if(strcmp(tag, "tag") == 0)
+        if((parse->proj.fields[OSM_NODE] & OSM_FIELD_TAGS) && strcmp(tag, "tag") == 0)
         {
             ptr = tag+4;
 
@@ -145,14 +252,13 @@ int osm_parse_ingest(struct osm_parse *parse, char *line)
             /* End of way; process using callback if specified */
             parse->in_way = 0;
 
-            if(parse->cb_way)
-                parse->cb_way(way, parse->priv_data);
+            osm_parse_deliver_way(parse, way);
 
             return 0;
         }
 
         /* Node forming part of way */
-        if(strcmp(tag, "nd") == 0)
+        if((parse->proj.fields[OSM_WAY] & OSM_FIELD_MEMBERS) && strcmp(tag, "nd") == 0)
         {
             ptr = tag+3;
 
@@ -169,7 +275,7 @@ int osm_parse_ingest(struct osm_parse *parse, char *line)
             way->node_count++;
         }
         /* Attribute tag for way */
-        else if(strcmp(tag, "tag") == 0)
+        else if((parse->proj.fields[OSM_WAY] & OSM_FIELD_TAGS) && strcmp(tag, "tag") == 0)
         {
             ptr = tag+4;
 
@@ -197,14 +303,13 @@ int osm_parse_ingest(struct osm_parse *parse, char *line)
             /* End of relation; process using callback if specified */
             parse->in_relation = 0;
 
-            if(parse->cb_relation)
-                parse->cb_relation(rel, parse->priv_data);
+            osm_parse_deliver_relation(parse, rel);
 
             return 0;
         }
 
         /* Member (either node or way) of relation */
-        if(strcmp(tag, "member") == 0)
+        if((parse->proj.fields[OSM_RELATION] & OSM_FIELD_MEMBERS) && strcmp(tag, "member") == 0)
         {
             ptr = tag+7;
 
@@ -266,7 +371,7 @@ int osm_parse_ingest(struct osm_parse *parse, char *line)
             }           
         }
         /* Attribute tag for relation */
-        else if(strcmp(tag, "tag") == 0)
+        else if((parse->proj.fields[OSM_RELATION] & OSM_FIELD_TAGS) && strcmp(tag, "tag") == 0)
         {
             ptr = tag+4;
 
@@ -288,21 +393,51 @@ int osm_parse_ingest(struct osm_parse *parse, char *line)
     else if(strcmp(tag, "node") == 0)
     {
         struct osm_node *node = &parse->node;
+        int single_line;
 
         ptr = tag+5;
+        single_line = (strstr(ptr, "/>") != NULL);
+
+        if(!parse->cb_node)
+        {
+            if(!single_line)
+                parse->skip_end = "</node>";
+            return 0;
+        }
 
         node->tag_count = 0;
-        if(sscanf(ptr, "id=\"%u\" lat=\"%lf\" lon=\"%lf\"", &node->id,  &node->lat, &node->lon) != 3)
+        if(sscanf(ptr, "id=\"%u\"", &node->id) != 1)
         {
             fprintf(stderr, "osm_parse_ingest(): Error parsing node; line follows below\n%s\n", ptr);
             return 0;
         }
+        if(skip_element(parse, OSM_NODE, node->id, single_line, "</node>"))
+            return 0;
+        if(parse->history || (parse->proj.fields[OSM_NODE] & OSM_FIELD_VERSION))
+            read_version(ptr, &node->version, &node->timestamp, &node->deleted);
+        if(sscanf(ptr, "id=\"%*u\" lat=\"%lf\" lon=\"%lf\"", &node->lat, &node->lon) != 2)
+        {
+            /* Attributes in another order, as written with metadata */
+            const char *lat = find_attr(ptr, "lat"), *lon = find_attr(ptr, "lon");
 
-        if(strstr(ptr, "/>"))
+            if(lat && lon)
+            {
+                node->lat = atof(lat);
+                node->lon = atof(lon);
+            }
+            else if(node->deleted) /* deleted versions need not have a position */
+                node->lat = node->lon = 0;
+            else
+            {
+                fprintf(stderr, "osm_parse_ingest(): Error parsing node; line follows below\n%s\n", ptr);
+                return 0;
+            }
+        }
+
+        if(single_line)
         {
             /* End of node; process using callback if specified */
-            if(parse->cb_node)
-                parse->cb_node(node, parse->priv_data);
+            osm_parse_deliver_node(parse, node);
         }
         else /* multi-line node */
             parse->in_node = 1;
@@ -312,8 +447,17 @@ int osm_parse_ingest(struct osm_parse *parse, char *line)
     else if(strcmp(tag, "way") == 0)
     {
         struct osm_way *way = &parse->way;
+        int single_line;
 
         ptr = tag+4;
+        single_line = (strstr(ptr, "/>") != NULL);
+
+        if(!parse->cb_way)
+        {
+            if(!single_line)
+                parse->skip_end = "</way>";
+            return 0;
+        }
 
         way->node_count = way->tag_count = 0;
         if(sscanf(ptr, "id=\"%u\"", &way->id) != 1)
@@ -321,9 +465,18 @@ int osm_parse_ingest(struct osm_parse *parse, char *line)
             fprintf(stderr, "osm_parse_ingest(): Error parsing way; line follows below\n%s\n", ptr);
             return 0;
         }
+        if(skip_element(parse, OSM_WAY, way->id, single_line, "</way>"))
+            return 0;
+        if(parse->history || (parse->proj.fields[OSM_WAY] & OSM_FIELD_VERSION))
+            read_version(ptr, &way->version, &way->timestamp, &way->deleted);
 
-        if(strstr(ptr, "/>")) /* end of way */
-            ; /* do nothing since this way must have no member nodes nor tags */
+        if(single_line) /* end of way */
+        {
+            /* A way with no member nodes nor tags is only of interest
+             * as a version in a history file (usually a deletion) */
+            if(parse->history)
+                osm_parse_deliver_way(parse, way);
+        }
         else /* normal multi-line way */
             parse->in_way = 1;
 
@@ -332,8 +485,17 @@ int osm_parse_ingest(struct osm_parse *parse, char *line)
     else if(strcmp(tag, "relation") == 0)
     {
         struct osm_relation *rel = &parse->relation;
+        int single_line;
 
         ptr = tag+9;
+        single_line = (strstr(ptr, "/>") != NULL);
+
+        if(!parse->cb_relation)
+        {
+            if(!single_line)
+                parse->skip_end = "</relation>";
+            return 0;
+        }
 
         rel->node_count = rel->way_count = rel->tag_count = 0;
         if(sscanf(ptr, "id=\"%u\"", &rel->id) != 1)
@@ -341,20 +503,242 @@ int osm_parse_ingest(struct osm_parse *parse, char *line)
             fprintf(stderr, "osm_parse_ingest(): Error parsing relation; line follows below\n%s\n", ptr);
             return 0;
         }
+        if(skip_element(parse, OSM_RELATION, rel->id, single_line, "</relation>"))
+            return 0;
+        if(parse->history || (parse->proj.fields[OSM_RELATION] & OSM_FIELD_VERSION))
+            read_version(ptr, &rel->version, &rel->timestamp, &rel->deleted);
 
-        if(strstr(ptr, "/>")) /* end of relation */
-            ; /* do nothing since this relation must have no member nodes, ways nor tags */
+        if(single_line) /* end of relation */
+        {
+            if(parse->history)
+                osm_parse_deliver_relation(parse, rel);
+        }
         else /* normal multi-line relation */
             parse->in_relation = 1;
 
         return 0;
     }
     else if(end_tag && strcmp(tag, "osm") == 0) /* end of data block */
+    {
+        osm_parse_flush(parse);
         return 1;
+    }
 
     return 0;
 }
 
+int osm_parse_wants(struct osm_parse *parse, int type, unsigned int id)
+{
+    switch(type)
+    {
+        case OSM_NODE:
+            if(!parse->cb_node)
+                return 0;
+            break;
+        case OSM_WAY:
+            if(!parse->cb_way)
+                return 0;
+            break;
+        case OSM_RELATION:
+            if(!parse->cb_relation)
+                return 0;
+            break;
+        default:
+            return 0;
+    }
+
+    if(parse->proj.filter && !parse->proj.filter(type, id, parse->priv_data))
+        return 0;
+
+    return 1;
+}
+
+unsigned char osm_parse_fields(struct osm_parse *parse, int type)
+{
+    return parse->proj.fields[type];
+}
+
+void osm_parse_deliver_node(struct osm_parse *parse, struct osm_node *node)
+{
+    struct osm_node *held = &parse->held_node;
+
+    if(parse->history)
+    {
+        if( !hold_element(parse, OSM_NODE, node->id, node->timestamp))
+            return;
+        deliver_raw(parse, 1);
+        held->tags = copy_array(held->tags, &parse->max_held_node_tags, node->tags,
+                                node->tag_count, sizeof(struct osm_tag));
+        held->lat = node->lat;
+        held->lon = node->lon;
+        held->tag_count = node->tag_count;
+        held->id = node->id;
+        held->version = node->version;
+        held->timestamp = node->timestamp;
+        held->deleted = node->deleted;
+        return;
+    }
+
+    deliver_raw(parse, 0);
+    if(parse->cb_node)
+        parse->cb_node(node, parse->priv_data);
+    parse->raw_text = NULL;
+
+    return;
+}
+
+void osm_parse_deliver_way(struct osm_parse *parse, struct osm_way *way)
+{
+    struct osm_way *held = &parse->held_way;
+
+    if(parse->history)
+    {
+        if( !hold_element(parse, OSM_WAY, way->id, way->timestamp))
+            return;
+        deliver_raw(parse, 1);
+        held->nodes = copy_array(held->nodes, &parse->max_held_way_nodes, way->nodes,
+                                 way->node_count, sizeof(unsigned int));
+        held->tags = copy_array(held->tags, &parse->max_held_way_tags, way->tags,
+                                way->tag_count, sizeof(struct osm_tag));
+        held->node_count = way->node_count;
+        held->tag_count = way->tag_count;
+        held->id = way->id;
+        held->version = way->version;
+        held->timestamp = way->timestamp;
+        held->deleted = way->deleted;
+        return;
+    }
+
+    deliver_raw(parse, 0);
+    if(parse->cb_way)
+        parse->cb_way(way, parse->priv_data);
+    parse->raw_text = NULL;
+
+    return;
+}
+
+void osm_parse_deliver_relation(struct osm_parse *parse, struct osm_relation *rel)
+{
+    struct osm_relation *held = &parse->held_relation;
+
+    if(parse->history)
+    {
+        int max_nodes, max_ways;
+
+        if( !hold_element(parse, OSM_RELATION, rel->id, rel->timestamp))
+            return;
+        deliver_raw(parse, 1);
+        /* Each pair of arrays shares one capacity */
+        max_nodes = parse->max_held_relation_nodes;
+        held->nodes = copy_array(held->nodes, &parse->max_held_relation_nodes, rel->nodes,
+                                 rel->node_count, sizeof(unsigned int));
+        held->node_roles = copy_array(held->node_roles, &max_nodes, rel->node_roles,
+                                      rel->node_count, OSM_TAG_SIZE + 1);
+        max_ways = parse->max_held_relation_ways;
+        held->ways = copy_array(held->ways, &parse->max_held_relation_ways, rel->ways,
+                                rel->way_count, sizeof(unsigned int));
+        held->way_roles = copy_array(held->way_roles, &max_ways, rel->way_roles,
+                                     rel->way_count, OSM_TAG_SIZE + 1);
+        held->tags = copy_array(held->tags, &parse->max_held_relation_tags, rel->tags,
+                                rel->tag_count, sizeof(struct osm_tag));
+        held->node_count = rel->node_count;
+        held->way_count = rel->way_count;
+        held->tag_count = rel->tag_count;
+        held->id = rel->id;
+        held->version = rel->version;
+        held->timestamp = rel->timestamp;
+        held->deleted = rel->deleted;
+        return;
+    }
+
+    deliver_raw(parse, 0);
+    if(parse->cb_relation)
+        parse->cb_relation(rel, parse->priv_data);
+    parse->raw_text = NULL;
+
+    return;
+}
+
+void osm_parse_flush(struct osm_parse *parse)
+{
+    int type = parse->held_type;
+
+    parse->held_type = -1;
+    if(type < 0 || !parse->held_valid)
+        return;
+
+    if(parse->held_raw_len > 0)
+    {
+        parse->raw_text = parse->held_raw;
+        parse->raw_text_len = parse->held_raw_len;
+    }
+
+    /* Deleted elements go no further */
+    if(type == OSM_NODE && !parse->held_node.deleted && parse->cb_node)
+        parse->cb_node(&parse->held_node, parse->priv_data);
+    else if(type == OSM_WAY && !parse->held_way.deleted && parse->cb_way)
+        parse->cb_way(&parse->held_way, parse->priv_data);
+    else if(type == OSM_RELATION && !parse->held_relation.deleted && parse->cb_relation)
+        parse->cb_relation(&parse->held_relation, parse->priv_data);
+    parse->raw_text = NULL;
+
+    return;
+}
+
+/* Called with each version of an element in history mode. The versions of
+ * an element are adjacent, so the one held back is delivered as soon as
+ * another element starts. Returns 1 if this version should replace the
+ * one held back, or 0 if it is after the as-of time. */
+static int hold_element(struct osm_parse *parse, int type, unsigned int id, long long timestamp)
+{
+    if(type != parse->held_type || id != parse->held_id)
+    {
+        osm_parse_flush(parse);
+        parse->held_type = type;
+        parse->held_id = id;
+        parse->held_valid = 0;
+    }
+
+    if(parse->as_of && timestamp > parse->as_of)
+        return 0;
+    parse->held_valid = 1;
+
+    return 1;
+}
+
+/* Copy "count" items to an array with capacity "max", growing it as needed */
+static void *copy_array(void *dest, int *max, const void *src, int count, size_t size)
+{
+    if(count > *max)
+    {
+        *max = count + 10;
+        dest = realloc(dest, *max * size);
+    }
+    if(count > 0)
+        memcpy(dest, src, count * size);
+
+    return dest;
+}
+
+long long osm_parse_timestamp(const char *str)
+{
+    int year, month, day, hour, min, sec;
+    long long days;
+
+    if(sscanf(str, "%4d-%2d-%2dT%2d:%2d:%2d", &year, &month, &day, &hour, &min, &sec) != 6
+       || month < 1 || month > 12 || day < 1 || day > 31)
+        return -1;
+
+    /* Days since 1970-01-01 in the proleptic Gregorian calendar, counting
+     * years from March so that the leap day falls at the end */
+    if(month <= 2)
+        year--;
+    days = 365LL * year + year / 4 - year / 100 + year / 400
+        + (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1 - 719468;
+
+    return days * 86400 + hour * 3600 + min * 60 + sec;
+}
+
 void osm_parse_destroy(struct osm_parse *parse)
 {
     free(parse->node.tags);
@@ -363,11 +747,55 @@ void osm_parse_destroy(struct osm_parse *parse)
     free(parse->relation.nodes);
     free(parse->relation.ways);
     free(parse->relation.tags);
+    free(parse->held_node.tags);
+    free(parse->held_way.nodes);
+    free(parse->held_way.tags);
+    free(parse->held_relation.nodes);
+    free(parse->held_relation.node_roles);
+    free(parse->held_relation.ways);
+    free(parse->held_relation.way_roles);
+    free(parse->held_relation.tags);
+    free(parse->raw);
+    free(parse->held_raw);
     free(parse);
 
     return;
 }
 
+/* Locate the value of an attribute within an element header, or return
+ * NULL if it is not present */
+static const char *find_attr(const char *text, const char *name)
+{
+    size_t len = strlen(name);
+    const char *ptr = text;
+
+    while((ptr = strstr(ptr, name)))
+    {
+        if((ptr == text || isspace(ptr[-1])) && strncmp(ptr + len, "=\"", 2) == 0)
+            return ptr + len + 2;
+        ptr += len;
+    }
+
+    return NULL;
+}
+
+/* Read the version, time and visibility of an element from its header */
+static void read_version(const char *text, unsigned int *version, long long *timestamp, char *deleted)
+{
+    const char *ptr;
+
+    *version = (ptr = find_attr(text, "version")) ? strtoul(ptr, NULL, 10) : 0;
+    *timestamp = (ptr = find_attr(text, "timestamp")) ? osm_parse_timestamp(ptr) : 0;
+    if(*timestamp < 0)
+    {
+        fprintf(stderr, "osm_parse_ingest(): Invalid timestamp; line follows below\n%s\n", text);
+        *timestamp = 0;
+    }
+    *deleted = (ptr = find_attr(text, "visible")) && strncmp(ptr, "false", 5) == 0;
+
+    return;
+}
+
 static int parse_tag(const char *text, struct osm_tag *tag)
 {
     char *ptr;
@@ -393,60 +821,103 @@ static int parse_tag(const char *text, struct osm_tag *tag)
  * an empty string, and de-escaping XML quoted characters. */
 static void read_string(char *dest, char **ptr)
 {
-    int c, len = 0;
+    osm_xml_unescape(dest, OSM_TAG_SIZE + 1, (const char **)ptr);
 
-    while((c = *(*ptr)++) != '\"' && len < OSM_TAG_SIZE)
+    return;
+}
+
+/* Append a line read from the input to the text of the current element */
+static void append_raw(struct osm_parse *parse, const char *line)
+{
+    size_t len = strlen(line);
+
+    if(parse->raw_len + len + 1 > parse->max_raw)
     {
-        if(c == '&')
-            dest[len++] = deescape_xml(ptr);
-        else
-            dest[len++] = c;
+        while(parse->raw_len + len + 1 > parse->max_raw)
+            parse->max_raw = parse->max_raw ? parse->max_raw * 2 : 4096;
+        parse->raw = realloc(parse->raw, parse->max_raw);
     }
-    dest[len] = '\0';
-    
+    memcpy(parse->raw + parse->raw_len, line, len);
+    parse->raw_len += len;
+    parse->raw[parse->raw_len++] = '\n';
+
     return;
 }
 
-/* De-escape the 5 standard XML-escaped characters:
- *               ' " & < >
- */
-static char deescape_xml(char **str)
+/* Called as each element is delivered. Makes the text of the element just
+ * read available to osm_parse_raw(), or if held is set, keeps it with the
+ * element being held back in history mode. */
+static void deliver_raw(struct osm_parse *parse, int held)
 {
-    switch(**str)
+    parse->raw_text = NULL;
+    parse->raw_text_len = 0;
+
+    /* Elements from the PBF parser have no text */
+    if(parse->raw_len > 0 && parse->strip_metadata)
+        parse->raw_len = strip_metadata(parse->raw, parse->raw_len);
+
+    if(held)
     {
-        case 'a':
-            switch(*(*str+1))
-            {
-                case 'm': /* &amp; */
-                    *str += 4;
-                    return '&';
-                case 'p': /* &apos; */
-                    *str += 5;
-                    return '\'';
-            }
-        case 'g': /* &gt; */
-            *str += 3;
-            return '>';
-        case 'l': /* &lt; */
-            *str += 3;
-            return '<';
-        case 'q': /* &quot; */
-            *str += 5;
-            return '\"';
-        case '#': /* numeric encoding */
-        {
-            char *next;
-            int c = strtol(*str+1, &next, 10);
+        parse->held_raw = copy_array(parse->held_raw, &parse->max_held_raw, parse->raw,
+                                     parse->raw_len, 1);
+        parse->held_raw_len = parse->raw_len;
+    }
+    else if(parse->raw_len > 0)
+    {
+        parse->raw_text = parse->raw;
+        parse->raw_text_len = parse->raw_len;
+    }
+    parse->raw_len = 0;
+
+    return;
+}
 
-            /* In future this could be extended to decode non-ASCII characters
-             * into the proper UTF-8 sequence. */
-            if(c >= 0x20 && c < 0x7f && *next == ';') /* ASCII printable */
+/* Remove the metadata attributes from the opening tag of an element, in
+ * place. Returns the new length of the text. */
+static size_t strip_metadata(char *text, size_t len)
+{
+    static const struct { const char *name; size_t len; } attrs[] = {
+        { "version=", 8 }, { "timestamp=", 10 }, { "changeset=", 10 },
+        { "uid=", 4 }, { "user=", 5 }, { "visible=", 8 }
+    };
+    char *line_end = memchr(text, '\n', len), *src = text, *dest = text;
+    char quote = 0;
+    size_t rest;
+    int a;
+
+    if( !line_end)
+        line_end = text + len;
+    rest = text + len - line_end;
+
+    while(src < line_end)
+    {
+        if(quote)
+        {
+            if(*src == quote)
+                quote = 0;
+        }
+        else if(*src == '"' || *src == '\'')
+            quote = *src;
+        else if(*src == ' ')
+        {
+            for(a = 0; a < (int)(sizeof(attrs) / sizeof(attrs[0])); a++)
             {
-                *str = next+1;
-                return c;
+                char *value = src + 1 + attrs[a].len, *end;
+
+                if(value >= line_end || strncmp(src + 1, attrs[a].name, attrs[a].len) != 0
+                   || (*value != '"' && *value != '\'')
+                   || !(end = memchr(value + 1, *value, line_end - value - 1)))
+                    continue;
+                /* Skip the space, name and quoted value */
+                src = end + 1;
+                break;
             }
+            if(a < (int)(sizeof(attrs) / sizeof(attrs[0])))
+                continue;
         }
-        default: /* unrecognised or non-ASCII character; don't deescape */
-            return '&';
+        *dest++ = *src++;
     }
+    memmove(dest, line_end, rest);
+
+    return dest - text + rest;
 }
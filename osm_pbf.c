@@ -0,0 +1,1178 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Reader for the OpenStreetMap PBF format. The file is a sequence of
+ * length-prefixed BlobHeader/Blob pairs; each Blob holds a zlib-compressed
+ * protocol buffer message (OSMHeader or OSMData). Worker threads read,
+ * decompress and decode blobs into a compact intermediate form, and the
+ * calling thread materialises the elements and delivers them in file order. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "osm.h"
+
+#define MAX_HEADER_SIZE (64 * 1024)        /**< Maximum size of a BlobHeader */
+#define MAX_BLOB_SIZE   (32 * 1024 * 1024) /**< Maximum size of a Blob, compressed or not */
+#define MAX_THREADS     16
+
+/* Protocol buffer wire types */
+#define WT_VARINT 0
+#define WT_64BIT  1
+#define WT_BYTES  2
+#define WT_32BIT  5
+
+/* Slot states */
+#define SLOT_FREE    0
+#define SLOT_BUSY    1
+#define SLOT_DONE    2
+
+/* Position within a protocol buffer message */
+struct pbf_msg
+{
+    const unsigned char *ptr, *end;
+};
+
+/* Element decoded from a primitive block, with references into the
+ * block's string table and member arrays */
+struct pbf_element
+{
+    unsigned char type;
+    unsigned int id;
+    double lat, lon;
+    int kv_start, tag_count;  /**< Pairs of string indices in kv[] */
+    int ref_start, ref_count; /**< Members in refs[], mtypes[] and roles[] */
+    unsigned int version;     /**< Metadata, if present */
+    long long timestamp;      /**< Seconds since 1970 */
+    char deleted;             /**< Boolean; visible flag was false */
+};
+
+/* Blob read from the file and decoded into elements by a worker thread */
+struct pbf_block
+{
+    long seq;    /**< Position of blob in file */
+    int state;   /**< SLOT_* */
+    int status;  /**< 0 if decoded successfully, 1 on error, 2 at end of file */
+
+    unsigned char *raw;      /**< Blob as read from file */
+    int raw_len;             /**< Length of blob, or 0 if it is to be ignored */
+    int raw_max;
+    char is_header;          /**< Boolean; blob is an OSMHeader block */
+    unsigned char *data;     /**< Uncompressed block data */
+    int data_max;
+
+    const unsigned char **str; /**< String table entries (not null-terminated) */
+    int *str_len;
+    int str_count, str_max;
+
+    struct pbf_element *ele;
+    int ele_count, ele_max;
+    int *kv;                 /**< Key/value string index pairs */
+    int kv_count, kv_max;
+    unsigned int *refs;      /**< Way node refs and relation member IDs */
+    unsigned char *mtypes;   /**< Relation member types (0 node, 1 way, 2 relation) */
+    int *roles;              /**< Relation member role string indices */
+    int ref_count, ref_max;
+};
+
+struct osm_pbf
+{
+    FILE *fp;
+    char *filename;
+
+    pthread_t threads[MAX_THREADS];
+    int nthreads;
+
+    struct pbf_block *slots; /**< Ring of blocks, indexed by sequence number */
+    int nslots;
+    long next_read;    /**< Sequence number of next blob to be read from file */
+    long next_deliver; /**< Sequence number of next block to be delivered */
+    char eof;          /**< Boolean; no more blobs to be read */
+    char exit_now;     /**< Boolean; tells worker threads to exit */
+
+    pthread_mutex_t mutex;
+    pthread_cond_t read_signal, done_signal;
+
+    /* Elements materialised for delivery through the parser */
+    struct osm_node node;
+    int max_node_tags;
+    struct osm_way way;
+    int max_way_nodes, max_way_tags;
+    struct osm_relation relation;
+    int max_relation_nodes, max_relation_ways, max_relation_tags;
+};
+
+static void *start_worker_thread(void *);
+
+struct osm_pbf *osm_pbf_open(const char *filename)
+{
+    struct osm_pbf *pbf = calloc(1, sizeof(struct osm_pbf));
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int t;
+
+    if( !(pbf->fp = fopen(filename, "rb")))
+    {
+        fprintf(stderr, "osm_pbf_open(): Unable to open file <%s>: %s\n", filename,
+                strerror(errno));
+        free(pbf);
+        return NULL;
+    }
+    pbf->filename = strdup(filename);
+
+    pbf->nthreads = ncpu < 1 ? 1 : (ncpu > MAX_THREADS ? MAX_THREADS : ncpu);
+    pbf->nslots = 2 * pbf->nthreads + 2;
+    pbf->slots = calloc(pbf->nslots, sizeof(struct pbf_block));
+
+    pthread_mutex_init(&pbf->mutex, NULL);
+    pthread_cond_init(&pbf->read_signal, NULL);
+    pthread_cond_init(&pbf->done_signal, NULL);
+
+    for(t = 0; t < pbf->nthreads; t++)
+    {
+        if(pthread_create(&pbf->threads[t], NULL, start_worker_thread, pbf) != 0)
+        {
+            fprintf(stderr, "osm_pbf_open(): Unable to start worker thread\n");
+            pbf->nthreads = t;
+            osm_pbf_close(pbf);
+            return NULL;
+        }
+    }
+
+    return pbf;
+}
+
+static void deliver_element(struct osm_pbf *, struct pbf_block *, struct pbf_element *,
+                            struct osm_parse *);
+
+int osm_pbf_ingest(struct osm_pbf *pbf, struct osm_parse *parse)
+{
+    struct pbf_block *blk = &pbf->slots[pbf->next_deliver % pbf->nslots];
+    int e, status;
+
+    /* Wait for the next block in sequence to be decoded */
+    pthread_mutex_lock(&pbf->mutex);
+    while(blk->state != SLOT_DONE || blk->seq != pbf->next_deliver)
+        pthread_cond_wait(&pbf->done_signal, &pbf->mutex);
+    pthread_mutex_unlock(&pbf->mutex);
+
+    status = blk->status;
+    if(status == 0)
+    {
+        for(e = 0; e < blk->ele_count; e++)
+            deliver_element(pbf, blk, blk->ele + e, parse);
+    }
+    else if(status == 1)
+        fprintf(stderr, "osm_pbf_ingest(): Error decoding blob %ld of <%s>\n",
+                blk->seq, pbf->filename);
+    else /* end of file; deliver any element the parser has held back */
+        osm_parse_flush(parse);
+
+    /* Release the slot for reuse by the worker threads. The end-of-file and
+     * error markers are left in place so that further calls return them. */
+    if(status == 0)
+    {
+        pthread_mutex_lock(&pbf->mutex);
+        blk->state = SLOT_FREE;
+        pbf->next_deliver++;
+        pthread_cond_broadcast(&pbf->read_signal);
+        pthread_mutex_unlock(&pbf->mutex);
+    }
+
+    return status;
+}
+
+int osm_pbf_close(struct osm_pbf *pbf)
+{
+    int t, ret = 0;
+
+    /* Signal to worker threads and wait for them to exit */
+    pthread_mutex_lock(&pbf->mutex);
+    pbf->exit_now = 1;
+    pthread_cond_broadcast(&pbf->read_signal);
+    pthread_mutex_unlock(&pbf->mutex);
+    for(t = 0; t < pbf->nthreads; t++)
+        pthread_join(pbf->threads[t], NULL);
+
+    pthread_mutex_destroy(&pbf->mutex);
+    pthread_cond_destroy(&pbf->read_signal);
+    pthread_cond_destroy(&pbf->done_signal);
+
+    if(fclose(pbf->fp) != 0)
+    {
+        fprintf(stderr, "osm_pbf_close(): Error closing file\n");
+        ret = 1;
+    }
+
+    for(t = 0; t < pbf->nslots; t++)
+    {
+        struct pbf_block *blk = &pbf->slots[t];
+
+        free(blk->raw);
+        free(blk->data);
+        free(blk->str);
+        free(blk->str_len);
+        free(blk->ele);
+        free(blk->kv);
+        free(blk->refs);
+        free(blk->mtypes);
+        free(blk->roles);
+    }
+    free(pbf->slots);
+
+    free(pbf->node.tags);
+    free(pbf->way.nodes);
+    free(pbf->way.tags);
+    free(pbf->relation.nodes);
+    free(pbf->relation.node_roles);
+    free(pbf->relation.ways);
+    free(pbf->relation.way_roles);
+    free(pbf->relation.tags);
+    free(pbf->filename);
+    free(pbf);
+
+    return ret;
+}
+
+/* Copy a string table entry into fixed-size tag storage, truncating if
+ * necessary */
+static void copy_string(char *dest, struct pbf_block *blk, int index)
+{
+    int len = 0;
+
+    if(index >= 0 && index < blk->str_count)
+    {
+        len = blk->str_len[index];
+        if(len > OSM_TAG_SIZE)
+            len = OSM_TAG_SIZE;
+        memcpy(dest, blk->str[index], len);
+    }
+    dest[len] = '\0';
+
+    return;
+}
+
+static struct osm_tag *copy_tags(struct pbf_block *blk, struct pbf_element *ele,
+                                 struct osm_tag *tags, int *max_tags)
+{
+    int t;
+
+    if(ele->tag_count > *max_tags)
+    {
+        *max_tags = ele->tag_count + 5;
+        tags = realloc(tags, *max_tags * sizeof(struct osm_tag));
+    }
+    for(t = 0; t < ele->tag_count; t++)
+    {
+        copy_string(tags[t].key, blk, blk->kv[2 * (ele->kv_start + t)]);
+        copy_string(tags[t].value, blk, blk->kv[2 * (ele->kv_start + t) + 1]);
+    }
+
+    return tags;
+}
+
+/* Fill in the reusable element structure for a decoded element, with only
+ * the fields of interest, and pass it to the parser's callback */
+static void deliver_element(struct osm_pbf *pbf, struct pbf_block *blk,
+                            struct pbf_element *ele, struct osm_parse *parse)
+{
+    unsigned char fields;
+
+    if(!osm_parse_wants(parse, ele->type, ele->id))
+        return;
+    fields = osm_parse_fields(parse, ele->type);
+
+    if(ele->type == OSM_NODE)
+    {
+        struct osm_node *node = &pbf->node;
+
+        node->id = ele->id;
+        node->lat = ele->lat;
+        node->lon = ele->lon;
+        node->version = ele->version;
+        node->timestamp = ele->timestamp;
+        node->deleted = ele->deleted;
+        node->tag_count = 0;
+        if(fields & OSM_FIELD_TAGS)
+        {
+            node->tags = copy_tags(blk, ele, node->tags, &pbf->max_node_tags);
+            node->tag_count = ele->tag_count;
+        }
+        osm_parse_deliver_node(parse, node);
+    }
+    else if(ele->type == OSM_WAY)
+    {
+        struct osm_way *way = &pbf->way;
+
+        way->id = ele->id;
+        way->version = ele->version;
+        way->timestamp = ele->timestamp;
+        way->deleted = ele->deleted;
+        way->node_count = way->tag_count = 0;
+        if(fields & OSM_FIELD_MEMBERS)
+        {
+            if(ele->ref_count > pbf->max_way_nodes)
+            {
+                pbf->max_way_nodes = ele->ref_count + 10;
+                way->nodes = realloc(way->nodes, pbf->max_way_nodes * sizeof(unsigned int));
+            }
+            memcpy(way->nodes, blk->refs + ele->ref_start, ele->ref_count * sizeof(unsigned int));
+            way->node_count = ele->ref_count;
+        }
+        if(fields & OSM_FIELD_TAGS)
+        {
+            way->tags = copy_tags(blk, ele, way->tags, &pbf->max_way_tags);
+            way->tag_count = ele->tag_count;
+        }
+        osm_parse_deliver_way(parse, way);
+    }
+    else if(ele->type == OSM_RELATION)
+    {
+        struct osm_relation *rel = &pbf->relation;
+        int m;
+
+        rel->id = ele->id;
+        rel->version = ele->version;
+        rel->timestamp = ele->timestamp;
+        rel->deleted = ele->deleted;
+        rel->node_count = rel->way_count = rel->tag_count = 0;
+        if(fields & OSM_FIELD_MEMBERS)
+        {
+            if(ele->ref_count > pbf->max_relation_nodes)
+            {
+                pbf->max_relation_nodes = ele->ref_count + 10;
+                rel->nodes = realloc(rel->nodes, pbf->max_relation_nodes * sizeof(unsigned int));
+                rel->node_roles = realloc(rel->node_roles, pbf->max_relation_nodes * (OSM_TAG_SIZE + 1));
+            }
+            if(ele->ref_count > pbf->max_relation_ways)
+            {
+                pbf->max_relation_ways = ele->ref_count + 10;
+                rel->ways = realloc(rel->ways, pbf->max_relation_ways * sizeof(unsigned int));
+                rel->way_roles = realloc(rel->way_roles, pbf->max_relation_ways * (OSM_TAG_SIZE + 1));
+            }
+
+            /* Members that are relations are not handled, as with XML input */
+            for(m = ele->ref_start; m < ele->ref_start + ele->ref_count; m++)
+            {
+                if(blk->mtypes[m] == 0)
+                {
+                    rel->nodes[rel->node_count] = blk->refs[m];
+                    copy_string(rel->node_roles[rel->node_count++], blk, blk->roles[m]);
+                }
+                else if(blk->mtypes[m] == 1)
+                {
+                    rel->ways[rel->way_count] = blk->refs[m];
+                    copy_string(rel->way_roles[rel->way_count++], blk, blk->roles[m]);
+                }
+            }
+        }
+        if(fields & OSM_FIELD_TAGS)
+        {
+            rel->tags = copy_tags(blk, ele, rel->tags, &pbf->max_relation_tags);
+            rel->tag_count = ele->tag_count;
+        }
+        osm_parse_deliver_relation(parse, rel);
+    }
+
+    return;
+}
+
+/* Protocol buffer decoding primitives. All return -1 on malformed input. */
+
+static int pbf_varint(struct pbf_msg *msg, uint64_t *val)
+{
+    uint64_t v = 0;
+    int shift;
+
+    for(shift = 0; shift < 64 && msg->ptr < msg->end; shift += 7)
+    {
+        unsigned char b = *msg->ptr++;
+
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if(!(b & 0x80))
+        {
+            *val = v;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static inline int64_t zigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/* Read the key of the next field, or return 1 at end of message */
+static int pbf_field(struct pbf_msg *msg, int *field, int *wiretype)
+{
+    uint64_t key;
+
+    if(msg->ptr >= msg->end)
+        return 1;
+    if(pbf_varint(msg, &key) != 0)
+        return -1;
+    *field = key >> 3;
+    *wiretype = key & 7;
+
+    return 0;
+}
+
+/* Read a length-delimited field as a sub-message */
+static int pbf_bytes(struct pbf_msg *msg, struct pbf_msg *sub)
+{
+    uint64_t len;
+
+    if(pbf_varint(msg, &len) != 0 || len > (uint64_t)(msg->end - msg->ptr))
+        return -1;
+    sub->ptr = msg->ptr;
+    sub->end = msg->ptr + len;
+    msg->ptr += len;
+
+    return 0;
+}
+
+static int pbf_skip(struct pbf_msg *msg, int wiretype)
+{
+    uint64_t v;
+    struct pbf_msg sub;
+
+    switch(wiretype)
+    {
+        case WT_VARINT:
+            return pbf_varint(msg, &v);
+        case WT_64BIT:
+            if(msg->end - msg->ptr < 8)
+                return -1;
+            msg->ptr += 8;
+            return 0;
+        case WT_BYTES:
+            return pbf_bytes(msg, &sub);
+        case WT_32BIT:
+            if(msg->end - msg->ptr < 4)
+                return -1;
+            msg->ptr += 4;
+            return 0;
+    }
+
+    return -1;
+}
+
+/* Count the varints in a packed field */
+static int pbf_packed_count(struct pbf_msg *msg)
+{
+    const unsigned char *p;
+    int count = 0;
+
+    for(p = msg->ptr; p < msg->end; p++)
+        if(!(*p & 0x80))
+            count++;
+
+    return count;
+}
+
+/* Decoded-block storage management */
+
+static void ensure_elements(struct pbf_block *blk, int count)
+{
+    if(blk->ele_count + count > blk->ele_max)
+    {
+        blk->ele_max = blk->ele_count + count + 1000;
+        blk->ele = realloc(blk->ele, blk->ele_max * sizeof(struct pbf_element));
+    }
+}
+
+static void ensure_kv(struct pbf_block *blk, int count)
+{
+    if(blk->kv_count + count > blk->kv_max)
+    {
+        blk->kv_max = blk->kv_count + count + 1000;
+        blk->kv = realloc(blk->kv, 2 * blk->kv_max * sizeof(int));
+    }
+}
+
+static void ensure_refs(struct pbf_block *blk, int count)
+{
+    if(blk->ref_count + count > blk->ref_max)
+    {
+        blk->ref_max = blk->ref_count + count + 10000;
+        blk->refs = realloc(blk->refs, blk->ref_max * sizeof(unsigned int));
+        blk->mtypes = realloc(blk->mtypes, blk->ref_max);
+        blk->roles = realloc(blk->roles, blk->ref_max * sizeof(int));
+    }
+}
+
+/* Element and member IDs are held in 32 bits, as they are for XML input.
+ * PBF IDs are 64-bit, and one that does not fit fails the block rather
+ * than wrapping round and silently aliasing another element. */
+static int check_id(int64_t id)
+{
+    if(id >= 0 && id <= UINT_MAX)
+        return 0;
+
+    fprintf(stderr, "osm_pbf_ingest(): ID %lld is outside the supported range 0-%u\n",
+            (long long)id, UINT_MAX);
+    return -1;
+}
+
+/* Decode parallel packed "keys" and "vals" fields into the kv array */
+static int decode_keys_vals(struct pbf_block *blk, struct pbf_element *ele,
+                            struct pbf_msg *keys, struct pbf_msg *vals)
+{
+    int count = pbf_packed_count(keys);
+
+    if(pbf_packed_count(vals) != count)
+        return -1;
+
+    ensure_kv(blk, count);
+    ele->kv_start = blk->kv_count;
+    ele->tag_count = count;
+    while(keys->ptr < keys->end)
+    {
+        uint64_t k, v;
+
+        if(pbf_varint(keys, &k) != 0 || pbf_varint(vals, &v) != 0)
+            return -1;
+        blk->kv[2 * blk->kv_count] = k;
+        blk->kv[2 * blk->kv_count + 1] = v;
+        blk->kv_count++;
+    }
+
+    return 0;
+}
+
+struct block_params
+{
+    int64_t granularity, lat_offset, lon_offset;
+    int64_t date_granularity; /**< Units of timestamps in milliseconds */
+};
+
+/* Decode the Info message of a node, way or relation. Only the fields
+ * needed to pick versions from history files are kept. */
+static int decode_info(struct pbf_element *ele, struct pbf_msg *msg, struct block_params *bp)
+{
+    int field, wt, ret;
+
+    while((ret = pbf_field(msg, &field, &wt)) == 0)
+    {
+        uint64_t v = 0;
+
+        if(field == 1 && wt == WT_VARINT)
+            ret = pbf_varint(msg, &v), ele->version = v;
+        else if(field == 2 && wt == WT_VARINT)
+            ret = pbf_varint(msg, &v), ele->timestamp = (int64_t)v * bp->date_granularity / 1000;
+        else if(field == 6 && wt == WT_VARINT)
+            ret = pbf_varint(msg, &v), ele->deleted = !v;
+        else
+            ret = pbf_skip(msg, wt);
+        if(ret != 0)
+            return -1;
+    }
+
+    return ret < 0 ? -1 : 0;
+}
+
+static int decode_node(struct pbf_block *blk, struct pbf_msg *msg, struct block_params *bp)
+{
+    struct pbf_msg keys = { NULL, NULL }, vals = { NULL, NULL }, info = { NULL, NULL };
+    struct pbf_element *ele;
+    int64_t id = 0, lat = 0, lon = 0;
+    int field, wt, ret;
+
+    while((ret = pbf_field(msg, &field, &wt)) == 0)
+    {
+        uint64_t v;
+
+        if(field == 1 && wt == WT_VARINT)
+            ret = pbf_varint(msg, &v), id = zigzag(v);
+        else if(field == 2 && wt == WT_BYTES)
+            ret = pbf_bytes(msg, &keys);
+        else if(field == 3 && wt == WT_BYTES)
+            ret = pbf_bytes(msg, &vals);
+        else if(field == 4 && wt == WT_BYTES)
+            ret = pbf_bytes(msg, &info);
+        else if(field == 8 && wt == WT_VARINT)
+            ret = pbf_varint(msg, &v), lat = zigzag(v);
+        else if(field == 9 && wt == WT_VARINT)
+            ret = pbf_varint(msg, &v), lon = zigzag(v);
+        else
+            ret = pbf_skip(msg, wt);
+        if(ret != 0)
+            return -1;
+    }
+    if(ret < 0 || check_id(id) != 0)
+        return -1;
+
+    ensure_elements(blk, 1);
+    ele = &blk->ele[blk->ele_count++];
+    ele->type = OSM_NODE;
+    ele->id = id;
+    ele->lat = 1e-9 * (bp->lat_offset + bp->granularity * lat);
+    ele->lon = 1e-9 * (bp->lon_offset + bp->granularity * lon);
+    ele->ref_start = ele->ref_count = 0;
+    ele->version = ele->timestamp = ele->deleted = 0;
+    if(info.ptr && decode_info(ele, &info, bp) != 0)
+        return -1;
+
+    return decode_keys_vals(blk, ele, &keys, &vals);
+}
+
+static int decode_dense(struct pbf_block *blk, struct pbf_msg *msg, struct block_params *bp)
+{
+    struct pbf_msg ids = { NULL, NULL }, lats = { NULL, NULL }, lons = { NULL, NULL };
+    struct pbf_msg kv = { NULL, NULL }, info = { NULL, NULL };
+    struct pbf_msg versions = { NULL, NULL }, times = { NULL, NULL }, visible = { NULL, NULL };
+    int64_t id = 0, lat = 0, lon = 0, timestamp = 0;
+    int field, wt, ret, count, n;
+
+    while((ret = pbf_field(msg, &field, &wt)) == 0)
+    {
+        if(field == 1 && wt == WT_BYTES)
+            ret = pbf_bytes(msg, &ids);
+        else if(field == 5 && wt == WT_BYTES)
+            ret = pbf_bytes(msg, &info);
+        else if(field == 8 && wt == WT_BYTES)
+            ret = pbf_bytes(msg, &lats);
+        else if(field == 9 && wt == WT_BYTES)
+            ret = pbf_bytes(msg, &lons);
+        else if(field == 10 && wt == WT_BYTES)
+            ret = pbf_bytes(msg, &kv);
+        else
+            ret = pbf_skip(msg, wt);
+        if(ret != 0)
+            return -1;
+    }
+    if(ret < 0)
+        return -1;
+
+    /* DenseInfo has packed arrays parallel to the IDs */
+    while(info.ptr && (ret = pbf_field(&info, &field, &wt)) == 0)
+    {
+        if(field == 1 && wt == WT_BYTES)
+            ret = pbf_bytes(&info, &versions);
+        else if(field == 2 && wt == WT_BYTES)
+            ret = pbf_bytes(&info, &times);
+        else if(field == 6 && wt == WT_BYTES)
+            ret = pbf_bytes(&info, &visible);
+        else
+            ret = pbf_skip(&info, wt);
+        if(ret != 0)
+            return -1;
+    }
+    if(ret < 0)
+        return -1;
+
+    count = ids.ptr ? pbf_packed_count(&ids) : 0;
+    ensure_elements(blk, count);
+    for(n = 0; n < count; n++)
+    {
+        struct pbf_element *ele = &blk->ele[blk->ele_count++];
+        uint64_t v;
+
+        /* IDs and co-ordinates are delta-encoded */
+        if( pbf_varint(&ids, &v) != 0)
+            return -1;
+        id += zigzag(v);
+        if(check_id(id) != 0)
+            return -1;
+        if( pbf_varint(&lats, &v) != 0)
+            return -1;
+        lat += zigzag(v);
+        if( pbf_varint(&lons, &v) != 0)
+            return -1;
+        lon += zigzag(v);
+
+        ele->type = OSM_NODE;
+        ele->id = id;
+        ele->lat = 1e-9 * (bp->lat_offset + bp->granularity * lat);
+        ele->lon = 1e-9 * (bp->lon_offset + bp->granularity * lon);
+        ele->ref_start = ele->ref_count = 0;
+        ele->kv_start = blk->kv_count;
+        ele->tag_count = 0;
+
+        /* Versions are not delta-encoded, but timestamps are */
+        ele->version = ele->timestamp = ele->deleted = 0;
+        if(versions.ptr && versions.ptr < versions.end)
+        {
+            if(pbf_varint(&versions, &v) != 0)
+                return -1;
+            ele->version = v;
+        }
+        if(times.ptr && times.ptr < times.end)
+        {
+            if(pbf_varint(&times, &v) != 0)
+                return -1;
+            timestamp += zigzag(v);
+            ele->timestamp = timestamp * bp->date_granularity / 1000;
+        }
+        if(visible.ptr && visible.ptr < visible.end)
+        {
+            if(pbf_varint(&visible, &v) != 0)
+                return -1;
+            ele->deleted = !v;
+        }
+
+        /* Tags of all nodes are packed into a single array of alternating
+         * key and value string indices, with each node's tags terminated
+         * by a zero. The array is absent if no node has tags. */
+        while(kv.ptr && kv.ptr < kv.end)
+        {
+            uint64_t k, val;
+
+            if(pbf_varint(&kv, &k) != 0)
+                return -1;
+            if(k == 0)
+                break;
+            if(pbf_varint(&kv, &val) != 0)
+                return -1;
+            ensure_kv(blk, 1);
+            blk->kv[2 * blk->kv_count] = k;
+            blk->kv[2 * blk->kv_count + 1] = val;
+            blk->kv_count++;
+            ele->tag_count++;
+        }
+    }
+
+    return 0;
+}
+
+static int decode_way(struct pbf_block *blk, struct pbf_msg *msg, struct block_params *bp)
+{
+    struct pbf_msg keys = { NULL, NULL }, vals = { NULL, NULL }, refs = { NULL, NULL };
+    struct pbf_msg info = { NULL, NULL };
+    struct pbf_element *ele;
+    uint64_t id = 0;
+    int64_t ref = 0;
+    int field, wt, ret;
+
+    while((ret = pbf_field(msg, &field, &wt)) == 0)
+    {
+        if(field == 1 && wt == WT_VARINT)
+            ret = pbf_varint(msg, &id);
+        else if(field == 2 && wt == WT_BYTES)
+            ret = pbf_bytes(msg, &keys);
+        else if(field == 3 && wt == WT_BYTES)
+            ret = pbf_bytes(msg, &vals);
+        else if(field == 4 && wt == WT_BYTES)
+            ret = pbf_bytes(msg, &info);
+        else if(field == 8 && wt == WT_BYTES)
+            ret = pbf_bytes(msg, &refs);
+        else
+            ret = pbf_skip(msg, wt);
+        if(ret != 0)
+            return -1;
+    }
+    if(ret < 0 || check_id(id) != 0)
+        return -1;
+
+    ensure_elements(blk, 1);
+    ele = &blk->ele[blk->ele_count++];
+    ele->type = OSM_WAY;
+    ele->id = id;
+    ele->lat = ele->lon = 0;
+    ele->version = ele->timestamp = ele->deleted = 0;
+    if(info.ptr && decode_info(ele, &info, bp) != 0)
+        return -1;
+
+    ele->ref_count = refs.ptr ? pbf_packed_count(&refs) : 0;
+    ensure_refs(blk, ele->ref_count);
+    ele->ref_start = blk->ref_count;
+    while(refs.ptr && refs.ptr < refs.end)
+    {
+        uint64_t v;
+
+        if(pbf_varint(&refs, &v) != 0)
+            return -1;
+        ref += zigzag(v);
+        if(check_id(ref) != 0)
+            return -1;
+        blk->refs[blk->ref_count++] = ref;
+    }
+
+    return decode_keys_vals(blk, ele, &keys, &vals);
+}
+
+static int decode_relation(struct pbf_block *blk, struct pbf_msg *msg, struct block_params *bp)
+{
+    struct pbf_msg keys = { NULL, NULL }, vals = { NULL, NULL }, info = { NULL, NULL };
+    struct pbf_msg roles = { NULL, NULL }, memids = { NULL, NULL }, types = { NULL, NULL };
+    struct pbf_element *ele;
+    uint64_t id = 0;
+    int64_t memid = 0;
+    int field, wt, ret, m;
+
+    while((ret = pbf_field(msg, &field, &wt)) == 0)
+    {
+        if(field == 1 && wt == WT_VARINT)
+            ret = pbf_varint(msg, &id);
+        else if(field == 2 && wt == WT_BYTES)
+            ret = pbf_bytes(msg, &keys);
+        else if(field == 3 && wt == WT_BYTES)
+            ret = pbf_bytes(msg, &vals);
+        else if(field == 4 && wt == WT_BYTES)
+            ret = pbf_bytes(msg, &info);
+        else if(field == 8 && wt == WT_BYTES)
+            ret = pbf_bytes(msg, &roles);
+        else if(field == 9 && wt == WT_BYTES)
+            ret = pbf_bytes(msg, &memids);
+        else if(field == 10 && wt == WT_BYTES)
+            ret = pbf_bytes(msg, &types);
+        else
+            ret = pbf_skip(msg, wt);
+        if(ret != 0)
+            return -1;
+    }
+    if(ret < 0 || check_id(id) != 0)
+        return -1;
+
+    ensure_elements(blk, 1);
+    ele = &blk->ele[blk->ele_count++];
+    ele->type = OSM_RELATION;
+    ele->id = id;
+    ele->lat = ele->lon = 0;
+    ele->version = ele->timestamp = ele->deleted = 0;
+    if(info.ptr && decode_info(ele, &info, bp) != 0)
+        return -1;
+
+    ele->ref_count = memids.ptr ? pbf_packed_count(&memids) : 0;
+    if( (roles.ptr ? pbf_packed_count(&roles) : 0) != ele->ref_count
+     || (types.ptr ? pbf_packed_count(&types) : 0) != ele->ref_count)
+        return -1;
+    /* All members are kept here with their types, but deliver_element()
+     * passes on only nodes (type 0) and ways (type 1): members that are
+     * relations (type 2) are dropped, as the XML parser drops them. */
+    ensure_refs(blk, ele->ref_count);
+    ele->ref_start = blk->ref_count;
+    for(m = 0; m < ele->ref_count; m++)
+    {
+        uint64_t v, role, type;
+
+        if( pbf_varint(&memids, &v) != 0
+         || pbf_varint(&roles, &role) != 0
+         || pbf_varint(&types, &type) != 0)
+            return -1;
+        memid += zigzag(v);
+        if(check_id(memid) != 0)
+            return -1;
+        blk->refs[blk->ref_count] = memid;
+        blk->roles[blk->ref_count] = role;
+        blk->mtypes[blk->ref_count] = type;
+        blk->ref_count++;
+    }
+
+    return decode_keys_vals(blk, ele, &keys, &vals);
+}
+
+static int decode_group(struct pbf_block *blk, struct pbf_msg *msg, struct block_params *bp)
+{
+    int field, wt, ret;
+
+    while((ret = pbf_field(msg, &field, &wt)) == 0)
+    {
+        struct pbf_msg sub;
+
+        if(wt != WT_BYTES)
+            ret = pbf_skip(msg, wt);
+        else if((ret = pbf_bytes(msg, &sub)) == 0)
+        {
+            switch(field)
+            {
+                case 1:
+                    ret = decode_node(blk, &sub, bp);
+                    break;
+                case 2:
+                    ret = decode_dense(blk, &sub, bp);
+                    break;
+                case 3:
+                    ret = decode_way(blk, &sub, bp);
+                    break;
+                case 4:
+                    ret = decode_relation(blk, &sub, bp);
+                    break;
+                default: /* changesets */
+                    break;
+            }
+        }
+        if(ret != 0)
+            return -1;
+    }
+
+    return ret < 0 ? -1 : 0;
+}
+
+static int decode_primitive_block(struct pbf_block *blk, struct pbf_msg *msg)
+{
+    struct block_params bp = { 100, 0, 0, 1000 };
+    struct pbf_msg scan = *msg;
+    int field, wt, ret;
+
+    /* The string table and block-wide parameters may in principle follow
+     * the primitive groups, so they are read in a first scan. */
+    while((ret = pbf_field(&scan, &field, &wt)) == 0)
+    {
+        uint64_t v;
+
+        if(field == 1 && wt == WT_BYTES)
+        {
+            struct pbf_msg table, s;
+            int f, w;
+
+            if((ret = pbf_bytes(&scan, &table)) != 0)
+                return -1;
+            while((ret = pbf_field(&table, &f, &w)) == 0)
+            {
+                if(f != 1 || w != WT_BYTES)
+                {
+                    if(pbf_skip(&table, w) != 0)
+                        return -1;
+                    continue;
+                }
+                if(pbf_bytes(&table, &s) != 0)
+                    return -1;
+                if(blk->str_count >= blk->str_max)
+                {
+                    blk->str_max = blk->str_count + 1000;
+                    blk->str = realloc(blk->str, blk->str_max * sizeof(unsigned char *));
+                    blk->str_len = realloc(blk->str_len, blk->str_max * sizeof(int));
+                }
+                blk->str[blk->str_count] = s.ptr;
+                blk->str_len[blk->str_count++] = s.end - s.ptr;
+            }
+            if(ret < 0)
+                return -1;
+            continue;
+        }
+        else if(field == 17 && wt == WT_VARINT)
+            ret = pbf_varint(&scan, &v), bp.granularity = v;
+        else if(field == 18 && wt == WT_VARINT)
+            ret = pbf_varint(&scan, &v), bp.date_granularity = v;
+        else if(field == 19 && wt == WT_VARINT)
+            ret = pbf_varint(&scan, &v), bp.lat_offset = v;
+        else if(field == 20 && wt == WT_VARINT)
+            ret = pbf_varint(&scan, &v), bp.lon_offset = v;
+        else
+            ret = pbf_skip(&scan, wt);
+        if(ret != 0)
+            return -1;
+    }
+    if(ret < 0)
+        return -1;
+
+    while((ret = pbf_field(msg, &field, &wt)) == 0)
+    {
+        struct pbf_msg group;
+
+        if(field == 2 && wt == WT_BYTES)
+            ret = pbf_bytes(msg, &group) || decode_group(blk, &group, &bp);
+        else
+            ret = pbf_skip(msg, wt);
+        if(ret != 0)
+            return -1;
+    }
+
+    return ret < 0 ? -1 : 0;
+}
+
+/* Check that all the features required to interpret the file are supported */
+static int decode_header_block(struct pbf_msg *msg)
+{
+    int field, wt, ret;
+
+    while((ret = pbf_field(msg, &field, &wt)) == 0)
+    {
+        struct pbf_msg feature;
+
+        if(field == 4 && wt == WT_BYTES)
+        {
+            int len;
+
+            if(pbf_bytes(msg, &feature) != 0)
+                return -1;
+            len = feature.end - feature.ptr;
+            if( !(len == 14 && memcmp(feature.ptr, "OsmSchema-V0.6", 14) == 0)
+             && !(len == 10 && memcmp(feature.ptr, "DenseNodes", 10) == 0)
+             && !(len == 21 && memcmp(feature.ptr, "HistoricalInformation", 21) == 0))
+            {
+                fprintf(stderr, "PBF file requires unsupported feature <%.*s>\n",
+                        len, (const char *)feature.ptr);
+                return -1;
+            }
+        }
+        else if(pbf_skip(msg, wt) != 0)
+            return -1;
+    }
+
+    return ret < 0 ? -1 : 0;
+}
+
+/* Read the next BlobHeader and Blob from the file into a slot. Called with
+ * the mutex held, so that blobs are read in file order. Returns 0 on
+ * success, 2 at end of file or 1 on error. */
+static int read_blob(struct osm_pbf *pbf, struct pbf_block *blk)
+{
+    unsigned char lenbuf[4], header[MAX_HEADER_SIZE];
+    struct pbf_msg msg, type = { NULL, NULL };
+    uint32_t len;
+    uint64_t datasize = 0;
+    int field, wt, ret;
+
+    if(fread(lenbuf, 1, 4, pbf->fp) != 4)
+        return feof(pbf->fp) ? 2 : 1;
+    len = ((uint32_t)lenbuf[0] << 24) | (lenbuf[1] << 16) | (lenbuf[2] << 8) | lenbuf[3];
+    if(len > MAX_HEADER_SIZE || fread(header, 1, len, pbf->fp) != len)
+        return 1;
+
+    msg.ptr = header;
+    msg.end = header + len;
+    while((ret = pbf_field(&msg, &field, &wt)) == 0)
+    {
+        if(field == 1 && wt == WT_BYTES)
+            ret = pbf_bytes(&msg, &type);
+        else if(field == 3 && wt == WT_VARINT)
+            ret = pbf_varint(&msg, &datasize);
+        else
+            ret = pbf_skip(&msg, wt);
+        if(ret != 0)
+            return 1;
+    }
+    if(ret < 0 || !type.ptr || datasize > MAX_BLOB_SIZE)
+        return 1;
+
+    if(datasize > (uint64_t)blk->raw_max)
+    {
+        blk->raw_max = datasize;
+        blk->raw = realloc(blk->raw, blk->raw_max);
+    }
+    if(fread(blk->raw, 1, datasize, pbf->fp) != datasize)
+        return 1;
+    blk->raw_len = datasize;
+
+    blk->is_header = (type.end - type.ptr == 9 && memcmp(type.ptr, "OSMHeader", 9) == 0);
+    if( !blk->is_header && !(type.end - type.ptr == 7 && memcmp(type.ptr, "OSMData", 7) == 0))
+        blk->raw_len = 0; /* unknown blob type; to be ignored */
+
+    return 0;
+}
+
+/* Decompress and decode a blob previously read into a slot */
+static int decode_blob(struct pbf_block *blk)
+{
+    struct pbf_msg msg, raw = { NULL, NULL }, zdata = { NULL, NULL };
+    uint64_t raw_size = 0;
+    size_t len;
+    int field, wt, ret;
+
+    blk->str_count = blk->ele_count = blk->kv_count = blk->ref_count = 0;
+    if(blk->raw_len == 0)
+        return 0;
+
+    msg.ptr = blk->raw;
+    msg.end = blk->raw + blk->raw_len;
+    while((ret = pbf_field(&msg, &field, &wt)) == 0)
+    {
+        if(field == 1 && wt == WT_BYTES)
+            ret = pbf_bytes(&msg, &raw);
+        else if(field == 2 && wt == WT_VARINT)
+            ret = pbf_varint(&msg, &raw_size);
+        else if(field == 3 && wt == WT_BYTES)
+            ret = pbf_bytes(&msg, &zdata);
+        else if(field >= 4 && field <= 7)
+        {
+            fprintf(stderr, "PBF blob compression type %d not supported\n", field);
+            return -1;
+        }
+        else
+            ret = pbf_skip(&msg, wt);
+        if(ret != 0)
+            return -1;
+    }
+    if(ret < 0)
+        return -1;
+
+    if(zdata.ptr)
+    {
+        if(raw_size > MAX_BLOB_SIZE)
+            return -1;
+        if(raw_size > (uint64_t)blk->data_max)
+        {
+            blk->data_max = raw_size;
+            blk->data = realloc(blk->data, blk->data_max);
+        }
+        if( osm_zlib_inflate(zdata.ptr, zdata.end - zdata.ptr, blk->data, raw_size, &len) != 0
+         || len != raw_size)
+            return -1;
+        msg.ptr = blk->data;
+        msg.end = blk->data + len;
+    }
+    else if(raw.ptr)
+        msg = raw;
+    else
+        return -1;
+
+    if(blk->is_header)
+        return decode_header_block(&msg);
+    else
+        return decode_primitive_block(blk, &msg);
+}
+
+/* Worker thread to read blobs from the file, decompress and decode them */
+static void *start_worker_thread(void *data)
+{
+    struct osm_pbf *pbf = data;
+
+    pthread_mutex_lock(&pbf->mutex);
+    while(!pbf->exit_now && !pbf->eof)
+    {
+        struct pbf_block *blk;
+        int status;
+
+        /* Wait until there is a free slot for the next blob */
+        if(pbf->next_read >= pbf->next_deliver + pbf->nslots)
+        {
+            pthread_cond_wait(&pbf->read_signal, &pbf->mutex);
+            continue;
+        }
+
+        blk = &pbf->slots[pbf->next_read % pbf->nslots];
+        blk->seq = pbf->next_read++;
+        blk->state = SLOT_BUSY;
+        status = read_blob(pbf, blk);
+        if(status != 0)
+            pbf->eof = 1;
+        pthread_mutex_unlock(&pbf->mutex);
+
+        if(status == 0 && decode_blob(blk) != 0)
+            status = 1;
+
+        pthread_mutex_lock(&pbf->mutex);
+        blk->status = status;
+        blk->state = SLOT_DONE;
+        pthread_cond_broadcast(&pbf->done_signal);
+    }
+    pthread_mutex_unlock(&pbf->mutex);
+
+    return NULL;
+}
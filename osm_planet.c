@@ -25,14 +25,29 @@
 #include <pthread.h>
 #include <bzlib.h>
 
+#include "osm.h"
+
 /* Maximum block size used in bzip2 compression. We always try to read uncompressed
  * blocks of this size, to be efficient. */
 #define BLOCK_SIZE 900000
 
+/* Compressed data is read ahead with this many reads of this size in
+ * flight, unless changed with osm_planet_set_readahead() */
+static int readahead_depth = 4;
+static size_t readahead_size = 4 * 1024 * 1024;
+static int decoder = OSM_BZIP2_LIBBZ2;
+
 struct osm_planet
 {
-    FILE *fp;              /**< File pointer to open compressed file */
-    BZFILE *bzfp;          /**< Abstract file pointer used by bzip2 library */
+    struct osm_readahead *ra; /**< Reader supplying the compressed data */
+    bz_stream bz;          /**< State of the bzip2 decompressor */
+    struct osm_bzip2 *bz2; /**< In-tree decompressor, used instead of bz if not NULL */
+    char input_eof;        /**< Boolean; all compressed data has been passed to bz2 */
+    char stream_end;       /**< Boolean; the last bzip2 stream is complete */
+    char checked;          /**< Boolean; the start of the file has been checked for compression */
+    char uncompressed;     /**< Boolean; the file is not compressed and is copied as it is */
+    struct osm_cache *cache; /**< Cache the file is recorded to or read from, or NULL */
+    int replay;            /**< Boolean; the file is read from the cache */
     unsigned char buff[2][BLOCK_SIZE]; /**< Double buffer to hold data read in file read thread */
     int buff_len[2];       /**< Number of bytes placed in buffer by file read thread */
 
@@ -54,23 +69,32 @@ struct osm_planet
 };
 
 static void *start_file_read_thread(void *);
+static int decompress(struct osm_planet *, unsigned char *buff, int size, int *len);
+static int decompress_builtin(struct osm_planet *, unsigned char *buff, int size, int *len);
+static int replay(struct osm_planet *, unsigned char *buff, int size, int *len);
+static void record(struct osm_planet *, const unsigned char *buff, int len, int bzerror);
 
 struct osm_planet *osm_planet_open(const char *filename)
 {
     struct osm_planet *osf = calloc(1, sizeof(struct osm_planet));
     int bzerror;
 
-    if( !(osf->fp = fopen(filename, "rb")))
+    /* A file already decompressed once is read from the cache */
+    osf->cache = osm_cache_open(filename, &osf->replay);
+    if( !osf->replay && !(osf->ra = osm_readahead_open(filename, readahead_depth, readahead_size)))
+        goto open_failed;
+
+    if((bzerror = BZ2_bzDecompressInit(&osf->bz, 0, 0)) != BZ_OK)
     {
-        fprintf(stderr, "osm_planet_open(): Unable to open file <%s>: %s\n", filename,
-                strerror(errno));
+        fprintf(stderr, "osm_planet_open(): Unable to initialise bzip2 decompressor: %d\n", bzerror);
+        if(osf->ra)
+            osm_readahead_close(osf->ra);
         goto open_failed;
     }
-
-    osf->bzfp = BZ2_bzReadOpen(&bzerror, osf->fp, 1, 0, NULL, 0);
-    if(bzerror != BZ_OK)
+    if(decoder == OSM_BZIP2_BUILTIN && !osf->replay && !(osf->bz2 = osm_bzip2_open()))
     {
-        fprintf(stderr, "osm_planet_open(): Unable to open compressed file with bzip2: %d\n", bzerror);
+        BZ2_bzDecompressEnd(&osf->bz);
+        osm_readahead_close(osf->ra);
         goto open_failed;
     }
 
@@ -82,12 +106,19 @@ struct osm_planet *osm_planet_open(const char *filename)
     if(pthread_create(&osf->file_read_thread, NULL, start_file_read_thread, osf) != 0)
     {
         fprintf(stderr, "osm_planet_open(): Unable to start file read thread\n");
+        BZ2_bzDecompressEnd(&osf->bz);
+        if(osf->bz2)
+            osm_bzip2_close(osf->bz2);
+        if(osf->ra)
+            osm_readahead_close(osf->ra);
         goto open_failed;
     }
 
     return osf;
 
 open_failed:
+    if(osf->cache)
+        osm_cache_close(osf->cache, OSM_CACHE_DROPPED);
     free(osf);
     return NULL;
 }
@@ -152,12 +183,32 @@ int osm_planet_readln(struct osm_planet *osf, char **line)
     return 0;
 }
 
+void osm_planet_set_readahead(int depth, size_t read_size)
+{
+    readahead_depth = depth;
+    readahead_size = read_size;
+
+    return;
+}
+
+void osm_planet_set_decoder(int which)
+{
+    decoder = which;
+
+    return;
+}
+
 int osm_planet_close(struct osm_planet *osf)
 {
-    int bzerror;
+    int ret = 0;
 
-    /* Signal to file read thread and wait for it to exit */
+    /* Signal to file read thread and wait for it to exit. It may be
+     * waiting for a buffer to be drained if the file was not read to the
+     * end. */
+    pthread_mutex_lock(&osf->drained_mutex);
     osf->exit_now = 1;
+    pthread_cond_signal(&osf->drained_signal);
+    pthread_mutex_unlock(&osf->drained_mutex);
     pthread_join(osf->file_read_thread, NULL);
     pthread_detach(osf->file_read_thread);
 
@@ -166,22 +217,18 @@ int osm_planet_close(struct osm_planet *osf)
     pthread_cond_destroy(&osf->drained_signal);
     pthread_cond_destroy(&osf->filled_signal);
 
-    BZ2_bzReadClose(&bzerror, osf->bzfp);
-    if(bzerror != BZ_OK)
-    {
-        fprintf(stderr, "osm_planet_close(): Error closing compressed file with bzip2: %d\n", bzerror);
-        return 1;
-    }
-
-    if(fclose(osf->fp) != 0)
-    {
-        fprintf(stderr, "osm_planet_close(): Error closing file\n");
-        return 1;
-    }
+    BZ2_bzDecompressEnd(&osf->bz);
+    if(osf->bz2)
+        osm_bzip2_close(osf->bz2);
+    if(osf->ra && osm_readahead_close(osf->ra) != 0)
+        ret = 1;
+    /* Still open if recording and the file was not read to the end */
+    if(osf->cache)
+        osm_cache_close(osf->cache, OSM_CACHE_STOPPED);
 
     free(osf->recvbuff);
     free(osf);
-    return 0;
+    return ret;
 }
 
 /* Thread to read from the compressed file and perform bzip2 uncompression */
@@ -205,46 +252,194 @@ static void *start_file_read_thread(void *data)
             break;
 
         /* Decompress up to 900000 bytes into the current buffer and store the
-         * number of bytes actually decoded, which may be less in the unlikely
-         * event that the bzip2 compression hasn't been done with the maximum
-         * block size (which is 900000 bytes). */
-        osf->buff_len[curr] = BZ2_bzRead(&bzerror, osf->bzfp, osf->buff[curr], BLOCK_SIZE);
+         * number of bytes actually decoded, which will be less only at the
+         * end of the file. */
+        if(osf->replay)
+            bzerror = replay(osf, osf->buff[curr], BLOCK_SIZE, &osf->buff_len[curr]);
+        else if(osf->bz2 && !osf->uncompressed)
+            bzerror = decompress_builtin(osf, osf->buff[curr], BLOCK_SIZE, &osf->buff_len[curr]);
+        else
+            bzerror = decompress(osf, osf->buff[curr], BLOCK_SIZE, &osf->buff_len[curr]);
 
         /* Mark the current buffer as filled and signal to the main thread that
          * it is now available for reading. */
         osf->buff_filled[curr] = 1;
-        curr = !curr;
         pthread_mutex_lock(&osf->filled_mutex);
         pthread_cond_signal(&osf->filled_signal);
         pthread_mutex_unlock(&osf->filled_mutex);
 
-        if(bzerror == BZ_STREAM_END) /* end of compression block */
+        /* Record the buffer while it is being read; it is not written
+         * again until the other one has been filled */
+        if(osf->cache && !osf->replay)
+            record(osf, osf->buff[curr], osf->buff_len[curr], bzerror);
+        curr = !curr;
+
+        if(bzerror == BZ_STREAM_END)
+            break;
+        if(bzerror != BZ_OK)
         {
-            void *unused;
-            int num_unused;
+            fprintf(stderr, "Error reading from compressed OSM file: %d\n", bzerror);
+            break;
+        }
+    }
 
-            /* If this is also end of file, then exit now... */
-            if(feof(osf->fp))
+    osf->finished = 1;
+    return NULL;
+}
+
+/* Decompress into a buffer until it is full or the end of the file is
+ * reached, feeding the decompressor with chunks from the readahead
+ * reader. Files made of several concatenated bzip2 streams, as written
+ * by parallel compressors, are decompressed as one, and files that do
+ * not start with the bzip2 signature are taken to be uncompressed XML,
+ * such as osmrail's own output. Returns BZ_OK,
+ * BZ_STREAM_END at the end of the file or a bzip2 error code. */
+static int decompress(struct osm_planet *osf, unsigned char *buff, int size, int *len)
+{
+    osf->bz.next_out = (char *)buff;
+    osf->bz.avail_out = size;
+
+    while(osf->bz.avail_out > 0)
+    {
+        int bzerror;
+
+        if(osf->bz.avail_in == 0)
+        {
+            const unsigned char *data;
+            size_t data_len;
+            int ret = osm_readahead_next(osf->ra, &data, &data_len);
+
+            if(ret == 2)
+            {
+                /* End of file; this is only expected between streams */
+                *len = size - osf->bz.avail_out;
+                return (osf->stream_end || osf->uncompressed) ? BZ_STREAM_END : BZ_UNEXPECTED_EOF;
+            }
+            if(ret != 0)
             {
-                fprintf(stderr, "End of file\n");
-                break;
+                *len = size - osf->bz.avail_out;
+                return BZ_IO_ERROR;
             }
+            osf->bz.next_in = (char *)data;
+            osf->bz.avail_in = data_len;
 
-            /* ...otherwise try reopening the stream to read the next block. */
-            BZ2_bzReadGetUnused(&bzerror, osf->bzfp, &unused, &num_unused);
-            fseek(osf->fp, -num_unused, SEEK_CUR);
-            BZ2_bzReadClose(&bzerror, osf->bzfp);
-            osf->bzfp = BZ2_bzReadOpen(&bzerror, osf->fp, 1, 0, NULL, 0);
+            if( !osf->checked)
+            {
+                osf->uncompressed = data_len < 3 || memcmp(data, "BZh", 3) != 0;
+                osf->checked = 1;
+            }
         }
 
-        if(bzerror != BZ_OK)
+        if(osf->uncompressed)
         {
-            fprintf(stderr, "Error reading from compressed OSM file: %d\n", bzerror);
-            break;
+            unsigned int n = osf->bz.avail_in < osf->bz.avail_out ? osf->bz.avail_in : osf->bz.avail_out;
+
+            memcpy(osf->bz.next_out, osf->bz.next_in, n);
+            osf->bz.next_in += n;
+            osf->bz.avail_in -= n;
+            osf->bz.next_out += n;
+            osf->bz.avail_out -= n;
+            continue;
+        }
+
+        if(osf->stream_end)
+        {
+            /* More data follows the end of a stream, so start the next */
+            BZ2_bzDecompressEnd(&osf->bz);
+            if((bzerror = BZ2_bzDecompressInit(&osf->bz, 0, 0)) != BZ_OK)
+                return bzerror;
+            osf->stream_end = 0;
+        }
+
+        bzerror = BZ2_bzDecompress(&osf->bz);
+        if(bzerror == BZ_STREAM_END)
+            osf->stream_end = 1;
+        else if(bzerror != BZ_OK)
+        {
+            *len = size - osf->bz.avail_out;
+            return bzerror;
         }
     }
+    *len = size;
 
-    fprintf(stderr, "File read thread exiting...\n");
-    osf->finished = 1;
-    return NULL;
+    return BZ_OK;
+}
+
+/* As decompress(), but using the decoder in osm_bzip2.c. The input is
+ * passed to it a whole chunk from the readahead reader at a time. */
+static int decompress_builtin(struct osm_planet *osf, unsigned char *buff, int size, int *len)
+{
+    size_t done = 0;
+
+    while(1)
+    {
+        const unsigned char *data;
+        size_t n, data_len;
+        int ret = osm_bzip2_read(osf->bz2, buff + done, size - done, &n, osf->input_eof);
+
+        done += n;
+        *len = done;
+        if(ret < 0)
+            return BZ_DATA_ERROR;
+        if(ret == 1)
+            return BZ_STREAM_END;
+        if(done == (size_t)size)
+            return BZ_OK;
+
+        /* More input is needed */
+        if((ret = osm_readahead_next(osf->ra, &data, &data_len)) == 2)
+        {
+            osf->input_eof = 1;
+            continue;
+        }
+        if(ret != 0)
+            return BZ_IO_ERROR;
+
+        if( !osf->checked)
+        {
+            osf->checked = 1;
+            if(data_len < 3 || memcmp(data, "BZh", 3) != 0)
+            {
+                /* Not compressed; copy it with decompress() from now on */
+                osf->uncompressed = 1;
+                osf->bz.next_in = (char *)data;
+                osf->bz.avail_in = data_len;
+                return decompress(osf, buff, size, len);
+            }
+        }
+        osm_bzip2_feed(osf->bz2, data, data_len);
+    }
+}
+
+/* As decompress(), but reading the data recorded in the cache the first
+ * time the file was read */
+static int replay(struct osm_planet *osf, unsigned char *buff, int size, int *len)
+{
+    size_t n;
+    int ret = osm_cache_read(osf->cache, buff, size, &n);
+
+    *len = n;
+    if(ret == 2)
+        return BZ_STREAM_END;
+
+    return ret == 0 ? BZ_OK : BZ_IO_ERROR;
+}
+
+/* Add a buffer of decompressed data to the cache. The recording is
+ * complete at the end of the file, and is dropped on an error or if the
+ * file turns out not to be compressed, as reading it again is as quick. */
+static void record(struct osm_planet *osf, const unsigned char *buff, int len, int bzerror)
+{
+    int end = (bzerror == BZ_STREAM_END) ? OSM_CACHE_COMPLETE : OSM_CACHE_DROPPED;
+
+    if(osf->uncompressed || (bzerror != BZ_OK && end != OSM_CACHE_COMPLETE)
+       || (len > 0 && osm_cache_write(osf->cache, buff, len) != 0))
+        end = OSM_CACHE_DROPPED;
+    else if(end != OSM_CACHE_COMPLETE)
+        return;
+
+    osm_cache_close(osf->cache, end);
+    osf->cache = NULL;
+
+    return;
 }
@@ -0,0 +1,581 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Sequential file reader keeping several large reads in flight. The file
+ * is read in chunks through a ring of buffers: chunk k is read into slot
+ * k % depth, and as soon as the caller has finished with a chunk its slot
+ * is reused for the chunk depth places further on. Reads are submitted
+ * with io_uring where the kernel allows it, otherwise they are performed
+ * with pread() by a small pool of threads. Files that cannot be read at
+ * an offset, such as pipes, are read one chunk at a time. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+#include "osm.h"
+
+#define MAX_DEPTH   64
+#define MAX_THREADS 16
+
+/* Read methods */
+#define METHOD_SYNC    0 /**< read() in the calling thread */
+#define METHOD_THREADS 1 /**< pread() by a pool of threads */
+#define METHOD_URING   2 /**< io_uring */
+
+static const char *method_names[] = { "read", "pread threads", "io_uring" };
+
+#define SLOT_FREE    0
+#define SLOT_PENDING 1 /**< Read submitted */
+#define SLOT_DONE    2 /**< Read complete, or failed if len < 0 */
+
+struct readahead_slot
+{
+    unsigned char *buf;
+    struct iovec iov;
+    off_t offset;
+    size_t size;    /**< Number of bytes requested */
+    ssize_t len;    /**< Number of bytes read, or -errno */
+    int state;
+};
+
+struct osm_readahead
+{
+    int fd;
+    char *filename;
+    int method;
+    int depth;
+    size_t read_size;
+    off_t file_size;
+    off_t next_offset;   /**< Offset of the next read to be submitted */
+
+    struct readahead_slot *slots;
+    int next;            /**< Slot holding the next chunk of the file */
+    int returned;        /**< Slot returned by the last call, or -1 */
+    char eof;
+
+    /* Statistics */
+    double stall_time;   /**< Time spent waiting for reads to complete */
+    uint64_t bytes;
+
+    /* Thread pool; slots are read in the order they were queued */
+    pthread_t *threads;
+    int nthreads;
+    int *queue;
+    int queue_start, queue_len;
+    char exit_now;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_signal, done_signal;
+
+#ifdef __NR_io_uring_setup
+    /* io_uring submission and completion rings */
+    int ring_fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+#endif
+};
+
+/* Whether osm_readahead_close() prints the read statistics */
+static int verbose;
+
+static int uring_init(struct osm_readahead *);
+static void uring_submit(struct osm_readahead *, int slot);
+static int uring_reap(struct osm_readahead *);
+static void uring_exit(struct osm_readahead *);
+static void *start_read_thread(void *);
+static void submit_read(struct osm_readahead *, int slot);
+static void finish_read(struct readahead_slot *, ssize_t len);
+static double now(void);
+
+struct osm_readahead *osm_readahead_open(const char *filename, int depth, size_t read_size)
+{
+    struct osm_readahead *ra = calloc(1, sizeof(struct osm_readahead));
+    struct stat st;
+    int i;
+
+    if((ra->fd = open(filename, O_RDONLY)) < 0)
+    {
+        fprintf(stderr, "osm_readahead_open(): Unable to open file <%s>: %s\n", filename,
+                strerror(errno));
+        free(ra);
+        return NULL;
+    }
+    ra->filename = strdup(filename);
+    ra->read_size = read_size < 4096 ? 4096 : read_size;
+    ra->depth = depth < 1 ? 1 : (depth > MAX_DEPTH ? MAX_DEPTH : depth);
+    ra->returned = -1;
+
+    if(fstat(ra->fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        /* Not seekable; read one chunk at a time */
+        ra->method = METHOD_SYNC;
+        ra->depth = 1;
+    }
+    else
+    {
+        ra->file_size = st.st_size;
+        posix_fadvise(ra->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        ra->method = uring_init(ra) ? METHOD_URING : METHOD_THREADS;
+    }
+
+    ra->slots = calloc(ra->depth, sizeof(struct readahead_slot));
+    for(i = 0; i < ra->depth; i++)
+    {
+        if(posix_memalign((void **)&ra->slots[i].buf, 4096, ra->read_size) != 0)
+        {
+            fprintf(stderr, "osm_readahead_open(): Unable to allocate read buffers\n");
+            osm_readahead_close(ra);
+            return NULL;
+        }
+    }
+
+    if(ra->method == METHOD_THREADS)
+    {
+        ra->queue = malloc(ra->depth * sizeof(int));
+        pthread_mutex_init(&ra->mutex, NULL);
+        pthread_cond_init(&ra->work_signal, NULL);
+        pthread_cond_init(&ra->done_signal, NULL);
+        ra->threads = malloc(MAX_THREADS * sizeof(pthread_t));
+        while(ra->nthreads < ra->depth && ra->nthreads < MAX_THREADS)
+        {
+            if(pthread_create(&ra->threads[ra->nthreads], NULL, start_read_thread, ra) != 0)
+                break;
+            ra->nthreads++;
+        }
+        if(ra->nthreads == 0)
+        {
+            fprintf(stderr, "osm_readahead_open(): Unable to start read threads\n");
+            osm_readahead_close(ra);
+            return NULL;
+        }
+    }
+
+    /* Start the first reads */
+    for(i = 0; i < ra->depth; i++)
+        submit_read(ra, i);
+
+    return ra;
+}
+
+int osm_readahead_next(struct osm_readahead *ra, const unsigned char **data, size_t *len)
+{
+    struct readahead_slot *slot;
+
+    /* The caller has finished with the previous chunk, so its slot can be
+     * reused to read further ahead */
+    if(ra->returned >= 0)
+    {
+        submit_read(ra, ra->returned);
+        ra->returned = -1;
+    }
+    if(ra->eof)
+        return 2;
+
+    slot = &ra->slots[ra->next];
+    if(slot->state == SLOT_FREE)
+    {
+        /* Nothing more was submitted, so the end of the file is reached */
+        ra->eof = 1;
+        return 2;
+    }
+
+    /* Wait for the read to complete if necessary */
+    if(ra->method == METHOD_URING && slot->state != SLOT_DONE)
+    {
+        double start = now();
+
+        while(slot->state != SLOT_DONE)
+        {
+            if( !uring_reap(ra))
+                return 1;
+        }
+        ra->stall_time += now() - start;
+    }
+    else if(ra->method == METHOD_THREADS)
+    {
+        pthread_mutex_lock(&ra->mutex);
+        if(slot->state != SLOT_DONE)
+        {
+            double start = now();
+
+            while(slot->state != SLOT_DONE)
+                pthread_cond_wait(&ra->done_signal, &ra->mutex);
+            ra->stall_time += now() - start;
+        }
+        pthread_mutex_unlock(&ra->mutex);
+    }
+
+    if(slot->len < 0)
+    {
+        fprintf(stderr, "osm_readahead_next(): Error reading <%s>: %s\n", ra->filename,
+                strerror(-slot->len));
+        return 1;
+    }
+    if(slot->len == 0)
+    {
+        ra->eof = 1;
+        return 2;
+    }
+
+    *data = slot->buf;
+    *len = slot->len;
+    ra->bytes += slot->len;
+    slot->state = SLOT_FREE;
+    ra->returned = ra->next;
+    ra->next = (ra->next + 1) % ra->depth;
+
+    return 0;
+}
+
+void osm_readahead_set_verbose(int on)
+{
+    verbose = on;
+
+    return;
+}
+
+int osm_readahead_close(struct osm_readahead *ra)
+{
+    int i, ret = 0;
+
+    if(ra->method == METHOD_THREADS && ra->threads)
+    {
+        pthread_mutex_lock(&ra->mutex);
+        ra->exit_now = 1;
+        pthread_cond_broadcast(&ra->work_signal);
+        pthread_mutex_unlock(&ra->mutex);
+        for(i = 0; i < ra->nthreads; i++)
+            pthread_join(ra->threads[i], NULL);
+        free(ra->threads);
+        free(ra->queue);
+        pthread_mutex_destroy(&ra->mutex);
+        pthread_cond_destroy(&ra->work_signal);
+        pthread_cond_destroy(&ra->done_signal);
+    }
+    if(ra->method == METHOD_URING)
+    {
+        /* Wait for reads still in flight before freeing their buffers */
+        for(i = 0; i < ra->depth; i++)
+        {
+            while(ra->slots[i].state == SLOT_PENDING)
+            {
+                if( !uring_reap(ra))
+                    break;
+            }
+        }
+        uring_exit(ra);
+    }
+
+    if(verbose)
+        fprintf(stderr, "Read %.1f MB of <%s> with %s, %d x %zu kB in flight; stalled for %.2f s\n",
+                ra->bytes / 1e6, ra->filename, method_names[ra->method], ra->depth, ra->read_size / 1024,
+                ra->stall_time);
+
+    if(ra->slots)
+    {
+        for(i = 0; i < ra->depth; i++)
+            free(ra->slots[i].buf);
+        free(ra->slots);
+    }
+    if(close(ra->fd) != 0)
+    {
+        fprintf(stderr, "osm_readahead_close(): Error closing file\n");
+        ret = 1;
+    }
+    free(ra->filename);
+    free(ra);
+
+    return ret;
+}
+
+/* Start reading the next chunk of the file into a slot, if there is any
+ * of the file left */
+static void submit_read(struct osm_readahead *ra, int i)
+{
+    struct readahead_slot *slot = &ra->slots[i];
+
+    if(ra->method == METHOD_SYNC)
+    {
+        /* Read now, as the data will be needed next anyway */
+        double start = now();
+        ssize_t len = read(ra->fd, slot->buf, ra->read_size);
+
+        ra->stall_time += now() - start;
+        slot->size = ra->read_size;
+        finish_read(slot, len < 0 ? -errno : len);
+        return;
+    }
+
+    if(ra->next_offset >= ra->file_size)
+        return;
+
+    slot->offset = ra->next_offset;
+    slot->size = ra->read_size;
+    if(slot->offset + slot->size > ra->file_size)
+        slot->size = ra->file_size - slot->offset;
+    ra->next_offset += slot->size;
+    slot->state = SLOT_PENDING;
+
+    if(ra->method == METHOD_URING)
+        uring_submit(ra, i);
+    else
+    {
+        pthread_mutex_lock(&ra->mutex);
+        ra->queue[(ra->queue_start + ra->queue_len++) % ra->depth] = i;
+        pthread_cond_signal(&ra->work_signal);
+        pthread_mutex_unlock(&ra->mutex);
+    }
+
+    return;
+}
+
+/* Record the result of a read */
+static void finish_read(struct readahead_slot *slot, ssize_t len)
+{
+    slot->len = len;
+    slot->state = SLOT_DONE;
+
+    return;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Thread performing the reads queued by submit_read() */
+static void *start_read_thread(void *data)
+{
+    struct osm_readahead *ra = data;
+
+    pthread_mutex_lock(&ra->mutex);
+    while(1)
+    {
+        struct readahead_slot *slot;
+        size_t done = 0;
+        ssize_t len = 0;
+
+        while( !ra->queue_len && !ra->exit_now)
+            pthread_cond_wait(&ra->work_signal, &ra->mutex);
+        if(ra->exit_now)
+            break;
+        slot = &ra->slots[ra->queue[ra->queue_start]];
+        ra->queue_start = (ra->queue_start + 1) % ra->depth;
+        ra->queue_len--;
+        pthread_mutex_unlock(&ra->mutex);
+
+        while(done < slot->size)
+        {
+            if((len = pread(ra->fd, slot->buf + done, slot->size - done, slot->offset + done)) <= 0)
+                break;
+            done += len;
+        }
+
+        pthread_mutex_lock(&ra->mutex);
+        finish_read(slot, len < 0 ? -errno : (ssize_t)done);
+        pthread_cond_broadcast(&ra->done_signal);
+    }
+    pthread_mutex_unlock(&ra->mutex);
+
+    return NULL;
+}
+
+#ifdef __NR_io_uring_setup
+
+/* Set up an io_uring instance, without liburing. Returns 0 if io_uring
+ * is not available, e.g. on old kernels or where it is disabled. */
+static int uring_init(struct osm_readahead *ra)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    if((ra->ring_fd = syscall(__NR_io_uring_setup, ra->depth, &params)) < 0)
+        return 0;
+
+    ra->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ra->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(ra->cq_size > ra->sq_size)
+            ra->sq_size = ra->cq_size;
+        ra->cq_size = 0;
+    }
+    ra->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ra->sq_ptr = mmap(NULL, ra->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ra->ring_fd, IORING_OFF_SQ_RING);
+    ra->cq_ptr = ra->sq_ptr;
+    if(ra->sq_ptr != MAP_FAILED && ra->cq_size)
+        ra->cq_ptr = mmap(NULL, ra->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ra->ring_fd, IORING_OFF_CQ_RING);
+    ra->sqes = mmap(NULL, ra->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ra->ring_fd, IORING_OFF_SQES);
+    if(ra->sq_ptr == MAP_FAILED || ra->cq_ptr == MAP_FAILED || ra->sqes == MAP_FAILED)
+    {
+        if(ra->sqes != MAP_FAILED)
+            munmap(ra->sqes, ra->sqes_size);
+        if(ra->cq_size && ra->cq_ptr != MAP_FAILED)
+            munmap(ra->cq_ptr, ra->cq_size);
+        if(ra->sq_ptr != MAP_FAILED)
+            munmap(ra->sq_ptr, ra->sq_size);
+        close(ra->ring_fd);
+        return 0;
+    }
+
+    ra->sq_head = (unsigned *)((char *)ra->sq_ptr + params.sq_off.head);
+    ra->sq_tail = (unsigned *)((char *)ra->sq_ptr + params.sq_off.tail);
+    ra->sq_mask = (unsigned *)((char *)ra->sq_ptr + params.sq_off.ring_mask);
+    ra->sq_array = (unsigned *)((char *)ra->sq_ptr + params.sq_off.array);
+    ra->cq_head = (unsigned *)((char *)ra->cq_ptr + params.cq_off.head);
+    ra->cq_tail = (unsigned *)((char *)ra->cq_ptr + params.cq_off.tail);
+    ra->cq_mask = (unsigned *)((char *)ra->cq_ptr + params.cq_off.ring_mask);
+    ra->cqes = (struct io_uring_cqe *)((char *)ra->cq_ptr + params.cq_off.cqes);
+
+    return 1;
+}
+
+/* Submit a read of a slot's chunk. There are never more reads in flight
+ * than slots, so the rings cannot overflow. */
+static void uring_submit(struct osm_readahead *ra, int i)
+{
+    struct readahead_slot *slot = &ra->slots[i];
+    unsigned tail = *ra->sq_tail, index = tail & *ra->sq_mask;
+    struct io_uring_sqe *sqe = &ra->sqes[index];
+
+    slot->iov.iov_base = slot->buf;
+    slot->iov.iov_len = slot->size;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = ra->fd;
+    sqe->addr = (uintptr_t)&slot->iov;
+    sqe->len = 1;
+    sqe->off = slot->offset;
+    sqe->user_data = i;
+    ra->sq_array[index] = index;
+    __atomic_store_n(ra->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    /* If this fails, the read stays in the ring and is submitted again
+     * by uring_reap() */
+    syscall(__NR_io_uring_enter, ra->ring_fd, 1, 0, 0, NULL, 0);
+
+    return;
+}
+
+/* Wait for at least one read to complete and record the results of all
+ * completed reads. Returns 0 on error. */
+static int uring_reap(struct osm_readahead *ra)
+{
+    unsigned head = *ra->cq_head, unsubmitted;
+    int reaped = 0;
+
+    while( !reaped)
+    {
+        while(head != __atomic_load_n(ra->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &ra->cqes[head & *ra->cq_mask];
+            struct readahead_slot *slot = &ra->slots[cqe->user_data];
+            ssize_t len = cqe->res;
+
+            /* Complete a short read synchronously */
+            while(len > 0 && (size_t)len < slot->size)
+            {
+                ssize_t more = pread(ra->fd, slot->buf + len, slot->size - len, slot->offset + len);
+
+                if(more <= 0)
+                    break;
+                len += more;
+            }
+            finish_read(slot, len);
+            head++;
+            reaped = 1;
+        }
+        __atomic_store_n(ra->cq_head, head, __ATOMIC_RELEASE);
+
+        if(reaped)
+            break;
+        unsubmitted = *ra->sq_tail - __atomic_load_n(ra->sq_head, __ATOMIC_ACQUIRE);
+        if(syscall(__NR_io_uring_enter, ra->ring_fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+           && errno != EINTR && errno != EAGAIN)
+        {
+            fprintf(stderr, "osm_readahead_next(): io_uring_enter() failed: %s\n", strerror(errno));
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void uring_exit(struct osm_readahead *ra)
+{
+    munmap(ra->sqes, ra->sqes_size);
+    if(ra->cq_size)
+        munmap(ra->cq_ptr, ra->cq_size);
+    munmap(ra->sq_ptr, ra->sq_size);
+    close(ra->ring_fd);
+
+    return;
+}
+
+#else /* io_uring not available at compile time */
+
+static int uring_init(struct osm_readahead *ra)
+{
+    return 0;
+}
+
+static void uring_submit(struct osm_readahead *ra, int i)
+{
+    return;
+}
+
+static int uring_reap(struct osm_readahead *ra)
+{
+    return 0;
+}
+
+static void uring_exit(struct osm_readahead *ra)
+{
+    return;
+}
+
+#endif
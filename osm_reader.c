@@ -0,0 +1,713 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Pull interface to the parsers, and column-oriented element batches.
+ * Elements delivered by the XML or PBF parser are appended to one of
+ * three batches, one per element type, and a batch is handed to the
+ * caller once it is full or elements of a different type start to
+ * arrive. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "osm.h"
+
+#define BATCH_SIZE 4096 /**< Number of elements after which a batch is returned */
+
+/* Allocated sizes of the columns of a batch, and storage for the elements
+ * returned by osm_batch_node() etc. */
+struct osm_batch_priv
+{
+    int max_elements;
+    int tag_count, max_tags;
+    int member_count, max_members;
+    size_t max_strings;
+    int max_raw_offsets;
+    size_t max_raw;
+
+    struct osm_node node;
+    struct osm_way way;
+    struct osm_relation relation;
+    int max_node_tags, max_way_tags, max_relation_tags;
+    int max_relation_nodes, max_relation_ways;
+};
+
+struct osm_reader
+{
+    struct osm_parse *parse;
+    struct osm_planet *osf; /**< XML input, or NULL */
+    struct osm_pbf *pbf;    /**< PBF input, or NULL */
+    struct osm_seek *sk;    /**< XML input positioned by the caller, or NULL */
+    int eof;
+    char keep_raw; /**< Boolean; see osm_reader_set_raw() */
+    char stop;     /**< Boolean; see osm_reader_stop() */
+
+    osm_filter_callback_t *filter; /**< Caller's filter from the projection */
+    void *filter_data;
+
+    struct osm_batch *batch[3];
+    char queued[3];  /**< Boolean; batch of this type is waiting to be returned */
+    int queue[3];    /**< Types of batches waiting to be returned, in order */
+    int queue_len;
+    int returned;    /**< Type of batch returned by the last call, or -1 */
+};
+
+static osm_filter_callback_t   reader_filter;
+static osm_node_callback_t     read_node;
+static osm_way_callback_t      read_way;
+static osm_relation_callback_t read_relation;
+static struct osm_reader *new_reader(int types, const struct osm_projection *proj, void *data);
+static void add_raw(struct osm_batch *, struct osm_parse *);
+static void copy_tags(const struct osm_batch *, int i, struct osm_tag **tags, int *count, int *max);
+static void *copy_column(const void *src, size_t size);
+
+struct osm_reader *osm_reader_open(const char *filename, int types,
+                                   const struct osm_projection *proj, void *data)
+{
+    struct osm_reader *reader = new_reader(types, proj, data);
+    size_t len = strlen(filename);
+
+    if(len > 4 && strcmp(filename + len - 4, ".pbf") == 0)
+        reader->pbf = osm_pbf_open(filename);
+    else
+        reader->osf = osm_planet_open(filename);
+
+    if( !reader->pbf && !reader->osf)
+    {
+        osm_reader_close(reader);
+        return NULL;
+    }
+
+    return reader;
+}
+
+struct osm_reader *osm_reader_open_seek(struct osm_seek *sk, int types,
+                                        const struct osm_projection *proj, void *data)
+{
+    struct osm_reader *reader = new_reader(types, proj, data);
+
+    reader->sk = sk;
+    osm_parse_resume(reader->parse);
+
+    return reader;
+}
+
+static struct osm_reader *new_reader(int types, const struct osm_projection *proj, void *data)
+{
+    struct osm_reader *reader = calloc(1, sizeof(struct osm_reader));
+    struct osm_projection parse_proj = *proj;
+    int ele;
+
+    reader->parse = osm_parse_init((types & OSM_NODES) ? read_node : NULL,
+                                   (types & OSM_WAYS) ? read_way : NULL,
+                                   (types & OSM_RELATIONS) ? read_relation : NULL, reader);
+    if(proj->filter)
+    {
+        reader->filter = proj->filter;
+        reader->filter_data = data;
+        parse_proj.filter = reader_filter;
+    }
+    osm_parse_set_projection(reader->parse, &parse_proj);
+
+    for(ele = OSM_NODE; ele <= OSM_RELATION; ele++)
+        reader->batch[ele] = osm_batch_new(ele);
+    reader->returned = -1;
+
+    return reader;
+}
+
+static int reader_filter(int type, unsigned int id, void *data)
+{
+    struct osm_reader *reader = data;
+
+    return reader->filter(type, id, reader->filter_data);
+}
+
+static void queue_batch(struct osm_reader *reader, int type)
+{
+    if( !reader->queued[type])
+    {
+        reader->queued[type] = 1;
+        reader->queue[reader->queue_len++] = type;
+    }
+
+    return;
+}
+
+int osm_reader_next(struct osm_reader *reader, struct osm_batch **batch)
+{
+    int type;
+
+    /* The batch returned last time is no longer needed by the caller */
+    if(reader->returned >= 0)
+    {
+        osm_batch_clear(reader->batch[reader->returned]);
+        reader->queued[reader->returned] = 0;
+        reader->returned = -1;
+    }
+
+    while(reader->queue_len == 0)
+    {
+        int ret;
+
+        if(reader->stop && !reader->eof)
+        {
+            /* Deliver any element held back, as at the end of the file */
+            osm_parse_flush(reader->parse);
+            reader->eof = 1;
+        }
+        if(reader->eof)
+        {
+            for(type = OSM_NODE; type <= OSM_RELATION; type++)
+            {
+                if(reader->batch[type]->count > 0)
+                    queue_batch(reader, type);
+            }
+            if(reader->queue_len == 0)
+                return 2;
+            break;
+        }
+
+        if(reader->pbf)
+            ret = osm_pbf_ingest(reader->pbf, reader->parse);
+        else
+        {
+            char *line;
+
+            if(reader->sk)
+                ret = osm_seek_readln(reader->sk, &line);
+            else
+                ret = osm_planet_readln(reader->osf, &line);
+            /* Stop reading when either EOF or logical end of data occurs,
+             * whichever is sooner */
+            if(ret == 0 && osm_parse_ingest(reader->parse, line) == 1)
+                ret = 2;
+        }
+
+        if(ret == 1) /* error */
+            return 1;
+        if(ret == 2)
+        {
+            osm_parse_flush(reader->parse);
+            reader->eof = 1;
+        }
+    }
+
+    type = reader->queue[0];
+    reader->queue_len--;
+    memmove(reader->queue, reader->queue + 1, reader->queue_len * sizeof(int));
+
+    reader->returned = type;
+    *batch = reader->batch[type];
+
+    return 0;
+}
+
+void osm_reader_set_history(struct osm_reader *reader, long long as_of)
+{
+    osm_parse_set_history(reader->parse, as_of);
+
+    return;
+}
+
+void osm_reader_set_raw(struct osm_reader *reader, int strip_metadata)
+{
+    osm_parse_set_raw(reader->parse, strip_metadata);
+    reader->keep_raw = 1;
+
+    return;
+}
+
+void osm_reader_stop(struct osm_reader *reader)
+{
+    reader->stop = 1;
+
+    return;
+}
+
+int osm_reader_close(struct osm_reader *reader)
+{
+    int ret = 0, ele;
+
+    if(reader->pbf && osm_pbf_close(reader->pbf) != 0)
+        ret = 1;
+    if(reader->osf && osm_planet_close(reader->osf) != 0)
+        ret = 1;
+    osm_parse_destroy(reader->parse);
+
+    for(ele = OSM_NODE; ele <= OSM_RELATION; ele++)
+        osm_batch_free(reader->batch[ele]);
+    free(reader);
+
+    return ret;
+}
+
+/* Called before an element of interest is added to the batch for its type.
+ * Any batches of other types are complete, as the input holds all elements
+ * of one type before the next. */
+static void add_element(struct osm_reader *reader, int type)
+{
+    int ele;
+
+    for(ele = OSM_NODE; ele <= OSM_RELATION; ele++)
+    {
+        if(ele != type && reader->batch[ele]->count > 0)
+            queue_batch(reader, ele);
+    }
+
+    return;
+}
+
+/* Callbacks called by the parser for each element of interest */
+static void read_node(struct osm_node *node, void *data)
+{
+    struct osm_reader *reader = data;
+
+    add_element(reader, OSM_NODE);
+    osm_batch_add_node(reader->batch[OSM_NODE], node);
+    if(reader->keep_raw)
+        add_raw(reader->batch[OSM_NODE], reader->parse);
+    if(reader->batch[OSM_NODE]->count >= BATCH_SIZE)
+        queue_batch(reader, OSM_NODE);
+
+    return;
+}
+
+static void read_way(struct osm_way *way, void *data)
+{
+    struct osm_reader *reader = data;
+
+    add_element(reader, OSM_WAY);
+    osm_batch_add_way(reader->batch[OSM_WAY], way);
+    if(reader->keep_raw)
+        add_raw(reader->batch[OSM_WAY], reader->parse);
+    if(reader->batch[OSM_WAY]->count >= BATCH_SIZE)
+        queue_batch(reader, OSM_WAY);
+
+    return;
+}
+
+static void read_relation(struct osm_relation *rel, void *data)
+{
+    struct osm_reader *reader = data;
+
+    add_element(reader, OSM_RELATION);
+    osm_batch_add_relation(reader->batch[OSM_RELATION], rel);
+    if(reader->keep_raw)
+        add_raw(reader->batch[OSM_RELATION], reader->parse);
+    if(reader->batch[OSM_RELATION]->count >= BATCH_SIZE)
+        queue_batch(reader, OSM_RELATION);
+
+    return;
+}
+
+/* Batches */
+
+struct osm_batch *osm_batch_new(int type)
+{
+    struct osm_batch *b = calloc(1, sizeof(struct osm_batch));
+
+    b->type = type;
+    b->priv = calloc(1, sizeof(struct osm_batch_priv));
+    b->priv->max_strings = 4096;
+    b->strings = malloc(b->priv->max_strings);
+    osm_batch_clear(b);
+
+    return b;
+}
+
+void osm_batch_clear(struct osm_batch *b)
+{
+    b->count = 0;
+    b->priv->tag_count = 0;
+    b->priv->member_count = 0;
+
+    /* Empty strings all refer to offset 0 */
+    b->strings[0] = '\0';
+    b->strings_len = 1;
+    b->raw_len = 0;
+
+    return;
+}
+
+void osm_batch_free(struct osm_batch *b)
+{
+    struct osm_batch_priv *priv = b->priv;
+
+    free(b->ids);
+    free(b->versions);
+    free(b->lat);
+    free(b->lon);
+    free(b->tag_offsets);
+    free(b->tag_keys);
+    free(b->tag_values);
+    free(b->member_offsets);
+    free(b->member_ids);
+    free(b->member_types);
+    free(b->member_roles);
+    free(b->strings);
+    free(b->raw_offsets);
+    free(b->raw);
+
+    free(priv->node.tags);
+    free(priv->way.tags);
+    free(priv->relation.nodes);
+    free(priv->relation.node_roles);
+    free(priv->relation.ways);
+    free(priv->relation.way_roles);
+    free(priv->relation.tags);
+    free(priv);
+    free(b);
+
+    return;
+}
+
+/* Make room for another element in a batch and record its ID */
+static void begin_element(struct osm_batch *b, unsigned int id, unsigned int version)
+{
+    struct osm_batch_priv *priv = b->priv;
+
+    if(b->count >= priv->max_elements)
+    {
+        priv->max_elements = priv->max_elements ? priv->max_elements * 2 : BATCH_SIZE;
+        b->ids = realloc(b->ids, priv->max_elements * sizeof(unsigned int));
+        b->versions = realloc(b->versions, priv->max_elements * sizeof(unsigned int));
+        b->tag_offsets = realloc(b->tag_offsets, (priv->max_elements + 1) * sizeof(uint32_t));
+        if(b->type == OSM_NODE)
+        {
+            b->lat = realloc(b->lat, priv->max_elements * sizeof(int32_t));
+            b->lon = realloc(b->lon, priv->max_elements * sizeof(int32_t));
+        }
+        else
+            b->member_offsets = realloc(b->member_offsets, (priv->max_elements + 1) * sizeof(uint32_t));
+    }
+
+    b->ids[b->count] = id;
+    b->versions[b->count] = version;
+    b->tag_offsets[0] = 0;
+    if(b->member_offsets)
+        b->member_offsets[0] = 0;
+
+    return;
+}
+
+static void end_element(struct osm_batch *b)
+{
+    b->count++;
+    b->tag_offsets[b->count] = b->priv->tag_count;
+    if(b->member_offsets)
+        b->member_offsets[b->count] = b->priv->member_count;
+
+    return;
+}
+
+/* Attach the text of the element just added to a batch, if the parser
+ * kept it. Called for every element once the reader keeps text, so that
+ * an element without text has an empty span. */
+static void add_raw(struct osm_batch *b, struct osm_parse *parse)
+{
+    struct osm_batch_priv *priv = b->priv;
+    size_t len;
+    const char *text = osm_parse_raw(parse, &len);
+
+    if(priv->max_raw_offsets < priv->max_elements + 1)
+    {
+        priv->max_raw_offsets = priv->max_elements + 1;
+        b->raw_offsets = realloc(b->raw_offsets, priv->max_raw_offsets * sizeof(uint32_t));
+    }
+    if(b->raw_len + len > priv->max_raw)
+    {
+        while(b->raw_len + len > priv->max_raw)
+            priv->max_raw = priv->max_raw ? priv->max_raw * 2 : 65536;
+        b->raw = realloc(b->raw, priv->max_raw);
+    }
+    if(len > 0)
+        memcpy(b->raw + b->raw_len, text, len);
+    b->raw_offsets[b->count - 1] = b->raw_len;
+    b->raw_len += len;
+    b->raw_offsets[b->count] = b->raw_len;
+
+    return;
+}
+
+/* Copy a string into the string arena and return its offset */
+static uint32_t add_string(struct osm_batch *b, const char *str)
+{
+    size_t len = strlen(str) + 1, offset = b->strings_len;
+
+    if(len == 1)
+        return 0;
+
+    if(b->strings_len + len > b->priv->max_strings)
+    {
+        while(b->strings_len + len > b->priv->max_strings)
+            b->priv->max_strings *= 2;
+        b->strings = realloc(b->strings, b->priv->max_strings);
+    }
+    memcpy(b->strings + offset, str, len);
+    b->strings_len += len;
+
+    return offset;
+}
+
+static void add_tags(struct osm_batch *b, struct osm_tag *tags, int count)
+{
+    struct osm_batch_priv *priv = b->priv;
+    int t;
+
+    if(priv->tag_count + count > priv->max_tags)
+    {
+        while(priv->tag_count + count > priv->max_tags)
+            priv->max_tags = priv->max_tags ? priv->max_tags * 2 : BATCH_SIZE;
+        b->tag_keys = realloc(b->tag_keys, priv->max_tags * sizeof(uint32_t));
+        b->tag_values = realloc(b->tag_values, priv->max_tags * sizeof(uint32_t));
+    }
+
+    for(t = 0; t < count; t++)
+    {
+        b->tag_keys[priv->tag_count] = add_string(b, tags[t].key);
+        b->tag_values[priv->tag_count] = add_string(b, tags[t].value);
+        priv->tag_count++;
+    }
+
+    return;
+}
+
+static void ensure_members(struct osm_batch *b, int count)
+{
+    struct osm_batch_priv *priv = b->priv;
+
+    if(priv->member_count + count > priv->max_members)
+    {
+        while(priv->member_count + count > priv->max_members)
+            priv->max_members = priv->max_members ? priv->max_members * 2 : 4 * BATCH_SIZE;
+        b->member_ids = realloc(b->member_ids, priv->max_members * sizeof(unsigned int));
+        if(b->type == OSM_RELATION)
+        {
+            b->member_types = realloc(b->member_types, priv->max_members);
+            b->member_roles = realloc(b->member_roles, priv->max_members * sizeof(uint32_t));
+        }
+    }
+
+    return;
+}
+
+void osm_batch_add_node(struct osm_batch *b, struct osm_node *node)
+{
+    begin_element(b, node->id, node->version);
+    b->lat[b->count] = (int32_t)lround(node->lat * 1e7);
+    b->lon[b->count] = (int32_t)lround(node->lon * 1e7);
+    add_tags(b, node->tags, node->tag_count);
+    end_element(b);
+
+    return;
+}
+
+void osm_batch_add_way(struct osm_batch *b, struct osm_way *way)
+{
+    begin_element(b, way->id, way->version);
+    ensure_members(b, way->node_count);
+    memcpy(b->member_ids + b->priv->member_count, way->nodes, way->node_count * sizeof(unsigned int));
+    b->priv->member_count += way->node_count;
+    add_tags(b, way->tags, way->tag_count);
+    end_element(b);
+
+    return;
+}
+
+void osm_batch_add_relation(struct osm_batch *b, struct osm_relation *rel)
+{
+    struct osm_batch_priv *priv = b->priv;
+    int m;
+
+    begin_element(b, rel->id, rel->version);
+    ensure_members(b, rel->node_count + rel->way_count);
+    for(m = 0; m < rel->node_count; m++)
+    {
+        b->member_ids[priv->member_count] = rel->nodes[m];
+        b->member_types[priv->member_count] = OSM_NODE;
+        b->member_roles[priv->member_count] = add_string(b, rel->node_roles[m]);
+        priv->member_count++;
+    }
+    for(m = 0; m < rel->way_count; m++)
+    {
+        b->member_ids[priv->member_count] = rel->ways[m];
+        b->member_types[priv->member_count] = OSM_WAY;
+        b->member_roles[priv->member_count] = add_string(b, rel->way_roles[m]);
+        priv->member_count++;
+    }
+    add_tags(b, rel->tags, rel->tag_count);
+    end_element(b);
+
+    return;
+}
+
+struct osm_batch *osm_batch_copy(const struct osm_batch *batch)
+{
+    struct osm_batch *copy = calloc(1, sizeof(struct osm_batch));
+    struct osm_batch_priv *priv = calloc(1, sizeof(struct osm_batch_priv));
+    int tags = batch->tag_offsets[batch->count];
+
+    copy->priv = priv;
+    copy->type = batch->type;
+    copy->count = priv->max_elements = batch->count;
+    copy->ids = copy_column(batch->ids, batch->count * sizeof(unsigned int));
+    copy->versions = copy_column(batch->versions, batch->count * sizeof(unsigned int));
+    copy->tag_offsets = copy_column(batch->tag_offsets, (batch->count + 1) * sizeof(uint32_t));
+    copy->tag_keys = copy_column(batch->tag_keys, tags * sizeof(uint32_t));
+    copy->tag_values = copy_column(batch->tag_values, tags * sizeof(uint32_t));
+    priv->tag_count = priv->max_tags = tags;
+    copy->strings_len = priv->max_strings = batch->strings_len;
+    copy->strings = copy_column(batch->strings, batch->strings_len);
+    if(batch->raw_offsets)
+    {
+        copy->raw_offsets = copy_column(batch->raw_offsets, (batch->count + 1) * sizeof(uint32_t));
+        copy->raw = copy_column(batch->raw, batch->raw_len);
+        copy->raw_len = priv->max_raw = batch->raw_len;
+        priv->max_raw_offsets = batch->count + 1;
+    }
+
+    if(batch->type == OSM_NODE)
+    {
+        copy->lat = copy_column(batch->lat, batch->count * sizeof(int32_t));
+        copy->lon = copy_column(batch->lon, batch->count * sizeof(int32_t));
+    }
+    else
+    {
+        int members = batch->member_offsets[batch->count];
+
+        copy->member_offsets = copy_column(batch->member_offsets, (batch->count + 1) * sizeof(uint32_t));
+        copy->member_ids = copy_column(batch->member_ids, members * sizeof(unsigned int));
+        if(batch->type == OSM_RELATION)
+        {
+            copy->member_types = copy_column(batch->member_types, members);
+            copy->member_roles = copy_column(batch->member_roles, members * sizeof(uint32_t));
+        }
+        priv->member_count = priv->max_members = members;
+    }
+
+    return copy;
+}
+
+static void *copy_column(const void *src, size_t size)
+{
+    void *dest;
+
+    if( !src)
+        return NULL;
+    /* Allocate at least one byte so that empty columns are not NULL */
+    dest = malloc(size ? size : 1);
+    memcpy(dest, src, size);
+
+    return dest;
+}
+
+struct osm_node *osm_batch_node(struct osm_batch *batch, int i)
+{
+    struct osm_node *node = &batch->priv->node;
+
+    node->id = batch->ids[i];
+    node->version = batch->versions[i];
+    node->lat = batch->lat[i] / 1e7;
+    node->lon = batch->lon[i] / 1e7;
+    copy_tags(batch, i, &node->tags, &node->tag_count, &batch->priv->max_node_tags);
+
+    return node;
+}
+
+struct osm_way *osm_batch_way(struct osm_batch *batch, int i)
+{
+    struct osm_way *way = &batch->priv->way;
+
+    way->id = batch->ids[i];
+    way->version = batch->versions[i];
+    /* Member nodes are used in place */
+    way->nodes = batch->member_ids + batch->member_offsets[i];
+    way->node_count = batch->member_offsets[i + 1] - batch->member_offsets[i];
+    copy_tags(batch, i, &way->tags, &way->tag_count, &batch->priv->max_way_tags);
+
+    return way;
+}
+
+struct osm_relation *osm_batch_relation(struct osm_batch *batch, int i)
+{
+    struct osm_batch_priv *priv = batch->priv;
+    struct osm_relation *rel = &priv->relation;
+    uint32_t m, start = batch->member_offsets[i], end = batch->member_offsets[i + 1];
+    int count = end - start;
+
+    rel->id = batch->ids[i];
+    rel->version = batch->versions[i];
+    if(count > priv->max_relation_nodes)
+    {
+        priv->max_relation_nodes = count;
+        rel->nodes = realloc(rel->nodes, count * sizeof(unsigned int));
+        rel->node_roles = realloc(rel->node_roles, count * (OSM_TAG_SIZE + 1));
+    }
+    if(count > priv->max_relation_ways)
+    {
+        priv->max_relation_ways = count;
+        rel->ways = realloc(rel->ways, count * sizeof(unsigned int));
+        rel->way_roles = realloc(rel->way_roles, count * (OSM_TAG_SIZE + 1));
+    }
+
+    rel->node_count = rel->way_count = 0;
+    for(m = start; m < end; m++)
+    {
+        const char *role = batch->strings + batch->member_roles[m];
+
+        if(batch->member_types[m] == OSM_NODE)
+        {
+            rel->nodes[rel->node_count] = batch->member_ids[m];
+            strcpy(rel->node_roles[rel->node_count++], role);
+        }
+        else
+        {
+            rel->ways[rel->way_count] = batch->member_ids[m];
+            strcpy(rel->way_roles[rel->way_count++], role);
+        }
+    }
+    copy_tags(batch, i, &rel->tags, &rel->tag_count, &priv->max_relation_tags);
+
+    return rel;
+}
+
+/* Copy the tags of element i of a batch into an array of struct osm_tag */
+static void copy_tags(const struct osm_batch *batch, int i, struct osm_tag **tags, int *count, int *max)
+{
+    uint32_t t, start = batch->tag_offsets[i], end = batch->tag_offsets[i + 1];
+
+    *count = end - start;
+    if(*count > *max)
+    {
+        *max = *count;
+        *tags = realloc(*tags, *max * sizeof(struct osm_tag));
+    }
+
+    for(t = start; t < end; t++)
+    {
+        strcpy((*tags)[t - start].key, batch->strings + batch->tag_keys[t]);
+        strcpy((*tags)[t - start].value, batch->strings + batch->tag_values[t]);
+    }
+
+    return;
+}
@@ -0,0 +1,664 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Ordered geometry of route=train relations. Node locations, ways and
+ * route relations are collected while the extract is written. Each
+ * route's member ways are then joined end to end into lines, using a
+ * hash table of the node IDs at the ends of the ways, and the routes are
+ * written as GeoJSON MultiLineString features by a pool of threads. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "osm.h"
+
+#define MAX_THREADS  16
+#define ROUTE_CHUNK  16 /**< Routes taken by a worker thread at a time */
+
+/* Way as stored until the routes are built */
+struct route_way
+{
+    unsigned int id;
+    int node_start, node_count; /**< Node IDs in way_nodes[] */
+};
+
+/* Route relation as stored until the routes are built */
+struct route
+{
+    unsigned int id;
+    int member_start, member_count; /**< Way IDs in members[] */
+    int tag_start, tag_count;       /**< Key and value offsets in tag_strings[] */
+};
+
+/* Segment of a stitched line: a member way, possibly reversed */
+struct route_segment
+{
+    int member;
+    char reversed;
+};
+
+/* End of a member way, as found in the endpoint hash table */
+struct route_end
+{
+    unsigned int node;
+    int member;     /**< Index into the route's members, or -1 if the slot is empty */
+    int last;       /**< Boolean; the last node of the way rather than the first */
+};
+
+/* Growable text buffer */
+struct route_text
+{
+    char *buf;
+    size_t len, max;
+};
+
+struct osm_routes
+{
+    /* Locations of all nodes in the extract */
+    unsigned int *node_ids;
+    double *node_lat, *node_lon;
+    int node_count, node_max;
+    char nodes_unsorted;
+
+    struct route_way *ways;
+    int way_count, way_max;
+    unsigned int *way_nodes;
+    int way_node_count, way_node_max;
+    char ways_unsorted;
+
+    struct route *routes;
+    int route_count, route_max;
+    unsigned int *members;
+    int member_count, member_max;
+    uint32_t *tag_offsets;      /**< Alternating key and value offsets into tag_strings */
+    int tag_count, tag_max;
+    char *tag_strings;
+    size_t strings_len, strings_max;
+
+    /* Routes being built */
+    char **features;  /**< GeoJSON of each route */
+    int next_route;   /**< Index of the next route to be taken by a worker */
+    pthread_mutex_t mutex;
+};
+
+/* State of one worker thread */
+struct route_worker
+{
+    struct osm_routes *routes;
+    pthread_t thread;
+
+    int *ways;                 /**< Way index of each member, or -1 */
+    char *used;
+    struct route_segment *segs, *back;
+    struct route_end *ends;
+    int member_max, end_max;
+    struct route_text text;
+};
+
+static int cmp_node(const void *a, const void *b);
+static int cmp_way(const void *a, const void *b);
+static uint32_t add_string(struct osm_routes *, const char *str);
+static int node_index(struct osm_routes *, unsigned int id);
+static int way_index(struct osm_routes *, unsigned int id);
+static void *start_route_thread(void *);
+
+struct osm_routes *osm_routes_init(void)
+{
+    return calloc(1, sizeof(struct osm_routes));
+}
+
+void osm_routes_add_node(struct osm_routes *routes, struct osm_node *node)
+{
+    if(routes->node_count >= routes->node_max)
+    {
+        routes->node_max += 100000;
+        routes->node_ids = realloc(routes->node_ids, routes->node_max * sizeof(unsigned int));
+        routes->node_lat = realloc(routes->node_lat, routes->node_max * sizeof(double));
+        routes->node_lon = realloc(routes->node_lon, routes->node_max * sizeof(double));
+    }
+
+    if(routes->node_count > 0 && node->id < routes->node_ids[routes->node_count - 1])
+        routes->nodes_unsorted = 1;
+    routes->node_ids[routes->node_count] = node->id;
+    routes->node_lat[routes->node_count] = node->lat;
+    routes->node_lon[routes->node_count] = node->lon;
+    routes->node_count++;
+
+    return;
+}
+
+void osm_routes_add_way(struct osm_routes *routes, struct osm_way *way)
+{
+    struct route_way *rw;
+
+    if(way->node_count < 2)
+        return;
+
+    if(routes->way_count >= routes->way_max)
+    {
+        routes->way_max += 10000;
+        routes->ways = realloc(routes->ways, routes->way_max * sizeof(struct route_way));
+    }
+    if(routes->way_node_count + way->node_count > routes->way_node_max)
+    {
+        routes->way_node_max += 100000 + way->node_count;
+        routes->way_nodes = realloc(routes->way_nodes, routes->way_node_max * sizeof(unsigned int));
+    }
+
+    if(routes->way_count > 0 && way->id < routes->ways[routes->way_count - 1].id)
+        routes->ways_unsorted = 1;
+    rw = &routes->ways[routes->way_count++];
+    rw->id = way->id;
+    rw->node_start = routes->way_node_count;
+    rw->node_count = way->node_count;
+    memcpy(routes->way_nodes + routes->way_node_count, way->nodes, way->node_count * sizeof(unsigned int));
+    routes->way_node_count += way->node_count;
+
+    return;
+}
+
+void osm_routes_add_relation(struct osm_routes *routes, struct osm_relation *relation)
+{
+    struct route *route;
+    int t, w, is_train = 0;
+
+    for(t = 0; t < relation->tag_count; t++)
+    {
+        if(strcmp(relation->tags[t].key, "route") == 0 && strcmp(relation->tags[t].value, "train") == 0)
+            is_train = 1;
+    }
+    if( !is_train)
+        return;
+
+    if(routes->route_count >= routes->route_max)
+    {
+        routes->route_max += 1000;
+        routes->routes = realloc(routes->routes, routes->route_max * sizeof(struct route));
+    }
+    if(routes->member_count + relation->way_count > routes->member_max)
+    {
+        routes->member_max += 10000 + relation->way_count;
+        routes->members = realloc(routes->members, routes->member_max * sizeof(unsigned int));
+    }
+    if(routes->tag_count + relation->tag_count > routes->tag_max)
+    {
+        routes->tag_max += 10000 + relation->tag_count;
+        routes->tag_offsets = realloc(routes->tag_offsets, 2 * routes->tag_max * sizeof(uint32_t));
+    }
+
+    route = &routes->routes[routes->route_count++];
+    route->id = relation->id;
+
+    /* Platforms and stops are not part of the line */
+    route->member_start = routes->member_count;
+    for(w = 0; w < relation->way_count; w++)
+    {
+        if(strncmp(relation->way_roles[w], "platform", 8) == 0
+           || strncmp(relation->way_roles[w], "stop", 4) == 0)
+            continue;
+        routes->members[routes->member_count++] = relation->ways[w];
+    }
+    route->member_count = routes->member_count - route->member_start;
+
+    route->tag_start = routes->tag_count;
+    route->tag_count = relation->tag_count;
+    for(t = 0; t < relation->tag_count; t++)
+    {
+        routes->tag_offsets[2 * routes->tag_count] = add_string(routes, relation->tags[t].key);
+        routes->tag_offsets[2 * routes->tag_count + 1] = add_string(routes, relation->tags[t].value);
+        routes->tag_count++;
+    }
+
+    return;
+}
+
+int osm_routes_write(struct osm_routes *routes, const char *filename)
+{
+    struct route_worker *workers;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = ncpu < 1 ? 1 : (ncpu > MAX_THREADS ? MAX_THREADS : ncpu);
+    int w, n, r, ret = 0;
+    FILE *fp;
+
+    /* Sort the nodes and ways by ID, if they were not added in order */
+    if(routes->nodes_unsorted)
+    {
+        struct { unsigned int id; double lat, lon; } *tmp = malloc(routes->node_count * sizeof(*tmp));
+
+        for(n = 0; n < routes->node_count; n++)
+        {
+            tmp[n].id = routes->node_ids[n];
+            tmp[n].lat = routes->node_lat[n];
+            tmp[n].lon = routes->node_lon[n];
+        }
+        qsort(tmp, routes->node_count, sizeof(*tmp), cmp_node);
+        for(n = 0; n < routes->node_count; n++)
+        {
+            routes->node_ids[n] = tmp[n].id;
+            routes->node_lat[n] = tmp[n].lat;
+            routes->node_lon[n] = tmp[n].lon;
+        }
+        free(tmp);
+    }
+    if(routes->ways_unsorted)
+        qsort(routes->ways, routes->way_count, sizeof(struct route_way), cmp_way);
+
+    if( !(fp = fopen(filename, "w")))
+    {
+        fprintf(stderr, "osm_routes_write(): Unable to open file <%s>\n", filename);
+        return 1;
+    }
+
+    /* Stitch the routes in parallel, this thread included */
+    routes->features = calloc(routes->route_count + 1, sizeof(char *));
+    routes->next_route = 0;
+    pthread_mutex_init(&routes->mutex, NULL);
+    workers = calloc(nthreads, sizeof(struct route_worker));
+    for(w = 0; w < nthreads; w++)
+    {
+        workers[w].routes = routes;
+        if(w > 0 && pthread_create(&workers[w].thread, NULL, start_route_thread, &workers[w]) != 0)
+        {
+            fprintf(stderr, "osm_routes_write(): Unable to start worker thread\n");
+            break;
+        }
+    }
+    start_route_thread(&workers[0]);
+    for(n = 1; n < w; n++)
+        pthread_join(workers[n].thread, NULL);
+
+    fprintf(fp, "{\"type\":\"FeatureCollection\",\"features\":[\n");
+    for(r = 0; r < routes->route_count; r++)
+    {
+        fputs(routes->features[r], fp);
+        fputs(r < routes->route_count - 1 ? ",\n" : "\n", fp);
+        free(routes->features[r]);
+    }
+    fprintf(fp, "]}\n");
+    if(fclose(fp) != 0)
+    {
+        fprintf(stderr, "osm_routes_write(): Error writing file <%s>\n", filename);
+        ret = 1;
+    }
+    fprintf(stderr, "Wrote %d train routes\n", routes->route_count);
+
+    for(w = 0; w < nthreads; w++)
+    {
+        free(workers[w].ways);
+        free(workers[w].used);
+        free(workers[w].segs);
+        free(workers[w].back);
+        free(workers[w].ends);
+        free(workers[w].text.buf);
+    }
+    free(workers);
+    free(routes->features);
+    routes->features = NULL;
+    pthread_mutex_destroy(&routes->mutex);
+
+    return ret;
+}
+
+void osm_routes_destroy(struct osm_routes *routes)
+{
+    free(routes->node_ids);
+    free(routes->node_lat);
+    free(routes->node_lon);
+    free(routes->ways);
+    free(routes->way_nodes);
+    free(routes->routes);
+    free(routes->members);
+    free(routes->tag_offsets);
+    free(routes->tag_strings);
+    free(routes);
+
+    return;
+}
+
+static int cmp_node(const void *a, const void *b)
+{
+    unsigned int aa = *(const unsigned int *)a, bb = *(const unsigned int *)b;
+
+    return aa < bb ? -1 : (aa > bb ? 1 : 0);
+}
+
+static int cmp_way(const void *a, const void *b)
+{
+    const struct route_way *wa = a, *wb = b;
+
+    return wa->id < wb->id ? -1 : (wa->id > wb->id ? 1 : 0);
+}
+
+/* Copy a string into the tag string arena and return its offset */
+static uint32_t add_string(struct osm_routes *routes, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    uint32_t offset = routes->strings_len;
+
+    if(routes->strings_len + len > routes->strings_max)
+    {
+        routes->strings_max = 2 * routes->strings_max + len + 65536;
+        routes->tag_strings = realloc(routes->tag_strings, routes->strings_max);
+    }
+    memcpy(routes->tag_strings + routes->strings_len, str, len);
+    routes->strings_len += len;
+
+    return offset;
+}
+
+/* Index of a node in the node arrays, or -1 if it is not present */
+static int node_index(struct osm_routes *routes, unsigned int id)
+{
+    int lo = 0, hi = routes->node_count - 1;
+
+    while(lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if(routes->node_ids[mid] < id)
+            lo = mid + 1;
+        else if(routes->node_ids[mid] > id)
+            hi = mid - 1;
+        else
+            return mid;
+    }
+
+    return -1;
+}
+
+/* Index of a way in ways[], or -1 if it is not present */
+static int way_index(struct osm_routes *routes, unsigned int id)
+{
+    int lo = 0, hi = routes->way_count - 1;
+
+    while(lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if(routes->ways[mid].id < id)
+            lo = mid + 1;
+        else if(routes->ways[mid].id > id)
+            hi = mid - 1;
+        else
+            return mid;
+    }
+
+    return -1;
+}
+
+static void text_printf(struct route_text *text, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    while(1)
+    {
+        va_start(ap, fmt);
+        n = vsnprintf(text->buf + text->len, text->max - text->len, fmt, ap);
+        va_end(ap);
+        if(text->len + n < text->max)
+            break;
+        text->max = 2 * text->max + n + 256;
+        text->buf = realloc(text->buf, text->max);
+    }
+    text->len += n;
+
+    return;
+}
+
+/* Append a string as a quoted JSON string */
+static void text_string(struct route_text *text, const char *str)
+{
+    text_printf(text, "\"");
+    for(; *str; str++)
+    {
+        unsigned char c = *str;
+
+        if(c == '"' || c == '\\')
+            text_printf(text, "\\%c", c);
+        else if(c < 0x20)
+            text_printf(text, "\\u%04x", c);
+        else
+            text_printf(text, "%c", c);
+    }
+    text_printf(text, "\"");
+
+    return;
+}
+
+static inline uint32_t hash_node(unsigned int id)
+{
+    return id * 2654435761u;
+}
+
+/* First and last node of a member way */
+static inline unsigned int way_end(struct osm_routes *routes, struct route_worker *worker, int member, int last)
+{
+    struct route_way *rw = &routes->ways[worker->ways[member]];
+
+    return routes->way_nodes[rw->node_start + (last ? rw->node_count - 1 : 0)];
+}
+
+/* Whether a member way starts or ends at a node */
+static inline int touches(struct osm_routes *routes, struct route_worker *worker, int member, unsigned int node)
+{
+    return worker->ways[member] >= 0
+        && (way_end(routes, worker, member, 0) == node || way_end(routes, worker, member, 1) == node);
+}
+
+/* Find the unused member with an end at a node. Where the route branches
+ * the earliest member is taken, and the others start lines of their own.
+ * Returns the member, or -1 if there is none, and sets *last to the end
+ * of it found. */
+static int next_member(struct route_worker *worker, unsigned int node, int *last)
+{
+    int mask = worker->end_max - 1, slot = hash_node(node) & mask, best = -1;
+    struct route_end *end;
+
+    while((end = &worker->ends[slot])->member >= 0)
+    {
+        if(end->node == node && !worker->used[end->member] && (best < 0 || end->member < best))
+        {
+            best = end->member;
+            *last = end->last;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return best;
+}
+
+/* Join the member ways of a route into lines, and write it as a GeoJSON
+ * feature. Returns the text, in memory allocated with malloc(). */
+static char *stitch_route(struct route_worker *worker, struct route *route)
+{
+    struct osm_routes *routes = worker->routes;
+    struct route_text *text = &worker->text;
+    int m, t, count = route->member_count, lines = 0;
+
+    if(count > worker->member_max)
+    {
+        worker->member_max = count;
+        worker->ways = realloc(worker->ways, count * sizeof(int));
+        worker->used = realloc(worker->used, count);
+        worker->segs = realloc(worker->segs, count * sizeof(struct route_segment));
+        worker->back = realloc(worker->back, count * sizeof(struct route_segment));
+    }
+    if(4 * count > worker->end_max)
+    {
+        /* At most half full */
+        for(worker->end_max = 16; worker->end_max < 4 * count; worker->end_max *= 2)
+            ;
+        worker->ends = realloc(worker->ends, worker->end_max * sizeof(struct route_end));
+    }
+    for(m = 0; m < worker->end_max; m++)
+        worker->ends[m].member = -1;
+
+    /* Resolve the members, leaving out ways missing from the extract and
+     * ways listed more than once */
+    for(m = 0; m < count; m++)
+    {
+        int w = way_index(routes, routes->members[route->member_start + m]), e;
+
+        worker->ways[m] = w;
+        worker->used[m] = w < 0;
+        if(w < 0)
+            continue;
+
+        for(e = 0; e < 2; e++)
+        {
+            unsigned int node = way_end(routes, worker, m, e);
+            int slot = hash_node(node) & (worker->end_max - 1), duplicate = 0;
+
+            while(worker->ends[slot].member >= 0)
+            {
+                struct route_end *end = &worker->ends[slot];
+
+                if(end->node == node && end->last == e && worker->ways[end->member] == w)
+                    duplicate = 1;
+                slot = (slot + 1) & (worker->end_max - 1);
+            }
+            if(duplicate)
+            {
+                worker->used[m] = 1;
+                break;
+            }
+            worker->ends[slot].node = node;
+            worker->ends[slot].member = m;
+            worker->ends[slot].last = e;
+        }
+    }
+
+    text->len = 0;
+    text_printf(text, "{\"type\":\"Feature\",\"id\":%u,\"geometry\":{\"type\":\"MultiLineString\",\"coordinates\":[",
+                route->id);
+
+    for(m = 0; m < count; m++)
+    {
+        int nseg = 0, nback = 0, next, last, rev, s, points = 0;
+        unsigned int node;
+        size_t line_start;
+
+        if(worker->used[m])
+            continue;
+
+        /* Take this way in the direction that leads on to the next
+         * member, so that the line follows the order of the members */
+        rev = m + 1 < count && !worker->used[m + 1]
+            && touches(routes, worker, m + 1, way_end(routes, worker, m, 0))
+            && !touches(routes, worker, m + 1, way_end(routes, worker, m, 1));
+
+        /* Follow the route forward from the end of this way... */
+        worker->used[m] = 1;
+        worker->segs[nseg].member = m;
+        worker->segs[nseg++].reversed = rev;
+        node = way_end(routes, worker, m, !rev);
+        while((next = next_member(worker, node, &last)) >= 0)
+        {
+            worker->used[next] = 1;
+            worker->segs[nseg].member = next;
+            worker->segs[nseg++].reversed = last;
+            node = way_end(routes, worker, next, !last);
+        }
+
+        /* ...and backward from its start */
+        node = way_end(routes, worker, m, rev);
+        while((next = next_member(worker, node, &last)) >= 0)
+        {
+            worker->used[next] = 1;
+            worker->back[nback].member = next;
+            worker->back[nback++].reversed = !last;
+            node = way_end(routes, worker, next, !last);
+        }
+
+        /* Write the line, with the node shared by consecutive ways once.
+         * Nodes missing from the extract are left out. */
+        line_start = text->len;
+        text_printf(text, "%s[", lines > 0 ? "," : "");
+        for(s = -nback; s < nseg; s++)
+        {
+            struct route_segment *seg = s < 0 ? &worker->back[-s - 1] : &worker->segs[s];
+            struct route_way *rw = &routes->ways[worker->ways[seg->member]];
+            int n;
+
+            for(n = (s == -nback ? 0 : 1); n < rw->node_count; n++)
+            {
+                int idx = node_index(routes, routes->way_nodes[rw->node_start
+                                                               + (seg->reversed ? rw->node_count - 1 - n : n)]);
+
+                if(idx < 0)
+                    continue;
+                text_printf(text, "%s[%.7f,%.7f]", points > 0 ? "," : "",
+                            routes->node_lon[idx], routes->node_lat[idx]);
+                points++;
+            }
+        }
+        text_printf(text, "]");
+        if(points < 2)
+            text->len = line_start;
+        else
+            lines++;
+    }
+
+    text_printf(text, "]},\"properties\":{");
+    for(t = 0; t < route->tag_count; t++)
+    {
+        uint32_t *offsets = routes->tag_offsets + 2 * (route->tag_start + t);
+
+        if(t > 0)
+            text_printf(text, ",");
+        text_string(text, routes->tag_strings + offsets[0]);
+        text_printf(text, ":");
+        text_string(text, routes->tag_strings + offsets[1]);
+    }
+    text_printf(text, "}}");
+
+    return strdup(text->buf);
+}
+
+/* Worker thread taking chunks of routes until none are left */
+static void *start_route_thread(void *data)
+{
+    struct route_worker *worker = data;
+    struct osm_routes *routes = worker->routes;
+
+    while(1)
+    {
+        int start, end, r;
+
+        pthread_mutex_lock(&routes->mutex);
+        start = routes->next_route;
+        end = start + ROUTE_CHUNK < routes->route_count ? start + ROUTE_CHUNK : routes->route_count;
+        routes->next_route = end;
+        pthread_mutex_unlock(&routes->mutex);
+        if(start >= end)
+            break;
+
+        for(r = start; r < end; r++)
+            routes->features[r] = stitch_route(worker, &routes->routes[r]);
+    }
+
+    return NULL;
+}
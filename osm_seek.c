@@ -0,0 +1,738 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Random access to XML files sorted by type and ID, plain or compressed
+ * with bzip2. A bzip2 stream is a sequence of blocks, each decodable on
+ * its own once its start is known; blocks are not byte-aligned, but each
+ * starts with a 48-bit magic number that can be searched for at every bit
+ * position. To find an element, the file is bisected by position: at each
+ * step the first block starting after the midpoint is decoded until the
+ * start of an element, and the key (type and ID) of that element decides
+ * which half to keep. The keys found are kept as a sample of the file, so
+ * later searches start from a narrower range and most of the file is
+ * never read at all, and the sample may be saved in a file for later
+ * runs. The file is read in pages, the most recent of which are kept,
+ * since searching for a block and then decoding it read the same bytes,
+ * and bzip2 input is read only up to the start of the next block, as
+ * each block is decoded once all of it is available. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "osm.h"
+
+#define SEEK_CHUNK   (256 * 1024) /**< Room made in the line buffer before adding to it */
+#define SEEK_PAGE    (16 * 1024)  /**< Size of each read of the file */
+#define SEEK_PAGES   256          /**< Number of pages of the file kept */
+#define BLOCK_MAGIC  0x314159265359ULL
+#define MAGIC_BITS   48
+
+#define SAMPLE_MAGIC   "OSMSEEK\0"
+#define SAMPLE_VERSION 1
+
+/* Key of the first element starting after a position in the file */
+struct seek_sample
+{
+    long long pos; /**< Position in bits: start of a bzip2 block, or any byte */
+    uint64_t key;  /**< (type << 32) | ID, or UINT64_MAX if none follows */
+};
+
+/* Header of the file in which the sample of FILE is saved, followed by
+ * the samples */
+struct sample_header
+{
+    char magic[8];      /**< SAMPLE_MAGIC, not null-terminated */
+    uint32_t version;   /**< SAMPLE_VERSION */
+    int32_t level;
+    int64_t size;       /**< Size and modification time of FILE */
+    int64_t mtime, mtime_nsec;
+    int64_t block_bits;
+    uint64_t count;
+};
+
+/* Page of the file, kept for rereading */
+struct seek_page
+{
+    long long offset;   /**< Offset in the file, a multiple of SEEK_PAGE, or -1 if unused */
+    size_t len;         /**< Less than SEEK_PAGE only at the end of the file */
+    unsigned long long used; /**< Value of page_clock when last read */
+    unsigned char data[SEEK_PAGE];
+};
+
+struct osm_seek
+{
+    FILE *fp;
+    char *filename;
+    long long size;      /**< Size of the file in bytes */
+    struct stat st;      /**< Size and modification time, for the saved sample */
+    char *sample_file;   /**< Name of the file the sample is saved in, or NULL */
+    int saved_count;     /**< Number of samples loaded from or saved to sample_file */
+    int level;           /**< bzip2 block size, 1 to 9, or 0 for plain XML */
+    long long data_start; /**< Position in bits of the first block or byte of XML */
+
+    struct seek_sample *samples; /**< In order of position, and so of key */
+    int sample_count, max_samples;
+    long long bytes_read; /**< Bytes of the file read so far, including rereads */
+    long long block_bits; /**< Smallest distance seen between two blocks, or 0 */
+
+    struct seek_page *pages;
+    unsigned long long page_clock;
+
+    /* Stream of lines from the current position */
+    struct osm_bzip2 *bz;
+    long long stream_start; /**< Position in bits at which the stream started */
+    long long read_pos;     /**< Next byte of the file to be read */
+    int file_eof;           /**< Boolean; read_pos has reached the end of the file */
+    int stream_eof;         /**< Boolean; all of the stream has been placed in buff */
+    char *buff;             /**< Decompressed data */
+    size_t buff_len, buff_pos, max_buff;
+    char *held;             /**< Line to be returned again by the next osm_seek_readln() */
+};
+
+static ssize_t read_file(struct osm_seek *, long long offset, unsigned char *buff, size_t len);
+static int find_block(struct osm_seek *, long long from, long long to, long long *pos);
+static int open_stream(struct osm_seek *, long long pos);
+static int fill(struct osm_seek *);
+static int first_element(struct osm_seek *, uint64_t *key);
+static int probe(struct osm_seek *, long long from, struct seek_sample *);
+static void add_sample(struct osm_seek *, const struct seek_sample *);
+static long long stream_pos(struct osm_seek *);
+static void load_samples(struct osm_seek *);
+static void save_samples(struct osm_seek *);
+
+struct osm_seek *osm_seek_open(const char *filename, const char *sample_file)
+{
+    struct osm_seek *sk = calloc(1, sizeof(struct osm_seek));
+    unsigned char header[4];
+    int p;
+
+    if( !(sk->fp = fopen(filename, "rb")) || fstat(fileno(sk->fp), &sk->st) != 0)
+    {
+        fprintf(stderr, "osm_seek_open(): Unable to open file <%s>\n", filename);
+        if(sk->fp)
+            fclose(sk->fp);
+        free(sk);
+        return NULL;
+    }
+    sk->filename = strdup(filename);
+    sk->size = sk->st.st_size;
+    sk->pages = malloc(SEEK_PAGES * sizeof(struct seek_page));
+    for(p = 0; p < SEEK_PAGES; p++)
+        sk->pages[p].offset = -1;
+    sk->max_buff = 2 * SEEK_CHUNK;
+    sk->buff = malloc(sk->max_buff + 1);
+
+    if(read_file(sk, 0, header, 4) == 4 && header[0] == 'B' && header[1] == 'Z' && header[2] == 'h'
+       && header[3] >= '1' && header[3] <= '9')
+    {
+        sk->level = header[3] - '0';
+        sk->data_start = 32;
+    }
+    if(sample_file)
+    {
+        sk->sample_file = strdup(sample_file);
+        load_samples(sk);
+    }
+
+    if(open_stream(sk, sk->data_start) != 0)
+    {
+        osm_seek_close(sk);
+        return NULL;
+    }
+
+    return sk;
+}
+
+int osm_seek_to(struct osm_seek *sk, int type, unsigned int id)
+{
+    uint64_t key = (uint64_t)type << 32 | id;
+    long long lo = sk->data_start, hi = sk->size * 8;
+    long long min_gap = sk->level ? MAGIC_BITS : 8 * SEEK_CHUNK;
+    uint64_t first;
+    int s;
+
+    /* Start from the narrowest range the sample allows. The start of the
+     * file is always a valid place to start reading from. */
+    for(s = 0; s < sk->sample_count; s++)
+    {
+        if(sk->samples[s].key <= key)
+            lo = sk->samples[s].pos;
+        else
+        {
+            hi = sk->samples[s].pos;
+            break;
+        }
+    }
+
+    /* Once the range spans only a couple of blocks, reading through it
+     * is quicker than decoding a block to halve it */
+    if(sk->block_bits > min_gap / 2)
+        min_gap = 2 * sk->block_bits;
+    while(hi - lo > min_gap)
+    {
+        long long mid = lo + (hi - lo) / 2;
+        struct seek_sample sample;
+
+        if(sk->level)
+        {
+            long long block;
+            int ret = find_block(sk, mid, hi, &block);
+
+            if(ret == 1)
+                return 1;
+            /* No block starts between mid and hi */
+            if(ret == 2)
+            {
+                hi = mid;
+                continue;
+            }
+            mid = block;
+        }
+        else
+            mid &= ~7LL;
+        if(probe(sk, mid, &sample) != 0)
+            return 1;
+        if(sample.pos >= hi)
+            hi = mid;
+        else if(sample.key <= key)
+            lo = sample.pos;
+        else
+            hi = mid;
+    }
+
+    /* The stream may already be at the first element of the block, if
+     * that block was the last probed */
+    if(sk->held && sk->stream_start == lo)
+        return 0;
+    if(open_stream(sk, lo) != 0)
+        return 1;
+
+    return first_element(sk, &first) < 0;
+}
+
+int osm_seek_ahead(struct osm_seek *sk, int type, unsigned int id)
+{
+    uint64_t key = (uint64_t)type << 32 | id;
+    long long pos = stream_pos(sk);
+    int s;
+
+    /* The first sample beyond the stream has the lowest key of them */
+    for(s = 0; s < sk->sample_count; s++)
+    {
+        if(sk->samples[s].pos > pos)
+            return sk->samples[s].key <= key;
+    }
+
+    return 0;
+}
+
+int osm_seek_readln(struct osm_seek *sk, char **line)
+{
+    while(1)
+    {
+        char *start, *nl;
+
+        if(sk->held)
+        {
+            *line = sk->held;
+            sk->held = NULL;
+            return 0;
+        }
+
+        start = sk->buff + sk->buff_pos;
+        nl = memchr(start, '\n', sk->buff_len - sk->buff_pos);
+        if(nl || (sk->stream_eof && sk->buff_pos < sk->buff_len))
+        {
+            size_t len = nl ? (size_t)(nl - start) : sk->buff_len - sk->buff_pos;
+
+            sk->buff_pos += nl ? len + 1 : len;
+            start[len] = '\0';
+            if(len > 0 && start[len - 1] == '\r')
+                start[--len] = '\0';
+            /* Skip blank lines, as osm_planet_readln() does */
+            if(len == 0)
+                continue;
+            *line = start;
+            return 0;
+        }
+        if(sk->stream_eof)
+            return 2;
+
+        switch(fill(sk))
+        {
+            case 0:
+                break;
+            case 2:
+                sk->stream_eof = 1;
+                break;
+            default:
+                return 1;
+        }
+    }
+}
+
+void osm_seek_stats(struct osm_seek *sk, long long *bytes_read, long long *size)
+{
+    *bytes_read = sk->bytes_read;
+    *size = sk->size;
+
+    return;
+}
+
+void osm_seek_close(struct osm_seek *sk)
+{
+    if(sk->sample_file && sk->sample_count > sk->saved_count)
+        save_samples(sk);
+    if(sk->bz)
+        osm_bzip2_close(sk->bz);
+    fclose(sk->fp);
+    free(sk->pages);
+    free(sk->buff);
+    free(sk->samples);
+    free(sk->sample_file);
+    free(sk->filename);
+    free(sk);
+
+    return;
+}
+
+/* Copy part of the file into buff, reading the pages not kept. Returns
+ * the number of bytes copied, less than len only at the end of the file,
+ * or -1 on a read error. */
+static ssize_t read_file(struct osm_seek *sk, long long offset, unsigned char *buff, size_t len)
+{
+    size_t done = 0;
+
+    while(done < len)
+    {
+        long long page_offset = (offset + done) / SEEK_PAGE * SEEK_PAGE;
+        struct seek_page *page = NULL;
+        size_t skip = offset + done - page_offset, n;
+        int p;
+
+        /* Find the page, or else the one least recently used */
+        for(p = 0; p < SEEK_PAGES; p++)
+        {
+            if(sk->pages[p].offset == page_offset)
+            {
+                page = &sk->pages[p];
+                break;
+            }
+            if( !page || sk->pages[p].used < page->used)
+                page = &sk->pages[p];
+        }
+        if(page->offset != page_offset)
+        {
+            if(fseeko(sk->fp, page_offset, SEEK_SET) != 0)
+                return -1;
+            page->offset = page_offset;
+            page->len = fread(page->data, 1, SEEK_PAGE, sk->fp);
+            sk->bytes_read += page->len;
+            if(page->len < SEEK_PAGE && ferror(sk->fp))
+            {
+                fprintf(stderr, "osm_seek_readln(): Error reading file\n");
+                page->offset = -1;
+                return -1;
+            }
+        }
+        page->used = ++sk->page_clock;
+
+        if(skip >= page->len)
+            break;
+        n = page->len - skip < len - done ? page->len - skip : len - done;
+        memcpy(buff + done, page->data + skip, n);
+        done += n;
+    }
+
+    return done;
+}
+
+/* Find the first block starting at or after a position in bits and
+ * before another. Returns 0 if one was found, 2 if there is none, or 1 on
+ * a read error. */
+static int find_block(struct osm_seek *sk, long long from, long long to, long long *pos)
+{
+    unsigned char chunk[SEEK_PAGE];
+    long long offset = from / 8, end = (to + MAGIC_BITS + 7) / 8;
+    uint64_t window = 0;
+    int have = 0; /* Number of bytes in window */
+
+    while(offset < end)
+    {
+        size_t want = end - offset < SEEK_PAGE ? end - offset : SEEK_PAGE, i;
+        ssize_t n = read_file(sk, offset, chunk, want);
+
+        if(n <= 0)
+            return n < 0 ? 1 : 2;
+        for(i = 0; i < (size_t)n; i++, offset++)
+        {
+            int shift;
+
+            window = (window << 8) | chunk[i];
+            if(++have < 7)
+                continue;
+            /* The last 7 bytes hold every 48-bit run starting in the
+             * earliest of them */
+            for(shift = 0; shift < 8; shift++)
+            {
+                long long start = (offset - 6) * 8 + shift;
+
+                if(((window >> (8 - shift)) & ((1ULL << MAGIC_BITS) - 1)) == BLOCK_MAGIC
+                   && start >= from && start < to)
+                {
+                    *pos = start;
+                    return 0;
+                }
+            }
+        }
+    }
+
+    return 2;
+}
+
+/* Start a stream of lines at a position in bits: the start of a block of
+ * bzip2 input, or a byte of plain XML */
+static int open_stream(struct osm_seek *sk, long long pos)
+{
+    if(sk->bz)
+        osm_bzip2_close(sk->bz);
+    sk->bz = NULL;
+    if(sk->level)
+    {
+        if( !(sk->bz = osm_bzip2_open()))
+            return 1;
+        osm_bzip2_start_block(sk->bz, sk->level, pos % 8);
+    }
+    sk->stream_start = pos;
+    sk->read_pos = pos / 8;
+    sk->file_eof = 0;
+    sk->stream_eof = 0;
+    sk->buff_len = 0;
+    sk->buff_pos = 0;
+    sk->held = NULL;
+
+    return 0;
+}
+
+/* Add more of the stream to buff. Plain XML is read a page at a time, and
+ * bzip2 input a block at a time: up to the next block header, which is
+ * all the decoder needs to decode the blocks before it. Returns 0 if some
+ * was added, 2 at the end of the stream, or 1 on error. */
+static int fill(struct osm_seek *sk)
+{
+    unsigned char chunk[SEEK_PAGE];
+    size_t start_len;
+
+    /* Drop the lines already returned */
+    memmove(sk->buff, sk->buff + sk->buff_pos, sk->buff_len - sk->buff_pos);
+    sk->buff_len -= sk->buff_pos;
+    sk->buff_pos = 0;
+    if(sk->max_buff - sk->buff_len < SEEK_CHUNK)
+    {
+        sk->max_buff *= 2;
+        sk->buff = realloc(sk->buff, sk->max_buff + 1);
+    }
+    start_len = sk->buff_len;
+
+    while(sk->buff_len == start_len)
+    {
+        ssize_t n = 0;
+        size_t len;
+
+        if( !sk->bz)
+        {
+            if((n = read_file(sk, sk->read_pos, chunk, SEEK_PAGE)) < 0)
+                return 1;
+            if(n == 0)
+                return 2;
+            memcpy(sk->buff + sk->buff_len, chunk, n);
+            sk->buff_len += n;
+            sk->read_pos += n;
+            break;
+        }
+
+        if( !sk->file_eof)
+        {
+            long long from = sk->read_pos * 8 > sk->stream_start ? sk->read_pos * 8 : sk->stream_start;
+            long long next, end;
+            int ret;
+
+            /* Feed up to the byte holding the start of the next block. A
+             * header at from itself is that of the block fed last. */
+            if((ret = find_block(sk, from + 1, sk->size * 8, &next)) == 1)
+                return 1;
+            end = (ret == 0) ? (next + 7) / 8 : sk->size;
+            while(sk->read_pos < end)
+            {
+                size_t want = end - sk->read_pos < SEEK_PAGE ? end - sk->read_pos : SEEK_PAGE;
+
+                if((n = read_file(sk, sk->read_pos, chunk, want)) < 0)
+                    return 1;
+                if(n == 0)
+                    break;
+                osm_bzip2_feed(sk->bz, chunk, n);
+                sk->read_pos += n;
+            }
+            sk->file_eof = (sk->read_pos >= sk->size);
+        }
+
+        while(1)
+        {
+            int ret = osm_bzip2_read(sk->bz, (unsigned char *)sk->buff + sk->buff_len,
+                                     sk->max_buff - sk->buff_len, &len, sk->file_eof);
+
+            sk->buff_len += len;
+            if(ret < 0)
+                return 1;
+            if(ret == 1)
+                return sk->buff_len > start_len ? 0 : 2;
+            /* More input is needed, or buff is full */
+            if(len == 0 || sk->buff_len == sk->max_buff)
+                break;
+        }
+        if(sk->file_eof && sk->buff_len == start_len)
+            return 2;
+    }
+
+    return 0;
+}
+
+/* Skip the rest of the line the stream started in, and any lines that do
+ * not start an element, leaving the next line read as the start of an
+ * element. Returns 0 with the key of the element, 1 if no element
+ * follows, or -1 on error. */
+static int first_element(struct osm_seek *sk, uint64_t *key)
+{
+    static const char *names[] = { "node", "way", "relation" };
+    char *line;
+    int type, ret, skipped = 0;
+
+    while((ret = osm_seek_readln(sk, &line)) == 0)
+    {
+        const char *p = line, *id;
+
+        if( !skipped++)
+            continue;
+        while(*p == ' ' || *p == '\t')
+            p++;
+        if(strncmp(p, "</osm>", 6) == 0)
+            break;
+        if(*p++ != '<')
+            continue;
+        for(type = OSM_NODE; type <= OSM_RELATION; type++)
+        {
+            size_t len = strlen(names[type]);
+
+            if(strncmp(p, names[type], len) == 0 && (p[len] == ' ' || p[len] == '\t')
+               && (id = strstr(p + len, " id=")) && (id[4] == '"' || id[4] == '\''))
+            {
+                *key = (uint64_t)type << 32 | strtoul(id + 5, NULL, 10);
+                sk->held = line;
+                return 0;
+            }
+        }
+    }
+    *key = UINT64_MAX;
+
+    return ret == 1 ? -1 : 1;
+}
+
+/* Find the key of the first element starting after a position in bits,
+ * from the sample or by decoding the first block starting there */
+static int probe(struct osm_seek *sk, long long from, struct seek_sample *sample)
+{
+    while(1)
+    {
+        long long pos = from;
+        int s, ret;
+
+        if(sk->level && (ret = find_block(sk, from, sk->size * 8, &pos)) != 0)
+        {
+            if(ret == 1)
+                return 1;
+            sample->pos = sk->size * 8;
+            sample->key = UINT64_MAX;
+            return 0;
+        }
+        for(s = 0; s < sk->sample_count; s++)
+        {
+            if(sk->samples[s].pos == pos)
+            {
+                *sample = sk->samples[s];
+                return 0;
+            }
+        }
+
+        if(open_stream(sk, pos) != 0)
+            return 1;
+        sample->pos = pos;
+        if(first_element(sk, &sample->key) < 0)
+        {
+            /* The magic number can also occur by chance within a block */
+            if(sk->level)
+            {
+                from = pos + 1;
+                continue;
+            }
+            return 1;
+        }
+        add_sample(sk, sample);
+        return 0;
+    }
+}
+
+static void add_sample(struct osm_seek *sk, const struct seek_sample *sample)
+{
+    int s = sk->sample_count, n;
+
+    if(sk->sample_count >= sk->max_samples)
+    {
+        sk->max_samples += 256;
+        sk->samples = realloc(sk->samples, sk->max_samples * sizeof(struct seek_sample));
+    }
+    while(s > 0 && sk->samples[s - 1].pos > sample->pos)
+        s--;
+    memmove(sk->samples + s + 1, sk->samples + s, (sk->sample_count - s) * sizeof(struct seek_sample));
+    sk->samples[s] = *sample;
+    sk->sample_count++;
+
+    /* Neighbouring samples are at least a block apart */
+    for(n = s - 1; n <= s + 1; n += 2)
+    {
+        long long gap;
+
+        if(n < 0 || n >= sk->sample_count || sk->samples[n].pos >= sk->size * 8)
+            continue;
+        gap = llabs(sk->samples[n].pos - sample->pos);
+        if(sk->level && gap > 0 && (sk->block_bits == 0 || gap < sk->block_bits))
+            sk->block_bits = gap;
+    }
+
+    return;
+}
+
+/* Position in bits that the stream has been read up to */
+static long long stream_pos(struct osm_seek *sk)
+{
+    if(sk->bz)
+        return (sk->stream_start & ~7LL) + osm_bzip2_tell(sk->bz);
+
+    return sk->read_pos * 8 - (long long)(sk->buff_len - sk->buff_pos) * 8;
+}
+
+/* Load the sample saved by an earlier run, if the file is unchanged */
+static void load_samples(struct osm_seek *sk)
+{
+    struct sample_header header;
+    FILE *fp;
+    uint64_t s;
+
+    if( !(fp = fopen(sk->sample_file, "rb")))
+        return;
+    if(fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, SAMPLE_MAGIC, sizeof(header.magic)) != 0
+       || header.version != SAMPLE_VERSION || header.level != sk->level || header.size != sk->size
+       || header.mtime != sk->st.st_mtim.tv_sec || header.mtime_nsec != sk->st.st_mtim.tv_nsec
+       || header.count > (uint64_t)sk->size * 8)
+    {
+        fclose(fp);
+        return;
+    }
+
+    sk->samples = malloc((header.count + 1) * sizeof(struct seek_sample));
+    sk->max_samples = header.count + 1;
+    if(fread(sk->samples, sizeof(struct seek_sample), header.count, fp) != header.count)
+        header.count = 0;
+    /* Samples are in order of both position and key */
+    for(s = 1; s < header.count; s++)
+    {
+        if(sk->samples[s].pos <= sk->samples[s - 1].pos || sk->samples[s].key < sk->samples[s - 1].key)
+            header.count = 0;
+    }
+    if(header.count > 0 && (sk->samples[0].pos < sk->data_start
+                            || sk->samples[header.count - 1].pos >= sk->size * 8))
+        header.count = 0;
+    fclose(fp);
+
+    sk->sample_count = sk->saved_count = header.count;
+    sk->block_bits = header.count > 0 ? header.block_bits : 0;
+
+    return;
+}
+
+/* Save the sample for later runs, unless the file has changed since it
+ * was opened. The sample is written to a temporary file and renamed, so
+ * that a run reading it at the same time sees either the old or the new
+ * sample. It is only an aid, so failing to write it is not an error. */
+static void save_samples(struct osm_seek *sk)
+{
+    struct sample_header header;
+    struct stat st;
+    char *tempname;
+    int fd, ok;
+    FILE *fp;
+
+    if(stat(sk->filename, &st) != 0 || st.st_size != sk->st.st_size
+       || st.st_mtim.tv_sec != sk->st.st_mtim.tv_sec || st.st_mtim.tv_nsec != sk->st.st_mtim.tv_nsec)
+    {
+        fprintf(stderr, "File <%s> changed while it was read; not saving its sample\n", sk->filename);
+        return;
+    }
+    tempname = malloc(strlen(sk->sample_file) + 8);
+    sprintf(tempname, "%s.XXXXXX", sk->sample_file);
+    if((fd = mkstemp(tempname)) < 0 || !(fp = fdopen(fd, "wb")))
+    {
+        fprintf(stderr, "Unable to save the sample of the file in <%s>\n", sk->sample_file);
+        if(fd >= 0)
+        {
+            close(fd);
+            unlink(tempname);
+        }
+        free(tempname);
+        return;
+    }
+    fchmod(fd, 0644);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SAMPLE_MAGIC, sizeof(header.magic));
+    header.version = SAMPLE_VERSION;
+    header.level = sk->level;
+    header.size = sk->size;
+    header.mtime = sk->st.st_mtim.tv_sec;
+    header.mtime_nsec = sk->st.st_mtim.tv_nsec;
+    header.block_bits = sk->block_bits;
+    header.count = sk->sample_count;
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1
+         && fwrite(sk->samples, sizeof(struct seek_sample), sk->sample_count, fp) == (size_t)sk->sample_count;
+    if(fclose(fp) != 0 || !ok || rename(tempname, sk->sample_file) != 0)
+    {
+        fprintf(stderr, "Unable to save the sample of the file in <%s>\n", sk->sample_file);
+        unlink(tempname);
+    }
+    else
+        sk->saved_count = sk->sample_count;
+    free(tempname);
+
+    return;
+}
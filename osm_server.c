@@ -0,0 +1,814 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Resident query server. An extract is loaded into memory once, as
+ * batches copied from an osm_reader, and indexed with a hash table per
+ * element type and a packed R-tree over the bounding boxes of the ways.
+ * Queries arrive as lines of text on a Unix domain socket and are
+ * answered with one line of JSON each, by a thread per connection. The
+ * data is never modified after loading, so the threads share it without
+ * locking. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <math.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "osm.h"
+
+#define RTREE_FANOUT 16   /**< Children of each R-tree node */
+#define MAX_QUERY    4096 /**< Maximum length of a query line */
+#define HIST_BUCKETS 24   /**< Latency buckets; bucket b counts times below 2^b microseconds */
+
+/* Query types, each with its own latency histogram */
+#define QUERY_NODE     0
+#define QUERY_WAY      1
+#define QUERY_RELATION 2
+#define QUERY_BBOX     3
+#define QUERY_OTHER    4
+#define QUERY_TYPES    5
+
+static const char *query_names[QUERY_TYPES] = { "node", "way", "relation", "bbox", "other" };
+
+/* Slot of an ID hash table. batch is numbered from 1, so that a slot
+ * with batch 0 is empty. */
+struct id_slot
+{
+    unsigned int id;
+    uint32_t batch;
+    uint32_t index;
+};
+
+/* All elements of one type, and a hash table for finding them by ID */
+struct element_store
+{
+    struct osm_batch **batches;
+    int batch_count, max_batches;
+    int count;
+
+    struct id_slot *slots;
+    uint32_t hash_size;
+};
+
+/* R-tree node. Nodes with count 0 are leaves holding the bounding box
+ * of the way whose ID is in first; otherwise the children are the nodes
+ * numbered from first up to first + count. Coordinates are in units of
+ * 1e-7 degrees. */
+struct rtree_node
+{
+    int32_t min_lat, min_lon, max_lat, max_lon;
+    uint32_t first, count;
+};
+
+struct osm_server
+{
+    struct element_store elements[3];
+
+    /* Packed R-tree, built bottom up with the root last */
+    struct rtree_node *tree;
+    int tree_count, tree_root;
+    int32_t min_lat, min_lon, max_lat, max_lon;
+
+    volatile sig_atomic_t stop;
+
+    /* Open connections, shut down when the server stops */
+    int *conn_fds;
+    int conn_count, max_conns;
+    pthread_mutex_t conn_mutex;
+    pthread_cond_t conn_done;
+
+    /* Latency histograms */
+    uint64_t hist[QUERY_TYPES][HIST_BUCKETS];
+    uint64_t total_us[QUERY_TYPES];
+    pthread_mutex_t hist_mutex;
+};
+
+/* Growable buffer holding a reply */
+struct reply
+{
+    char *buf;
+    size_t len, max;
+};
+
+struct connection
+{
+    struct osm_server *server;
+    int fd;
+};
+
+static void index_elements(struct element_store *);
+static int find_element(struct osm_server *, int type, unsigned int id, struct osm_batch **batch);
+static void build_rtree(struct osm_server *);
+static void str_sort(struct rtree_node *nodes, int count);
+static void *start_connection(void *);
+static int answer_query(struct osm_server *, char *query, struct reply *);
+static void reply_printf(struct reply *, const char *fmt, ...);
+static void reply_string(struct reply *, const char *str);
+static void reply_tags(struct reply *, struct osm_batch *, int i);
+static void reply_stats(struct osm_server *, struct reply *);
+static void remove_connection(struct osm_server *, int fd);
+
+struct osm_server *osm_server_load(const char *filename)
+{
+    struct osm_projection proj = { { OSM_FIELD_ALL, OSM_FIELD_ALL, OSM_FIELD_ALL }, NULL };
+    struct osm_server *server;
+    struct osm_reader *reader;
+    struct osm_batch *batch;
+    int ret, type;
+
+    if( !(reader = osm_reader_open(filename, OSM_ALL_TYPES, &proj, NULL)))
+        return NULL;
+
+    server = calloc(1, sizeof(struct osm_server));
+    while((ret = osm_reader_next(reader, &batch)) == 0)
+    {
+        struct element_store *store = &server->elements[batch->type];
+
+        if(store->batch_count == store->max_batches)
+        {
+            store->max_batches += 64;
+            store->batches = realloc(store->batches, store->max_batches * sizeof(struct osm_batch *));
+        }
+        store->batches[store->batch_count++] = osm_batch_copy(batch);
+        store->count += batch->count;
+    }
+    osm_reader_close(reader);
+    if(ret != 2)
+    {
+        fprintf(stderr, "osm_server_load(): Error reading <%s>\n", filename);
+        osm_server_free(server);
+        return NULL;
+    }
+
+    for(type = OSM_NODE; type <= OSM_RELATION; type++)
+        index_elements(&server->elements[type]);
+    build_rtree(server);
+    pthread_mutex_init(&server->conn_mutex, NULL);
+    pthread_cond_init(&server->conn_done, NULL);
+    pthread_mutex_init(&server->hist_mutex, NULL);
+
+    fprintf(stderr, "Loaded %d nodes, %d ways and %d relations\n", server->elements[OSM_NODE].count,
+            server->elements[OSM_WAY].count, server->elements[OSM_RELATION].count);
+
+    return server;
+}
+
+int osm_server_run(struct osm_server *server, const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "osm_server_run(): Socket path <%s> too long\n", path);
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* Remove a socket left behind by a previous server, but nothing else */
+    if(stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+       || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0)
+    {
+        fprintf(stderr, "osm_server_run(): Unable to listen on <%s>\n", path);
+        if(fd >= 0)
+            close(fd);
+        return 1;
+    }
+    fprintf(stderr, "Listening on <%s>\n", path);
+
+    while( !server->stop)
+    {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        struct connection *conn;
+        pthread_t thread;
+        int client;
+
+        /* Wake up regularly to check for osm_server_stop() */
+        if(poll(&pfd, 1, 250) <= 0 || (client = accept(fd, NULL, NULL)) < 0)
+            continue;
+
+        conn = malloc(sizeof(struct connection));
+        conn->server = server;
+        conn->fd = client;
+        pthread_mutex_lock(&server->conn_mutex);
+        if(server->conn_count == server->max_conns)
+        {
+            server->max_conns += 16;
+            server->conn_fds = realloc(server->conn_fds, server->max_conns * sizeof(int));
+        }
+        server->conn_fds[server->conn_count++] = client;
+        pthread_mutex_unlock(&server->conn_mutex);
+
+        if(pthread_create(&thread, NULL, start_connection, conn) != 0)
+        {
+            fprintf(stderr, "osm_server_run(): Unable to start connection thread\n");
+            remove_connection(server, client);
+            close(client);
+            free(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(fd);
+    unlink(path);
+
+    /* Wake up the connection threads and wait for them to finish */
+    pthread_mutex_lock(&server->conn_mutex);
+    while(server->conn_count > 0)
+    {
+        int i;
+
+        for(i = 0; i < server->conn_count; i++)
+            shutdown(server->conn_fds[i], SHUT_RDWR);
+        pthread_cond_wait(&server->conn_done, &server->conn_mutex);
+    }
+    pthread_mutex_unlock(&server->conn_mutex);
+
+    return 0;
+}
+
+void osm_server_stop(struct osm_server *server)
+{
+    server->stop = 1;
+
+    return;
+}
+
+void osm_server_print_stats(struct osm_server *server, FILE *fp)
+{
+    int q, b;
+
+    pthread_mutex_lock(&server->hist_mutex);
+    for(q = 0; q < QUERY_TYPES; q++)
+    {
+        uint64_t count = 0, seen = 0;
+        int p50 = -1, p99 = -1, max = 0;
+
+        for(b = 0; b < HIST_BUCKETS; b++)
+        {
+            count += server->hist[q][b];
+            if(server->hist[q][b])
+                max = b;
+        }
+        if(count == 0)
+            continue;
+        for(b = 0; b < HIST_BUCKETS; b++)
+        {
+            seen += server->hist[q][b];
+            if(p50 < 0 && 2 * seen >= count)
+                p50 = b;
+            if(p99 < 0 && 100 * seen >= 99 * count)
+                p99 = b;
+        }
+        fprintf(fp, "%-8s %10llu queries, mean %.1f us, p50 < %d us, p99 < %d us, max < %d us\n",
+                query_names[q], (unsigned long long)count, (double)server->total_us[q] / count,
+                1 << p50, 1 << p99, 1 << max);
+    }
+    pthread_mutex_unlock(&server->hist_mutex);
+
+    return;
+}
+
+void osm_server_free(struct osm_server *server)
+{
+    int type, i;
+
+    for(type = OSM_NODE; type <= OSM_RELATION; type++)
+    {
+        struct element_store *store = &server->elements[type];
+
+        for(i = 0; i < store->batch_count; i++)
+            osm_batch_free(store->batches[i]);
+        free(store->batches);
+        free(store->slots);
+    }
+    free(server->tree);
+    free(server->conn_fds);
+    free(server);
+
+    return;
+}
+
+/* Build the ID hash table of a store, kept no more than half full */
+static void index_elements(struct element_store *store)
+{
+    int b, i;
+
+    store->hash_size = 64;
+    while(store->hash_size < 2 * (uint32_t)store->count)
+        store->hash_size *= 2;
+    store->slots = calloc(store->hash_size, sizeof(struct id_slot));
+
+    for(b = 0; b < store->batch_count; b++)
+    {
+        struct osm_batch *batch = store->batches[b];
+
+        for(i = 0; i < batch->count; i++)
+        {
+            uint32_t slot = (batch->ids[i] * 2654435761u) & (store->hash_size - 1);
+
+            while(store->slots[slot].batch && store->slots[slot].id != batch->ids[i])
+                slot = (slot + 1) & (store->hash_size - 1);
+            store->slots[slot].id = batch->ids[i];
+            store->slots[slot].batch = b + 1;
+            store->slots[slot].index = i;
+        }
+    }
+
+    return;
+}
+
+/* Find an element by ID. Returns its index in the batch placed in
+ * *batch, or -1 if there is no such element. */
+static int find_element(struct osm_server *server, int type, unsigned int id, struct osm_batch **batch)
+{
+    struct element_store *store = &server->elements[type];
+    uint32_t slot = (id * 2654435761u) & (store->hash_size - 1);
+
+    while(store->slots[slot].batch)
+    {
+        if(store->slots[slot].id == id)
+        {
+            *batch = store->batches[store->slots[slot].batch - 1];
+            return store->slots[slot].index;
+        }
+        slot = (slot + 1) & (store->hash_size - 1);
+    }
+
+    return -1;
+}
+
+/* Build a packed R-tree over the bounding boxes of all ways whose nodes
+ * are present, with the Sort-Tile-Recursive method */
+static void build_rtree(struct osm_server *server)
+{
+    struct element_store *ways = &server->elements[OSM_WAY];
+    int max_nodes = 1, level_start = 0, level_count = 0, b, i;
+
+    /* Enough for every level of the tree */
+    for(i = ways->count; i > 1; i = (i + RTREE_FANOUT - 1) / RTREE_FANOUT)
+        max_nodes += i;
+    server->tree = malloc(max_nodes * sizeof(struct rtree_node));
+
+    for(b = 0; b < ways->batch_count; b++)
+    {
+        struct osm_batch *batch = ways->batches[b];
+
+        for(i = 0; i < batch->count; i++)
+        {
+            struct rtree_node *leaf = &server->tree[level_count];
+            uint32_t m;
+            int found = 0;
+
+            leaf->min_lat = leaf->min_lon = INT32_MAX;
+            leaf->max_lat = leaf->max_lon = INT32_MIN;
+            for(m = batch->member_offsets[i]; m < batch->member_offsets[i + 1]; m++)
+            {
+                struct osm_batch *nodes;
+                int n = find_element(server, OSM_NODE, batch->member_ids[m], &nodes);
+
+                if(n < 0)
+                    continue;
+                if(nodes->lat[n] < leaf->min_lat)
+                    leaf->min_lat = nodes->lat[n];
+                if(nodes->lat[n] > leaf->max_lat)
+                    leaf->max_lat = nodes->lat[n];
+                if(nodes->lon[n] < leaf->min_lon)
+                    leaf->min_lon = nodes->lon[n];
+                if(nodes->lon[n] > leaf->max_lon)
+                    leaf->max_lon = nodes->lon[n];
+                found = 1;
+            }
+            if( !found)
+                continue;
+            leaf->first = batch->ids[i];
+            leaf->count = 0;
+            level_count++;
+        }
+    }
+
+    server->tree_root = -1;
+    if(level_count == 0)
+        return;
+
+    /* Pack each level into parent nodes until only the root is left */
+    str_sort(server->tree, level_count);
+    while(level_count > 1)
+    {
+        int parents = (level_count + RTREE_FANOUT - 1) / RTREE_FANOUT, p;
+
+        for(p = 0; p < parents; p++)
+        {
+            struct rtree_node *node = &server->tree[level_start + level_count + p];
+            uint32_t first = level_start + p * RTREE_FANOUT, count = RTREE_FANOUT, c;
+
+            if(p == parents - 1)
+                count = level_count - p * RTREE_FANOUT;
+            *node = (struct rtree_node){ INT32_MAX, INT32_MAX, INT32_MIN, INT32_MIN, first, count };
+            for(c = node->first; c < node->first + node->count; c++)
+            {
+                struct rtree_node *child = &server->tree[c];
+
+                if(child->min_lat < node->min_lat)
+                    node->min_lat = child->min_lat;
+                if(child->min_lon < node->min_lon)
+                    node->min_lon = child->min_lon;
+                if(child->max_lat > node->max_lat)
+                    node->max_lat = child->max_lat;
+                if(child->max_lon > node->max_lon)
+                    node->max_lon = child->max_lon;
+            }
+        }
+        level_start += level_count;
+        level_count = parents;
+        if(level_count > 1)
+            str_sort(server->tree + level_start, level_count);
+    }
+    server->tree_count = level_start + 1;
+    server->tree_root = level_start;
+    server->min_lat = server->tree[level_start].min_lat;
+    server->min_lon = server->tree[level_start].min_lon;
+    server->max_lat = server->tree[level_start].max_lat;
+    server->max_lon = server->tree[level_start].max_lon;
+
+    return;
+}
+
+static int compare_lon(const void *a, const void *b)
+{
+    const struct rtree_node *na = a, *nb = b;
+    int64_t ca = (int64_t)na->min_lon + na->max_lon, cb = (int64_t)nb->min_lon + nb->max_lon;
+
+    return (ca > cb) - (ca < cb);
+}
+
+static int compare_lat(const void *a, const void *b)
+{
+    const struct rtree_node *na = a, *nb = b;
+    int64_t ca = (int64_t)na->min_lat + na->max_lat, cb = (int64_t)nb->min_lat + nb->max_lat;
+
+    return (ca > cb) - (ca < cb);
+}
+
+/* Order the nodes of one level so that each run of RTREE_FANOUT of them
+ * covers a compact area: sort into vertical slices by longitude, then
+ * each slice by latitude */
+static void str_sort(struct rtree_node *nodes, int count)
+{
+    int parents = (count + RTREE_FANOUT - 1) / RTREE_FANOUT;
+    int slices = (int)ceil(sqrt(parents)), slice_size, i;
+
+    slice_size = ((parents + slices - 1) / slices) * RTREE_FANOUT;
+    qsort(nodes, count, sizeof(struct rtree_node), compare_lon);
+    for(i = 0; i < count; i += slice_size)
+        qsort(nodes + i, (count - i < slice_size) ? count - i : slice_size,
+              sizeof(struct rtree_node), compare_lat);
+
+    return;
+}
+
+static int compare_id(const void *a, const void *b)
+{
+    unsigned int ia = *(const unsigned int *)a, ib = *(const unsigned int *)b;
+
+    return (ia > ib) - (ia < ib);
+}
+
+/* Thread serving one client connection until it is closed */
+static void *start_connection(void *data)
+{
+    struct connection *conn = data;
+    struct osm_server *server = conn->server;
+    struct reply reply = { NULL, 0, 0 };
+    char buf[MAX_QUERY];
+    size_t len = 0;
+    ssize_t n;
+
+    while((n = read(conn->fd, buf + len, sizeof(buf) - len)) > 0)
+    {
+        char *line = buf, *end;
+
+        len += n;
+        while((end = memchr(line, '\n', buf + len - line)))
+        {
+            struct timespec start, finish;
+            uint64_t us;
+            int type, b;
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            *end = '\0';
+            if(end > line && end[-1] == '\r')
+                end[-1] = '\0';
+            reply.len = 0;
+            type = answer_query(server, line, &reply);
+            reply_printf(&reply, "\n");
+            if(send(conn->fd, reply.buf, reply.len, MSG_NOSIGNAL) != (ssize_t)reply.len)
+                goto done;
+            clock_gettime(CLOCK_MONOTONIC, &finish);
+
+            us = (finish.tv_sec - start.tv_sec) * 1000000 + (finish.tv_nsec - start.tv_nsec) / 1000;
+            for(b = 0; b < HIST_BUCKETS - 1 && us >= ((uint64_t)1 << b); b++)
+                ;
+            pthread_mutex_lock(&server->hist_mutex);
+            server->hist[type][b]++;
+            server->total_us[type] += us;
+            pthread_mutex_unlock(&server->hist_mutex);
+
+            line = end + 1;
+        }
+
+        /* Keep the start of an incomplete query */
+        len -= line - buf;
+        memmove(buf, line, len);
+        if(len == sizeof(buf))
+        {
+            reply.len = 0;
+            reply_printf(&reply, "{\"error\":\"query too long\"}\n");
+            send(conn->fd, reply.buf, reply.len, MSG_NOSIGNAL);
+            break;
+        }
+    }
+
+done:
+    remove_connection(server, conn->fd);
+    close(conn->fd);
+    free(reply.buf);
+    free(conn);
+
+    return NULL;
+}
+
+static void remove_connection(struct osm_server *server, int fd)
+{
+    int i;
+
+    pthread_mutex_lock(&server->conn_mutex);
+    for(i = 0; i < server->conn_count; i++)
+    {
+        if(server->conn_fds[i] == fd)
+        {
+            server->conn_fds[i] = server->conn_fds[--server->conn_count];
+            break;
+        }
+    }
+    pthread_cond_signal(&server->conn_done);
+    pthread_mutex_unlock(&server->conn_mutex);
+
+    return;
+}
+
+/* Answer a single query. Returns the QUERY_* type, for the statistics. */
+static int answer_query(struct osm_server *server, char *query, struct reply *reply)
+{
+    char command[16];
+    double min_lon, min_lat, max_lon, max_lat;
+    unsigned int id;
+    int type;
+
+    if(sscanf(query, "bbox %lf %lf %lf %lf", &min_lon, &min_lat, &max_lon, &max_lat) == 4)
+    {
+        int32_t q_min_lat = lround(min_lat * 1e7), q_max_lat = lround(max_lat * 1e7);
+        int32_t q_min_lon = lround(min_lon * 1e7), q_max_lon = lround(max_lon * 1e7);
+        unsigned int *ids = NULL;
+        int *stack = NULL, depth = 0, max_depth = 0, count = 0, max_ids = 0, i;
+
+        if(server->tree_root >= 0)
+        {
+            max_depth = RTREE_FANOUT * 16;
+            stack = malloc(max_depth * sizeof(int));
+            stack[depth++] = server->tree_root;
+        }
+        while(depth > 0)
+        {
+            struct rtree_node *node = &server->tree[stack[--depth]];
+
+            if(node->max_lat < q_min_lat || node->min_lat > q_max_lat
+               || node->max_lon < q_min_lon || node->min_lon > q_max_lon)
+                continue;
+            if(node->count == 0)
+            {
+                if(count == max_ids)
+                {
+                    max_ids += 256;
+                    ids = realloc(ids, max_ids * sizeof(unsigned int));
+                }
+                ids[count++] = node->first;
+                continue;
+            }
+            if(depth + node->count > max_depth)
+            {
+                max_depth += node->count + RTREE_FANOUT * 16;
+                stack = realloc(stack, max_depth * sizeof(int));
+            }
+            for(i = 0; i < node->count; i++)
+                stack[depth++] = node->first + i;
+        }
+
+        qsort(ids, count, sizeof(unsigned int), compare_id);
+        reply_printf(reply, "{\"ways\":[");
+        for(i = 0; i < count; i++)
+            reply_printf(reply, i ? ",%u" : "%u", ids[i]);
+        reply_printf(reply, "]}");
+        free(ids);
+        free(stack);
+
+        return QUERY_BBOX;
+    }
+
+    if(sscanf(query, "%15s %u", command, &id) == 2)
+    {
+        struct osm_batch *batch;
+        int i;
+        uint32_t m;
+
+        for(type = OSM_NODE; type <= OSM_RELATION; type++)
+        {
+            if(strcmp(command, query_names[type]) == 0)
+                break;
+        }
+        if(type > OSM_RELATION)
+            goto unknown;
+
+        if((i = find_element(server, type, id, &batch)) < 0)
+        {
+            reply_printf(reply, "{\"error\":\"not found\",\"type\":\"%s\",\"id\":%u}", query_names[type], id);
+            return type;
+        }
+
+        reply_printf(reply, "{\"type\":\"%s\",\"id\":%u", query_names[type], id);
+        if(type == OSM_NODE)
+            reply_printf(reply, ",\"lat\":%.7f,\"lon\":%.7f", batch->lat[i] / 1e7, batch->lon[i] / 1e7);
+        else if(type == OSM_WAY)
+        {
+            reply_printf(reply, ",\"nodes\":[");
+            for(m = batch->member_offsets[i]; m < batch->member_offsets[i + 1]; m++)
+                reply_printf(reply, m > batch->member_offsets[i] ? ",%u" : "%u", batch->member_ids[m]);
+            reply_printf(reply, "]");
+        }
+        else
+        {
+            reply_printf(reply, ",\"members\":[");
+            for(m = batch->member_offsets[i]; m < batch->member_offsets[i + 1]; m++)
+            {
+                reply_printf(reply, "%s{\"type\":\"%s\",\"ref\":%u,\"role\":", m > batch->member_offsets[i] ? "," : "",
+                             query_names[batch->member_types[m]], batch->member_ids[m]);
+                reply_string(reply, batch->strings + batch->member_roles[m]);
+                reply_printf(reply, "}");
+            }
+            reply_printf(reply, "]");
+        }
+        reply_tags(reply, batch, i);
+        reply_printf(reply, "}");
+
+        return type;
+    }
+
+    if(strcmp(query, "info") == 0)
+    {
+        reply_printf(reply, "{\"nodes\":%d,\"ways\":%d,\"relations\":%d", server->elements[OSM_NODE].count,
+                     server->elements[OSM_WAY].count, server->elements[OSM_RELATION].count);
+        if(server->tree_root >= 0)
+            reply_printf(reply, ",\"bbox\":[%.7f,%.7f,%.7f,%.7f]", server->min_lon / 1e7, server->min_lat / 1e7,
+                         server->max_lon / 1e7, server->max_lat / 1e7);
+        reply_printf(reply, "}");
+        return QUERY_OTHER;
+    }
+    if(strcmp(query, "stats") == 0)
+    {
+        reply_stats(server, reply);
+        return QUERY_OTHER;
+    }
+
+unknown:
+    reply_printf(reply, "{\"error\":\"unknown query\"}");
+
+    return QUERY_OTHER;
+}
+
+/* Append the latency histograms to a reply */
+static void reply_stats(struct osm_server *server, struct reply *reply)
+{
+    int q, b;
+
+    reply_printf(reply, "{\"bucket_limits_us\":[");
+    for(b = 0; b < HIST_BUCKETS; b++)
+        reply_printf(reply, b ? ",%u" : "%u", 1u << b);
+    reply_printf(reply, "]");
+
+    pthread_mutex_lock(&server->hist_mutex);
+    for(q = 0; q < QUERY_TYPES; q++)
+    {
+        uint64_t count = 0;
+
+        for(b = 0; b < HIST_BUCKETS; b++)
+            count += server->hist[q][b];
+        reply_printf(reply, ",\"%s\":{\"count\":%llu,\"total_us\":%llu,\"histogram\":[", query_names[q],
+                     (unsigned long long)count, (unsigned long long)server->total_us[q]);
+        for(b = 0; b < HIST_BUCKETS; b++)
+            reply_printf(reply, b ? ",%llu" : "%llu", (unsigned long long)server->hist[q][b]);
+        reply_printf(reply, "]}");
+    }
+    pthread_mutex_unlock(&server->hist_mutex);
+    reply_printf(reply, "}");
+
+    return;
+}
+
+static void reply_tags(struct reply *reply, struct osm_batch *batch, int i)
+{
+    uint32_t t;
+
+    reply_printf(reply, ",\"tags\":{");
+    for(t = batch->tag_offsets[i]; t < batch->tag_offsets[i + 1]; t++)
+    {
+        if(t > batch->tag_offsets[i])
+            reply_printf(reply, ",");
+        reply_string(reply, batch->strings + batch->tag_keys[t]);
+        reply_printf(reply, ":");
+        reply_string(reply, batch->strings + batch->tag_values[t]);
+    }
+    reply_printf(reply, "}");
+
+    return;
+}
+
+/* Append a string to a reply as a quoted JSON string */
+static void reply_string(struct reply *reply, const char *str)
+{
+    reply_printf(reply, "\"");
+    for(; *str; str++)
+    {
+        unsigned char c = *str;
+
+        if(c == '"' || c == '\\')
+            reply_printf(reply, "\\%c", c);
+        else if(c < 0x20)
+            reply_printf(reply, "\\u%04x", c);
+        else
+        {
+            if(reply->len + 1 >= reply->max)
+                reply_printf(reply, "%c", c);
+            else
+            {
+                reply->buf[reply->len++] = c;
+                reply->buf[reply->len] = '\0';
+            }
+        }
+    }
+    reply_printf(reply, "\"");
+
+    return;
+}
+
+static void reply_printf(struct reply *reply, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    while(1)
+    {
+        va_start(ap, fmt);
+        n = vsnprintf(reply->buf + reply->len, reply->max - reply->len, fmt, ap);
+        va_end(ap);
+        if(reply->len + n < reply->max)
+            break;
+        reply->max = 2 * reply->max + n + 256;
+        reply->buf = realloc(reply->buf, reply->max);
+    }
+    reply->len += n;
+
+    return;
+}
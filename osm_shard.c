@@ -0,0 +1,604 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Output split into one file per grid cell. The calling thread works out
+ * which cells each element belongs in and appends a copy of it, once per
+ * cell, to a batch for the writer thread that owns the cell. Each writer
+ * thread owns a fixed subset of the cells and writes their files with
+ * its own struct osm_output, so no file is ever shared between threads. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "osm.h"
+
+#define MAX_THREADS     16
+#define SHARD_BATCH     1024 /**< Elements handed to a writer thread at a time */
+#define QUEUE_LEN       4    /**< Batches waiting for each writer thread */
+#define MAX_LAT_MERCATOR 85.0511287798
+
+/* Output file for one grid cell */
+struct shard_file
+{
+    uint32_t cell;
+    FILE *fp;
+    struct osm_output *out;
+};
+
+/* Batch of elements handed to a writer thread; element i is written to
+ * the file of cell cells[i] */
+struct shard_item
+{
+    struct osm_batch *batch;
+    uint32_t *cells;
+};
+
+struct shard_writer
+{
+    struct osm_shard *shard;
+    pthread_t thread;
+
+    /* Batch being filled by the calling thread */
+    struct shard_item fill;
+
+    /* Batches waiting to be written */
+    struct shard_item queue[QUEUE_LEN];
+    int queue_start, queue_len;
+    char exit_now;
+    pthread_mutex_t mutex;
+    pthread_cond_t signal;
+
+    /* Files of the cells owned by this thread, in an open-addressed hash
+     * table keyed on cell number */
+    struct shard_file *files;
+    int file_count, hash_size;
+    int error;
+};
+
+/* Cell of a node */
+struct node_cell
+{
+    unsigned int id;
+    uint32_t cell;
+};
+
+/* Cells of a way, held in the shared cell pool */
+struct way_cells
+{
+    unsigned int id;
+    uint32_t start, count;
+};
+
+struct osm_shard
+{
+    char *prefix;
+    int format;
+    int grid;         /**< OSM_GRID_* */
+    double size;      /**< Cell size in degrees, or zoom level */
+    uint32_t columns; /**< Number of cells in each row of the grid */
+    uint32_t rows;
+
+    struct shard_writer *writers;
+    int nwriters;
+
+    /* Cells of the nodes and ways written so far, for placing the ways
+     * and relations that refer to them */
+    struct node_cell *nodes;
+    int node_count, max_nodes;
+    char nodes_unsorted;
+    struct way_cells *ways;
+    int way_count, max_ways;
+    char ways_unsorted;
+    uint32_t *way_pool;
+    int pool_count, max_pool;
+
+    /* Cells of the element being placed */
+    uint32_t *cells;
+    int cell_count, max_cells;
+};
+
+static void *start_writer_thread(void *);
+static void hand_over(struct shard_writer *);
+static void dispatch(struct osm_shard *, int type, void *element);
+
+struct osm_shard *osm_shard_open(const char *prefix, int format, int grid, double size)
+{
+    struct osm_shard *shard = calloc(1, sizeof(struct osm_shard));
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    struct rlimit limit;
+    int w;
+
+    shard->prefix = strdup(prefix);
+    shard->format = format;
+    shard->grid = grid;
+    shard->size = size;
+
+    if(grid == OSM_GRID_TILES)
+    {
+        if(size < 0 || size > 16)
+        {
+            fprintf(stderr, "osm_shard_open(): Tile zoom level must be from 0 to 16\n");
+            goto open_failed;
+        }
+        shard->columns = shard->rows = 1u << (int)size;
+    }
+    else
+    {
+        if(size < 0.01 || size > 360)
+        {
+            fprintf(stderr, "osm_shard_open(): Cell size must be from 0.01 to 360 degrees\n");
+            goto open_failed;
+        }
+        shard->columns = (uint32_t)ceil(360 / size);
+        shard->rows = (uint32_t)ceil(180 / size);
+    }
+
+    /* There may be a file open for every cell, so allow as many open
+     * files as the system permits */
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    shard->nwriters = ncpu < 1 ? 1 : (ncpu > MAX_THREADS ? MAX_THREADS : ncpu);
+    shard->writers = calloc(shard->nwriters, sizeof(struct shard_writer));
+    for(w = 0; w < shard->nwriters; w++)
+    {
+        struct shard_writer *writer = &shard->writers[w];
+
+        writer->shard = shard;
+        writer->hash_size = 64;
+        writer->files = calloc(writer->hash_size, sizeof(struct shard_file));
+        pthread_mutex_init(&writer->mutex, NULL);
+        pthread_cond_init(&writer->signal, NULL);
+        if(pthread_create(&writer->thread, NULL, start_writer_thread, writer) != 0)
+        {
+            fprintf(stderr, "osm_shard_open(): Unable to start writer thread\n");
+            shard->nwriters = w;
+            osm_shard_close(shard);
+            return NULL;
+        }
+    }
+
+    return shard;
+
+open_failed:
+    free(shard->prefix);
+    free(shard);
+    return NULL;
+}
+
+void osm_shard_node(struct osm_shard *shard, struct osm_node *node)
+{
+    double lat = node->lat, lon = node->lon;
+    uint32_t x, y, cell;
+
+    /* Work out the grid cell */
+    if(shard->grid == OSM_GRID_TILES)
+    {
+        double lat_rad;
+
+        if(lat > MAX_LAT_MERCATOR)
+            lat = MAX_LAT_MERCATOR;
+        else if(lat < -MAX_LAT_MERCATOR)
+            lat = -MAX_LAT_MERCATOR;
+        lat_rad = lat * M_PI / 180;
+        x = (uint32_t)floor((lon + 180) / 360 * shard->columns);
+        y = (uint32_t)floor((1 - asinh(tan(lat_rad)) / M_PI) / 2 * shard->rows);
+    }
+    else
+    {
+        x = (uint32_t)floor((lon + 180) / shard->size);
+        y = (uint32_t)floor((lat + 90) / shard->size);
+    }
+    if(x >= shard->columns)
+        x = shard->columns - 1;
+    if(y >= shard->rows)
+        y = shard->rows - 1;
+    cell = y * shard->columns + x;
+
+    /* Remember it for the ways */
+    if(shard->node_count >= shard->max_nodes)
+    {
+        shard->max_nodes = shard->max_nodes ? 2 * shard->max_nodes : 65536;
+        shard->nodes = realloc(shard->nodes, shard->max_nodes * sizeof(struct node_cell));
+    }
+    if(shard->node_count > 0 && node->id < shard->nodes[shard->node_count - 1].id)
+        shard->nodes_unsorted = 1;
+    shard->nodes[shard->node_count].id = node->id;
+    shard->nodes[shard->node_count].cell = cell;
+    shard->node_count++;
+
+    shard->cell_count = 0;
+    if(shard->max_cells < 1)
+    {
+        shard->max_cells = 64;
+        shard->cells = malloc(shard->max_cells * sizeof(uint32_t));
+    }
+    shard->cells[shard->cell_count++] = cell;
+    dispatch(shard, OSM_NODE, node);
+
+    return;
+}
+
+static int cmp_node_cell(const void *a, const void *b)
+{
+    const struct node_cell *aa = a, *bb = b;
+
+    return aa->id < bb->id ? -1 : aa->id > bb->id;
+}
+
+static int cmp_way_cells(const void *a, const void *b)
+{
+    const struct way_cells *aa = a, *bb = b;
+
+    return aa->id < bb->id ? -1 : aa->id > bb->id;
+}
+
+/* Add a cell to the list of cells of the element being placed, unless
+ * it is already there */
+static void add_cell(struct osm_shard *shard, uint32_t cell)
+{
+    int c;
+
+    for(c = 0; c < shard->cell_count; c++)
+    {
+        if(shard->cells[c] == cell)
+            return;
+    }
+
+    if(shard->cell_count >= shard->max_cells)
+    {
+        shard->max_cells = shard->max_cells ? 2 * shard->max_cells : 64;
+        shard->cells = realloc(shard->cells, shard->max_cells * sizeof(uint32_t));
+    }
+    shard->cells[shard->cell_count++] = cell;
+
+    return;
+}
+
+static void add_node_cells(struct osm_shard *shard, unsigned int *nodes, int count)
+{
+    struct node_cell key, *found;
+    int n;
+
+    if(shard->nodes_unsorted)
+    {
+        qsort(shard->nodes, shard->node_count, sizeof(struct node_cell), cmp_node_cell);
+        shard->nodes_unsorted = 0;
+    }
+
+    for(n = 0; n < count; n++)
+    {
+        key.id = nodes[n];
+        found = bsearch(&key, shard->nodes, shard->node_count, sizeof(struct node_cell), cmp_node_cell);
+        if(found)
+            add_cell(shard, found->cell);
+    }
+
+    return;
+}
+
+void osm_shard_way(struct osm_shard *shard, struct osm_way *way)
+{
+    struct way_cells *wc;
+    int c;
+
+    shard->cell_count = 0;
+    add_node_cells(shard, way->nodes, way->node_count);
+
+    /* Remember the cells for the relations */
+    if(shard->way_count >= shard->max_ways)
+    {
+        shard->max_ways = shard->max_ways ? 2 * shard->max_ways : 16384;
+        shard->ways = realloc(shard->ways, shard->max_ways * sizeof(struct way_cells));
+    }
+    if(shard->pool_count + shard->cell_count > shard->max_pool)
+    {
+        while(shard->pool_count + shard->cell_count > shard->max_pool)
+            shard->max_pool = shard->max_pool ? 2 * shard->max_pool : 65536;
+        shard->way_pool = realloc(shard->way_pool, shard->max_pool * sizeof(uint32_t));
+    }
+    if(shard->way_count > 0 && way->id < shard->ways[shard->way_count - 1].id)
+        shard->ways_unsorted = 1;
+    wc = &shard->ways[shard->way_count++];
+    wc->id = way->id;
+    wc->start = shard->pool_count;
+    wc->count = shard->cell_count;
+    for(c = 0; c < shard->cell_count; c++)
+        shard->way_pool[shard->pool_count++] = shard->cells[c];
+
+    dispatch(shard, OSM_WAY, way);
+
+    return;
+}
+
+void osm_shard_relation(struct osm_shard *shard, struct osm_relation *rel)
+{
+    struct way_cells key, *found;
+    uint32_t c;
+    int w;
+
+    shard->cell_count = 0;
+    add_node_cells(shard, rel->nodes, rel->node_count);
+
+    if(shard->ways_unsorted)
+    {
+        qsort(shard->ways, shard->way_count, sizeof(struct way_cells), cmp_way_cells);
+        shard->ways_unsorted = 0;
+    }
+    for(w = 0; w < rel->way_count; w++)
+    {
+        key.id = rel->ways[w];
+        found = bsearch(&key, shard->ways, shard->way_count, sizeof(struct way_cells), cmp_way_cells);
+        if( !found)
+            continue;
+        for(c = 0; c < found->count; c++)
+            add_cell(shard, shard->way_pool[found->start + c]);
+    }
+
+    dispatch(shard, OSM_RELATION, rel);
+
+    return;
+}
+
+/* Append an element to the batch of the writer thread owning each of the
+ * cells it has been placed in */
+static void dispatch(struct osm_shard *shard, int type, void *element)
+{
+    int c;
+
+    for(c = 0; c < shard->cell_count; c++)
+    {
+        struct shard_writer *writer = &shard->writers[shard->cells[c] % shard->nwriters];
+        struct shard_item *fill = &writer->fill;
+
+        if(fill->batch && fill->batch->type != type)
+            hand_over(writer);
+        if( !fill->batch)
+        {
+            fill->batch = osm_batch_new(type);
+            fill->cells = malloc(SHARD_BATCH * sizeof(uint32_t));
+        }
+
+        fill->cells[fill->batch->count] = shard->cells[c];
+        if(type == OSM_NODE)
+            osm_batch_add_node(fill->batch, element);
+        else if(type == OSM_WAY)
+            osm_batch_add_way(fill->batch, element);
+        else
+            osm_batch_add_relation(fill->batch, element);
+
+        if(fill->batch->count >= SHARD_BATCH)
+            hand_over(writer);
+    }
+
+    return;
+}
+
+/* Pass the batch being filled to the writer thread, waiting if its queue
+ * is full */
+static void hand_over(struct shard_writer *writer)
+{
+    if( !writer->fill.batch)
+        return;
+
+    pthread_mutex_lock(&writer->mutex);
+    while(writer->queue_len >= QUEUE_LEN)
+        pthread_cond_wait(&writer->signal, &writer->mutex);
+    writer->queue[(writer->queue_start + writer->queue_len) % QUEUE_LEN] = writer->fill;
+    writer->queue_len++;
+    pthread_cond_broadcast(&writer->signal);
+    pthread_mutex_unlock(&writer->mutex);
+
+    writer->fill.batch = NULL;
+    writer->fill.cells = NULL;
+
+    return;
+}
+
+/* Find the file for a cell, opening it if this is the first element in it */
+static struct shard_file *get_file(struct shard_writer *writer, uint32_t cell)
+{
+    struct osm_shard *shard = writer->shard;
+    struct shard_file *file;
+    uint32_t slot = (cell * 2654435761u) & (writer->hash_size - 1);
+    char filename[1024];
+
+    for(file = &writer->files[slot]; file->fp; file = &writer->files[slot])
+    {
+        if(file->cell == cell)
+            return file->out ? file : NULL;
+        slot = (slot + 1) & (writer->hash_size - 1);
+    }
+
+    /* Keep the hash table no more than half full */
+    if(2 * (writer->file_count + 1) > writer->hash_size)
+    {
+        struct shard_file *old = writer->files;
+        int old_size = writer->hash_size, i;
+
+        writer->hash_size *= 2;
+        writer->files = calloc(writer->hash_size, sizeof(struct shard_file));
+        for(i = 0; i < old_size; i++)
+        {
+            if( !old[i].fp)
+                continue;
+            slot = (old[i].cell * 2654435761u) & (writer->hash_size - 1);
+            while(writer->files[slot].fp)
+                slot = (slot + 1) & (writer->hash_size - 1);
+            writer->files[slot] = old[i];
+        }
+        free(old);
+
+        slot = (cell * 2654435761u) & (writer->hash_size - 1);
+        while(writer->files[slot].fp)
+            slot = (slot + 1) & (writer->hash_size - 1);
+    }
+
+    snprintf(filename, sizeof(filename), "%s_%u_%u.%s", shard->prefix,
+             cell % shard->columns, cell / shard->columns,
+             shard->format == OSM_FORMAT_PBF ? "osm.pbf" : "osm");
+    file = &writer->files[slot];
+    file->cell = cell;
+    if( !(file->fp = fopen(filename, "wb")))
+    {
+        fprintf(stderr, "osm_shard: Unable to open output file <%s>\n", filename);
+        writer->error = 1;
+        /* Leave a placeholder so that the error is reported once */
+        file->fp = stderr;
+        writer->file_count++;
+        return NULL;
+    }
+    /* Compression is done in this thread, as each writer thread already
+     * has plenty of files to write */
+    if( !(file->out = osm_output_open_threads(file->fp, shard->format, 0)))
+        writer->error = 1;
+    writer->file_count++;
+
+    return file->out ? file : NULL;
+}
+
+static void write_item(struct shard_writer *writer, struct shard_item *item)
+{
+    struct osm_batch *batch = item->batch;
+    int i;
+
+    for(i = 0; i < batch->count; i++)
+    {
+        struct shard_file *file = get_file(writer, item->cells[i]);
+
+        if( !file)
+            continue;
+
+        switch(batch->type)
+        {
+            case OSM_NODE:
+                osm_output_node(file->out, osm_batch_node(batch, i));
+                break;
+            case OSM_WAY:
+                osm_output_way(file->out, osm_batch_way(batch, i));
+                break;
+            case OSM_RELATION:
+                osm_output_relation(file->out, osm_batch_relation(batch, i));
+                break;
+        }
+    }
+
+    osm_batch_free(batch);
+    free(item->cells);
+
+    return;
+}
+
+/* Writer thread, writing the batches handed to it until told to exit */
+static void *start_writer_thread(void *data)
+{
+    struct shard_writer *writer = data;
+    int i;
+
+    pthread_mutex_lock(&writer->mutex);
+    while(1)
+    {
+        struct shard_item item;
+
+        if(writer->queue_len == 0)
+        {
+            if(writer->exit_now)
+                break;
+            pthread_cond_wait(&writer->signal, &writer->mutex);
+            continue;
+        }
+
+        item = writer->queue[writer->queue_start];
+        writer->queue_start = (writer->queue_start + 1) % QUEUE_LEN;
+        writer->queue_len--;
+        pthread_cond_broadcast(&writer->signal);
+        pthread_mutex_unlock(&writer->mutex);
+
+        write_item(writer, &item);
+
+        pthread_mutex_lock(&writer->mutex);
+    }
+    pthread_mutex_unlock(&writer->mutex);
+
+    /* Finish the files of this thread's cells */
+    for(i = 0; i < writer->hash_size; i++)
+    {
+        struct shard_file *file = &writer->files[i];
+
+        if( !file->out)
+            continue;
+        if(osm_output_close(file->out) != 0 || fclose(file->fp) != 0)
+            writer->error = 1;
+    }
+
+    return NULL;
+}
+
+int osm_shard_close(struct osm_shard *shard)
+{
+    int error = 0, files = 0, w;
+
+    for(w = 0; w < shard->nwriters; w++)
+    {
+        struct shard_writer *writer = &shard->writers[w];
+
+        hand_over(writer);
+        pthread_mutex_lock(&writer->mutex);
+        writer->exit_now = 1;
+        pthread_cond_broadcast(&writer->signal);
+        pthread_mutex_unlock(&writer->mutex);
+    }
+
+    for(w = 0; w < shard->nwriters; w++)
+    {
+        struct shard_writer *writer = &shard->writers[w];
+
+        pthread_join(writer->thread, NULL);
+        pthread_mutex_destroy(&writer->mutex);
+        pthread_cond_destroy(&writer->signal);
+        error |= writer->error;
+        files += writer->file_count;
+        free(writer->files);
+    }
+
+    if(error)
+        fprintf(stderr, "osm_shard_close(): Error writing output\n");
+    else
+        fprintf(stderr, "Wrote %d shards\n", files);
+
+    free(shard->writers);
+    free(shard->nodes);
+    free(shard->ways);
+    free(shard->way_pool);
+    free(shard->cells);
+    free(shard->prefix);
+    free(shard);
+
+    return error;
+}
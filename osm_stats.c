@@ -0,0 +1,291 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Tag statistics. Counts of the elements carrying each value of a set of
+ * keys are kept in an open-addressed hash table, with each distinct value
+ * copied once into an arena. One table is filled per input file without
+ * locking, and the tables are merged at the end. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "osm.h"
+
+#define ARENA_BLOCK (64 * 1024) /**< Size of each block of interned strings */
+
+/* Count for one key and value */
+struct stats_entry
+{
+    const char *value; /**< Interned, or NULL if the slot is empty */
+    uint32_t hash;
+    int key;           /**< Index into keys[] */
+    uint64_t count[3]; /**< Nodes, ways and relations */
+    double length;     /**< Total length of ways in metres */
+};
+
+struct osm_stats
+{
+    char **keys;
+    int key_count;
+
+    struct stats_entry *entries;
+    int entry_count, entry_max; /**< entry_max is a power of two */
+
+    /* Blocks of interned strings */
+    char **blocks;
+    int block_count;
+    size_t block_used;
+};
+
+static struct stats_entry *find_entry(struct osm_stats *, int key, const char *value);
+static void grow_table(struct osm_stats *);
+static const char *intern(struct osm_stats *, const char *str);
+
+struct osm_stats *osm_stats_new(char **keys, int key_count)
+{
+    struct osm_stats *stats = calloc(1, sizeof(struct osm_stats));
+    int k;
+
+    stats->keys = malloc(key_count * sizeof(char *));
+    for(k = 0; k < key_count; k++)
+        stats->keys[k] = strdup(keys[k]);
+    stats->key_count = key_count;
+
+    stats->entry_max = 1024;
+    stats->entries = calloc(stats->entry_max, sizeof(struct stats_entry));
+    stats->block_used = ARENA_BLOCK;
+
+    return stats;
+}
+
+/* Index of a key in the list of keys of interest, or -1 */
+static int key_index(struct osm_stats *stats, const char *key)
+{
+    int k;
+
+    for(k = 0; k < stats->key_count; k++)
+    {
+        if(strcmp(stats->keys[k], key) == 0)
+            return k;
+    }
+
+    return -1;
+}
+
+void osm_stats_add_batch(struct osm_stats *stats, struct osm_batch *batch)
+{
+    uint32_t t;
+
+    /* Each tag belongs to exactly one element, so the tags of the whole
+     * batch can be scanned in one loop */
+    for(t = 0; t < batch->tag_offsets[batch->count]; t++)
+    {
+        int key = key_index(stats, batch->strings + batch->tag_keys[t]);
+
+        if(key >= 0)
+            find_entry(stats, key, batch->strings + batch->tag_values[t])->count[batch->type]++;
+    }
+
+    return;
+}
+
+void osm_stats_add_length(struct osm_stats *stats, struct osm_way *way, double length)
+{
+    int t;
+
+    for(t = 0; t < way->tag_count; t++)
+    {
+        int key = key_index(stats, way->tags[t].key);
+
+        if(key >= 0)
+            find_entry(stats, key, way->tags[t].value)->length += length;
+    }
+
+    return;
+}
+
+void osm_stats_merge(struct osm_stats *dest, struct osm_stats *src)
+{
+    int e, ele;
+
+    for(e = 0; e < src->entry_max; e++)
+    {
+        struct stats_entry *from = &src->entries[e], *to;
+
+        if( !from->value)
+            continue;
+        /* Both were created with the same keys, in the same order */
+        to = find_entry(dest, from->key, from->value);
+        for(ele = OSM_NODE; ele <= OSM_RELATION; ele++)
+            to->count[ele] += from->count[ele];
+        to->length += from->length;
+    }
+
+    return;
+}
+
+static int cmp_entries(const void *a, const void *b)
+{
+    const struct stats_entry *ea = *(const struct stats_entry **)a;
+    const struct stats_entry *eb = *(const struct stats_entry **)b;
+    uint64_t ta = ea->count[0] + ea->count[1] + ea->count[2];
+    uint64_t tb = eb->count[0] + eb->count[1] + eb->count[2];
+
+    if(ea->key != eb->key)
+        return ea->key - eb->key;
+    if(ta != tb)
+        return ta > tb ? -1 : 1;
+
+    return strcmp(ea->value, eb->value);
+}
+
+int osm_stats_write(struct osm_stats *stats, FILE *fp)
+{
+    struct stats_entry **sorted = malloc((stats->entry_count + 1) * sizeof(struct stats_entry *));
+    int e, n = 0;
+
+    for(e = 0; e < stats->entry_max; e++)
+    {
+        if(stats->entries[e].value)
+            sorted[n++] = &stats->entries[e];
+    }
+    qsort(sorted, n, sizeof(struct stats_entry *), cmp_entries);
+
+    fprintf(fp, "%-20s %-30s %12s %12s %12s %12s\n", "key", "value", "nodes", "ways",
+            "relations", "length_km");
+    for(e = 0; e < n; e++)
+    {
+        struct stats_entry *entry = sorted[e];
+
+        fprintf(fp, "%-20s %-30s %12llu %12llu %12llu %12.1f\n", stats->keys[entry->key],
+                entry->value, (unsigned long long)entry->count[OSM_NODE],
+                (unsigned long long)entry->count[OSM_WAY],
+                (unsigned long long)entry->count[OSM_RELATION], entry->length / 1000);
+    }
+    free(sorted);
+
+    if(fflush(fp) != 0)
+    {
+        fprintf(stderr, "osm_stats_write(): Error writing statistics\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+void osm_stats_free(struct osm_stats *stats)
+{
+    int i;
+
+    for(i = 0; i < stats->key_count; i++)
+        free(stats->keys[i]);
+    free(stats->keys);
+    for(i = 0; i < stats->block_count; i++)
+        free(stats->blocks[i]);
+    free(stats->blocks);
+    free(stats->entries);
+    free(stats);
+
+    return;
+}
+
+static uint32_t hash_value(int key, const char *value)
+{
+    uint32_t hash = 2166136261u ^ key;
+
+    /* 32-bit FNV-1a */
+    while(*value)
+        hash = (hash ^ (unsigned char)*value++) * 16777619u;
+
+    return hash;
+}
+
+/* Find the entry for a key and value, adding it if it is not present */
+static struct stats_entry *find_entry(struct osm_stats *stats, int key, const char *value)
+{
+    uint32_t hash = hash_value(key, value);
+    int slot = hash & (stats->entry_max - 1);
+    struct stats_entry *entry;
+
+    while((entry = &stats->entries[slot])->value)
+    {
+        if(entry->hash == hash && entry->key == key && strcmp(entry->value, value) == 0)
+            return entry;
+        slot = (slot + 1) & (stats->entry_max - 1);
+    }
+
+    /* Keep the table at most half full */
+    if(2 * (stats->entry_count + 1) > stats->entry_max)
+    {
+        grow_table(stats);
+        return find_entry(stats, key, value);
+    }
+
+    entry->value = intern(stats, value);
+    entry->hash = hash;
+    entry->key = key;
+    stats->entry_count++;
+
+    return entry;
+}
+
+static void grow_table(struct osm_stats *stats)
+{
+    struct stats_entry *old = stats->entries;
+    int old_max = stats->entry_max, e;
+
+    stats->entry_max *= 2;
+    stats->entries = calloc(stats->entry_max, sizeof(struct stats_entry));
+    for(e = 0; e < old_max; e++)
+    {
+        int slot;
+
+        if( !old[e].value)
+            continue;
+        slot = old[e].hash & (stats->entry_max - 1);
+        while(stats->entries[slot].value)
+            slot = (slot + 1) & (stats->entry_max - 1);
+        stats->entries[slot] = old[e];
+    }
+    free(old);
+
+    return;
+}
+
+/* Copy a string into the arena */
+static const char *intern(struct osm_stats *stats, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy;
+
+    if(stats->block_used + len > ARENA_BLOCK)
+    {
+        stats->blocks = realloc(stats->blocks, (stats->block_count + 1) * sizeof(char *));
+        /* Values are limited to OSM_TAG_SIZE, so always fit in a block */
+        stats->blocks[stats->block_count++] = malloc(ARENA_BLOCK);
+        stats->block_used = 0;
+    }
+    copy = stats->blocks[stats->block_count - 1] + stats->block_used;
+    memcpy(copy, str, len);
+    stats->block_used += len;
+
+    return copy;
+}
@@ -0,0 +1,936 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Mapbox Vector Tiles of the railway ways. Node locations and ways are
+ * collected while the extract is written, as for the graph. For each zoom
+ * level the way geometries, in Web Mercator, are simplified with the
+ * Douglas-Peucker algorithm and listed against every tile that one of
+ * their segments touches. A pool of threads then clips the ways to each
+ * tile and encodes and writes the tiles as DIR/Z/X/Y.mvt. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "osm.h"
+
+#define MAX_THREADS      16
+#define MVT_EXTENT       4096 /**< Size of a tile in tile coordinates */
+#define MVT_BUFFER       64   /**< Overlap of the geometry clipped to each tile */
+#define TILE_CHUNK       64   /**< Tiles taken by a writer thread at a time */
+#define MAX_LAT_MERCATOR 85.0511287798
+
+/* Vector tile geometry commands */
+#define CMD_MOVE_TO 1
+#define CMD_LINE_TO 2
+
+/* Way as stored until the tiles are built */
+struct tile_way
+{
+    unsigned int id;
+    int node_start, node_count; /**< Node IDs in way_nodes[] */
+    int tag_start, tag_count;   /**< Key and value offsets in tag_strings[] */
+    int pt_start, pt_count;     /**< Projected points in geom[] */
+};
+
+/* Reference from a tile to a way crossing it */
+struct tile_ref
+{
+    uint32_t x, y;
+    int way;
+};
+
+/* Growable byte buffer for building protocol buffer messages */
+struct pb_buf
+{
+    unsigned char *data;
+    size_t len, max;
+};
+
+/* Strings of the key or value table of a tile, with an open-addressed
+ * hash table for finding their indices */
+struct string_table
+{
+    const char **strs;
+    int count, max;
+    int *slots;     /**< Index plus one of the string in each slot, or 0 */
+    int slot_max;   /**< Power of two */
+};
+
+struct osm_tiles
+{
+    char *dir;
+    int min_zoom, max_zoom;
+
+    /* Locations of all nodes in the extract, in world coordinates (0 to 1
+     * across the Web Mercator square) */
+    unsigned int *node_ids;
+    double *node_xy;
+    int node_count, node_max;
+    char nodes_unsorted;
+
+    struct tile_way *ways;
+    int way_count, way_max;
+    unsigned int *way_nodes;
+    int way_node_count, way_node_max;
+    uint32_t *tag_offsets;      /**< Alternating key and value offsets into tag_strings */
+    int tag_count, tag_max;
+    char *tag_strings;
+    size_t strings_len, strings_max;
+
+    /* Full and simplified geometry of the ways, as x, y pairs */
+    double *geom, *simple;
+    int *simple_start, *simple_count;
+
+    /* Tiles of the zoom level being written */
+    int zoom;
+    struct tile_ref *refs;
+    int ref_count;
+    int next_ref;    /**< Index into refs of the next tile to be written */
+    int tiles_written, error;
+    pthread_mutex_t mutex;
+};
+
+/* State of one tile writer thread */
+struct tile_writer
+{
+    struct osm_tiles *tiles;
+    pthread_t thread;
+
+    struct pb_buf tile, layer, feature, packed;
+    struct string_table keys, values;
+    uint32_t *cmds;       /**< Geometry commands of the feature being built */
+    int cmd_count, cmd_max;
+    int32_t *part;        /**< Points of the line being clipped */
+    int part_count, part_max;
+    int32_t cursor_x, cursor_y;
+};
+
+static int cmp_node(const void *a, const void *b);
+static int cmp_ref(const void *a, const void *b);
+static uint32_t add_string(struct osm_tiles *, const char *str);
+static int node_index(struct osm_tiles *, unsigned int id);
+static int simplify(const double *pts, int count, double tolerance, char *keep, int *stack, double *out);
+static void assign_tiles(struct osm_tiles *);
+static void *start_writer_thread(void *);
+static int write_metadata(struct osm_tiles *);
+
+struct osm_tiles *osm_tiles_init(const char *dir, int min_zoom, int max_zoom)
+{
+    struct osm_tiles *tiles = calloc(1, sizeof(struct osm_tiles));
+
+    tiles->dir = strdup(dir);
+    tiles->min_zoom = min_zoom;
+    tiles->max_zoom = max_zoom;
+
+    return tiles;
+}
+
+void osm_tiles_add_node(struct osm_tiles *tiles, struct osm_node *node)
+{
+    double lat = node->lat;
+
+    if(tiles->node_count >= tiles->node_max)
+    {
+        tiles->node_max += 100000;
+        tiles->node_ids = realloc(tiles->node_ids, tiles->node_max * sizeof(unsigned int));
+        tiles->node_xy = realloc(tiles->node_xy, 2 * tiles->node_max * sizeof(double));
+    }
+
+    if(lat > MAX_LAT_MERCATOR)
+        lat = MAX_LAT_MERCATOR;
+    else if(lat < -MAX_LAT_MERCATOR)
+        lat = -MAX_LAT_MERCATOR;
+
+    if(tiles->node_count > 0 && node->id < tiles->node_ids[tiles->node_count - 1])
+        tiles->nodes_unsorted = 1;
+    tiles->node_ids[tiles->node_count] = node->id;
+    tiles->node_xy[2 * tiles->node_count] = (node->lon + 180) / 360;
+    tiles->node_xy[2 * tiles->node_count + 1] = (1 - asinh(tan(lat * M_PI / 180)) / M_PI) / 2;
+    tiles->node_count++;
+
+    return;
+}
+
+void osm_tiles_add_way(struct osm_tiles *tiles, struct osm_way *way)
+{
+    struct tile_way *tw;
+    int t;
+
+    if(way->node_count < 2)
+        return;
+
+    if(tiles->way_count >= tiles->way_max)
+    {
+        tiles->way_max += 10000;
+        tiles->ways = realloc(tiles->ways, tiles->way_max * sizeof(struct tile_way));
+    }
+    if(tiles->way_node_count + way->node_count > tiles->way_node_max)
+    {
+        tiles->way_node_max += 100000 + way->node_count;
+        tiles->way_nodes = realloc(tiles->way_nodes, tiles->way_node_max * sizeof(unsigned int));
+    }
+    if(tiles->tag_count + way->tag_count > tiles->tag_max)
+    {
+        tiles->tag_max += 10000 + way->tag_count;
+        tiles->tag_offsets = realloc(tiles->tag_offsets, 2 * tiles->tag_max * sizeof(uint32_t));
+    }
+
+    tw = &tiles->ways[tiles->way_count++];
+    tw->id = way->id;
+    tw->node_start = tiles->way_node_count;
+    tw->node_count = way->node_count;
+    memcpy(tiles->way_nodes + tiles->way_node_count, way->nodes, way->node_count * sizeof(unsigned int));
+    tiles->way_node_count += way->node_count;
+
+    tw->tag_start = tiles->tag_count;
+    tw->tag_count = way->tag_count;
+    for(t = 0; t < way->tag_count; t++)
+    {
+        tiles->tag_offsets[2 * tiles->tag_count] = add_string(tiles, way->tags[t].key);
+        tiles->tag_offsets[2 * tiles->tag_count + 1] = add_string(tiles, way->tags[t].value);
+        tiles->tag_count++;
+    }
+
+    return;
+}
+
+int osm_tiles_write(struct osm_tiles *tiles)
+{
+    struct tile_writer *writers;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = ncpu < 1 ? 1 : (ncpu > MAX_THREADS ? MAX_THREADS : ncpu);
+    int w, n, pt_count = 0, max_count = 0, ret = 0;
+    char *keep;
+    int *stack;
+
+    /* Sort the nodes by ID, if they were not added in order */
+    if(tiles->nodes_unsorted)
+    {
+        struct { unsigned int id; double x, y; } *tmp = malloc(tiles->node_count * sizeof(*tmp));
+
+        for(n = 0; n < tiles->node_count; n++)
+        {
+            tmp[n].id = tiles->node_ids[n];
+            tmp[n].x = tiles->node_xy[2 * n];
+            tmp[n].y = tiles->node_xy[2 * n + 1];
+        }
+        qsort(tmp, tiles->node_count, sizeof(*tmp), cmp_node);
+        for(n = 0; n < tiles->node_count; n++)
+        {
+            tiles->node_ids[n] = tmp[n].id;
+            tiles->node_xy[2 * n] = tmp[n].x;
+            tiles->node_xy[2 * n + 1] = tmp[n].y;
+        }
+        free(tmp);
+    }
+
+    /* Resolve the geometry of each way. Nodes missing from the input are
+     * left out. */
+    tiles->geom = malloc(2 * (tiles->way_node_count + 1) * sizeof(double));
+    for(w = 0; w < tiles->way_count; w++)
+    {
+        struct tile_way *tw = &tiles->ways[w];
+
+        tw->pt_start = pt_count;
+        for(n = 0; n < tw->node_count; n++)
+        {
+            int idx = node_index(tiles, tiles->way_nodes[tw->node_start + n]);
+
+            if(idx < 0)
+                continue;
+            tiles->geom[2 * pt_count] = tiles->node_xy[2 * idx];
+            tiles->geom[2 * pt_count + 1] = tiles->node_xy[2 * idx + 1];
+            pt_count++;
+        }
+        tw->pt_count = pt_count - tw->pt_start;
+        if(tw->pt_count > max_count)
+            max_count = tw->pt_count;
+    }
+
+    tiles->simple = malloc(2 * (pt_count + 1) * sizeof(double));
+    tiles->simple_start = malloc((tiles->way_count + 1) * sizeof(int));
+    tiles->simple_count = malloc((tiles->way_count + 1) * sizeof(int));
+    keep = malloc(max_count + 1);
+    stack = malloc(2 * (max_count + 1) * sizeof(int));
+    pthread_mutex_init(&tiles->mutex, NULL);
+    writers = calloc(nthreads, sizeof(struct tile_writer));
+
+    for(tiles->zoom = tiles->min_zoom; tiles->zoom <= tiles->max_zoom && !ret; tiles->zoom++)
+    {
+        /* Points closer than one tile coordinate to the simplified line
+         * cannot be seen */
+        double tolerance = 1.0 / ((double)MVT_EXTENT * (1 << tiles->zoom));
+        char path[1024];
+
+        pt_count = 0;
+        for(w = 0; w < tiles->way_count; w++)
+        {
+            struct tile_way *tw = &tiles->ways[w];
+
+            tiles->simple_start[w] = pt_count;
+            tiles->simple_count[w] = simplify(tiles->geom + 2 * tw->pt_start, tw->pt_count, tolerance,
+                                              keep, stack, tiles->simple + 2 * pt_count);
+            pt_count += tiles->simple_count[w];
+        }
+        assign_tiles(tiles);
+
+        snprintf(path, sizeof(path), "%s/%d", tiles->dir, tiles->zoom);
+        if((mkdir(tiles->dir, 0777) != 0 && errno != EEXIST)
+           || (mkdir(path, 0777) != 0 && errno != EEXIST))
+        {
+            fprintf(stderr, "osm_tiles_write(): Unable to create directory <%s>\n", path);
+            ret = 1;
+            break;
+        }
+
+        /* Write the tiles in parallel, this thread included */
+        tiles->next_ref = tiles->tiles_written = 0;
+        for(w = 0; w < nthreads; w++)
+        {
+            writers[w].tiles = tiles;
+            if(w > 0 && pthread_create(&writers[w].thread, NULL, start_writer_thread, &writers[w]) != 0)
+            {
+                fprintf(stderr, "osm_tiles_write(): Unable to start writer thread\n");
+                break;
+            }
+        }
+        start_writer_thread(&writers[0]);
+        for(n = 1; n < w; n++)
+            pthread_join(writers[n].thread, NULL);
+
+        fprintf(stderr, "Zoom %d: %d tiles\n", tiles->zoom, tiles->tiles_written);
+        if(tiles->error)
+            ret = 1;
+    }
+
+    if( !ret)
+        ret = write_metadata(tiles);
+
+    for(w = 0; w < nthreads; w++)
+    {
+        free(writers[w].tile.data);
+        free(writers[w].layer.data);
+        free(writers[w].feature.data);
+        free(writers[w].packed.data);
+        free(writers[w].keys.strs);
+        free(writers[w].keys.slots);
+        free(writers[w].values.strs);
+        free(writers[w].values.slots);
+        free(writers[w].cmds);
+        free(writers[w].part);
+    }
+    free(writers);
+    free(keep);
+    free(stack);
+    pthread_mutex_destroy(&tiles->mutex);
+
+    return ret;
+}
+
+void osm_tiles_destroy(struct osm_tiles *tiles)
+{
+    free(tiles->dir);
+    free(tiles->node_ids);
+    free(tiles->node_xy);
+    free(tiles->ways);
+    free(tiles->way_nodes);
+    free(tiles->tag_offsets);
+    free(tiles->tag_strings);
+    free(tiles->geom);
+    free(tiles->simple);
+    free(tiles->simple_start);
+    free(tiles->simple_count);
+    free(tiles->refs);
+    free(tiles);
+
+    return;
+}
+
+static int cmp_node(const void *a, const void *b)
+{
+    unsigned int aa = *(const unsigned int *)a, bb = *(const unsigned int *)b;
+
+    return aa < bb ? -1 : (aa > bb ? 1 : 0);
+}
+
+static int cmp_ref(const void *a, const void *b)
+{
+    const struct tile_ref *ra = a, *rb = b;
+
+    if(ra->x != rb->x)
+        return ra->x < rb->x ? -1 : 1;
+    if(ra->y != rb->y)
+        return ra->y < rb->y ? -1 : 1;
+
+    return ra->way - rb->way;
+}
+
+/* Copy a string into the tag string arena and return its offset */
+static uint32_t add_string(struct osm_tiles *tiles, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    uint32_t offset = tiles->strings_len;
+
+    if(tiles->strings_len + len > tiles->strings_max)
+    {
+        tiles->strings_max = 2 * tiles->strings_max + len + 65536;
+        tiles->tag_strings = realloc(tiles->tag_strings, tiles->strings_max);
+    }
+    memcpy(tiles->tag_strings + tiles->strings_len, str, len);
+    tiles->strings_len += len;
+
+    return offset;
+}
+
+/* Index of a node in the node arrays, or -1 if it is not present */
+static int node_index(struct osm_tiles *tiles, unsigned int id)
+{
+    int lo = 0, hi = tiles->node_count - 1;
+
+    while(lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if(tiles->node_ids[mid] < id)
+            lo = mid + 1;
+        else if(tiles->node_ids[mid] > id)
+            hi = mid - 1;
+        else
+            return mid;
+    }
+
+    return -1;
+}
+
+/* Square of the distance from point p to the segment from a to b */
+static double segment_dist2(const double *p, const double *a, const double *b)
+{
+    double dx = b[0] - a[0], dy = b[1] - a[1], len2 = dx * dx + dy * dy, t = 0;
+
+    if(len2 > 0)
+    {
+        t = ((p[0] - a[0]) * dx + (p[1] - a[1]) * dy) / len2;
+        t = t < 0 ? 0 : (t > 1 ? 1 : t);
+    }
+    dx = a[0] + t * dx - p[0];
+    dy = a[1] + t * dy - p[1];
+
+    return dx * dx + dy * dy;
+}
+
+/* Simplify a line with the Douglas-Peucker algorithm, using an explicit
+ * stack of ranges rather than recursion. Returns the number of points
+ * written to "out". */
+static int simplify(const double *pts, int count, double tolerance, char *keep, int *stack, double *out)
+{
+    int top = 0, i, n = 0;
+
+    if(count < 3)
+    {
+        memcpy(out, pts, 2 * count * sizeof(double));
+        return count;
+    }
+
+    memset(keep, 0, count);
+    keep[0] = keep[count - 1] = 1;
+    stack[top++] = 0;
+    stack[top++] = count - 1;
+    while(top > 0)
+    {
+        int last = stack[--top], first = stack[--top], far = -1;
+        double max = tolerance * tolerance;
+
+        for(i = first + 1; i < last; i++)
+        {
+            double d = segment_dist2(pts + 2 * i, pts + 2 * first, pts + 2 * last);
+
+            if(d > max)
+            {
+                max = d;
+                far = i;
+            }
+        }
+        if(far < 0)
+            continue;
+        keep[far] = 1;
+        stack[top++] = first;
+        stack[top++] = far;
+        stack[top++] = far;
+        stack[top++] = last;
+    }
+
+    for(i = 0; i < count; i++)
+    {
+        if(keep[i])
+        {
+            out[2 * n] = pts[2 * i];
+            out[2 * n + 1] = pts[2 * i + 1];
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/* List each way against every tile touched by one of its simplified
+ * segments, allowing for the buffer, sorted by tile */
+static void assign_tiles(struct osm_tiles *tiles)
+{
+    double scale = (double)(1 << tiles->zoom), buffer = (double)MVT_BUFFER / MVT_EXTENT;
+    int64_t limit = (1 << tiles->zoom) - 1;
+    int max_refs = 0, w, i, r, out;
+
+    tiles->ref_count = 0;
+    for(w = 0; w < tiles->way_count; w++)
+    {
+        const double *pts = tiles->simple + 2 * tiles->simple_start[w];
+
+        for(i = 0; i + 1 < tiles->simple_count[w]; i++)
+        {
+            const double *a = pts + 2 * i, *b = a + 2;
+            int64_t x0 = floor(fmin(a[0], b[0]) * scale - buffer), x1 = floor(fmax(a[0], b[0]) * scale + buffer);
+            int64_t y0 = floor(fmin(a[1], b[1]) * scale - buffer), y1 = floor(fmax(a[1], b[1]) * scale + buffer);
+            int64_t x, y;
+
+            x0 = x0 < 0 ? 0 : x0;
+            y0 = y0 < 0 ? 0 : y0;
+            x1 = x1 > limit ? limit : x1;
+            y1 = y1 > limit ? limit : y1;
+            for(x = x0; x <= x1; x++)
+            {
+                for(y = y0; y <= y1; y++)
+                {
+                    if(tiles->ref_count >= max_refs)
+                    {
+                        max_refs = 2 * max_refs + 100000;
+                        tiles->refs = realloc(tiles->refs, max_refs * sizeof(struct tile_ref));
+                    }
+                    tiles->refs[tiles->ref_count].x = x;
+                    tiles->refs[tiles->ref_count].y = y;
+                    tiles->refs[tiles->ref_count].way = w;
+                    tiles->ref_count++;
+                }
+            }
+        }
+    }
+
+    qsort(tiles->refs, tiles->ref_count, sizeof(struct tile_ref), cmp_ref);
+    for(r = out = 0; r < tiles->ref_count; r++)
+    {
+        if(out > 0 && cmp_ref(&tiles->refs[out - 1], &tiles->refs[r]) == 0)
+            continue;
+        tiles->refs[out++] = tiles->refs[r];
+    }
+    tiles->ref_count = out;
+
+    return;
+}
+
+/* Protocol buffer encoding */
+
+static void pb_reserve(struct pb_buf *buf, size_t len)
+{
+    if(buf->len + len > buf->max)
+    {
+        buf->max = 2 * buf->max + len + 1024;
+        buf->data = realloc(buf->data, buf->max);
+    }
+}
+
+static void pb_varint(struct pb_buf *buf, uint64_t v)
+{
+    pb_reserve(buf, 10);
+    while(v >= 0x80)
+    {
+        buf->data[buf->len++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    buf->data[buf->len++] = v;
+}
+
+static void pb_uint_field(struct pb_buf *buf, int field, uint64_t v)
+{
+    pb_varint(buf, field << 3);
+    pb_varint(buf, v);
+}
+
+static void pb_bytes_field(struct pb_buf *buf, int field, const void *data, size_t len)
+{
+    pb_varint(buf, (field << 3) | 2);
+    pb_varint(buf, len);
+    pb_reserve(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static inline uint32_t zigzag(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+/* Index of a string in a key or value table, adding it if necessary */
+static int table_index(struct string_table *table, const char *str)
+{
+    uint32_t hash = 2166136261u;
+    const char *p;
+    int slot, s;
+
+    if(2 * (table->count + 1) > table->slot_max)
+    {
+        /* Rebuild the hash table at twice the size */
+        table->slot_max = table->slot_max ? 2 * table->slot_max : 256;
+        table->slots = realloc(table->slots, table->slot_max * sizeof(int));
+        memset(table->slots, 0, table->slot_max * sizeof(int));
+        for(s = 0; s < table->count; s++)
+        {
+            uint32_t h = 2166136261u;
+
+            for(p = table->strs[s]; *p; p++)
+                h = (h ^ (unsigned char)*p) * 16777619u;
+            slot = h & (table->slot_max - 1);
+            while(table->slots[slot])
+                slot = (slot + 1) & (table->slot_max - 1);
+            table->slots[slot] = s + 1;
+        }
+    }
+
+    for(p = str; *p; p++)
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    slot = hash & (table->slot_max - 1);
+    while((s = table->slots[slot]))
+    {
+        if(strcmp(table->strs[s - 1], str) == 0)
+            return s - 1;
+        slot = (slot + 1) & (table->slot_max - 1);
+    }
+
+    if(table->count >= table->max)
+    {
+        table->max = 2 * table->max + 256;
+        table->strs = realloc(table->strs, table->max * sizeof(const char *));
+    }
+    table->strs[table->count] = str;
+    table->slots[slot] = ++table->count;
+
+    return table->count - 1;
+}
+
+static void table_clear(struct string_table *table)
+{
+    table->count = 0;
+    if(table->slots)
+        memset(table->slots, 0, table->slot_max * sizeof(int));
+
+    return;
+}
+
+static void add_cmd(struct tile_writer *writer, uint32_t cmd)
+{
+    if(writer->cmd_count >= writer->cmd_max)
+    {
+        writer->cmd_max = 2 * writer->cmd_max + 1024;
+        writer->cmds = realloc(writer->cmds, writer->cmd_max * sizeof(uint32_t));
+    }
+    writer->cmds[writer->cmd_count++] = cmd;
+}
+
+static void add_part_point(struct tile_writer *writer, double x, double y)
+{
+    int32_t ix = lround(x), iy = lround(y);
+
+    /* Points falling on the same tile coordinate are merged */
+    if(writer->part_count > 0 && writer->part[2 * writer->part_count - 2] == ix
+       && writer->part[2 * writer->part_count - 1] == iy)
+        return;
+    if(writer->part_count >= writer->part_max)
+    {
+        writer->part_max = 2 * writer->part_max + 256;
+        writer->part = realloc(writer->part, 2 * writer->part_max * sizeof(int32_t));
+    }
+    writer->part[2 * writer->part_count] = ix;
+    writer->part[2 * writer->part_count + 1] = iy;
+    writer->part_count++;
+}
+
+/* Encode the line being clipped as a MoveTo and a LineTo command */
+static void end_part(struct tile_writer *writer)
+{
+    int i;
+
+    if(writer->part_count >= 2)
+    {
+        add_cmd(writer, CMD_MOVE_TO | (1 << 3));
+        for(i = 0; i < writer->part_count; i++)
+        {
+            if(i == 1)
+                add_cmd(writer, CMD_LINE_TO | ((writer->part_count - 1) << 3));
+            add_cmd(writer, zigzag(writer->part[2 * i] - writer->cursor_x));
+            add_cmd(writer, zigzag(writer->part[2 * i + 1] - writer->cursor_y));
+            writer->cursor_x = writer->part[2 * i];
+            writer->cursor_y = writer->part[2 * i + 1];
+        }
+    }
+    writer->part_count = 0;
+
+    return;
+}
+
+/* Clip a way to a tile, with each segment clipped by the Liang-Barsky
+ * method, and encode the pieces inside as geometry commands */
+static void clip_way(struct tile_writer *writer, int w, uint32_t tx, uint32_t ty)
+{
+    struct osm_tiles *tiles = writer->tiles;
+    const double *pts = tiles->simple + 2 * tiles->simple_start[w];
+    double scale = (double)(1 << tiles->zoom) * MVT_EXTENT;
+    double lo = -MVT_BUFFER, hi = MVT_EXTENT + MVT_BUFFER;
+    int i, open = 0;
+
+    writer->cmd_count = writer->part_count = 0;
+    writer->cursor_x = writer->cursor_y = 0;
+    for(i = 0; i + 1 < tiles->simple_count[w]; i++)
+    {
+        double x0 = pts[2 * i] * scale - (double)tx * MVT_EXTENT;
+        double y0 = pts[2 * i + 1] * scale - (double)ty * MVT_EXTENT;
+        double dx = pts[2 * i + 2] * scale - (double)tx * MVT_EXTENT - x0;
+        double dy = pts[2 * i + 3] * scale - (double)ty * MVT_EXTENT - y0;
+        double p[4] = { -dx, dx, -dy, dy }, q[4] = { x0 - lo, hi - x0, y0 - lo, hi - y0 };
+        double t0 = 0, t1 = 1;
+        int k, inside = 1;
+
+        for(k = 0; k < 4 && inside; k++)
+        {
+            if(p[k] == 0)
+            {
+                if(q[k] < 0)
+                    inside = 0;
+            }
+            else if(p[k] < 0)
+                t0 = fmax(t0, q[k] / p[k]);
+            else
+                t1 = fmin(t1, q[k] / p[k]);
+            if(t0 > t1)
+                inside = 0;
+        }
+        if( !inside)
+        {
+            if(open)
+                end_part(writer);
+            open = 0;
+            continue;
+        }
+
+        /* A segment entering the tile starts a new line */
+        if( !open || t0 > 0)
+        {
+            end_part(writer);
+            add_part_point(writer, x0 + t0 * dx, y0 + t0 * dy);
+        }
+        add_part_point(writer, x0 + t1 * dx, y0 + t1 * dy);
+        open = t1 == 1;
+        if( !open)
+            end_part(writer);
+    }
+    end_part(writer);
+
+    return;
+}
+
+/* Encode a tile holding the ways refs[start] to refs[end - 1] and write it */
+static int write_tile(struct tile_writer *writer, int start, int end)
+{
+    struct osm_tiles *tiles = writer->tiles;
+    uint32_t tx = tiles->refs[start].x, ty = tiles->refs[start].y;
+    int r, t, features = 0;
+    char path[1024];
+    FILE *fp;
+
+    writer->layer.len = 0;
+    table_clear(&writer->keys);
+    table_clear(&writer->values);
+    pb_bytes_field(&writer->layer, 1, "rail", 4);
+
+    for(r = start; r < end; r++)
+    {
+        struct tile_way *tw = &tiles->ways[tiles->refs[r].way];
+
+        clip_way(writer, tiles->refs[r].way, tx, ty);
+        if(writer->cmd_count == 0)
+            continue;
+
+        writer->feature.len = 0;
+        pb_uint_field(&writer->feature, 1, tw->id);
+
+        writer->packed.len = 0;
+        for(t = tw->tag_start; t < tw->tag_start + tw->tag_count; t++)
+        {
+            pb_varint(&writer->packed, table_index(&writer->keys, tiles->tag_strings + tiles->tag_offsets[2 * t]));
+            pb_varint(&writer->packed, table_index(&writer->values, tiles->tag_strings + tiles->tag_offsets[2 * t + 1]));
+        }
+        if(writer->packed.len > 0)
+            pb_bytes_field(&writer->feature, 2, writer->packed.data, writer->packed.len);
+        pb_uint_field(&writer->feature, 3, 2); /* LINESTRING */
+
+        writer->packed.len = 0;
+        for(t = 0; t < writer->cmd_count; t++)
+            pb_varint(&writer->packed, writer->cmds[t]);
+        pb_bytes_field(&writer->feature, 4, writer->packed.data, writer->packed.len);
+
+        pb_bytes_field(&writer->layer, 2, writer->feature.data, writer->feature.len);
+        features++;
+    }
+    if(features == 0)
+        return 0;
+
+    for(t = 0; t < writer->keys.count; t++)
+        pb_bytes_field(&writer->layer, 3, writer->keys.strs[t], strlen(writer->keys.strs[t]));
+    for(t = 0; t < writer->values.count; t++)
+    {
+        /* Value message with string_value */
+        writer->packed.len = 0;
+        pb_bytes_field(&writer->packed, 1, writer->values.strs[t], strlen(writer->values.strs[t]));
+        pb_bytes_field(&writer->layer, 4, writer->packed.data, writer->packed.len);
+    }
+    pb_uint_field(&writer->layer, 5, MVT_EXTENT);
+    pb_uint_field(&writer->layer, 15, 2);
+
+    writer->tile.len = 0;
+    pb_bytes_field(&writer->tile, 3, writer->layer.data, writer->layer.len);
+
+    snprintf(path, sizeof(path), "%s/%d/%u", tiles->dir, tiles->zoom, tx);
+    if(mkdir(path, 0777) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "osm_tiles_write(): Unable to create directory <%s>\n", path);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/%d/%u/%u.mvt", tiles->dir, tiles->zoom, tx, ty);
+    if( !(fp = fopen(path, "wb")))
+    {
+        fprintf(stderr, "osm_tiles_write(): Unable to open file <%s>\n", path);
+        return 1;
+    }
+    if(fwrite(writer->tile.data, 1, writer->tile.len, fp) != writer->tile.len || fclose(fp) != 0)
+    {
+        fprintf(stderr, "osm_tiles_write(): Error writing file <%s>\n", path);
+        return 1;
+    }
+
+    pthread_mutex_lock(&tiles->mutex);
+    tiles->tiles_written++;
+    pthread_mutex_unlock(&tiles->mutex);
+
+    return 0;
+}
+
+/* Writer thread taking chunks of tiles until none are left */
+static void *start_writer_thread(void *data)
+{
+    struct tile_writer *writer = data;
+    struct osm_tiles *tiles = writer->tiles;
+
+    while(1)
+    {
+        int start, end, count, error = 0;
+
+        /* Take the next TILE_CHUNK tiles, ending at a tile boundary */
+        pthread_mutex_lock(&tiles->mutex);
+        start = tiles->next_ref;
+        for(end = start, count = 0; end < tiles->ref_count; end++)
+        {
+            if(end > start && (tiles->refs[end].x != tiles->refs[end - 1].x
+                               || tiles->refs[end].y != tiles->refs[end - 1].y)
+               && ++count == TILE_CHUNK)
+                break;
+        }
+        tiles->next_ref = end;
+        error = tiles->error;
+        pthread_mutex_unlock(&tiles->mutex);
+        if(start >= end || error)
+            break;
+
+        while(start < end)
+        {
+            int next = start + 1;
+
+            while(next < end && tiles->refs[next].x == tiles->refs[start].x
+                  && tiles->refs[next].y == tiles->refs[start].y)
+                next++;
+            if(write_tile(writer, start, next) != 0)
+            {
+                pthread_mutex_lock(&tiles->mutex);
+                tiles->error = 1;
+                pthread_mutex_unlock(&tiles->mutex);
+                break;
+            }
+            start = next;
+        }
+    }
+
+    return NULL;
+}
+
+/* Write metadata.json describing the tile set, with the fields of the
+ * MBTiles metadata table */
+static int write_metadata(struct osm_tiles *tiles)
+{
+    double bounds[4] = { 180, 90, -180, -90 };
+    char path[1024];
+    FILE *fp;
+    int n;
+
+    for(n = 0; n < tiles->node_count; n++)
+    {
+        double lon = tiles->node_xy[2 * n] * 360 - 180;
+        double lat = atan(sinh(M_PI * (1 - 2 * tiles->node_xy[2 * n + 1]))) * 180 / M_PI;
+
+        bounds[0] = fmin(bounds[0], lon);
+        bounds[1] = fmin(bounds[1], lat);
+        bounds[2] = fmax(bounds[2], lon);
+        bounds[3] = fmax(bounds[3], lat);
+    }
+    if(tiles->node_count == 0)
+        bounds[0] = bounds[1] = bounds[2] = bounds[3] = 0;
+
+    snprintf(path, sizeof(path), "%s/metadata.json", tiles->dir);
+    if( !(fp = fopen(path, "w")))
+    {
+        fprintf(stderr, "osm_tiles_write(): Unable to open file <%s>\n", path);
+        return 1;
+    }
+    fprintf(fp, "{\"name\":\"osmrail\",\"format\":\"pbf\",\"type\":\"overlay\","
+            "\"minzoom\":%d,\"maxzoom\":%d,\"bounds\":\"%.7f,%.7f,%.7f,%.7f\","
+            "\"json\":\"{\\\"vector_layers\\\":[{\\\"id\\\":\\\"rail\\\",\\\"minzoom\\\":%d,"
+            "\\\"maxzoom\\\":%d,\\\"fields\\\":{}}]}\"}\n",
+            tiles->min_zoom, tiles->max_zoom, bounds[0], bounds[1], bounds[2], bounds[3],
+            tiles->min_zoom, tiles->max_zoom);
+    if(fclose(fp) != 0)
+    {
+        fprintf(stderr, "osm_tiles_write(): Error writing file <%s>\n", path);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,911 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Minimal implementation of the zlib (RFC 1950) and deflate (RFC 1951)
+ * compressed data formats, as used for the blobs of OSM PBF files. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include "osm.h"
+
+#define MAX_BITS   15  /**< Maximum length of a deflate Huffman code */
+#define FAST_BITS  10  /**< Number of bits decoded by table lookup in one step */
+
+/* Bit reader for deflate streams. Bits are consumed least significant first. */
+struct bit_reader
+{
+    const unsigned char *in, *end;
+    uint64_t bits;   /**< Bit accumulator */
+    int nbits;       /**< Number of valid bits in accumulator */
+    int overrun;     /**< Number of bytes read past the end of the input */
+};
+
+/* Huffman decoding table. Codes of up to FAST_BITS bits are decoded with a
+ * single lookup; longer codes are decoded canonically one bit at a time. */
+struct huffman
+{
+    /** (length << 9) | symbol for each FAST_BITS-bit prefix, 0 if code is longer */
+    unsigned short fast[1 << FAST_BITS];
+    short count[MAX_BITS + 1]; /**< Number of codes of each length */
+    short symbol[288];         /**< Symbols ordered by code */
+};
+
+static const short length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const short length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const short dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577 };
+static const short dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+/* Order in which code length code lengths are transmitted */
+static const unsigned char clen_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static inline void refill(struct bit_reader *br)
+{
+    while(br->nbits <= 56)
+    {
+        if(br->in < br->end)
+            br->bits |= (uint64_t)*br->in++ << br->nbits;
+        else
+            br->overrun++;
+        br->nbits += 8;
+    }
+}
+
+/* Discard bits up to the next byte boundary and return any whole bytes
+ * remaining in the accumulator to the input. Returns -1 if the input was
+ * already exhausted. */
+static int align_input(struct bit_reader *br)
+{
+    int unused = br->nbits / 8 - br->overrun;
+
+    if(unused < 0)
+        return -1;
+    br->in -= unused;
+    br->bits = 0;
+    br->nbits = 0;
+    br->overrun = 0;
+
+    return 0;
+}
+
+static inline unsigned int get_bits(struct bit_reader *br, int n)
+{
+    unsigned int val;
+
+    if(n == 0)
+        return 0;
+    if(br->nbits < n)
+        refill(br);
+    val = br->bits & ((1u << n) - 1);
+    br->bits >>= n;
+    br->nbits -= n;
+
+    return val;
+}
+
+/* Build decoding table from array of code lengths. Returns 0 on success,
+ * or -1 if the set of lengths is over-subscribed. Incomplete codes are
+ * permitted since they are legitimate for single distance codes. */
+static int build_huffman(struct huffman *h, const unsigned char *lengths, int n)
+{
+    short offs[MAX_BITS + 2];
+    int left, len, sym, code;
+
+    memset(h->count, 0, sizeof(h->count));
+    for(sym = 0; sym < n; sym++)
+        h->count[lengths[sym]]++;
+
+    left = 1;
+    for(len = 1; len <= MAX_BITS; len++)
+    {
+        left <<= 1;
+        left -= h->count[len];
+        if(left < 0)
+            return -1;
+    }
+
+    offs[1] = 0;
+    for(len = 1; len <= MAX_BITS; len++)
+        offs[len + 1] = offs[len] + h->count[len];
+    for(sym = 0; sym < n; sym++)
+        if(lengths[sym] != 0)
+            h->symbol[offs[lengths[sym]]++] = sym;
+
+    /* Fill the fast lookup table. Canonical codes are assigned in order of
+     * length and then symbol value, and are transmitted most significant
+     * bit first, so must be bit-reversed for indexing. */
+    memset(h->fast, 0, sizeof(h->fast));
+    code = 0;
+    sym = 0;
+    for(len = 1; len <= FAST_BITS; len++)
+    {
+        int i;
+
+        for(i = 0; i < h->count[len]; i++, sym++, code++)
+        {
+            int rev = 0, b, fill;
+
+            for(b = 0; b < len; b++)
+                rev |= ((code >> b) & 1) << (len - 1 - b);
+            for(fill = rev; fill < (1 << FAST_BITS); fill += (1 << len))
+                h->fast[fill] = (len << 9) | h->symbol[sym];
+        }
+        code <<= 1;
+    }
+
+    return 0;
+}
+
+/* Decode one symbol, or return -1 if the code is invalid */
+static inline int decode_symbol(struct bit_reader *br, const struct huffman *h)
+{
+    int code, first, index, len;
+    unsigned short entry;
+
+    if(br->nbits < MAX_BITS)
+        refill(br);
+
+    entry = h->fast[br->bits & ((1 << FAST_BITS) - 1)];
+    if(entry)
+    {
+        br->bits >>= entry >> 9;
+        br->nbits -= entry >> 9;
+        return entry & 0x1ff;
+    }
+
+    /* Slow path for long codes */
+    code = first = index = 0;
+    for(len = 1; len <= MAX_BITS; len++)
+    {
+        int count = h->count[len];
+
+        code |= br->bits & 1;
+        br->bits >>= 1;
+        br->nbits--;
+        if(code - count < first)
+            return h->symbol[index + (code - first)];
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+
+    return -1;
+}
+
+/* Decode literal/length and distance codes of a compressed block until
+ * the end-of-block code is reached */
+static int inflate_codes(struct bit_reader *br, const struct huffman *lencode,
+                         const struct huffman *distcode,
+                         unsigned char *dst, size_t dstlen, size_t *pos)
+{
+    size_t out = *pos;
+
+    while(1)
+    {
+        int sym = decode_symbol(br, lencode);
+
+        if(sym < 0)
+            return -1;
+        if(sym < 256)
+        {
+            if(out >= dstlen)
+                return -1;
+            dst[out++] = sym;
+        }
+        else if(sym == 256) /* end of block */
+            break;
+        else
+        {
+            unsigned int len, dist;
+            unsigned char *from, *to;
+
+            sym -= 257;
+            if(sym >= 29)
+                return -1;
+            len = length_base[sym] + get_bits(br, length_extra[sym]);
+
+            sym = decode_symbol(br, distcode);
+            if(sym < 0 || sym >= 30)
+                return -1;
+            dist = dist_base[sym] + get_bits(br, dist_extra[sym]);
+
+            if(dist > out || len > dstlen - out)
+                return -1;
+
+            /* Copy may overlap its own output, so go byte by byte unless
+             * the source is far enough behind. */
+            from = dst + out - dist;
+            to = dst + out;
+            out += len;
+            if(dist >= len)
+                memcpy(to, from, len);
+            else while(len--)
+                *to++ = *from++;
+        }
+    }
+
+    *pos = out;
+    return 0;
+}
+
+/* The fixed Huffman tables are constant, so are built only once */
+static struct huffman fixed_lencode, fixed_distcode;
+static pthread_once_t fixed_once = PTHREAD_ONCE_INIT;
+
+static void build_fixed(void)
+{
+    unsigned char lengths[288];
+    int sym;
+
+    for(sym = 0; sym < 144; sym++)
+        lengths[sym] = 8;
+    for(; sym < 256; sym++)
+        lengths[sym] = 9;
+    for(; sym < 280; sym++)
+        lengths[sym] = 7;
+    for(; sym < 288; sym++)
+        lengths[sym] = 8;
+    build_huffman(&fixed_lencode, lengths, 288);
+
+    for(sym = 0; sym < 30; sym++)
+        lengths[sym] = 5;
+    build_huffman(&fixed_distcode, lengths, 30);
+
+    return;
+}
+
+static int inflate_fixed(struct bit_reader *br, unsigned char *dst, size_t dstlen, size_t *pos)
+{
+    pthread_once(&fixed_once, build_fixed);
+
+    return inflate_codes(br, &fixed_lencode, &fixed_distcode, dst, dstlen, pos);
+}
+
+static int inflate_dynamic(struct bit_reader *br, unsigned char *dst, size_t dstlen, size_t *pos)
+{
+    struct huffman lencode, distcode;
+    unsigned char lengths[288 + 32];
+    int nlen, ndist, ncode, index;
+
+    nlen = get_bits(br, 5) + 257;
+    ndist = get_bits(br, 5) + 1;
+    ncode = get_bits(br, 4) + 4;
+    if(nlen > 286 || ndist > 30)
+        return -1;
+
+    /* Code length code */
+    for(index = 0; index < ncode; index++)
+        lengths[clen_order[index]] = get_bits(br, 3);
+    for(; index < 19; index++)
+        lengths[clen_order[index]] = 0;
+    if(build_huffman(&lencode, lengths, 19) != 0)
+        return -1;
+
+    /* Literal/length and distance code lengths */
+    index = 0;
+    while(index < nlen + ndist)
+    {
+        int sym = decode_symbol(br, &lencode), len = 0, rep;
+
+        if(sym < 0)
+            return -1;
+        if(sym < 16)
+        {
+            lengths[index++] = sym;
+            continue;
+        }
+        if(sym == 16)
+        {
+            if(index == 0)
+                return -1;
+            len = lengths[index - 1];
+            rep = 3 + get_bits(br, 2);
+        }
+        else if(sym == 17)
+            rep = 3 + get_bits(br, 3);
+        else
+            rep = 11 + get_bits(br, 7);
+
+        if(index + rep > nlen + ndist)
+            return -1;
+        while(rep--)
+            lengths[index++] = len;
+    }
+
+    if(lengths[256] == 0) /* no end-of-block code */
+        return -1;
+    if( build_huffman(&lencode, lengths, nlen) != 0
+     || build_huffman(&distcode, lengths + nlen, ndist) != 0)
+        return -1;
+
+    return inflate_codes(br, &lencode, &distcode, dst, dstlen, pos);
+}
+
+static uint32_t adler32(const unsigned char *buf, size_t len)
+{
+    uint32_t a = 1, b = 0;
+
+    while(len > 0)
+    {
+        /* 5552 is the largest n such that the sums cannot overflow */
+        size_t n = len < 5552 ? len : 5552;
+
+        len -= n;
+        while(n--)
+        {
+            a += *buf++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+
+    return (b << 16) | a;
+}
+
+int osm_zlib_inflate(const unsigned char *src, size_t srclen,
+                     unsigned char *dst, size_t dstlen, size_t *outlen)
+{
+    struct bit_reader br;
+    size_t pos = 0;
+    int last;
+    uint32_t check;
+
+    if(srclen < 6)
+        return -1;
+
+    /* zlib header: deflate method, no preset dictionary */
+    if( (src[0] & 0x0f) != 8 || (src[0] >> 4) > 7
+     || ((src[0] << 8) | src[1]) % 31 != 0 || (src[1] & 0x20))
+        return -1;
+
+    br.in = src + 2;
+    br.end = src + srclen;
+    br.bits = 0;
+    br.nbits = 0;
+    br.overrun = 0;
+
+    do
+    {
+        int type, ret;
+
+        last = get_bits(&br, 1);
+        type = get_bits(&br, 2);
+
+        if(type == 0) /* stored block */
+        {
+            unsigned int len;
+
+            if(align_input(&br) != 0 || br.end - br.in < 4)
+                return -1;
+            len = br.in[0] | (br.in[1] << 8);
+            if((len ^ 0xffff) != (unsigned int)(br.in[2] | (br.in[3] << 8)))
+                return -1;
+            br.in += 4;
+            if((size_t)(br.end - br.in) < len || dstlen - pos < len)
+                return -1;
+            memcpy(dst + pos, br.in, len);
+            br.in += len;
+            pos += len;
+            ret = 0;
+        }
+        else if(type == 1)
+            ret = inflate_fixed(&br, dst, dstlen, &pos);
+        else if(type == 2)
+            ret = inflate_dynamic(&br, dst, dstlen, &pos);
+        else
+            ret = -1;
+
+        if(ret != 0 || br.overrun > 8)
+            return -1;
+    } while(!last);
+
+    /* Adler-32 checksum of uncompressed data follows at the next byte
+     * boundary */
+    if(align_input(&br) != 0 || br.end - br.in < 4)
+        return -1;
+    check = ((uint32_t)br.in[0] << 24) | (br.in[1] << 16) | (br.in[2] << 8) | br.in[3];
+    if(check != adler32(dst, pos))
+        return -1;
+
+    *outlen = pos;
+    return 0;
+}
+
+/* Compression. LZ77 matching uses hash chains over a 32K window, and each
+ * block of symbols is then coded with dynamic Huffman codes. */
+
+#define WINDOW_SIZE   32768
+#define HASH_BITS     15
+#define MAX_CHAIN     32    /**< Maximum match candidates examined per position */
+#define MIN_MATCH     3
+#define MAX_MATCH     258
+#define BLOCK_SYMBOLS 16384 /**< Number of LZ77 symbols per deflate block */
+
+/* Bit writer. Output that would overflow the buffer is discarded and
+ * flagged, in which case the caller falls back to stored blocks. */
+struct bit_writer
+{
+    unsigned char *out, *end;
+    uint64_t bits;
+    int nbits;
+    int overflow;
+};
+
+/* LZ77 symbol: a literal byte if dist is 0, otherwise a match */
+struct lz_symbol
+{
+    unsigned short litlen; /**< Literal byte or match length */
+    unsigned short dist;   /**< Match distance, or 0 for a literal */
+};
+
+static inline void put_bits(struct bit_writer *bw, unsigned int val, int n)
+{
+    bw->bits |= (uint64_t)val << bw->nbits;
+    bw->nbits += n;
+    while(bw->nbits >= 8)
+    {
+        if(bw->out < bw->end)
+            *bw->out++ = bw->bits & 0xff;
+        else
+            bw->overflow = 1;
+        bw->bits >>= 8;
+        bw->nbits -= 8;
+    }
+}
+
+static void flush_bits(struct bit_writer *bw)
+{
+    if(bw->nbits > 0)
+        put_bits(bw, 0, 8 - bw->nbits);
+}
+
+/* Build Huffman code lengths of at most max_len bits from symbol
+ * frequencies. If the optimal code is too long, the frequencies are
+ * flattened and the code rebuilt. At least two symbols are always given
+ * codes, so that the result is a complete code. */
+static void build_lengths(unsigned int *freq, int n, int max_len, unsigned char *lengths)
+{
+    int heap[288], parent[2 * 288], depth[2 * 288];
+    unsigned int weight[2 * 288];
+    int used = 0, sym;
+
+    for(sym = 0; sym < n; sym++)
+        if(freq[sym])
+            used++;
+    for(sym = 0; used < 2 && sym < n; sym++)
+        if(!freq[sym])
+        {
+            freq[sym] = 1;
+            used++;
+        }
+
+    while(1)
+    {
+        int heap_len = 0, next = n, maxdepth = 0, i;
+
+        /* Binary min-heap of node indices ordered by weight */
+        for(sym = 0; sym < n; sym++)
+        {
+            weight[sym] = freq[sym];
+            if(!freq[sym])
+                continue;
+            i = heap_len++;
+            while(i > 0 && weight[heap[(i - 1) / 2]] > weight[sym])
+            {
+                heap[i] = heap[(i - 1) / 2];
+                i = (i - 1) / 2;
+            }
+            heap[i] = sym;
+        }
+
+        while(heap_len > 1)
+        {
+            int a, b, node, last;
+
+            /* Pop the two lightest nodes and push their parent */
+            a = heap[0];
+            last = heap[--heap_len];
+            for(i = 0; 2 * i + 1 < heap_len; )
+            {
+                int c = 2 * i + 1;
+
+                if(c + 1 < heap_len && weight[heap[c + 1]] < weight[heap[c]])
+                    c++;
+                if(weight[heap[c]] >= weight[last])
+                    break;
+                heap[i] = heap[c];
+                i = c;
+            }
+            heap[i] = last;
+            b = heap[0];
+
+            node = next++;
+            weight[node] = weight[a] + weight[b];
+            parent[a] = parent[b] = node;
+
+            /* Replace root with the new node and sift down */
+            for(i = 0; 2 * i + 1 < heap_len; )
+            {
+                int c = 2 * i + 1;
+
+                if(c + 1 < heap_len && weight[heap[c + 1]] < weight[heap[c]])
+                    c++;
+                if(weight[heap[c]] >= weight[node])
+                    break;
+                heap[i] = heap[c];
+                i = c;
+            }
+            heap[i] = node;
+        }
+
+        /* Nodes are created in order, so parents always have higher indices
+         * than their children and depths can be found in one reverse scan */
+        depth[next - 1] = 0;
+        for(i = next - 2; i >= n; i--)
+            depth[i] = depth[parent[i]] + 1;
+        for(sym = 0; sym < n; sym++)
+        {
+            lengths[sym] = freq[sym] ? depth[parent[sym]] + 1 : 0;
+            if(lengths[sym] > maxdepth)
+                maxdepth = lengths[sym];
+        }
+
+        if(maxdepth <= max_len)
+            break;
+        for(sym = 0; sym < n; sym++)
+            if(freq[sym])
+                freq[sym] = (freq[sym] + 1) / 2;
+    }
+
+    return;
+}
+
+/* Assign canonical codes to a set of code lengths, bit-reversed ready
+ * for writing least significant bit first */
+static void build_codes(const unsigned char *lengths, int n, unsigned short *codes)
+{
+    int count[MAX_BITS + 1] = { 0 }, next_code[MAX_BITS + 1];
+    int len, sym, code = 0;
+
+    for(sym = 0; sym < n; sym++)
+        count[lengths[sym]]++;
+    count[0] = 0;
+    for(len = 1; len <= MAX_BITS; len++)
+    {
+        code = (code + count[len - 1]) << 1;
+        next_code[len] = code;
+    }
+
+    for(sym = 0; sym < n; sym++)
+    {
+        int c, rev = 0, b;
+
+        len = lengths[sym];
+        if(len == 0)
+            continue;
+        c = next_code[len]++;
+        for(b = 0; b < len; b++)
+            rev |= ((c >> b) & 1) << (len - 1 - b);
+        codes[sym] = rev;
+    }
+
+    return;
+}
+
+static int length_code(int len)
+{
+    int code = 28;
+
+    while(length_base[code] > len)
+        code--;
+    return code;
+}
+
+static int dist_code(int dist)
+{
+    int code = 29;
+
+    while(dist_base[code] > dist)
+        code--;
+    return code;
+}
+
+/* Write a block of LZ77 symbols using dynamic Huffman codes */
+static void write_block(struct bit_writer *bw, const struct lz_symbol *syms, int nsyms, int last)
+{
+    unsigned int litfreq[286] = { 0 }, distfreq[30] = { 0 }, clfreq[19] = { 0 };
+    unsigned char lengths[286 + 30], cllengths[19];
+    unsigned short litcodes[286], distcodes[30], clcodes[19];
+    unsigned char rle[286 + 30], rle_extra[286 + 30];
+    int nlit, ndist, ncl, nrle = 0, i;
+
+    for(i = 0; i < nsyms; i++)
+    {
+        if(syms[i].dist == 0)
+            litfreq[syms[i].litlen]++;
+        else
+        {
+            litfreq[257 + length_code(syms[i].litlen)]++;
+            distfreq[dist_code(syms[i].dist)]++;
+        }
+    }
+    litfreq[256] = 1;
+
+    build_lengths(litfreq, 286, MAX_BITS, lengths);
+    build_lengths(distfreq, 30, MAX_BITS, lengths + 286);
+    build_codes(lengths, 286, litcodes);
+    build_codes(lengths + 286, 30, distcodes);
+
+    for(nlit = 286; nlit > 257 && lengths[nlit - 1] == 0; nlit--)
+        ;
+    for(ndist = 30; ndist > 1 && lengths[286 + ndist - 1] == 0; ndist--)
+        ;
+    /* Literal/length and distance code lengths are sent as one sequence */
+    memmove(lengths + nlit, lengths + 286, ndist);
+
+    /* Run-length encode the code lengths with codes 16, 17 and 18 */
+    for(i = 0; i < nlit + ndist; )
+    {
+        int len = lengths[i], run = 1;
+
+        while(i + run < nlit + ndist && lengths[i + run] == len)
+            run++;
+
+        if(len == 0 && run >= 11)
+        {
+            run = run > 138 ? 138 : run;
+            rle[nrle] = 18;
+            rle_extra[nrle++] = run - 11;
+        }
+        else if(len == 0 && run >= 3)
+        {
+            rle[nrle] = 17;
+            rle_extra[nrle++] = run - 3;
+        }
+        else if(len != 0 && run >= 4)
+        {
+            /* The first length is sent literally, then repeated */
+            run = run > 7 ? 7 : run;
+            rle[nrle++] = len;
+            rle[nrle] = 16;
+            rle_extra[nrle++] = run - 4;
+        }
+        else
+        {
+            run = 1;
+            rle[nrle++] = len;
+        }
+        i += run;
+    }
+
+    for(i = 0; i < nrle; i++)
+        clfreq[rle[i]]++;
+    build_lengths(clfreq, 19, 7, cllengths);
+    build_codes(cllengths, 19, clcodes);
+    for(ncl = 19; ncl > 4 && cllengths[clen_order[ncl - 1]] == 0; ncl--)
+        ;
+
+    /* Block header */
+    put_bits(bw, last, 1);
+    put_bits(bw, 2, 2);
+    put_bits(bw, nlit - 257, 5);
+    put_bits(bw, ndist - 1, 5);
+    put_bits(bw, ncl - 4, 4);
+    for(i = 0; i < ncl; i++)
+        put_bits(bw, cllengths[clen_order[i]], 3);
+    for(i = 0; i < nrle; i++)
+    {
+        put_bits(bw, clcodes[rle[i]], cllengths[rle[i]]);
+        if(rle[i] == 16)
+            put_bits(bw, rle_extra[i], 2);
+        else if(rle[i] == 17)
+            put_bits(bw, rle_extra[i], 3);
+        else if(rle[i] == 18)
+            put_bits(bw, rle_extra[i], 7);
+    }
+
+    /* Symbols, using the code lengths before they were moved together */
+    memmove(lengths + 286, lengths + nlit, ndist);
+    for(i = 0; i < nsyms; i++)
+    {
+        if(syms[i].dist == 0)
+            put_bits(bw, litcodes[syms[i].litlen], lengths[syms[i].litlen]);
+        else
+        {
+            int lc = length_code(syms[i].litlen), dc = dist_code(syms[i].dist);
+
+            put_bits(bw, litcodes[257 + lc], lengths[257 + lc]);
+            put_bits(bw, syms[i].litlen - length_base[lc], length_extra[lc]);
+            put_bits(bw, distcodes[dc], lengths[286 + dc]);
+            put_bits(bw, syms[i].dist - dist_base[dc], dist_extra[dc]);
+        }
+    }
+    put_bits(bw, litcodes[256], lengths[256]);
+
+    return;
+}
+
+/* Write the data uncompressed, as stored blocks */
+static void write_stored(struct bit_writer *bw, const unsigned char *src, size_t srclen)
+{
+    do
+    {
+        unsigned int len = srclen > 65535 ? 65535 : srclen;
+
+        put_bits(bw, srclen == len, 1);
+        put_bits(bw, 0, 2);
+        flush_bits(bw);
+        put_bits(bw, len & 0xffff, 16);
+        put_bits(bw, ~len & 0xffff, 16);
+        if(bw->end - bw->out < (long)len)
+        {
+            bw->overflow = 1;
+            return;
+        }
+        memcpy(bw->out, src, len);
+        bw->out += len;
+        src += len;
+        srclen -= len;
+    } while(srclen > 0);
+
+    return;
+}
+
+size_t osm_zlib_bound(size_t srclen)
+{
+    /* Stored blocks cost 5 bytes each, plus zlib header and checksum */
+    return srclen + 5 * (srclen / 65535 + 1) + 6;
+}
+
+int osm_zlib_deflate(const unsigned char *src, size_t srclen,
+                     unsigned char *dst, size_t dstlen, size_t *outlen)
+{
+    struct bit_writer bw;
+    struct lz_symbol *syms;
+    int *head, *prev;
+    size_t pos = 0;
+    int nsyms = 0;
+    uint32_t check;
+
+    if(dstlen < osm_zlib_bound(srclen))
+        return -1;
+
+    syms = malloc(BLOCK_SYMBOLS * sizeof(struct lz_symbol));
+    head = malloc((1 << HASH_BITS) * sizeof(int));
+    prev = malloc(WINDOW_SIZE * sizeof(int));
+    memset(head, 0xff, (1 << HASH_BITS) * sizeof(int));
+
+    bw.out = dst;
+    bw.end = dst + dstlen - 4; /* leave room for checksum */
+    bw.bits = 0;
+    bw.nbits = 0;
+    bw.overflow = 0;
+
+    /* zlib header: deflate, 32K window, default compression level */
+    put_bits(&bw, 0x78, 8);
+    put_bits(&bw, 0x9c, 8);
+
+    while(pos < srclen && !bw.overflow)
+    {
+        int best_len = 0, best_dist = 0;
+
+        if(srclen - pos >= MIN_MATCH)
+        {
+            unsigned int h = ((src[pos] << 10) ^ (src[pos + 1] << 5) ^ src[pos + 2]) & ((1 << HASH_BITS) - 1);
+            int cand = head[h], chain = MAX_CHAIN;
+            int max_len = srclen - pos > MAX_MATCH ? MAX_MATCH : srclen - pos;
+
+            while(cand >= 0 && pos - cand <= WINDOW_SIZE && chain-- > 0)
+            {
+                const unsigned char *a = src + cand, *b = src + pos;
+
+                if(a[best_len] == b[best_len] && a[0] == b[0])
+                {
+                    int len = 0;
+
+                    while(len < max_len && a[len] == b[len])
+                        len++;
+                    if(len > best_len)
+                    {
+                        best_len = len;
+                        best_dist = pos - cand;
+                        if(len == max_len)
+                            break;
+                    }
+                }
+                cand = prev[cand & (WINDOW_SIZE - 1)];
+            }
+
+            prev[pos & (WINDOW_SIZE - 1)] = head[h];
+            head[h] = pos;
+        }
+
+        if(best_len >= MIN_MATCH)
+        {
+            size_t end = pos + best_len, p;
+
+            syms[nsyms].litlen = best_len;
+            syms[nsyms++].dist = best_dist;
+
+            /* Insert the matched positions into the hash chains */
+            for(p = pos + 1; p < end && p + MIN_MATCH <= srclen; p++)
+            {
+                unsigned int h = ((src[p] << 10) ^ (src[p + 1] << 5) ^ src[p + 2]) & ((1 << HASH_BITS) - 1);
+
+                prev[p & (WINDOW_SIZE - 1)] = head[h];
+                head[h] = p;
+            }
+            pos = end;
+        }
+        else
+        {
+            syms[nsyms].litlen = src[pos++];
+            syms[nsyms++].dist = 0;
+        }
+
+        if(nsyms == BLOCK_SYMBOLS)
+        {
+            write_block(&bw, syms, nsyms, pos == srclen);
+            nsyms = 0;
+        }
+    }
+    if(nsyms > 0 || srclen == 0)
+        write_block(&bw, syms, nsyms, 1);
+    flush_bits(&bw);
+
+    free(syms);
+    free(head);
+    free(prev);
+
+    /* Data that does not compress is stored instead */
+    if(bw.overflow || (size_t)(bw.out - dst) > osm_zlib_bound(srclen) - 4)
+    {
+        bw.out = dst + 2;
+        bw.bits = 0;
+        bw.nbits = 0;
+        bw.overflow = 0;
+        write_stored(&bw, src, srclen);
+        if(bw.overflow)
+            return -1;
+    }
+
+    check = adler32(src, srclen);
+    bw.out[0] = check >> 24;
+    bw.out[1] = check >> 16;
+    bw.out[2] = check >> 8;
+    bw.out[3] = check;
+    *outlen = bw.out + 4 - dst;
+
+    return 0;
+}
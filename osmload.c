@@ -0,0 +1,353 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Load generator for the osmrail query server (osmrail --serve). Each
+ * client thread holds a connection open and sends a mix of bounding box
+ * queries, with random boxes inside the bounding box of the data, and
+ * lookups of ways returned by earlier box queries. The latency of every
+ * query is measured and summarised at the end. With -r the queries are
+ * instead read from standard input and the replies printed, so that the
+ * answers of a server can be checked. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_POOL     1024 /**< Way IDs remembered by each client for lookups */
+#define HIST_BUCKETS 24   /**< Latency buckets; bucket b counts times below 2^b microseconds */
+
+struct load_params
+{
+    const char *path;
+    int queries;        /**< Queries sent by each client */
+    double box_size;    /**< Size of query boxes in degrees */
+    double bbox[4];     /**< Bounding box of the data */
+
+    uint64_t hist[HIST_BUCKETS];
+    uint64_t total_us, max_us, count, errors;
+    pthread_mutex_t mutex;
+};
+
+/* Connection to the server */
+struct client
+{
+    int fd;
+    char *buf;
+    size_t len, max;
+};
+
+static int client_connect(struct client *, const char *path);
+static char *client_query(struct client *, const char *query);
+static void *start_client(void *);
+static int replay_queries(const char *path);
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [options] <socket>\n"
+            "Options:\n"
+            "  -c, --clients N      Number of concurrent connections (default 4)\n"
+            "  -n, --queries N      Number of queries sent on each connection (default 10000)\n"
+            "  -b, --box DEGREES    Size of bounding box queries (default 0.1)\n"
+            "  -r, --replay         Send the queries read from standard input, one per line,\n"
+            "                       on a single connection and print each reply\n",
+            progname);
+
+    return;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "clients", required_argument, NULL, 'c' },
+        { "queries", required_argument, NULL, 'n' },
+        { "box",     required_argument, NULL, 'b' },
+        { "replay",  no_argument,       NULL, 'r' },
+        { "help",    no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct load_params *load = calloc(1, sizeof(struct load_params));
+    struct client client;
+    struct timespec start, finish;
+    pthread_t *threads;
+    uint64_t seen = 0;
+    double seconds;
+    char *reply, *bbox;
+    int clients = 4, replay = 0, opt, i, b;
+
+    load->queries = 10000;
+    load->box_size = 0.1;
+    while((opt = getopt_long(argc, argv, "c:n:b:rh", long_options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 'c':
+                clients = atoi(optarg);
+                break;
+            case 'n':
+                load->queries = atoi(optarg);
+                break;
+            case 'b':
+                load->box_size = atof(optarg);
+                break;
+            case 'r':
+                replay = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(optind != argc - 1 || clients < 1 || load->queries < 1 || load->box_size <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    load->path = argv[optind];
+    if(replay)
+        return replay_queries(load->path);
+    pthread_mutex_init(&load->mutex, NULL);
+
+    /* Find the extent of the data */
+    if( !client_connect(&client, load->path))
+        return 1;
+    if( !(reply = client_query(&client, "info")) || !(bbox = strstr(reply, "\"bbox\":["))
+       || sscanf(bbox + 8, "%lf,%lf,%lf,%lf", &load->bbox[0], &load->bbox[1], &load->bbox[2], &load->bbox[3]) != 4)
+    {
+        fprintf(stderr, "Server has no ways to query\n");
+        return 1;
+    }
+    fprintf(stderr, "Server: %s\n", reply);
+    close(client.fd);
+    free(client.buf);
+
+    threads = malloc(clients * sizeof(pthread_t));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < clients; i++)
+    {
+        if(pthread_create(&threads[i], NULL, start_client, load) != 0)
+        {
+            fprintf(stderr, "Unable to start client thread\n");
+            return 1;
+        }
+    }
+    for(i = 0; i < clients; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    seconds = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+
+    if(load->count == 0)
+    {
+        fprintf(stderr, "No queries answered\n");
+        return 1;
+    }
+    printf("%llu queries in %.2f s from %d clients: %.0f queries/s, %llu errors\n",
+           (unsigned long long)load->count, seconds, clients, load->count / seconds,
+           (unsigned long long)load->errors);
+    printf("Latency: mean %.1f us, max %llu us\n", (double)load->total_us / load->count,
+           (unsigned long long)load->max_us);
+    for(b = 0; b < HIST_BUCKETS; b++)
+    {
+        if( !load->hist[b])
+            continue;
+        seen += load->hist[b];
+        printf("  < %8u us %10llu  %6.2f%%\n", 1u << b, (unsigned long long)load->hist[b],
+               100.0 * seen / load->count);
+    }
+
+    return load->errors > 0;
+}
+
+/* Client thread sending queries on its own connection */
+static void *start_client(void *data)
+{
+    struct load_params *load = data;
+    struct client client;
+    unsigned int pool[MAX_POOL], seed = (unsigned int)(uintptr_t)&client ^ time(NULL);
+    uint64_t hist[HIST_BUCKETS] = { 0 }, total_us = 0, max_us = 0, count = 0, errors = 0;
+    int pool_count = 0, q, b;
+
+    if( !client_connect(&client, load->path))
+    {
+        pthread_mutex_lock(&load->mutex);
+        load->errors++;
+        pthread_mutex_unlock(&load->mutex);
+        return NULL;
+    }
+
+    for(q = 0; q < load->queries; q++)
+    {
+        struct timespec start, finish;
+        char query[128], *reply;
+        uint64_t us;
+        int lookup = pool_count > 0 && rand_r(&seed) % 2;
+
+        if(lookup)
+            snprintf(query, sizeof(query), "way %u", pool[rand_r(&seed) % pool_count]);
+        else
+        {
+            double lon = load->bbox[0] + (load->bbox[2] - load->bbox[0]) * rand_r(&seed) / RAND_MAX;
+            double lat = load->bbox[1] + (load->bbox[3] - load->bbox[1]) * rand_r(&seed) / RAND_MAX;
+
+            snprintf(query, sizeof(query), "bbox %.7f %.7f %.7f %.7f", lon, lat,
+                     lon + load->box_size, lat + load->box_size);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        reply = client_query(&client, query);
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        if( !reply)
+        {
+            errors++;
+            break;
+        }
+        if(strncmp(reply, "{\"error\"", 8) == 0)
+            errors++;
+
+        us = (finish.tv_sec - start.tv_sec) * 1000000 + (finish.tv_nsec - start.tv_nsec) / 1000;
+        for(b = 0; b < HIST_BUCKETS - 1 && us >= ((uint64_t)1 << b); b++)
+            ;
+        hist[b]++;
+        total_us += us;
+        if(us > max_us)
+            max_us = us;
+        count++;
+
+        /* Remember some of the ways found for later lookups */
+        if( !lookup)
+        {
+            char *p = strchr(reply, '['), *end;
+
+            while(p && *++p != ']')
+            {
+                unsigned int id = strtoul(p, &end, 10);
+
+                if(end == p)
+                    break;
+                if(pool_count < MAX_POOL)
+                    pool[pool_count++] = id;
+                else
+                    pool[rand_r(&seed) % MAX_POOL] = id;
+                p = end;
+            }
+        }
+    }
+    close(client.fd);
+    free(client.buf);
+
+    pthread_mutex_lock(&load->mutex);
+    for(b = 0; b < HIST_BUCKETS; b++)
+        load->hist[b] += hist[b];
+    load->total_us += total_us;
+    if(max_us > load->max_us)
+        load->max_us = max_us;
+    load->count += count;
+    load->errors += errors;
+    pthread_mutex_unlock(&load->mutex);
+
+    return NULL;
+}
+
+/* Send each line of standard input as a query and print the replies */
+static int replay_queries(const char *path)
+{
+    struct client client;
+    char line[256], *reply;
+    size_t len;
+
+    if( !client_connect(&client, path))
+        return 1;
+    while(fgets(line, sizeof(line), stdin))
+    {
+        if((len = strcspn(line, "\r\n")) == 0)
+            continue;
+        line[len] = '\0';
+        if( !(reply = client_query(&client, line)))
+        {
+            fprintf(stderr, "No reply to <%s>\n", line);
+            close(client.fd);
+            free(client.buf);
+            return 1;
+        }
+        printf("%s\n", reply);
+    }
+    close(client.fd);
+    free(client.buf);
+
+    return 0;
+}
+
+static int client_connect(struct client *client, const char *path)
+{
+    struct sockaddr_un addr;
+
+    memset(client, 0, sizeof(struct client));
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if((client->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+       || connect(client->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        fprintf(stderr, "Unable to connect to <%s>\n", path);
+        if(client->fd >= 0)
+            close(client->fd);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Send a query and wait for the reply. Returns the reply without its
+ * newline, valid until the next query, or NULL on error. */
+static char *client_query(struct client *client, const char *query)
+{
+    char line[256];
+    size_t len = snprintf(line, sizeof(line), "%s\n", query);
+    char *end;
+    ssize_t n;
+
+    if(send(client->fd, line, len, MSG_NOSIGNAL) != (ssize_t)len)
+        return NULL;
+
+    /* Replies are only sent in answer to queries, so nothing is read
+     * beyond the end of this one */
+    client->len = 0;
+    do
+    {
+        if(client->len + 4096 > client->max)
+        {
+            client->max = 2 * client->max + 4096;
+            client->buf = realloc(client->buf, client->max);
+        }
+        if((n = read(client->fd, client->buf + client->len, client->max - client->len)) <= 0)
+            return NULL;
+        end = memchr(client->buf + client->len, '\n', n);
+        client->len += n;
+    } while( !end);
+    *end = '\0';
+
+    return client->buf;
+}
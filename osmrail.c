@@ -1,17 +1,17 @@
 /*
  * osmrail - OpenStreetMap filter for railway-related features
  * Copyright (C) 2011 Paul D Kelly
- * 
+ *
  * This program is free software; you can redistribute it and/or
  * modify it under the terms of the GNU General Public License
  * as published by the Free Software Foundation; either version 2
  * of the License, or (at your option) any later version.
- * 
+ *
  * This program is distributed in the hope that it will be useful,
  * but WITHOUT ANY WARRANTY; without even the implied warranty of
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
- * 
+ *
  * You should have received a copy of the GNU General Public License
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
@@ -20,379 +20,2060 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <getopt.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <ctype.h>
+#include <signal.h>
 
 #include "osm.h"
 
-#define OSM_NODE     0
-#define OSM_WAY      1
-#define OSM_RELATION 2
+#define RUN_CHUNK 65536 /**< Number of IDs read from a spilled run at a time */
+#define MIN_SHARE 65536 /**< Fewest IDs an input file may hold in a pass under --memory-limit */
+#define EARTH_RADIUS 6371008.8 /**< Mean radius of the Earth in metres */
+
+/* Growable list of element IDs */
+struct id_list
+{
+    unsigned int *ids;
+    int count;
+    int max;
+
+    /* Sorted, duplicate-free runs of IDs spilled to temporary files when
+     * the memory limit was reached */
+    FILE **runs;
+    int run_count;
+};
+
+struct osm_params;
+
+/* State of one input file */
+struct osm_input
+{
+    char *filename;
+    struct osm_params *osm;
+    int ok; /**< Boolean; the current pass over the file succeeded */
+
+    /* IDs of interest found in this file during the current pass, merged
+     * into the lists in struct osm_params once all files have been read */
+    struct id_list found[3];
+    size_t budget; /**< Maximum number of IDs held in found and resolved, or 0 if unlimited */
+    struct osm_stats *stats; /**< Tag statistics gathered from this file in the first pass */
+
+    /* Ways of interest by their own tags, whose nodes were collected in
+     * the first pass */
+    struct id_list resolved;
+    unsigned int last_way;  /**< For checking the order of the ways in the first pass */
+    char ways_unsorted;     /**< Boolean; ways found out of ID order in the first pass */
+    int last_type;          /**< For checking the order of the element types in the first pass */
+    char types_unsorted;    /**< Boolean; types found out of order (not nodes, ways, relations) */
+    struct osm_reader *reader; /**< Reader of the current pass */
+    char stopped;           /**< Boolean; the pass stopped before the end of the file */
+
+    /* Merge-join cursors into the sorted ID lists, used while the input
+     * is found to be in ascending ID order */
+    int cursor[3];
+    unsigned int last_id[3];
+    char unsorted[3]; /**< Boolean; input was out of order, use bsearch() */
+
+    /* Elements of interest read in the third pass, kept for merging when
+     * there is more than one input file */
+    struct osm_batch **batches;
+    int batch_count, max_batches;
+};
+
+/** Function processing each batch of elements read in a pass */
+typedef void batch_callback_t(struct osm_reader *, struct osm_batch *, struct osm_input *);
+
+/** Function processing each element of interest once merged */
+typedef void element_callback_t(struct osm_params *, struct osm_batch *, int i);
+
+/* Element collected in the third pass */
+struct element_ref
+{
+    struct osm_batch *batch;
+    int i;
+};
+
+/* Location of an element, for ordering by Hilbert index */
+struct element_location
+{
+    unsigned int id;
+    int32_t lat, lon;
+};
+
+struct osm_params
+{
+    /* Tags of interest */
+    struct osm_tag *tags;
+    int tag_count;
+
+    /* IDs of nodes/ways/relations of interest, from all input files */
+    struct id_list wanted[3];
+    /* Ways of interest whose nodes are still to be collected after the
+     * first pass: those wanted only as members of relations */
+    struct id_list pending;
+
+    struct osm_input *inputs;
+    int input_count;
+    size_t memory_limit; /**< Memory available for collecting IDs in bytes, or 0 */
+    char history;        /**< Boolean; inputs are full-history files */
+    long long as_of;     /**< Time to take history files at, or 0 for latest */
+    char raw;            /**< Boolean; copy elements to the output as read */
+    char strip_metadata; /**< Boolean; remove metadata from elements copied */
+    char hilbert;        /**< Boolean; write elements in order of Hilbert index */
+
+    /* Elements of interest in order of type and ID, for --order hilbert */
+    struct element_ref *refs;
+    int ref_count, max_refs;
+
+    /* Pass being run by the worker threads */
+    int pass_types;
+    const struct osm_projection *pass_proj;
+    batch_callback_t *pass_process;
+    int next_input; /**< Index of next input file to be read in the pass */
+    pthread_mutex_t next_mutex;
+
+    struct osm_output *out; /**< Destination for elements of interest, or */
+    struct osm_shard *shard; /**< Destination split into grid cells */
+    struct osm_graph *graph; /**< Railway graph builder, or NULL */
+    struct osm_tiles *tiles; /**< Vector tile builder, or NULL */
+    struct osm_routes *routes; /**< Train route builder, or NULL */
+    struct osm_index *index; /**< Index of the output by type and ID, or NULL */
+
+    /* Tag statistics (--stats-tags), or NULL */
+    struct osm_stats *stats;
+    int32_t *node_coords; /**< Latitude and longitude of each wanted node, for way lengths */
+};
+
+static int run_pass(struct osm_params *, int types, const struct osm_projection *, batch_callback_t *);
+static int parse_entire_file(struct osm_input *);
+static osm_filter_callback_t filter_wanted, filter_pending, filter_fetch;
+static batch_callback_t      load_batch_1, load_batch_2, output_batch;
+static void merge_found(struct osm_params *, int ele);
+static void share_memory(struct osm_params *);
+static void keep_batch(struct osm_input *, struct osm_batch *);
+static void merge_output(struct osm_params *, element_callback_t *);
+static element_callback_t output_element, collect_element;
+static void ordered_output(struct osm_params *);
+static void add_way_length(struct osm_params *, struct osm_way *);
+static int split_keys(char *str, char ***keys);
+static void sort_ids(struct id_list *);
+static size_t parse_size(const char *str);
+static int is_wanted(struct osm_input *, int ele, unsigned int id);
+static int is_listed(struct osm_input *, int ele, struct id_list *, unsigned int id);
+static void plan_second_pass(struct osm_params *);
+static int find_wanted(struct osm_params *);
+static int fetch_ids(struct osm_params *, const char *filename, const char *sample_file);
+static int has_suffix(const char *str, const char *suffix);
+static int raw_only(struct osm_params *);
+static int serve(const char *path, const char *filename);
+static int write_diff(const char *old_filename, const char *new_filename, const char *output);
+
+/* Fields of interest in each pass. Pass 1 needs only tags of nodes,
+ * and the member nodes of ways and member ways of relations, which are
+ * collected for those of interest; pass 2 needs only the member nodes of
+ * the ways found through relations. */
+static const struct osm_projection pass1_proj = {
+    { OSM_FIELD_TAGS, OSM_FIELD_ALL, OSM_FIELD_ALL }, NULL
+};
+static const struct osm_projection pass2_proj = {
+    { 0, OSM_FIELD_MEMBERS, 0 }, filter_pending
+};
+/* Versions are kept in the output, where the input has them */
+static const struct osm_projection pass3_proj = {
+    { OSM_FIELD_ALL | OSM_FIELD_VERSION, OSM_FIELD_ALL | OSM_FIELD_VERSION,
+      OSM_FIELD_ALL | OSM_FIELD_VERSION }, filter_wanted
+};
+/* Elements copied from XML input as they were read need no fields at all */
+static const struct osm_projection pass3_raw_proj = {
+    { 0, 0, 0 }, filter_wanted
+};
+/* Elements listed with --ids, found by seeking */
+static const struct osm_projection fetch_proj = {
+    { OSM_FIELD_ALL | OSM_FIELD_VERSION, OSM_FIELD_ALL | OSM_FIELD_VERSION,
+      OSM_FIELD_ALL | OSM_FIELD_VERSION }, filter_fetch
+};
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [options] <planet.osm.bz2|planet.osm.pbf>...\n"
+            "       %s --diff [-o FILE] <old.osm> <new.osm>\n"
+            "Options:\n"
+            "  -o, --output FILE    Write output to FILE instead of standard output\n"
+            "  -f, --format FORMAT  Output format, either \"xml\" or \"pbf\". The default\n"
+            "                       is \"pbf\" if FILE ends in \".pbf\", otherwise \"xml\"\n"
+            "  -g, --graph FILE     Also write the railway track network to FILE as a\n"
+            "                       graph in compressed sparse row form\n"
+            "  -x, --index FILE     Also write a sparse index of the XML output by type\n"
+            "                       and ID to FILE, for osm_index_find()\n"
+            "  -O, --order ORDER    Order of the elements of each type in the output,\n"
+            "                       either \"id\" (the default) or \"hilbert\" to cluster\n"
+            "                       them by location along a Hilbert curve\n"
+            "  -M, --mvt DIR        Also write the ways as Mapbox Vector Tiles, as\n"
+            "                       DIR/Z/X/Y.mvt\n"
+            "  -l, --routes FILE    Also write the route=train relations to FILE as\n"
+            "                       GeoJSON, with their ways joined into lines\n"
+            "  -z, --zoom MIN-MAX   Zoom levels of the vector tiles (default 6-14)\n"
+            "  -s, --shard GRID     Split the output into one file per grid cell, named\n"
+            "                       from the -o option (default \"shard\"). GRID is the\n"
+            "                       cell size in degrees, or \"z\" and a zoom level for\n"
+            "                       map tiles, e.g. \"1\" or \"z8\"\n"
+            "  -m, --memory-limit SIZE\n"
+            "                       Limit the memory used for collecting element IDs to\n"
+            "                       about SIZE bytes (suffix K, M or G), spilling sorted\n"
+            "                       runs of IDs to temporary files in $TMPDIR beyond it\n"
+            "  -C, --cache SIZE     Decompress compressed XML input only once, keeping it\n"
+            "                       for the later passes in up to SIZE bytes of memory\n"
+            "                       (suffix K, M or G) and compressed in temporary files\n"
+            "                       in $TMPDIR beyond that\n"
+            "  -d, --read-depth N   Number of reads of compressed XML input kept in\n"
+            "                       flight (default 4)\n"
+            "  -r, --read-size SIZE Size of each read of compressed XML input (suffix K,\n"
+            "                       M or G; default 4M)\n"
+            "  -v, --verbose        Report the amount of each input read, how, and the\n"
+            "                       time spent waiting for it\n"
+            "  -B, --bzip2 DECODER  bzip2 decoder, either \"libbz2\" (the default) or\n"
+            "                       \"builtin\"\n"
+            "  -H, --history        Inputs are full-history files; use only the latest\n"
+            "                       version of each element, and none if it is deleted\n"
+            "  -T, --as-of TIME     As --history, but use the versions current at TIME,\n"
+            "                       e.g. \"2012-01-01T00:00:00Z\"\n"
+            "  -R, --raw            Copy the elements of interest from XML input to XML\n"
+            "                       output as they are, instead of formatting them again\n"
+            "  -n, --no-metadata    As --raw, but remove the version, timestamp, changeset,\n"
+            "                       uid, user and visible attributes of each element\n"
+            "  -t, --stats-tags KEYS\n"
+            "                       Also count the elements with each value of the\n"
+            "                       comma-separated keys KEYS, and the length of the\n"
+            "                       ways of interest, and print a report at the end\n"
+            "  -D, --diff           Instead of filtering, compare two ID-sorted files such\n"
+            "                       as earlier osmrail output, and write the differences\n"
+            "                       from the first to the second as osmChange XML\n"
+            "  -I, --ids FILE       Instead of filtering by tags, extract the elements\n"
+            "                       listed in FILE (IDs prefixed with n, w or r, e.g.\n"
+            "                       \"w123\"; \"-\" for standard input) and the ways and\n"
+            "                       nodes they refer to, seeking in a single sorted\n"
+            "                       XML input rather than reading all of it\n"
+            "  -k, --seek-cache FILE\n"
+            "                       With --ids, keep the positions found in the input\n"
+            "                       in FILE, to narrow the search of later runs while\n"
+            "                       the input is unchanged\n"
+            "  -S, --serve SOCKET   Instead of filtering, load a single file (usually an\n"
+            "                       extract written earlier) and answer queries on the\n"
+            "                       Unix domain socket SOCKET until interrupted\n"
+            "If several input files are given, they are read concurrently and elements\n"
+            "present in more than one of them are written only once.\n",
+            progname, progname);
+
+    return;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "output", required_argument, NULL, 'o' },
+        { "format", required_argument, NULL, 'f' },
+        { "graph",  required_argument, NULL, 'g' },
+        { "index",  required_argument, NULL, 'x' },
+        { "order",  required_argument, NULL, 'O' },
+        { "ids",    required_argument, NULL, 'I' },
+        { "seek-cache", required_argument, NULL, 'k' },
+        { "shard",  required_argument, NULL, 's' },
+        { "mvt",    required_argument, NULL, 'M' },
+        { "zoom",   required_argument, NULL, 'z' },
+        { "routes", required_argument, NULL, 'l' },
+        { "memory-limit", required_argument, NULL, 'm' },
+        { "cache",  required_argument, NULL, 'C' },
+        { "serve",  required_argument, NULL, 'S' },
+        { "diff",   no_argument,       NULL, 'D' },
+        { "read-depth", required_argument, NULL, 'd' },
+        { "read-size",  required_argument, NULL, 'r' },
+        { "verbose", no_argument,      NULL, 'v' },
+        { "bzip2",  required_argument, NULL, 'B' },
+        { "history", no_argument,       NULL, 'H' },
+        { "as-of",  required_argument, NULL, 'T' },
+        { "stats-tags", required_argument, NULL, 't' },
+        { "raw",    no_argument,       NULL, 'R' },
+        { "no-metadata", no_argument,  NULL, 'n' },
+        { "help",   no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct osm_params *osm = calloc(1, sizeof(struct osm_params));
+    char *output = NULL, *graph_file = NULL, *socket_path = NULL, **stats_keys = NULL;
+    char *tiles_dir = NULL, *index_file = NULL, *routes_file = NULL, *ids_file = NULL;
+    char *seek_file = NULL;
+    int min_zoom = 6, max_zoom = 14;
+    int format = -1, opt, i, grid = -1, read_depth = 4, diff = 0, stats_key_count = 0;
+    size_t read_size = 4 * 1024 * 1024, cache_limit = 0;
+    double grid_size = 0;
+    FILE *out_fp = stdout;
+
+    while((opt = getopt_long(argc, argv, "o:f:g:x:O:I:k:s:M:z:l:m:C:S:Dd:r:vB:HT:t:Rnh", long_options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 'o':
+                output = optarg;
+                break;
+            case 'f':
+                if(strcmp(optarg, "xml") == 0)
+                    format = OSM_FORMAT_XML;
+                else if(strcmp(optarg, "pbf") == 0)
+                    format = OSM_FORMAT_PBF;
+                else
+                {
+                    fprintf(stderr, "Unknown output format <%s>\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'g':
+                graph_file = optarg;
+                break;
+            case 'x':
+                index_file = optarg;
+                break;
+            case 'O':
+                if(strcmp(optarg, "hilbert") == 0)
+                    osm->hilbert = 1;
+                else if(strcmp(optarg, "id") != 0)
+                {
+                    fprintf(stderr, "Unknown order <%s>\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'I':
+                ids_file = optarg;
+                break;
+            case 'k':
+                seek_file = optarg;
+                break;
+            case 'M':
+                tiles_dir = optarg;
+                break;
+            case 'l':
+                routes_file = optarg;
+                break;
+            case 'z':
+                if(sscanf(optarg, "%d-%d", &min_zoom, &max_zoom) != 2
+                   || min_zoom < 0 || max_zoom > 22 || min_zoom > max_zoom)
+                {
+                    fprintf(stderr, "Invalid zoom levels <%s>\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                if( !(osm->memory_limit = parse_size(optarg)))
+                {
+                    fprintf(stderr, "Invalid memory limit <%s>\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'C':
+                if( !(cache_limit = parse_size(optarg)))
+                {
+                    fprintf(stderr, "Invalid cache size <%s>\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'H':
+                osm->history = 1;
+                break;
+            case 'T':
+                if((osm->as_of = osm_parse_timestamp(optarg)) <= 0)
+                {
+                    fprintf(stderr, "Invalid time <%s>\n", optarg);
+                    return 1;
+                }
+                osm->history = 1;
+                break;
+            case 'v':
+                osm_readahead_set_verbose(1);
+                break;
+            case 'n':
+                osm->strip_metadata = 1;
+                /* fall through */
+            case 'R':
+                osm->raw = 1;
+                break;
+            case 't':
+                if( !(stats_key_count = split_keys(optarg, &stats_keys)))
+                {
+                    fprintf(stderr, "Invalid list of keys <%s>\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'S':
+                socket_path = optarg;
+                break;
+            case 'D':
+                diff = 1;
+                break;
+            case 'd':
+                if((read_depth = atoi(optarg)) < 1)
+                {
+                    fprintf(stderr, "Invalid read depth <%s>\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r':
+                if( !(read_size = parse_size(optarg)))
+                {
+                    fprintf(stderr, "Invalid read size <%s>\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'B':
+                if(strcmp(optarg, "builtin") == 0)
+                    osm_planet_set_decoder(OSM_BZIP2_BUILTIN);
+                else if(strcmp(optarg, "libbz2") == 0)
+                    osm_planet_set_decoder(OSM_BZIP2_LIBBZ2);
+                else
+                {
+                    fprintf(stderr, "Unknown bzip2 decoder <%s>\n", optarg);
+                    return 1;
+                }
+                break;
+            case 's':
+            {
+                char *end;
+
+                if(optarg[0] == 'z')
+                {
+                    grid = OSM_GRID_TILES;
+                    grid_size = strtol(optarg + 1, &end, 10);
+                }
+                else
+                {
+                    grid = OSM_GRID_DEGREES;
+                    grid_size = strtod(optarg, &end);
+                }
+                if(end == optarg || *end != '\0')
+                {
+                    fprintf(stderr, "Invalid grid <%s>\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(optind >= argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    osm_planet_set_readahead(read_depth, read_size);
+
+    if(socket_path)
+    {
+        if(optind != argc - 1)
+        {
+            fprintf(stderr, "Only one file can be served\n");
+            return 1;
+        }
+        return serve(socket_path, argv[optind]);
+    }
+    if(diff)
+    {
+        if(optind != argc - 2)
+        {
+            fprintf(stderr, "Two files are needed for a diff\n");
+            return 1;
+        }
+        return write_diff(argv[optind], argv[optind + 1], output);
+    }
+    /* Only the passes over the input files are cached */
+    osm_cache_set_limit(cache_limit);
+    osm->input_count = argc - optind;
+    osm->inputs = calloc(osm->input_count, sizeof(struct osm_input));
+    for(i = 0; i < osm->input_count; i++)
+    {
+        osm->inputs[i].filename = argv[optind + i];
+        osm->inputs[i].osm = osm;
+        if(stats_keys)
+            osm->inputs[i].stats = osm_stats_new(stats_keys, stats_key_count);
+    }
+    pthread_mutex_init(&osm->next_mutex, NULL);
+
+    if(format < 0)
+        format = (output && has_suffix(output, ".pbf")) ? OSM_FORMAT_PBF : OSM_FORMAT_XML;
+    if(osm->raw && (grid >= 0 || format != OSM_FORMAT_XML))
+    {
+        fprintf(stderr, "--raw can only be used with XML output\n");
+        return 1;
+    }
+    if(index_file && (grid >= 0 || format != OSM_FORMAT_XML))
+    {
+        fprintf(stderr, "--index can only be used with XML output\n");
+        return 1;
+    }
+    if(ids_file && (osm->input_count != 1 || has_suffix(osm->inputs[0].filename, ".pbf")))
+    {
+        fprintf(stderr, "--ids needs a single XML input file\n");
+        return 1;
+    }
+    if(seek_file && !ids_file)
+    {
+        fprintf(stderr, "--seek-cache can only be used with --ids\n");
+        return 1;
+    }
+    if(ids_file && stats_keys)
+    {
+        fprintf(stderr, "--stats-tags cannot be used with --ids\n");
+        return 1;
+    }
+    if(index_file && osm->hilbert)
+    {
+        fprintf(stderr, "--index needs output in order of ID\n");
+        return 1;
+    }
+    if(grid < 0 && output && !(out_fp = fopen(output, "wb")))
+    {
+        fprintf(stderr, "Unable to open output file <%s>\n", output);
+        return 1;
+    }
+
+    /* Define tags of interest. In future these could be specified on standard input. */
+    osm->tag_count = 2;
+    osm->tags = malloc(osm->tag_count * sizeof(struct osm_tag));
+    strcpy(osm->tags[0].key, "railway");
+    strcpy(osm->tags[0].value, "*");
+    strcpy(osm->tags[1].key, "route");
+    strcpy(osm->tags[1].value, "train");
+
+    /* Find the elements of interest, by their tags in the first two
+     * passes or from the list given */
+    if(ids_file)
+    {
+        if(fetch_ids(osm, ids_file, seek_file) != 0)
+            return 1;
+    }
+    else if(find_wanted(osm) != 0)
+        return 1;
+
+    if(stats_keys)
+    {
+        osm->stats = osm_stats_new(stats_keys, stats_key_count);
+        for(i = 0; i < osm->input_count; i++)
+        {
+            osm_stats_merge(osm->stats, osm->inputs[i].stats);
+            osm_stats_free(osm->inputs[i].stats);
+        }
+        osm->node_coords = calloc(2 * (size_t)osm->wanted[OSM_NODE].count, sizeof(int32_t));
+    }
+
+    fprintf(stderr, "Finished loading.\nElements of interest:\nNodes:\t%d\n Ways:\t%d\n Relations:\t%d\n",
+            osm->wanted[OSM_NODE].count, osm->wanted[OSM_WAY].count, osm->wanted[OSM_RELATION].count);
+
+    /* Third pass. Output all interesting nodes, ways and relations. With
+     * a single input file in ID order they are written as they are read;
+     * otherwise they are collected from each file, merged, and if need be
+     * put in Hilbert order. Elements found from a list of IDs have been
+     * collected already. */
+    if( !ids_file)
+        fprintf(stderr, "Third pass...\n");
+    if(grid >= 0)
+    {
+        if( !(osm->shard = osm_shard_open(output ? output : "shard", format, grid, grid_size)))
+            return 1;
+    }
+    else if( !(osm->out = osm_output_open(out_fp, format)))
+        return 1;
+    if(index_file && !(osm->index = osm_index_create(index_file, OSM_INDEX_INTERVAL)))
+        return 1;
+    if(graph_file)
+        osm->graph = osm_graph_init();
+    if(tiles_dir)
+        osm->tiles = osm_tiles_init(tiles_dir, min_zoom, max_zoom);
+    if(routes_file)
+        osm->routes = osm_routes_init();
+    if( !ids_file && !run_pass(osm, OSM_ALL_TYPES, raw_only(osm) ? &pass3_raw_proj : &pass3_proj, output_batch))
+        return 1;
+    osm_cache_set_limit(0);
+    if(osm->hilbert)
+    {
+        merge_output(osm, collect_element);
+        ordered_output(osm);
+    }
+    else if(osm->input_count > 1 || ids_file)
+        merge_output(osm, output_element);
+    if(osm->index && osm_index_close(osm->index, osm_output_tell(osm->out)) != 0)
+        return 1;
+    if(osm->shard)
+    {
+        if(osm_shard_close(osm->shard) != 0)
+            return 1;
+    }
+    else if(osm_output_close(osm->out) != 0)
+        return 1;
+    else if(output && fclose(out_fp) != 0)
+    {
+        fprintf(stderr, "Error closing output file <%s>\n", output);
+        return 1;
+    }
+
+    if(osm->graph)
+    {
+        if(osm_graph_write(osm->graph, graph_file) != 0)
+            return 1;
+        osm_graph_destroy(osm->graph);
+    }
+
+    if(osm->tiles)
+    {
+        fprintf(stderr, "Writing vector tiles...\n");
+        if(osm_tiles_write(osm->tiles) != 0)
+            return 1;
+        osm_tiles_destroy(osm->tiles);
+    }
+
+    if(osm->routes)
+    {
+        fprintf(stderr, "Writing train routes...\n");
+        if(osm_routes_write(osm->routes, routes_file) != 0)
+            return 1;
+        osm_routes_destroy(osm->routes);
+    }
+
+    if(osm->stats)
+    {
+        fprintf(stderr, "Tag statistics:\n");
+        if(osm_stats_write(osm->stats, stderr) != 0)
+            return 1;
+        osm_stats_free(osm->stats);
+        free(osm->node_coords);
+    }
+
+    return 0;
+}
+
+/* Run the first pass, and the second if needed, to find the IDs of the
+ * elements of interest. Returns 1 on error, otherwise 0. */
+static int find_wanted(struct osm_params *osm)
+{
+    int i;
+
+    /* First pass. Read all node, way and relation IDs, and IDs of
+     * all ways referenced in relations. */
+    fprintf(stderr, "First pass...\n");
+    share_memory(osm);
+    if( !run_pass(osm, OSM_ALL_TYPES, &pass1_proj, load_batch_1))
+        return 1;
+
+    /* Relation and way lists are complete after first pass. Merge the
+     * lists from all files into sorted lists without duplicates. */
+    merge_found(osm, OSM_NODE);
+    merge_found(osm, OSM_WAY);
+    merge_found(osm, OSM_RELATION);
+    plan_second_pass(osm);
+
+    /* Second pass, only if there are ways whose nodes were not collected
+     * in the first. Read IDs of the nodes of those ways, stopping in each
+     * file once they can all have been seen. */
+    if(osm->pending.count > 0)
+    {
+        int stopped = 0;
+
+        fprintf(stderr, "Second pass...\n");
+        share_memory(osm);
+        if( !run_pass(osm, OSM_WAYS | OSM_RELATIONS, &pass2_proj, load_batch_2))
+            return 1;
+        for(i = 0; i < osm->input_count; i++)
+            stopped += osm->inputs[i].stopped;
+        fprintf(stderr, "Second pass stopped before the end of %d of %d files\n",
+                stopped, osm->input_count);
+    }
+    free(osm->pending.ids);
+    memset(&osm->pending, 0, sizeof(struct id_list));
+
+    /* Node list is now complete */
+    merge_found(osm, OSM_NODE);
+
+    return 0;
+}
+
+static int has_suffix(const char *str, const char *suffix)
+{
+    size_t len = strlen(str), suffix_len = strlen(suffix);
+
+    return len > suffix_len && strcmp(str + len - suffix_len, suffix) == 0;
+}
+
+/* Check whether the elements of interest are only to be copied out as
+ * they were read, so that none of their fields need to be parsed. PBF
+ * input has no text to copy and is always formatted again. */
+static int raw_only(struct osm_params *osm)
+{
+    int i;
+
+    if( !osm->raw || osm->hilbert || osm->graph || osm->tiles || osm->routes || osm->stats)
+        return 0;
+    for(i = 0; i < osm->input_count; i++)
+    {
+        if(has_suffix(osm->inputs[i].filename, ".pbf"))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Write the differences between two files as osmChange */
+static int write_diff(const char *old_filename, const char *new_filename, const char *output)
+{
+    FILE *fp = stdout;
+    struct osm_output *out;
+    int ret;
+
+    if(output && !(fp = fopen(output, "wb")))
+    {
+        fprintf(stderr, "Unable to open output file <%s>\n", output);
+        return 1;
+    }
+    if( !(out = osm_output_open(fp, OSM_FORMAT_CHANGE)))
+        return 1;
+    ret = osm_diff(old_filename, new_filename, out);
+    if(osm_output_close(out) != 0)
+        ret = 1;
+    if(output && fclose(fp) != 0)
+    {
+        fprintf(stderr, "Error closing output file <%s>\n", output);
+        ret = 1;
+    }
+
+    return ret;
+}
+
+static struct osm_server *server;
+
+static void stop_server(int sig)
+{
+    osm_server_stop(server);
+
+    return;
+}
+
+/* Load a file and answer queries on it until SIGINT or SIGTERM */
+static int serve(const char *path, const char *filename)
+{
+    int ret;
+
+    fprintf(stderr, "Loading <%s>...\n", filename);
+    if( !(server = osm_server_load(filename)))
+        return 1;
+
+    signal(SIGINT, stop_server);
+    signal(SIGTERM, stop_server);
+    ret = osm_server_run(server, path);
+    osm_server_print_stats(server, stderr);
+    osm_server_free(server);
+
+    return ret;
+}
+
+/* Worker thread reading input files until none are left in the pass */
+static void *start_pass_thread(void *data)
+{
+    struct osm_params *osm = data;
+
+    while(1)
+    {
+        int i;
+
+        pthread_mutex_lock(&osm->next_mutex);
+        i = osm->next_input++;
+        pthread_mutex_unlock(&osm->next_mutex);
+
+        if(i >= osm->input_count)
+            break;
+        osm->inputs[i].ok = parse_entire_file(&osm->inputs[i]);
+    }
+
+    return NULL;
+}
+
+/* Read every input file, with up to one thread per CPU reading
+ * different files concurrently */
+static int run_pass(struct osm_params *osm, int types, const struct osm_projection *proj,
+                    batch_callback_t *process)
+{
+    pthread_t *threads;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int t, i;
+
+    osm->pass_types = types;
+    osm->pass_proj = proj;
+    osm->pass_process = process;
+    osm->next_input = 0;
+
+    if(nthreads > osm->input_count)
+        nthreads = osm->input_count;
+    if(nthreads < 1)
+        nthreads = 1;
+
+    /* A single file is read in this thread */
+    if(nthreads == 1)
+        start_pass_thread(osm);
+    else
+    {
+        threads = malloc(nthreads * sizeof(pthread_t));
+        for(t = 0; t < nthreads - 1; t++)
+        {
+            if(pthread_create(&threads[t], NULL, start_pass_thread, osm) != 0)
+            {
+                fprintf(stderr, "Unable to start input thread\n");
+                break;
+            }
+        }
+        /* This thread reads files too */
+        start_pass_thread(osm);
+        while(t-- > 0)
+            pthread_join(threads[t], NULL);
+        free(threads);
+    }
+
+    for(i = 0; i < osm->input_count; i++)
+    {
+        if( !osm->inputs[i].ok)
+            return 0;
+    }
+
+    return 1;
+}
+
+static int parse_entire_file(struct osm_input *in)
+{
+    struct osm_params *osm = in->osm;
+    struct osm_reader *reader;
+    struct osm_batch *batch;
+    int ele, ret;
+
+    /* Restart the merge-join cursors at the beginning of each pass */
+    for(ele = OSM_NODE; ele <= OSM_RELATION; ele++)
+    {
+        in->cursor[ele] = 0;
+        in->last_id[ele] = 0;
+        in->unsorted[ele] = 0;
+    }
+
+    if( !(reader = osm_reader_open(in->filename, osm->pass_types, osm->pass_proj, in)))
+    {
+        fprintf(stderr, "Unable to open file <%s>\n", in->filename);
+        return 0;
+    }
+    in->reader = reader;
+    in->stopped = 0;
+    if(osm->history)
+        osm_reader_set_history(reader, osm->as_of);
+    /* Only the third pass writes elements out */
+    if(osm->raw && osm->pass_process == output_batch)
+        osm_reader_set_raw(reader, osm->strip_metadata);
+
+    while((ret = osm_reader_next(reader, &batch)) == 0)
+        osm->pass_process(reader, batch, in);
+
+    if(osm_reader_close(reader) != 0 || ret != 2)
+        return 0;
+
+    return 1;
+}
+
+static int check_tags(struct osm_batch *, int i, struct osm_params *);
+static void ensure_capacity(struct id_list *, int count);
+static void reserve_ids(struct osm_input *, struct id_list *, int count);
+static void add_ids(struct osm_input *, int ele, const unsigned int *ids, int count);
+
+static int cmp_id(const void *a, const void *b)
+{
+    unsigned int aa = *(unsigned int *)a, bb = *(unsigned int *)b;
+
+    return (int)aa - bb;
+}
+
+/* Filter callback called by the parser as soon as the ID of an element
+ * has been read in the second and third passes. */
+static int filter_wanted(int type, unsigned int id, void *data)
+{
+    return is_wanted(data, type, id);
+}
+
+/* Filter callback for the second pass, selecting the pending ways. Once
+ * a file's ways have passed the last pending way, if they are in order,
+ * or its relations have begun, if the types are in order, none can
+ * follow, so the rest of the file is not read. */
+static int filter_pending(int type, unsigned int id, void *data)
+{
+    struct osm_input *in = data;
+    struct id_list *pending = &in->osm->pending;
+
+    if(type != OSM_WAY && in->types_unsorted)
+        return 0;
+    if(type != OSM_WAY || ( !in->ways_unsorted && id > pending->ids[pending->count - 1]))
+    {
+        if( !in->stopped)
+            osm_reader_stop(in->reader);
+        in->stopped = 1;
+        return 0;
+    }
+
+    return is_listed(in, OSM_WAY, pending, id);
+}
+
+/* Called for every batch of elements in the first pass. Collects the IDs
+ * of all elements with tags of interest, of the member nodes of ways of
+ * interest, and of the member ways of relations of interest. */
+static void load_batch_1(struct osm_reader *reader, struct osm_batch *batch, struct osm_input *in)
+{
+    int type = batch->type, i;
+
+    if(in->stats)
+        osm_stats_add_batch(in->stats, batch);
+
+    if(type < in->last_type)
+        in->types_unsorted = 1;
+    in->last_type = type;
+
+    for(i = 0; i < batch->count; i++)
+    {
+        if(type == OSM_WAY)
+        {
+            if(batch->ids[i] < in->last_way)
+                in->ways_unsorted = 1;
+            in->last_way = batch->ids[i];
+        }
+
+        if( !check_tags(batch, i, in->osm))
+            continue;
+
+        add_ids(in, type, &batch->ids[i], 1);
+
+        if(type == OSM_WAY)
+        {
+            uint32_t start = batch->member_offsets[i];
+
+            add_ids(in, OSM_NODE, &batch->member_ids[start], batch->member_offsets[i + 1] - start);
+            reserve_ids(in, &in->resolved, 1);
+            in->resolved.ids[in->resolved.count++] = batch->ids[i];
+        }
+        else if(type == OSM_RELATION)
+        {
+            uint32_t m;
+
+            for(m = batch->member_offsets[i]; m < batch->member_offsets[i + 1]; m++)
+            {
+                if(batch->member_types[m] == OSM_WAY)
+                    add_ids(in, OSM_WAY, &batch->member_ids[m], 1);
+            }
+        }
+    }
+
+    return;
+}
+
+/* Called in the second pass with batches of pending ways only, as
+ * selected by filter_pending(). All their member nodes are of interest. */
+static void load_batch_2(struct osm_reader *reader, struct osm_batch *batch, struct osm_input *in)
+{
+    add_ids(in, OSM_NODE, batch->member_ids, batch->member_offsets[batch->count]);
+
+    return;
+}
+
+static int check_tags(struct osm_batch *batch, int i, struct osm_params *osm)
+{
+    uint32_t t;
+
+    for(t = batch->tag_offsets[i]; t < batch->tag_offsets[i + 1]; t++)
+    {
+        const char *key = batch->strings + batch->tag_keys[t];
+        const char *value = batch->strings + batch->tag_values[t];
+        int j;
+
+        for(j = 0; j < osm->tag_count; j++)
+        {
+            struct osm_tag *wanted = osm->tags+j;
+
+            if(wanted->key[0] == '*')
+            {
+                if(strcmp(wanted->value, value) == 0)
+                    return 1;
+            }
+            else if(wanted->value[0] == '*')
+            {
+                if(strcmp(wanted->key, key) == 0)
+                    return 1;
+            }
+            else if( strcmp(wanted->key, key) == 0
+                  && strcmp(wanted->value, value) == 0)
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void ensure_capacity(struct id_list *list, int count)
+{
+    if(list->count + count > list->max)
+    {
+        list->max += (10000 + count);
+        list->ids = realloc(list->ids, list->max * sizeof(unsigned int));
+    }
+
+    return;
+}
+
+/* Sort a list of IDs and write it to a temporary file as a run, and
+ * empty it. Returns 1 if it could not be written, otherwise 0. */
+static int spill_run(struct id_list *list)
+{
+    const char *dir = getenv("TMPDIR");
+    char filename[1024];
+    FILE *fp = NULL;
+    int fd;
+
+    sort_ids(list);
+    snprintf(filename, sizeof(filename), "%s/osmrail.XXXXXX", dir ? dir : "/tmp");
+    if((fd = mkstemp(filename)) >= 0)
+    {
+        /* The file is deleted as soon as it is closed */
+        unlink(filename);
+        fp = fdopen(fd, "w+b");
+    }
+    if( !fp || fwrite(list->ids, sizeof(unsigned int), list->count, fp) != (size_t)list->count)
+    {
+        /* Carry on in memory rather than lose the IDs */
+        fprintf(stderr, "Unable to write temporary file in <%s>; exceeding memory limit\n",
+                dir ? dir : "/tmp");
+        if(fp)
+            fclose(fp);
+        return 1;
+    }
+
+    list->runs = realloc(list->runs, (list->run_count + 1) * sizeof(FILE *));
+    list->runs[list->run_count++] = fp;
+    free(list->ids);
+    list->ids = NULL;
+    list->count = list->max = 0;
+
+    return 0;
+}
+
+/* Share the memory limit equally between the input files for the IDs
+ * they find in a pass. The lists of IDs of interest found in earlier
+ * passes are held throughout, so only what they leave is shared. */
+static void share_memory(struct osm_params *osm)
+{
+    size_t limit = osm->memory_limit / sizeof(unsigned int), held = osm->pending.max, share;
+    int ele, i;
+
+    if( !limit)
+        return;
+    for(ele = OSM_NODE; ele <= OSM_RELATION; ele++)
+        held += osm->wanted[ele].max;
+    if(held + MIN_SHARE * osm->input_count > limit)
+    {
+        /* Each file needs room for at least MIN_SHARE IDs, on top of the
+         * lists of IDs of interest already held */
+        size_t minimum = (held + MIN_SHARE * osm->input_count) * sizeof(unsigned int);
+
+        fprintf(stderr, "Memory limit of %zu kB is below the %zu kB needed: %zu kB for "
+                "each of %d input files, and %zu kB of IDs of interest; exceeding it\n",
+                osm->memory_limit >> 10, (minimum + 1023) >> 10,
+                MIN_SHARE * sizeof(unsigned int) >> 10, osm->input_count,
+                (held * sizeof(unsigned int) + 1023) >> 10);
+        share = MIN_SHARE;
+    }
+    else
+        share = (limit - held) / osm->input_count;
+    for(i = 0; i < osm->input_count; i++)
+        osm->inputs[i].budget = share;
+
+    return;
+}
+
+/* Number of IDs allocated for the lists an input file fills in a pass */
+static size_t input_ids(struct osm_input *in)
+{
+    return in->found[OSM_NODE].max + in->found[OSM_WAY].max + in->found[OSM_RELATION].max
+         + in->resolved.max;
+}
+
+/* Make room for count more IDs in one of the lists of an input file,
+ * keeping all of them within the file's share of the memory limit. While
+ * they would exceed it, the largest of the lists of IDs found is spilled
+ * to a temporary file; the list of resolved ways is needed in memory, but
+ * is counted. Lists grow by up to 10000 IDs at a time, as far as the
+ * share allows. */
+static void reserve_ids(struct osm_input *in, struct id_list *list, int count)
+{
+    size_t needed, step;
+
+    if(list->count + count <= list->max)
+        return;
+    if( !in->budget)
+    {
+        ensure_capacity(list, count);
+        return;
+    }
+
+    while((needed = input_ids(in) - list->max + list->count + count) > in->budget)
+    {
+        struct id_list *largest = NULL;
+        int ele;
+
+        for(ele = OSM_NODE; ele <= OSM_RELATION; ele++)
+        {
+            if(in->found[ele].max > 0 && ( !largest || in->found[ele].max > largest->max))
+                largest = &in->found[ele];
+        }
+        /* Carry on over the limit if nothing more can be spilled */
+        if( !largest || spill_run(largest) != 0)
+            break;
+    }
+
+    step = needed < in->budget ? in->budget - needed : 0;
+    list->max = list->count + count + (step < 10000 ? step : 10000);
+    list->ids = realloc(list->ids, list->max * sizeof(unsigned int));
+
+    return;
+}
+
+/* Add IDs found in an input file to one of its lists */
+static void add_ids(struct osm_input *in, int ele, const unsigned int *ids, int count)
+{
+    struct id_list *list = &in->found[ele];
+
+    reserve_ids(in, list, count);
+    memcpy(list->ids + list->count, ids, count * sizeof(unsigned int));
+    list->count += count;
+
+    return;
+}
+
+/* Source of sorted IDs for merge_found(), either a list held in memory
+ * or a run in a temporary file */
+struct id_source
+{
+    unsigned int *ids;
+    int count, pos;
+    FILE *fp;
+};
+
+/* Move a source on to its next ID, reading more from the file if
+ * necessary. Returns 0 if the source is exhausted. */
+static int next_source_id(struct id_source *src)
+{
+    if(++src->pos < src->count)
+        return 1;
+    if( !src->fp)
+        return 0;
+
+    src->count = fread(src->ids, sizeof(unsigned int), RUN_CHUNK, src->fp);
+    src->pos = 0;
+
+    return src->count > 0;
+}
+
+/* Restore the heap property of a min-heap of sources below entry i */
+static void sift_down(struct id_source **heap, int count, int i)
+{
+    while(1)
+    {
+        int child = 2 * i + 1, smallest = i;
+        struct id_source *tmp;
+
+        if(child < count && heap[child]->ids[heap[child]->pos] < heap[smallest]->ids[heap[smallest]->pos])
+            smallest = child;
+        child++;
+        if(child < count && heap[child]->ids[heap[child]->pos] < heap[smallest]->ids[heap[smallest]->pos])
+            smallest = child;
+        if(smallest == i)
+            break;
+
+        tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+
+    return;
+}
+
+/* Replace the list of IDs of interest with the union of itself and the
+ * IDs found in each input file during the last pass, sorted and without
+ * duplicates. The lists held in memory and any runs spilled to temporary
+ * files are combined with a k-way merge. Under a memory limit, the lists
+ * still in memory are spilled first if the merged list might not fit
+ * beside them. */
+static void merge_found(struct osm_params *osm, int ele)
+{
+    struct id_list merged = { NULL, 0, 0, NULL, 0 };
+    struct id_source *sources, **heap;
+    int nsources = 1, count = 0, runs = 0, i, r;
+
+    if(osm->memory_limit)
+    {
+        size_t in_memory = 0, held = osm->pending.max;
+        int spilled = 0, type;
+
+        for(type = OSM_NODE; type <= OSM_RELATION; type++)
+        {
+            held += osm->wanted[type].max;
+            for(i = 0; i < osm->input_count; i++)
+                held += osm->inputs[i].found[type].max;
+        }
+        for(i = 0; i < osm->input_count; i++)
+        {
+            in_memory += osm->inputs[i].found[ele].count;
+            spilled += osm->inputs[i].found[ele].run_count;
+        }
+        /* The merged list holds at most the current one and all those found */
+        if(spilled > 0 || held + osm->wanted[ele].count + in_memory
+                          > osm->memory_limit / sizeof(unsigned int))
+        {
+            for(i = 0; i < osm->input_count; i++)
+            {
+                if(osm->inputs[i].found[ele].count > 0)
+                    spill_run(&osm->inputs[i].found[ele]);
+            }
+        }
+    }
+
+    for(i = 0; i < osm->input_count; i++)
+        nsources += 1 + osm->inputs[i].found[ele].run_count;
+    sources = calloc(nsources, sizeof(struct id_source));
+    heap = malloc(nsources * sizeof(struct id_source *));
+
+    /* The current list is already sorted */
+    sources[count].ids = osm->wanted[ele].ids;
+    sources[count].count = osm->wanted[ele].count;
+    sources[count].pos = -1;
+    count++;
+    for(i = 0; i < osm->input_count; i++)
+    {
+        struct id_list *found = &osm->inputs[i].found[ele];
 
-struct osm_params
-{
-    /* Tags of interest */
-    struct osm_tag *tags;
-    int tag_count;
+        sort_ids(found);
+        sources[count].ids = found->ids;
+        sources[count].count = found->count;
+        sources[count].pos = -1;
+        count++;
 
-    /* IDs of nodes/ways/relations of interest */
-    unsigned int *ids[3];
-    int count[3];
-    int max[3];
-};
+        for(r = 0; r < found->run_count; r++)
+        {
+            rewind(found->runs[r]);
+            sources[count].fp = found->runs[r];
+            sources[count].ids = malloc(RUN_CHUNK * sizeof(unsigned int));
+            sources[count].pos = -1;
+            count++;
+            runs++;
+        }
+    }
+    if(runs > 0)
+        fprintf(stderr, "Merging %d runs of IDs from temporary files\n", runs);
+
+    /* Build the heap from the sources that are not empty */
+    count = 0;
+    for(i = 0; i < nsources; i++)
+    {
+        if(next_source_id(&sources[i]))
+            heap[count++] = &sources[i];
+    }
+    for(i = count / 2 - 1; i >= 0; i--)
+        sift_down(heap, count, i);
 
-static int parse_entire_file(char *filename, osm_node_callback_t *, osm_way_callback_t *, 
-                             osm_relation_callback_t *, void *);
-static osm_node_callback_t     load_node, output_node;
-static osm_way_callback_t      load_way_1, load_way_2, output_way;
-static osm_relation_callback_t load_relation, output_relation;
-static void sort_ids(struct osm_params *, int ele);
+    while(count > 0)
+    {
+        unsigned int id = heap[0]->ids[heap[0]->pos];
 
-int main(int argc, char **argv)
+        if(merged.count == 0 || merged.ids[merged.count - 1] != id)
+        {
+            ensure_capacity(&merged, 1);
+            merged.ids[merged.count++] = id;
+        }
+
+        if( !next_source_id(heap[0]))
+            heap[0] = heap[--count];
+        sift_down(heap, count, 0);
+    }
+
+    /* Free the per-file lists and runs */
+    for(i = 0; i < osm->input_count; i++)
+    {
+        struct id_list *found = &osm->inputs[i].found[ele];
+
+        for(r = 0; r < found->run_count; r++)
+            fclose(found->runs[r]);
+        free(found->runs);
+        free(found->ids);
+        memset(found, 0, sizeof(struct id_list));
+    }
+    for(i = 0; i < nsources; i++)
+    {
+        if(sources[i].fp)
+            free(sources[i].ids);
+    }
+    free(sources);
+    free(heap);
+
+    free(osm->wanted[ele].ids);
+    merged.ids = realloc(merged.ids, merged.count * sizeof(unsigned int));
+    merged.max = merged.count;
+    osm->wanted[ele] = merged;
+
+    return;
+}
+
+/* Decide what the second pass has to do. The nodes of ways of interest
+ * by their own tags were collected in the first pass; only ways wanted
+ * solely as members of relations, which were found after the ways had
+ * been read, remain. If there are none the second pass is skipped. */
+static void plan_second_pass(struct osm_params *osm)
 {
-    struct osm_params *osm = calloc(1, sizeof(struct osm_params));
+    struct id_list resolved = { NULL, 0, 0, NULL, 0 };
+    struct id_list *wanted = &osm->wanted[OSM_WAY], *pending = &osm->pending;
+    int i, w, r = 0;
 
-    if(argc != 2)
+    for(i = 0; i < osm->input_count; i++)
     {
-        fprintf(stderr, "Usage: %s <planet.osm.bz2>\n", argv[0]);
-        return 1;
+        struct id_list *list = &osm->inputs[i].resolved;
+
+        ensure_capacity(&resolved, list->count);
+        memcpy(resolved.ids + resolved.count, list->ids, list->count * sizeof(unsigned int));
+        resolved.count += list->count;
+        free(list->ids);
+        memset(list, 0, sizeof(struct id_list));
     }
+    sort_ids(&resolved);
 
-    /* Define tags of interest. In future these could be specified on standard input. */
-    osm->tag_count = 2;
-    osm->tags = malloc(osm->tag_count * sizeof(struct osm_tag));
-    strcpy(osm->tags[0].key, "railway");
-    strcpy(osm->tags[0].value, "*");
-    strcpy(osm->tags[1].key, "route");
-    strcpy(osm->tags[1].value, "train");
+    /* Pending ways are those wanted but not resolved */
+    pending->ids = malloc((wanted->count + 1) * sizeof(unsigned int));
+    pending->count = 0;
+    for(w = 0; w < wanted->count; w++)
+    {
+        while(r < resolved.count && resolved.ids[r] < wanted->ids[w])
+            r++;
+        if(r >= resolved.count || resolved.ids[r] != wanted->ids[w])
+            pending->ids[pending->count++] = wanted->ids[w];
+    }
+    free(resolved.ids);
 
-    /* First pass. Read all node, way and relation IDs, and IDs of
-     * all ways referenced in relations. */
-    fprintf(stderr, "First pass...\n");
-    if( !parse_entire_file(argv[1], load_node, load_way_1, load_relation, osm))
-        return 1;
+    if(pending->count == 0)
+        fprintf(stderr, "Pass plan: nodes of all %d ways collected; second pass skipped\n",
+                wanted->count);
+    else
+        fprintf(stderr, "Pass plan: nodes of %d of %d ways collected; second pass for %d ways "
+                "found through relations\n", wanted->count - pending->count, wanted->count,
+                pending->count);
 
-    /* Relation and way lists are complete after first pass. Sort,
-     * remove duplicates and resize. */
-    sort_ids(osm, OSM_WAY);
-    sort_ids(osm, OSM_RELATION);
+    return;
+}
 
-    /* Second pass. Read IDs of all nodes referenced in ways. */
-    fprintf(stderr, "Second pass...\n");
-    if( !parse_entire_file(argv[1], NULL, load_way_2, NULL, osm))
-        return 1;
+/* State of the search for the listed elements of one type in --ids mode */
+struct id_fetch
+{
+    struct osm_input *in;
+    struct osm_seek *sk;
+    struct osm_reader *reader;
+    int type;
+    int next;       /**< Index in the list of the next ID not yet passed */
+    int seek_next;  /**< Value of next when the file was last positioned */
+    char seek;      /**< Boolean; reading stopped to seek to the next ID */
+    char unsorted;  /**< Boolean; elements were found out of ID order */
+    unsigned int last_id;
+    int found;
+};
 
-    /* Node list is now complete. Sort, remove duplicates and resize. */
-    sort_ids(osm, OSM_NODE);
+/* Read a list of IDs, each prefixed by the letter of its type, into the
+ * lists of elements of interest */
+static int read_id_file(struct osm_params *osm, const char *filename)
+{
+    FILE *fp = stdin;
+    char token[32];
+    int ele;
 
-    fprintf(stderr, "Finished loading.\nElements of interest:\nNodes:\t%d\n Ways:\t%d\n Relations:\t%d\n",
-            osm->count[OSM_NODE], osm->count[OSM_WAY], osm->count[OSM_RELATION]);
-   
-    /* Third pass. Output all interesting nodes, ways and relations. */
-    fprintf(stderr, "Third pass...\n");
-    printf("<?xml version='1.0' encoding='UTF-8'?>\n");
-    printf("<osm version=\"0.6\" generator=\"osmrail by Paul Kelly\">\n");
-    if( !parse_entire_file(argv[1], output_node, output_way, output_relation, osm))
+    if(strcmp(filename, "-") != 0 && !(fp = fopen(filename, "r")))
+    {
+        fprintf(stderr, "Unable to open ID list <%s>\n", filename);
         return 1;
-    printf("</osm>\n");
+    }
+    while(fscanf(fp, " %31[^, \t\r\n]%*[, \t\r\n]", token) == 1)
+    {
+        struct id_list *list;
+        char *end;
+        unsigned long id;
+
+        switch(token[0] | 0x20)
+        {
+            case 'n':
+                list = &osm->wanted[OSM_NODE];
+                break;
+            case 'w':
+                list = &osm->wanted[OSM_WAY];
+                break;
+            case 'r':
+                list = &osm->wanted[OSM_RELATION];
+                break;
+            default:
+                list = NULL;
+                break;
+        }
+        id = strtoul(token + 1, &end, 10);
+        if( !list || end == token + 1 || *end != '\0' || id > UINT32_MAX)
+        {
+            fprintf(stderr, "Invalid element <%s> in ID list\n", token);
+            if(fp != stdin)
+                fclose(fp);
+            return 1;
+        }
+        ensure_capacity(list, 1);
+        list->ids[list->count++] = id;
+    }
+    if(fp != stdin)
+        fclose(fp);
+
+    for(ele = OSM_NODE; ele <= OSM_RELATION; ele++)
+        sort_ids(&osm->wanted[ele]);
 
     return 0;
 }
 
-static int parse_entire_file(char *filename, osm_node_callback_t *cb_node, 
-                      osm_way_callback_t *cb_way, osm_relation_callback_t *cb_relation, void *data)
+/* Filter callback while reading the elements of one type in --ids mode.
+ * Reading stops once the type or the list has been passed, or when the
+ * next ID is known to lie further on than can quickly be read through. */
+static int filter_fetch(int type, unsigned int id, void *data)
 {
-    struct osm_planet *osf;
-    struct osm_parse *parse;
+    struct id_fetch *f = data;
+    struct id_list *list = &f->in->osm->wanted[f->type];
 
-    if( !(osf = osm_planet_open(filename)))
+    if(type < f->type)
+        return 0;
+    if(type > f->type)
     {
-        fprintf(stderr, "Unable to open file <%s>\n", filename);
+        osm_reader_stop(f->reader);
         return 0;
     }
 
-    if( !(parse = osm_parse_init(cb_node, cb_way, cb_relation, data)))
+    if(id < f->last_id && !f->unsorted)
     {
-        fprintf(stderr, "Unable to initialise OSM parser\n");
-        return 0;
+        fprintf(stderr, "<%s> is not sorted by ID; elements may be missed\n", f->in->filename);
+        f->unsorted = 1;
     }
+    f->last_id = id;
 
-    while(1)
+    while(f->next < list->count && list->ids[f->next] < id)
+        f->next++;
+    if(f->next >= list->count)
+        osm_reader_stop(f->reader);
+    else if(list->ids[f->next] == id)
+        return 1;
+    else if(f->next > f->seek_next && osm_seek_ahead(f->sk, f->type, list->ids[f->next]))
     {
-        char *recvbuff;
-        int ret = osm_planet_readln(osf, &recvbuff);
+        f->seek = 1;
+        osm_reader_stop(f->reader);
+    }
 
-        if(ret == 1) /* error */
-            return 0;
+    return 0;
+}
 
-        /* Stop reading when either EOF or logical end of data occurs,
-         * whichever is sooner */
-        if( ret == 2 /* EOF */
-         || osm_parse_ingest(parse, recvbuff) == 1)
-            break;
-    }
+/* Add the IDs of the members of elements of interest to the lists of
+ * the types still to be read: the ways of relations, and the nodes of
+ * ways */
+static void add_members(struct osm_params *osm, struct osm_batch *batch)
+{
+    uint32_t m;
 
-    if(osm_planet_close(osf) != 0)
-        return 0;
-    osm_parse_destroy(parse);
+    for(m = 0; m < batch->member_offsets[batch->count]; m++)
+    {
+        int type = (batch->type == OSM_WAY) ? OSM_NODE : batch->member_types[m];
+        struct id_list *list = &osm->wanted[type];
 
-    return 1;
-}
+        if((batch->type == OSM_WAY && type == OSM_NODE) || (batch->type == OSM_RELATION && type == OSM_WAY))
+        {
+            ensure_capacity(list, 1);
+            list->ids[list->count++] = batch->member_ids[m];
+        }
+    }
 
-static int check_tags(struct osm_tag *, int tag_count, struct osm_params *);
-static void ensure_capacity(struct osm_params *, int ele_type, int count);
+    return;
+}
 
-static int cmp_id(const void *a, const void *b)
+/* Find the elements of one type listed, by seeking to each in turn, and
+ * keep copies of them for writing out. Reading carries on from one to
+ * the next where they are close together. */
+static int fetch_type(struct osm_input *in, struct osm_seek *sk, int type)
 {
-    unsigned int aa = *(unsigned int *)a, bb = *(unsigned int *)b;
+    struct osm_params *osm = in->osm;
+    struct id_list *list = &osm->wanted[type];
+    struct id_fetch f;
+    struct osm_batch *batch;
+    int ret;
+
+    memset(&f, 0, sizeof(f));
+    f.in = in;
+    f.sk = sk;
+    f.type = type;
+    sort_ids(list);
+    while(f.next < list->count)
+    {
+        if(osm_seek_to(sk, type, list->ids[f.next]) != 0)
+            return 1;
+        f.seek_next = f.next;
+        f.seek = 0;
+        f.last_id = 0;
+        f.reader = osm_reader_open_seek(sk, 1 << type, &fetch_proj, &f);
+        if(osm->history)
+            osm_reader_set_history(f.reader, osm->as_of);
+        if(osm->raw)
+            osm_reader_set_raw(f.reader, osm->strip_metadata);
+
+        while((ret = osm_reader_next(f.reader, &batch)) == 0)
+        {
+            f.found += batch->count;
+            if(type != OSM_NODE)
+                add_members(osm, batch);
+            keep_batch(in, batch);
+        }
+        osm_reader_close(f.reader);
+        if(ret != 2)
+            return 1;
+        if( !f.seek)
+            break;
+    }
+    fprintf(stderr, "Found %d of %d %s\n", f.found, list->count,
+            type == OSM_NODE ? "nodes" : (type == OSM_WAY ? "ways" : "relations"));
 
-    return (int)aa - bb;
+    return 0;
 }
 
-/* Callback function called by osm_parse_ingest() every time a new node has
- * been ingested from the OpenStreetMap data. */
-static void load_node(struct osm_node *node, void *data)
+/* Find the elements listed in a file, and the ways and nodes they refer
+ * to, without reading the whole of the input. Relations are read first,
+ * then ways, then nodes, so that the members of each are known before
+ * their type is read. The elements are kept in the input's batches, in
+ * the order of the file, as the third pass keeps them. The sample of the
+ * input found while seeking is kept in sample_file, if given. */
+static int fetch_ids(struct osm_params *osm, const char *filename, const char *sample_file)
 {
-    struct osm_params *osm = data;
+    struct osm_input *in = &osm->inputs[0];
+    struct osm_batch **batches;
+    struct osm_seek *sk;
+    long long bytes_read, size;
+    int ele, b, count = 0;
 
-    if( !check_tags(node->tags, node->tag_count, osm))
-        return;
+    if(read_id_file(osm, filename) != 0)
+        return 1;
+    if( !(sk = osm_seek_open(in->filename, sample_file)))
+        return 1;
+    fprintf(stderr, "Finding listed elements...\n");
+    for(ele = OSM_RELATION; ele >= OSM_NODE; ele--)
+    {
+        if(fetch_type(in, sk, ele) != 0)
+        {
+            fprintf(stderr, "Error reading file <%s>\n", in->filename);
+            osm_seek_close(sk);
+            return 1;
+        }
+    }
+    osm_seek_stats(sk, &bytes_read, &size);
+    fprintf(stderr, "Read %.1f MB of %.1f MB\n", bytes_read / 1048576.0, size / 1048576.0);
+    osm_seek_close(sk);
+
+    /* Put the batches back in order of type */
+    batches = malloc(in->batch_count * sizeof(struct osm_batch *));
+    for(ele = OSM_NODE; ele <= OSM_RELATION; ele++)
+    {
+        for(b = 0; b < in->batch_count; b++)
+        {
+            if(in->batches[b]->type == ele)
+                batches[count++] = in->batches[b];
+        }
+    }
+    free(in->batches);
+    in->batches = batches;
+    in->max_batches = in->batch_count;
 
-    ensure_capacity(osm, OSM_NODE, 1);
-    osm->ids[OSM_NODE][osm->count[OSM_NODE]++] = node->id;
+    return 0;
+}
+
+static void sort_ids(struct id_list *list)
+{
+    int curr, prev = 0;
+
+    qsort(list->ids, list->count, sizeof(unsigned int), cmp_id);
+    for(curr = 1; curr < list->count; curr++)
+    {
+        if(list->ids[curr] != list->ids[prev])
+            list->ids[++prev] = list->ids[curr];
+    }
+    if(list->count > 0)
+        list->count = prev + 1;
+    list->max = list->count;
+    list->ids = realloc(list->ids, list->count * sizeof(unsigned int));
 
     return;
 }
 
-static void load_way_1(struct osm_way *way, void *data)
+/* Check whether an element ID is present in the sorted list of IDs of
+ * interest. Planet files are sorted by ID within each element type, so
+ * the lookup is normally a merge join that only ever moves a cursor
+ * forwards through the list. If the input is found to be out of order
+ * we fall back to a binary search for the remainder of the pass. */
+static int is_wanted(struct osm_input *in, int ele, unsigned int id)
 {
-    struct osm_params *osm = data;
+    return is_listed(in, ele, &in->osm->wanted[ele], id);
+}
 
-    if( !check_tags(way->tags, way->tag_count, osm))
-        return;
+/* As is_wanted(), but for any sorted list of IDs */
+static int is_listed(struct osm_input *in, int ele, struct id_list *list, unsigned int id)
+{
+    unsigned int *ids = list->ids;
+    int cursor, count = list->count;
 
-    ensure_capacity(osm, OSM_WAY, 1);
-    osm->ids[OSM_WAY][osm->count[OSM_WAY]++] = way->id;
+    if( !in->unsorted[ele])
+    {
+        if(id >= in->last_id[ele])
+        {
+            in->last_id[ele] = id;
 
-    return;
+            cursor = in->cursor[ele];
+            while(cursor < count && ids[cursor] < id)
+                cursor++;
+            in->cursor[ele] = cursor;
+
+            return cursor < count && ids[cursor] == id;
+        }
+
+        fprintf(stderr, "<%s> not sorted by ID (%u follows %u); using random lookups\n",
+                in->filename, id, in->last_id[ele]);
+        in->unsorted[ele] = 1;
+    }
+
+    return bsearch(&id, ids, count, sizeof(unsigned int), cmp_id) != NULL;
 }
 
-static void load_way_2(struct osm_way *way, void *data)
+/* Called in the third pass with batches of elements of interest only, as
+ * selected by filter_wanted() */
+static void output_batch(struct osm_reader *reader, struct osm_batch *batch, struct osm_input *in)
 {
-    struct osm_params *osm = data;
-    int n;
+    int i;
 
-    /* Check if this is an interesting way */
-    if( !bsearch(&way->id, osm->ids[OSM_WAY], osm->count[OSM_WAY], sizeof(unsigned int), cmp_id))
+    if(in->osm->input_count > 1 || in->osm->hilbert)
+    {
+        keep_batch(in, batch);
         return;
+    }
 
-    ensure_capacity(osm, OSM_NODE, way->node_count);
-    for(n = 0; n < way->node_count; n++)
-        osm->ids[OSM_NODE][osm->count[OSM_NODE]++] = way->nodes[n];
+    for(i = 0; i < batch->count; i++)
+        output_element(in->osm, batch, i);
 
     return;
 }
 
-static void load_relation(struct osm_relation *relation, void *data)
+/* Keep a copy of a batch for merge_output() */
+static void keep_batch(struct osm_input *in, struct osm_batch *batch)
 {
-    struct osm_params *osm = data;
-    int w;
+    if(in->batch_count >= in->max_batches)
+    {
+        in->max_batches += 64;
+        in->batches = realloc(in->batches, in->max_batches * sizeof(struct osm_batch *));
+    }
+    in->batches[in->batch_count++] = osm_batch_copy(batch);
 
-    if( !check_tags(relation->tags, relation->tag_count, osm))
-        return;
+    return;
+}
+
+/* Position of the next element to be merged from an input file */
+struct merge_cursor
+{
+    int batch, i;
+};
+
+/* Return the batch holding the next element to be merged from an input
+ * file, or NULL if there are none left */
+static struct osm_batch *merge_current(struct osm_input *in, struct merge_cursor *cursor)
+{
+    if(cursor->batch >= in->batch_count)
+        return NULL;
 
-    ensure_capacity(osm, OSM_RELATION, 1);
-    osm->ids[OSM_RELATION][osm->count[OSM_RELATION]++] = relation->id;
+    return in->batches[cursor->batch];
+}
 
-    ensure_capacity(osm, OSM_WAY, relation->way_count);
-    for(w = 0; w < relation->way_count; w++)
-        osm->ids[OSM_WAY][osm->count[OSM_WAY]++] = relation->ways[w];
+static void merge_advance(struct osm_input *in, struct merge_cursor *cursor)
+{
+    if(++cursor->i >= in->batches[cursor->batch]->count)
+    {
+        /* Batches are freed by ordered_output() once written */
+        if( !in->osm->hilbert)
+            osm_batch_free(in->batches[cursor->batch]);
+        cursor->batch++;
+        cursor->i = 0;
+    }
 
     return;
 }
 
-static int check_tags(struct osm_tag *tags, int tag_count, struct osm_params *osm)
+/* Pass the elements collected from all input files in the third pass to
+ * emit(), ordered by type and then ID, using a k-way merge of the per-file
+ * sequences. An element found in more than one file is passed once,
+ * taken from the first file on the command line that contains it. */
+static void merge_output(struct osm_params *osm, element_callback_t *emit)
 {
-    int i;
+    struct merge_cursor *cursors = calloc(osm->input_count, sizeof(struct merge_cursor));
+    int k;
 
-    for(i = 0; i < tag_count; i++)
+    while(1)
     {
-        struct osm_tag *candidate = tags+i;
-        int j;
+        struct osm_batch *batch, *best_batch = NULL;
+        unsigned int best_id = 0;
+        int best = -1, best_type = 0;
 
-        for(j = 0; j < osm->tag_count; j++)
+        /* The number of input files is small, so a linear scan for the
+         * smallest element is as quick as maintaining a heap */
+        for(k = 0; k < osm->input_count; k++)
         {
-            struct osm_tag *wanted = osm->tags+j;
+            unsigned int id;
 
-            if(wanted->key[0] == '*')
-            {
-                if(strcmp(wanted->value, candidate->value) == 0)
-                    return 1;
-            }
-            else if(wanted->value[0] == '*')
+            if( !(batch = merge_current(&osm->inputs[k], &cursors[k])))
+                continue;
+            id = batch->ids[cursors[k].i];
+            if(best < 0 || batch->type < best_type
+             || (batch->type == best_type && id < best_id))
             {
-                if(strcmp(wanted->key, candidate->key) == 0)
-                    return 1;
+                best = k;
+                best_batch = batch;
+                best_type = batch->type;
+                best_id = id;
             }
-            else if( strcmp(wanted->key, candidate->key) == 0 
-                  && strcmp(wanted->value, candidate->value) == 0)
-                return 1;
         }
-    }
+        if(best < 0)
+            break;
 
-    return 0;
-}
+        emit(osm, best_batch, cursors[best].i);
 
-static void ensure_capacity(struct osm_params *osm, int ele, int count)
-{
-    if(osm->count[ele] + count > osm->max[ele])
+        /* Advance past this element in every file that contains it */
+        for(k = 0; k < osm->input_count; k++)
+        {
+            if( !(batch = merge_current(&osm->inputs[k], &cursors[k])))
+                continue;
+            if(batch->type == best_type && batch->ids[cursors[k].i] == best_id)
+                merge_advance(&osm->inputs[k], &cursors[k]);
+        }
+    }
+
+    if( !osm->hilbert)
     {
-        osm->max[ele] += (10000 + count);
-        osm->ids[ele] = realloc(osm->ids[ele], osm->max[ele] * sizeof(unsigned int));
+        for(k = 0; k < osm->input_count; k++)
+            free(osm->inputs[k].batches);
     }
+    free(cursors);
 
     return;
 }
 
-static void sort_ids(struct osm_params *osm, int ele)
+static void collect_element(struct osm_params *osm, struct osm_batch *batch, int i)
 {
-    int curr, prev = 0;
-
-    qsort(osm->ids[ele], osm->count[ele], sizeof(unsigned int), cmp_id);
-    for(curr = 1; curr < osm->count[ele]; curr++)
+    if(osm->ref_count >= osm->max_refs)
     {
-        if(osm->ids[ele][curr] != osm->ids[ele][prev])
-            osm->ids[ele][++prev] = osm->ids[ele][curr];
+        osm->max_refs = osm->max_refs ? 2 * osm->max_refs : 65536;
+        osm->refs = realloc(osm->refs, osm->max_refs * sizeof(struct element_ref));
     }
-    osm->count[ele] = prev + 1;
-    osm->ids[ele] = realloc(osm->ids[ele], osm->count[ele] * sizeof(unsigned int));
+    osm->refs[osm->ref_count].batch = batch;
+    osm->refs[osm->ref_count].i = i;
+    osm->ref_count++;
 
     return;
 }
 
-static void print_tags(struct osm_tag *, int tag_count);
-static void print_xml(char *);
+static int cmp_location(const void *a, const void *b)
+{
+    unsigned int ia = ((const struct element_location *)a)->id;
+    unsigned int ib = ((const struct element_location *)b)->id;
+
+    return ia < ib ? -1 : (ia > ib ? 1 : 0);
+}
 
-static void output_node(struct osm_node *node, void *data)
+/* Add the location of an element, if known, to a running centroid */
+static void add_location(struct element_location *locs, int count, unsigned int id,
+                         int64_t *lat, int64_t *lon, int *n)
 {
-    struct osm_params *osm = data;
+    struct element_location key, *found;
 
-    /* Check if this is an interesting node */
-    if( !bsearch(&node->id, osm->ids[OSM_NODE], osm->count[OSM_NODE], sizeof(unsigned int), cmp_id))
+    key.id = id;
+    if( !(found = bsearch(&key, locs, count, sizeof(struct element_location), cmp_location)))
         return;
+    *lat += found->lat;
+    *lon += found->lon;
+    (*n)++;
+
+    return;
+}
+
+/* Sort locations by ID if they are not in order already, as they are
+ * unless the input was not sorted */
+static void sort_locations(struct element_location *locs, int count)
+{
+    int i;
 
-    printf("  <node id=\"%u\" lat=\"%.7f\" lon=\"%.7f\"", node->id, node->lat, node->lon);
-    if(node->tag_count == 0)
+    for(i = 1; i < count; i++)
     {
-        printf("/>\n");
-        return;
+        if(locs[i].id < locs[i - 1].id)
+        {
+            qsort(locs, count, sizeof(struct element_location), cmp_location);
+            break;
+        }
     }
-    else
-        printf(">\n");
-
-    print_tags(node->tags, node->tag_count);
-    printf("  </node>\n");
 
     return;
 }
 
-static void output_way(struct osm_way *way, void *data)
+/* Write the elements collected by collect_element(), each type in order
+ * of the Hilbert index of its location: its own for a node, the centroid
+ * of its nodes for a way, and the centroid of its member nodes and ways
+ * for a relation. Elements without a location are written last. The
+ * locations of the nodes, and then of the ways, are sorted by ID once
+ * all of them have been found, unless the input was in order already,
+ * so that the ways and relations that follow can find them by bsearch(). */
+static void ordered_output(struct osm_params *osm)
 {
-    struct osm_params *osm = data;
-    int n;
+    struct osm_order_key *keys = malloc(osm->ref_count * sizeof(struct osm_order_key));
+    struct element_location *locs[2];
+    int start, end, count[2] = { 0, 0 }, j, k;
 
-    /* Check if this is an interesting way */
-    if( !bsearch(&way->id, osm->ids[OSM_WAY], osm->count[OSM_WAY], sizeof(unsigned int), cmp_id))
-        return;
+    locs[OSM_NODE] = malloc(osm->ref_count * sizeof(struct element_location));
+    locs[OSM_WAY] = malloc(osm->ref_count * sizeof(struct element_location));
 
-    printf("  <way id=\"%u\">\n", way->id);
+    fprintf(stderr, "Ordering %d elements...\n", osm->ref_count);
+    for(start = 0; start < osm->ref_count; start = end)
+    {
+        int type = osm->refs[start].batch->type;
 
-    for(n = 0; n < way->node_count; n++)
-        printf("    <nd ref=\"%u\"/>\n", way->nodes[n]);
+        for(end = start; end < osm->ref_count && osm->refs[end].batch->type == type; end++)
+        {
+            struct osm_batch *batch = osm->refs[end].batch;
+            int i = osm->refs[end].i, n = 0;
+            int64_t lat = 0, lon = 0;
+            uint32_t m;
+
+            if(type == OSM_NODE)
+            {
+                lat = batch->lat[i];
+                lon = batch->lon[i];
+                n = 1;
+            }
+            else
+            {
+                for(m = batch->member_offsets[i]; m < batch->member_offsets[i + 1]; m++)
+                {
+                    int member_type = (type == OSM_WAY) ? OSM_NODE : batch->member_types[m];
+
+                    if(member_type == OSM_NODE || member_type == OSM_WAY)
+                        add_location(locs[member_type], count[member_type], batch->member_ids[m],
+                                     &lat, &lon, &n);
+                }
+            }
+
+            keys[end].index = end;
+            keys[end].key = UINT64_MAX;
+            if(n > 0)
+            {
+                keys[end].key = osm_hilbert_index(lat / n, lon / n);
+                if(type != OSM_RELATION)
+                {
+                    locs[type][count[type]].id = batch->ids[i];
+                    locs[type][count[type]].lat = lat / n;
+                    locs[type][count[type]].lon = lon / n;
+                    count[type]++;
+                }
+            }
+        }
+        osm_order_sort(keys + start, end - start);
+        if(type != OSM_RELATION)
+            sort_locations(locs[type], count[type]);
+    }
+    free(locs[OSM_NODE]);
+    free(locs[OSM_WAY]);
+
+    for(j = 0; j < osm->ref_count; j++)
+        output_element(osm, osm->refs[keys[j].index].batch, osm->refs[keys[j].index].i);
+    free(keys);
+    free(osm->refs);
 
-    print_tags(way->tags, way->tag_count);
-    printf("  </way>\n");
+    for(k = 0; k < osm->input_count; k++)
+    {
+        for(j = 0; j < osm->inputs[k].batch_count; j++)
+            osm_batch_free(osm->inputs[k].batches[j]);
+        free(osm->inputs[k].batches);
+    }
 
     return;
 }
 
-static void output_relation(struct osm_relation *relation, void *data)
+static void output_element(struct osm_params *osm, struct osm_batch *batch, int i)
 {
-    struct osm_params *osm = data;
-    int n, w;
-
-    /* Check if this is an interesting relation */
-    if( !bsearch(&relation->id, osm->ids[OSM_RELATION], osm->count[OSM_RELATION], sizeof(unsigned int), cmp_id))
-        return;
+    int copied = 0;
 
-    printf("  <relation id=\"%u\">\n", relation->id);
+    if(osm->index)
+        osm_index_add(osm->index, batch->type, batch->ids[i], osm_output_tell(osm->out));
 
-    for(n = 0; n < relation->node_count; n++)
+    /* Copy the element as it was read if its text was kept */
+    if(osm->raw && batch->raw_offsets && batch->raw_offsets[i + 1] > batch->raw_offsets[i])
     {
-        printf("    <member type=\"node\" ref=\"%u\" role=\"", relation->nodes[n]);
-        print_xml((char *)relation->node_roles[n]);
-        printf("\"/>\n");
+        osm_output_raw(osm->out, batch->raw + batch->raw_offsets[i],
+                       batch->raw_offsets[i + 1] - batch->raw_offsets[i]);
+        if( !osm->graph && !osm->tiles && !osm->routes && !osm->stats)
+            return;
+        copied = 1;
     }
 
-    for(w = 0; w < relation->way_count; w++)
+    switch(batch->type)
     {
-        printf("    <member type=\"way\" ref=\"%u\" role=\"", relation->ways[w]);
-        print_xml((char *)relation->way_roles[w]);
-        printf("\"/>\n");
-    }
+        case OSM_NODE:
+        {
+            struct osm_node *node = osm_batch_node(batch, i);
+
+            if(osm->shard)
+                osm_shard_node(osm->shard, node);
+            else if( !copied)
+                osm_output_node(osm->out, node);
+            if(osm->graph)
+                osm_graph_add_node(osm->graph, node);
+            if(osm->tiles)
+                osm_tiles_add_node(osm->tiles, node);
+            if(osm->routes)
+                osm_routes_add_node(osm->routes, node);
+            if(osm->node_coords)
+            {
+                unsigned int *found = bsearch(&batch->ids[i], osm->wanted[OSM_NODE].ids,
+                                              osm->wanted[OSM_NODE].count, sizeof(unsigned int), cmp_id);
 
-    print_tags(relation->tags, relation->tag_count);
-    printf("  </relation>\n");
+                if(found)
+                {
+                    size_t n = found - osm->wanted[OSM_NODE].ids;
+
+                    osm->node_coords[2 * n] = batch->lat[i];
+                    osm->node_coords[2 * n + 1] = batch->lon[i];
+                }
+            }
+            break;
+        }
+        case OSM_WAY:
+        {
+            struct osm_way *way = osm_batch_way(batch, i);
+
+            if(osm->shard)
+                osm_shard_way(osm->shard, way);
+            else if( !copied)
+                osm_output_way(osm->out, way);
+            if(osm->graph)
+                osm_graph_add_way(osm->graph, way);
+            if(osm->tiles)
+                osm_tiles_add_way(osm->tiles, way);
+            if(osm->routes)
+                osm_routes_add_way(osm->routes, way);
+            if(osm->stats)
+                add_way_length(osm, way);
+            break;
+        }
+        case OSM_RELATION:
+        {
+            struct osm_relation *relation = osm_batch_relation(batch, i);
+
+            if(osm->shard)
+                osm_shard_relation(osm->shard, relation);
+            else if( !copied)
+                osm_output_relation(osm->out, relation);
+            if(osm->routes)
+                osm_routes_add_relation(osm->routes, relation);
+            break;
+        }
+    }
 
     return;
 }
 
-static void print_tags(struct osm_tag *tags, int tag_count)
+/* Add the length of a way to the tag statistics, from the locations of
+ * its nodes written earlier in the third pass. Nodes whose location is
+ * unknown (missing from the input) are skipped over. */
+static void add_way_length(struct osm_params *osm, struct osm_way *way)
 {
-    int t;
+    double length = 0, lat, lon, prev_lat = 0, prev_lon = 0;
+    int n, have_prev = 0;
 
-    for(t = 0; t < tag_count; t++)
+    for(n = 0; n < way->node_count; n++)
     {
-        struct osm_tag *tag = tags+t;
+        unsigned int *found = bsearch(&way->nodes[n], osm->wanted[OSM_NODE].ids,
+                                      osm->wanted[OSM_NODE].count, sizeof(unsigned int), cmp_id);
+        int32_t *coords;
+
+        if( !found)
+            continue;
+        coords = &osm->node_coords[2 * (found - osm->wanted[OSM_NODE].ids)];
+        if(coords[0] == 0 && coords[1] == 0)
+            continue;
+        lat = coords[0] * 1e-7 * M_PI / 180;
+        lon = coords[1] * 1e-7 * M_PI / 180;
+        if(have_prev)
+        {
+            double h = sin((lat - prev_lat) / 2) * sin((lat - prev_lat) / 2)
+                + cos(prev_lat) * cos(lat) * sin((lon - prev_lon) / 2) * sin((lon - prev_lon) / 2);
 
-        printf("    <tag k=\"");
-        print_xml(tag->key);
-        printf("\" v=\"");
-        print_xml(tag->value);
-        printf("\" />\n");
+            length += 2 * EARTH_RADIUS * asin(sqrt(h));
+        }
+        prev_lat = lat;
+        prev_lon = lon;
+        have_prev = 1;
     }
+    osm_stats_add_length(osm->stats, way, length);
 
     return;
 }
 
-static void print_xml(char *str)
+/* Split a comma-separated list of keys in place. Returns the number of
+ * keys, or 0 if any is empty. */
+static int split_keys(char *str, char ***keys)
 {
-    int c;
+    int count = 0;
+    char *key;
 
-    while((c = *(unsigned char *)str++))
+    *keys = NULL;
+    for(key = strtok(str, ","); key; key = strtok(NULL, ","))
     {
-        if(c < 0x20 || c == 0x7f) /* ASCII non-printable */
-            printf("&#%d;", c);
-        else switch(c)
-        {
-            case '"':
-                printf("&quot;");
-                break;
-            case '<':
-                printf("&lt;");
-                break;
-            case '>':
-                printf("&gt;");
-                break;
-            case '&':
-                if(*str != '#')
-                {
-                    printf("&amp;");
-                    break;
-                }
-            default:
-                putchar(c);
-                break;
-        }
+        if(strlen(key) > OSM_TAG_SIZE)
+            return 0;
+        *keys = realloc(*keys, (count + 1) * sizeof(char *));
+        (*keys)[count++] = key;
     }
 
-    return;
+    return count;
+}
+
+/* Parse a size in bytes, with an optional K, M or G suffix. Returns 0 if
+ * the size is not valid. */
+static size_t parse_size(const char *str)
+{
+    char *end;
+    double size = strtod(str, &end);
+
+    switch(toupper(*end))
+    {
+        case 'G':
+            size *= 1024;
+        case 'M':
+            size *= 1024;
+        case 'K':
+            size *= 1024;
+            end++;
+            break;
+    }
+    if(end == str || *end != '\0' || size < 1)
+        return 0;
+
+    return (size_t)size;
 }
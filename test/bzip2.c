@@ -0,0 +1,570 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Tests of the bzip2 decoder in osm_bzip2.c against libbz2. Generated
+ * data of several kinds is compressed with libbz2 at block sizes 1 and 9
+ * and decoded with both osm_bzip2_read() and BZ2_bzDecompress(), fed in
+ * pieces of various sizes, and the output compared byte for byte. The
+ * streams are also decoded concatenated, truncated, with single bits
+ * flipped, and from each block in the middle of a stream as osm_seek.c
+ * does. Given .bz2 files as arguments, the files are decoded with both
+ * decoders instead, and the output compared and the time taken printed. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <bzlib.h>
+
+#include "osm.h"
+
+#define MAX_STARTS 64 /**< Block starts tried for each stream */
+
+/* Growable byte buffer */
+struct buffer
+{
+    unsigned char *data;
+    size_t len, max;
+};
+
+static int failures;
+static int saved_stderr = -1;
+
+static void fail(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void append(struct buffer *buf, const void *data, size_t len)
+{
+    if(len == 0)
+        return;
+    if(buf->len + len > buf->max)
+    {
+        while(buf->len + len > buf->max)
+            buf->max = buf->max ? 2 * buf->max : 65536;
+        buf->data = realloc(buf->data, buf->max);
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+
+    return;
+}
+
+/* Whether buf holds the len bytes at data */
+static int same(const struct buffer *buf, const unsigned char *data, size_t len)
+{
+    return buf->len == len && (len == 0 || memcmp(buf->data, data, len) == 0);
+}
+
+/* The decoder reports errors on stderr, which is expected for bad input */
+static void quiet(int on)
+{
+    if(on && saved_stderr < 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+
+        fflush(stderr);
+        saved_stderr = dup(2);
+        dup2(null, 2);
+        close(null);
+    }
+    else if( !on && saved_stderr >= 0)
+    {
+        fflush(stderr);
+        dup2(saved_stderr, 2);
+        close(saved_stderr);
+        saved_stderr = -1;
+    }
+
+    return;
+}
+
+/* Decode with libbz2, starting a new stream whenever one ends with input
+ * left over. Returns 1 if all of the input was decoded. */
+static int libbz2_decode(const unsigned char *in, size_t len, struct buffer *out)
+{
+    unsigned char buff[65536];
+    bz_stream bz;
+    int ret = BZ_OK;
+
+    out->len = 0;
+    memset(&bz, 0, sizeof(bz));
+    if(BZ2_bzDecompressInit(&bz, 0, 0) != BZ_OK)
+        return 0;
+    bz.next_in = (char *)in;
+    bz.avail_in = len;
+    while(1)
+    {
+        unsigned int avail_in = bz.avail_in;
+
+        bz.next_out = (char *)buff;
+        bz.avail_out = sizeof(buff);
+        ret = BZ2_bzDecompress(&bz);
+        append(out, buff, sizeof(buff) - bz.avail_out);
+        if(ret == BZ_STREAM_END)
+        {
+            if(bz.avail_in == 0)
+                break;
+            BZ2_bzDecompressEnd(&bz);
+            if(BZ2_bzDecompressInit(&bz, 0, 0) != BZ_OK)
+                return 0;
+            continue;
+        }
+        /* Input ended within a stream */
+        if(ret != BZ_OK || (bz.avail_in == 0 && avail_in == 0 && bz.avail_out == sizeof(buff)))
+            break;
+    }
+    BZ2_bzDecompressEnd(&bz);
+
+    return ret == BZ_STREAM_END;
+}
+
+/* Decode with osm_bzip2_read(), feeding chunk bytes at a time and reading
+ * size bytes at a time. If level is not 0, decoding starts at a block in
+ * the middle of a stream, at the given bit of the first byte. Returns the
+ * last value returned by osm_bzip2_read(). */
+static int builtin_decode(const unsigned char *in, size_t len, size_t chunk, size_t size, int level, int bit,
+                          struct buffer *out)
+{
+    struct osm_bzip2 *bz = osm_bzip2_open();
+    unsigned char *buff = malloc(size);
+    size_t pos = 0, n;
+    int eof = 0, ret;
+
+    out->len = 0;
+    if(level)
+        osm_bzip2_start_block(bz, level, bit);
+    while(1)
+    {
+        if( !eof)
+        {
+            n = len - pos < chunk ? len - pos : chunk;
+            osm_bzip2_feed(bz, in + pos, n);
+            pos += n;
+            eof = (pos == len);
+        }
+        do
+        {
+            ret = osm_bzip2_read(bz, buff, size, &n, eof);
+            append(out, buff, n);
+        } while(ret == 0 && n == size);
+        if(ret != 0)
+            break;
+        if(eof && n == 0)
+        {
+            fail("osm_bzip2_read() made no progress at the end of the input");
+            ret = -1;
+            break;
+        }
+    }
+    osm_bzip2_close(bz);
+    free(buff);
+
+    return ret;
+}
+
+static void compress(const unsigned char *data, size_t len, int level, struct buffer *out)
+{
+    unsigned int out_len = len + len / 100 + 600;
+
+    out->len = 0;
+    if(out_len > out->max)
+    {
+        out->max = out_len;
+        out->data = realloc(out->data, out->max);
+    }
+    if(BZ2_bzBuffToBuffCompress((char *)out->data, &out_len, (char *)data, len, level, 0, 0) != BZ_OK)
+    {
+        fprintf(stderr, "bzip2: compression failed\n");
+        exit(1);
+    }
+    out->len = out_len;
+
+    return;
+}
+
+/* Bit positions of the block headers of a compressed file, found by
+ * searching for the block magic number at every bit */
+static int find_blocks(const unsigned char *in, size_t len, uint64_t *starts, int max)
+{
+    uint64_t window = 0, bit;
+    int count = 0;
+
+    for(bit = 0; bit < (uint64_t)len * 8 && count < max; bit++)
+    {
+        window = ((window << 1) | ((in[bit / 8] >> (7 - bit % 8)) & 1)) & 0xffffffffffffULL;
+        if(bit >= 47 && window == 0x314159265359ULL)
+            starts[count++] = bit - 47;
+    }
+
+    return count;
+}
+
+/* Decode a complete file both ways, with several feed and read sizes */
+static void check_decode(const char *name, const unsigned char *in, size_t len, const struct buffer *expected)
+{
+    static const size_t sizes[][2] = { { 1 << 30, 1 << 20 }, { 4093, 65536 }, { 1, 7 }, { 100000, 1 } };
+    struct buffer got = { 0 };
+    int i, ret;
+
+    for(i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+    {
+        /* Byte-at-a-time reads of large files take too long */
+        if(sizes[i][1] < 7 && expected->len > 1000000)
+            continue;
+        /* So does trying a whole block after each byte fed */
+        if(sizes[i][0] == 1 && len > 100000)
+            continue;
+        ret = builtin_decode(in, len, sizes[i][0], sizes[i][1], 0, 0, &got);
+        if(ret != 1 || !same(&got, expected->data, expected->len))
+            fail("%s: decoding fed %zu and read %zu bytes at a time returned %d with %zu bytes, expected %zu",
+                 name, sizes[i][0], sizes[i][1], ret, got.len, expected->len);
+    }
+    free(got.data);
+
+    return;
+}
+
+/* Decode starting at each block in turn, which must give the end of the
+ * output of the whole file */
+static void check_mid_stream(const char *name, const unsigned char *in, size_t len, const struct buffer *expected)
+{
+    uint64_t starts[MAX_STARTS];
+    struct buffer got = { 0 };
+    int count = find_blocks(in, len, starts, MAX_STARTS), level = in[3] - '0', i, ret;
+
+    for(i = 0; i < count; i++)
+    {
+        size_t byte = starts[i] / 8;
+
+        ret = builtin_decode(in + byte, len - byte, 65536, 65536, level, starts[i] % 8, &got);
+        if(ret != 1 || got.len > expected->len || !same(&got, expected->data + expected->len - got.len, got.len))
+            fail("%s: decoding from block %d at bit %llu returned %d with %zu bytes not ending the output",
+                 name, i, (unsigned long long)starts[i], ret, got.len);
+        else if(i > 0 && got.len == expected->len)
+            fail("%s: decoding from block %d gave the whole output", name, i);
+    }
+    if(len > 100 && count == 0)
+        fail("%s: no blocks found", name);
+    free(got.data);
+
+    return;
+}
+
+/* Every truncation of a file must fail, after giving a prefix of the
+ * output, unless it falls at the end of one of several streams, listed in
+ * ends */
+static void check_truncated(const char *name, const unsigned char *in, size_t len, const struct buffer *expected,
+                            const size_t *ends, int end_count)
+{
+    uint64_t starts[MAX_STARTS];
+    size_t cuts[32 + 3 * MAX_STARTS];
+    struct buffer got = { 0 };
+    int count = find_blocks(in, len, starts, MAX_STARTS), cut_count = 0, i, j;
+
+    for(i = 0; i < 12 && i < (int)len; i++)
+        cuts[cut_count++] = i;
+    for(i = 1; i <= 12 && i <= (int)len; i++)
+        cuts[cut_count++] = len - i;
+    for(i = 0; i < 8; i++)
+        cuts[cut_count++] = rand() % (len + 1);
+    for(i = 0; i < count; i++)
+    {
+        for(j = -1; j <= 1; j++)
+        {
+            size_t cut = starts[i] / 8 + j;
+
+            if(cut < len)
+                cuts[cut_count++] = cut;
+        }
+    }
+
+    quiet(1);
+    for(i = 0; i < cut_count; i++)
+    {
+        int valid = (cuts[i] == len), ret;
+
+        for(j = 0; j < end_count; j++)
+            valid |= (cuts[i] == ends[j]);
+        ret = builtin_decode(in, cuts[i], 65536, 65536, 0, 0, &got);
+        if(got.len > expected->len || !same(&got, expected->data, got.len))
+            fail("%s: truncated at %zu bytes, output is not a prefix", name, cuts[i]);
+        else if(valid ? ret != 1 : ret != -1)
+            fail("%s: truncated at %zu bytes, returned %d", name, cuts[i], ret);
+    }
+    quiet(0);
+    free(got.data);
+
+    return;
+}
+
+/* With a bit flipped, either both decoders must fail or both must succeed
+ * with the same output. Flipping the randomised flag of a block is left
+ * out, as only libbz2 reads randomised blocks. */
+static void check_corrupt(const char *name, const unsigned char *in, size_t len, int trials)
+{
+    unsigned char *copy = malloc(len);
+    uint64_t starts[MAX_STARTS];
+    struct buffer got = { 0 }, expected = { 0 };
+    int count = find_blocks(in, len, starts, MAX_STARTS), i, j;
+
+    quiet(1);
+    for(i = 0; i < trials; i++)
+    {
+        size_t bit = rand() % (len * 8);
+        int ok, ret;
+
+        for(j = 0; j < count; j++)
+        {
+            if(bit == starts[j] + 80)
+                bit++;
+        }
+
+        memcpy(copy, in, len);
+        copy[bit / 8] ^= 0x80 >> (bit % 8);
+        ok = libbz2_decode(copy, len, &expected);
+        ret = builtin_decode(copy, len, 65536, 65536, 0, 0, &got);
+        if(ok ? ret != 1 || !same(&got, expected.data, expected.len) : ret != -1)
+            fail("%s: with bit %zu flipped libbz2 %s but osm_bzip2_read() returned %d", name, bit,
+                 ok ? "succeeded" : "failed", ret);
+    }
+    quiet(0);
+    free(copy);
+    free(got.data);
+    free(expected.data);
+
+    return;
+}
+
+/* Test data */
+
+static void make_xml(struct buffer *buf, size_t len)
+{
+    static const char *keys[] = { "railway", "name", "operator", "gauge", "electrified", "usage" };
+    static const char *values[] = { "rail", "station", "Network Rail", "1435", "contact_line", "main", "yes" };
+    char line[256];
+    unsigned int id = 1000;
+
+    buf->len = 0;
+    while(buf->len < len)
+    {
+        int tags = rand() % 4, n;
+
+        id += 1 + rand() % 20;
+        n = snprintf(line, sizeof(line), " <node id=\"%u\" lat=\"%.7f\" lon=\"%.7f\"%s>\n", id,
+                     50 + rand() / (double)RAND_MAX, -2 + 3.0 * rand() / RAND_MAX, tags ? "" : "/");
+        append(buf, line, n);
+        while(tags-- > 0)
+        {
+            n = snprintf(line, sizeof(line), "  <tag k=\"%s\" v=\"%s\"/>\n", keys[rand() % 6], values[rand() % 7]);
+            append(buf, line, n);
+            if( !tags)
+                append(buf, " </node>\n", 9);
+        }
+    }
+
+    return;
+}
+
+static void make_random(struct buffer *buf, size_t len)
+{
+    buf->len = 0;
+    while(buf->len < len)
+    {
+        unsigned char c = rand();
+
+        append(buf, &c, 1);
+    }
+
+    return;
+}
+
+/* Runs of all lengths, which bzip2 codes as four bytes and a count */
+static void make_runs(struct buffer *buf, size_t len)
+{
+    unsigned char run[600];
+
+    buf->len = 0;
+    while(buf->len < len)
+    {
+        int n = 1 + rand() % (rand() % 4 ? 8 : 600);
+
+        memset(run, "abcd\0\xff"[rand() % 6], n);
+        append(buf, run, n);
+    }
+
+    return;
+}
+
+static void make_repeated(struct buffer *buf, size_t len)
+{
+    buf->len = 0;
+    while(buf->len < len)
+        append(buf, "x", 1);
+
+    return;
+}
+
+static void run_tests(void)
+{
+    static const struct { const char *name; void (*make)(struct buffer *, size_t); size_t len; } data[] = {
+        { "xml", make_xml, 1100000 },
+        { "random", make_random, 200000 },
+        { "runs", make_runs, 500000 },
+        { "repeated", make_repeated, 2000000 },
+        { "byte", make_repeated, 1 },
+        { "empty", make_repeated, 0 },
+    };
+    struct buffer plain = { 0 }, packed = { 0 }, multi = { 0 }, multi_plain = { 0 }, check = { 0 };
+    size_t ends[16];
+    int end_count = 0, d, level;
+
+    for(d = 0; d < (int)(sizeof(data) / sizeof(data[0])); d++)
+    {
+        data[d].make(&plain, data[d].len);
+        for(level = 1; level <= 9; level += 8)
+        {
+            char name[64];
+
+            snprintf(name, sizeof(name), "%s -%d", data[d].name, level);
+            compress(plain.data, plain.len, level, &packed);
+            if( !libbz2_decode(packed.data, packed.len, &check) || !same(&check, plain.data, plain.len))
+                fail("%s: libbz2 does not decode its own output", name);
+
+            check_decode(name, packed.data, packed.len, &plain);
+            check_mid_stream(name, packed.data, packed.len, &plain);
+            check_truncated(name, packed.data, packed.len, &plain, NULL, 0);
+            check_corrupt(name, packed.data, packed.len, plain.len > 1000000 ? 16 : 60);
+
+            /* Streams of each kind at block size 1 are concatenated, as
+             * written by parallel compressors */
+            if(level == 1 && end_count < 16)
+            {
+                append(&multi, packed.data, packed.len);
+                append(&multi_plain, plain.data, plain.len);
+                ends[end_count++] = multi.len;
+            }
+        }
+    }
+
+    if( !libbz2_decode(multi.data, multi.len, &check) || !same(&check, multi_plain.data, multi_plain.len))
+        fail("multi-stream: libbz2 does not decode the streams");
+    check_decode("multi-stream", multi.data, multi.len, &multi_plain);
+    check_mid_stream("multi-stream", multi.data, multi.len, &multi_plain);
+    check_truncated("multi-stream", multi.data, multi.len, &multi_plain, ends, end_count);
+    check_corrupt("multi-stream", multi.data, multi.len, 16);
+
+    /* Data after the last stream is an error */
+    append(&multi, "BZ", 2);
+    quiet(1);
+    if(builtin_decode(multi.data, multi.len, 65536, 65536, 0, 0, &check) != -1)
+        fail("multi-stream: trailing garbage accepted");
+    quiet(0);
+
+    free(plain.data);
+    free(packed.data);
+    free(multi.data);
+    free(multi_plain.data);
+    free(check.data);
+
+    return;
+}
+
+/* Decode files with both decoders and compare the output and speed */
+static void run_files(int count, char **files)
+{
+    struct buffer in = { 0 }, expected = { 0 }, got = { 0 };
+    int i;
+
+    for(i = 0; i < count; i++)
+    {
+        struct timespec t0, t1, t2;
+        unsigned char buff[65536];
+        double libbz2_s, builtin_s;
+        int fd = open(files[i], O_RDONLY), ok, ret;
+        ssize_t n;
+
+        if(fd < 0)
+        {
+            perror(files[i]);
+            exit(1);
+        }
+        in.len = 0;
+        while((n = read(fd, buff, sizeof(buff))) > 0)
+            append(&in, buff, n);
+        close(fd);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        ok = libbz2_decode(in.data, in.len, &expected);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ret = builtin_decode(in.data, in.len, 1 << 20, 1 << 20, 0, 0, &got);
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        libbz2_s = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        builtin_s = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+
+        if( !ok || ret != 1 || !same(&got, expected.data, expected.len))
+            fail("%s: libbz2 returned %d with %zu bytes, osm_bzip2_read() %d with %zu bytes", files[i],
+                 ok, expected.len, ret, got.len);
+        printf("%s: %.1f MB, libbz2 %.2f s (%.1f MB/s), osm_bzip2 %.2f s (%.1f MB/s)\n", files[i],
+               expected.len / 1e6, libbz2_s, expected.len / 1e6 / libbz2_s, builtin_s,
+               expected.len / 1e6 / builtin_s);
+    }
+    free(in.data);
+    free(expected.data);
+    free(got.data);
+
+    return;
+}
+
+static void fail(const char *fmt, ...)
+{
+    va_list ap;
+
+    if(failures++ < 10)
+    {
+        va_start(ap, fmt);
+        printf("bzip2: ");
+        vprintf(fmt, ap);
+        printf("\n");
+        va_end(ap);
+    }
+
+    return;
+}
+
+int main(int argc, char **argv)
+{
+    srand(1);
+    if(argc > 1)
+        run_files(argc - 1, argv + 1);
+    else
+        run_tests();
+
+    if(failures)
+    {
+        printf("bzip2: %d failures\n", failures);
+        return 1;
+    }
+    printf("bzip2: ok\n");
+
+    return 0;
+}
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Extracts a bzip2-compressed copy of the sample extract with --cache and
+# checks the output against sample.expected, then extracts a compressed
+# made-up planet with a cache too small for it, so that most of it is
+# kept in temporary files, and checks that the output is that written
+# without the cache.
+
+dir=`dirname $0`
+tmp=${TMPDIR:-/tmp}/osmrail-check.$$
+trap 'rm -f $tmp.*' 0
+
+bzip2 -c $dir/sample.osm > $tmp.sample.osm.bz2 || exit 1
+./osmrail -C 16M -o $tmp.osm $tmp.sample.osm.bz2 2> $tmp.err || exit 1
+if ! grep -q '^Cached' $tmp.err; then
+    echo "cache: sample not cached" >&2
+    exit 1
+fi
+if ! diff $dir/sample.expected $tmp.osm; then
+    echo "cache: wrong sample output" >&2
+    exit 1
+fi
+
+sh $dir/planet.sh | bzip2 -1 > $tmp.planet.osm.bz2
+./osmrail -o $tmp.expected $tmp.planet.osm.bz2 2>/dev/null || exit 1
+./osmrail -C 64K -o $tmp.osm $tmp.planet.osm.bz2 2> $tmp.err || exit 1
+if ! grep -q '^Cached.* compressed in' $tmp.err; then
+    echo "cache: planet not cached" >&2
+    exit 1
+fi
+if ! cmp $tmp.expected $tmp.osm; then
+    echo "cache: wrong planet output" >&2
+    exit 1
+fi
+echo "cache: ok"
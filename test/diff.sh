@@ -0,0 +1,16 @@
+#!/bin/sh
+# Extracts two versions of a small file and checks the osmChange written
+# by --diff between the extracts against diff.expected.
+
+dir=`dirname $0`
+tmp=${TMPDIR:-/tmp}/osmrail-check.$$
+trap 'rm -f $tmp.*' 0
+
+./osmrail -o $tmp.old.osm $dir/diff-old.osm 2>/dev/null || exit 1
+./osmrail -o $tmp.new.osm $dir/diff-new.osm 2>/dev/null || exit 1
+./osmrail -D -o $tmp.osc $tmp.old.osm $tmp.new.osm 2>/dev/null || exit 1
+if ! diff $dir/diff.expected $tmp.osc; then
+    echo "diff: wrong osmChange" >&2
+    exit 1
+fi
+echo "diff: ok"
@@ -0,0 +1,431 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Tests of osm_xml_unescape() and osm_xml_escape(). Random ASCII values
+ * are compared with the byte-wise code the scanning kernels replaced, at
+ * every alignment and at lengths either side of one and two blocks, both
+ * in the middle of a buffer and ending at the last byte before an
+ * unmapped page. Numeric character references and truncation, where the
+ * old code differed, are checked against fixed cases. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "osm.h"
+
+#define MAX_LEN    72   /**< Longest random value */
+#define ITERATIONS 50   /**< Random values of each length and alignment */
+
+static int failures;
+
+static void fail(const char *what, const char *input, const char *expected, size_t expected_len,
+                 const char *got, size_t got_len);
+
+/* Byte-wise unescaping from the old parser, with its fall-through for
+ * entities it did not recognise */
+static char deescape_xml(const char **str)
+{
+    switch(**str)
+    {
+        case 'a':
+            switch(*(*str+1))
+            {
+                case 'm': /* &amp; */
+                    *str += 4;
+                    return '&';
+                case 'p': /* &apos; */
+                    *str += 5;
+                    return '\'';
+            }
+        case 'g': /* &gt; */
+            *str += 3;
+            return '>';
+        case 'l': /* &lt; */
+            *str += 3;
+            return '<';
+        case 'q': /* &quot; */
+            *str += 5;
+            return '\"';
+        case '#': /* numeric encoding */
+        {
+            char *next;
+            int c = strtol(*str+1, &next, 10);
+
+            if(c >= 0x20 && c < 0x7f && *next == ';') /* ASCII printable */
+            {
+                *str = next+1;
+                return c;
+            }
+        }
+        default: /* unrecognised or non-ASCII character; don't deescape */
+            return '&';
+    }
+}
+
+static size_t old_unescape(char *dest, const char **ptr)
+{
+    int c;
+    size_t len = 0;
+
+    while((c = *(*ptr)++) != '\"')
+    {
+        if(c == '&')
+            dest[len++] = deescape_xml(ptr);
+        else
+            dest[len++] = c;
+    }
+    dest[len] = '\0';
+
+    return len;
+}
+
+/* Byte-wise escaping from the old output code */
+static size_t old_escape(char *dest, const char *str)
+{
+    char *out = dest;
+    int c;
+
+    while((c = *(unsigned char *)str++))
+    {
+        if(c < 0x20 || c == 0x7f) /* ASCII non-printable */
+            out += sprintf(out, "&#%d;", c);
+        else switch(c)
+        {
+            case '"':
+                memcpy(out, "&quot;", 6);
+                out += 6;
+                break;
+            case '<':
+                memcpy(out, "&lt;", 4);
+                out += 4;
+                break;
+            case '>':
+                memcpy(out, "&gt;", 4);
+                out += 4;
+                break;
+            case '&':
+                if(*str != '#')
+                {
+                    memcpy(out, "&amp;", 5);
+                    out += 5;
+                    break;
+                }
+            default:
+                *out++ = c;
+                break;
+        }
+    }
+    *out = '\0';
+
+    return out - dest;
+}
+
+/* Random attribute value of exactly len bytes, of printable ASCII and
+ * entities both versions decode, followed by the closing quote */
+static void random_value(char *value, int len)
+{
+    static const char *entities[] = { "&amp;", "&lt;", "&gt;", "&quot;", "&apos;", "&#65;", "&#126;", "&#32;" };
+    int i = 0;
+
+    while(i < len)
+    {
+        const char *entity = entities[rand() % 8];
+        int n = strlen(entity);
+
+        if(rand() % 6 == 0 && i + n <= len)
+        {
+            memcpy(value + i, entity, n);
+            i += n;
+        }
+        else
+        {
+            do
+                value[i] = 0x20 + rand() % 95;
+            while(value[i] == '"' || value[i] == '&');
+            i++;
+        }
+    }
+    value[len] = '"';
+    value[len + 1] = '\0';
+
+    return;
+}
+
+/* Random string of exactly len bytes of ASCII, control characters
+ * included, without the "&#" the old code passed through */
+static void random_string(char *str, int len)
+{
+    int i;
+
+    for(i = 0; i < len; i++)
+    {
+        do
+            str[i] = 1 + rand() % 127;
+        while(str[i] == '#' && i > 0 && str[i - 1] == '&');
+    }
+    str[len] = '\0';
+
+    return;
+}
+
+static void compare_unescape(const char *value)
+{
+    char expected[MAX_LEN + 1], got[MAX_LEN + 1];
+    const char *p = value, *q = value;
+    size_t expected_len, got_len;
+
+    expected_len = old_unescape(expected, &p);
+    got_len = osm_xml_unescape(got, sizeof(got), &q);
+    if(got_len != expected_len || memcmp(got, expected, expected_len + 1) != 0)
+        fail("unescape", value, expected, expected_len, got, got_len);
+    else if(q != p)
+        fail("unescape end", value, p, strlen(p), q, strlen(q));
+
+    return;
+}
+
+static void compare_escape(const char *str)
+{
+    char expected[6 * MAX_LEN + 1], got[6 * MAX_LEN + 1];
+    size_t expected_len, got_len;
+
+    expected_len = old_escape(expected, str);
+    got_len = osm_xml_escape(got, str);
+    if(got_len != expected_len || memcmp(got, expected, expected_len + 1) != 0)
+        fail("escape", str, expected, expected_len, got, got_len);
+
+    return;
+}
+
+/* Compare with the old code at every alignment and length, in the
+ * middle of a buffer and ending just before an unmapped page */
+static void compare_random(void)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    char *pages = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    char *buffer = aligned_alloc(16, 4 * MAX_LEN), *edge = pages + page;
+    char value[MAX_LEN + 2];
+    int len, align, i;
+
+    if(pages == MAP_FAILED || mprotect(edge, page, PROT_NONE) != 0)
+    {
+        perror("mmap");
+        exit(1);
+    }
+
+    for(len = 0; len <= MAX_LEN; len++)
+    {
+        for(align = 0; align < 16; align++)
+        {
+            for(i = 0; i < ITERATIONS; i++)
+            {
+                /* Bytes after the terminator must not be looked at */
+                memset(buffer, '&', 4 * MAX_LEN);
+
+                random_value(value, len);
+                memcpy(buffer + align, value, len + 2);
+                compare_unescape(buffer + align);
+                memcpy(edge - (len + 2) - align, value, len + 2);
+                compare_unescape(edge - (len + 2) - align);
+
+                random_string(value, len);
+                memcpy(buffer + align, value, len + 1);
+                compare_escape(buffer + align);
+                memcpy(edge - (len + 1) - align, value, len + 1);
+                compare_escape(edge - (len + 1) - align);
+            }
+        }
+    }
+
+    munmap(pages, 2 * page);
+    free(buffer);
+
+    return;
+}
+
+/* Numeric character references, which the old code only decoded for
+ * printable ASCII */
+static void check_entities(void)
+{
+    static const struct { const char *value, *expected; } cases[] = {
+        { "&#65;\"", "A" },
+        { "&#x41;&#X41;&#x6a;&#x6A;\"", "AAjj" },
+        { "&#233;\"", "\xc3\xa9" },
+        { "&#x4e2d;\"", "\xe4\xb8\xad" },
+        { "&#x1F600;\"", "\xf0\x9f\x98\x80" },
+        { "&#55295;\"", "\xed\x9f\xbf" },
+        { "&#xE000;\"", "\xee\x80\x80" },
+        { "&#x10FFFF;\"", "\xf4\x8f\xbf\xbf" },
+        { "&#00000065;&#x0000041;\"", "AA" },
+        /* Surrogates, values above 0x10FFFF, null and malformed references are left as they are */
+        { "&#xD800;&#xdfff;&#55296;&#57343;\"", "&#xD800;&#xdfff;&#55296;&#57343;" },
+        { "&#x110000;&#1114112;&#xFFFFFFF;&#99999999;\"", "&#x110000;&#1114112;&#xFFFFFFF;&#99999999;" },
+        { "&#0;&#x0;\"", "&#0;&#x0;" },
+        { "&#000000065;&#x00000041;\"", "&#000000065;&#x00000041;" },
+        { "&#;&#x;&#65&#x41 &#-65;&#x-41;\"", "&#;&#x;&#65&#x41 &#-65;&#x-41;" },
+        { "&nbsp;&am;&amp&\"", "&nbsp;&am;&amp&" },
+        { "&amp;lt;&amp;#65;\"", "&lt;&#65;" },
+        { "&quot;&apos;&lt;&gt;\"", "\"'<>" },
+        { "\xc3\xa9\xe4\xb8\xad\"", "\xc3\xa9\xe4\xb8\xad" },
+    };
+    char got[64];
+    int i;
+
+    for(i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++)
+    {
+        const char *p = cases[i].value;
+        size_t len = osm_xml_unescape(got, sizeof(got), &p);
+
+        if(len != strlen(cases[i].expected) || strcmp(got, cases[i].expected) != 0)
+            fail("entity", cases[i].value, cases[i].expected, strlen(cases[i].expected), got, len);
+        else if(*p != '\0')
+            fail("entity end", cases[i].value, "", 0, p, strlen(p));
+    }
+
+    return;
+}
+
+/* Values longer than the buffer are cut at the last whole character that
+ * fits, and the rest of the value is skipped */
+static void check_truncation(void)
+{
+    static const struct { const char *value; size_t size; const char *expected, *rest; } cases[] = {
+        { "abcdef\" x", 4, "abc", " x" },
+        { "abc\" x", 4, "abc", " x" },
+        { "abcd\" x", 4, "abc", " x" },
+        { "abc\" x", 1, "", " x" },
+        { "a\xc3\xa9\" x", 3, "a", " x" },
+        { "a\xc3\xa9\" x", 4, "a\xc3\xa9", " x" },
+        { "\xe4\xb8\xad\xe4\xb8\xad\" x", 6, "\xe4\xb8\xad", " x" },
+        { "\xf0\x9f\x98\x80\" x", 4, "", " x" },
+        { "ab&amp;c\" x", 3, "ab", " x" },
+        { "ab&amp;c\" x", 4, "ab&", " x" },
+        { "a&#233;b\" x", 2, "a", " x" },
+        { "a&#233;b\" x", 3, "a", " x" },
+        { "a&#233;b\" x", 4, "a\xc3\xa9", " x" },
+        { "a&#x1F600;&amp;\" x", 5, "a", " x" },
+        { "abcdefghijklmnopqrstuvwxyz&quot;\" x", 17, "abcdefghijklmnop", " x" },
+        { "abcdefghijklmnopqrstuvwxyz0123456789\" x", 33, "abcdefghijklmnopqrstuvwxyz012345", " x" },
+        /* Without a closing quote the source is left at the end of the string */
+        { "abcdef", 4, "abc", "" },
+        { "abc", 8, "abc", "" },
+    };
+    char got[64];
+    int i;
+
+    for(i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++)
+    {
+        const char *p = cases[i].value;
+        size_t len;
+
+        memset(got, 'X', sizeof(got));
+        len = osm_xml_unescape(got, cases[i].size, &p);
+        if(len != strlen(cases[i].expected) || strcmp(got, cases[i].expected) != 0)
+            fail("truncation", cases[i].value, cases[i].expected, strlen(cases[i].expected), got, len);
+        else if(strcmp(p, cases[i].rest) != 0)
+            fail("truncation end", cases[i].value, cases[i].rest, strlen(cases[i].rest), p, strlen(p));
+        else if(got[cases[i].size] != 'X')
+            fail("truncation size", cases[i].value, "", 0, got, cases[i].size + 1);
+    }
+
+    return;
+}
+
+/* Characters the old code escaped differently */
+static void check_escape(void)
+{
+    static const struct { const char *str, *expected; } cases[] = {
+        { "&#65;", "&amp;#65;" },
+        { "\x01\x09\x0a\x1f\x7f", "&#1;&#9;&#10;&#31;&#127;" },
+        { "\xc3\xa9\xe4\xb8\xad\x80\xff", "\xc3\xa9\xe4\xb8\xad\x80\xff" },
+        { "<\"a&b\">", "&lt;&quot;a&amp;b&quot;&gt;" },
+        { "", "" },
+    };
+    char got[64];
+    int i;
+
+    for(i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++)
+    {
+        size_t len = osm_xml_escape(got, cases[i].str);
+
+        if(len != strlen(cases[i].expected) || strcmp(got, cases[i].expected) != 0)
+            fail("escape", cases[i].str, cases[i].expected, strlen(cases[i].expected), got, len);
+    }
+
+    return;
+}
+
+static void print_bytes(const char *label, const char *str, size_t len)
+{
+    size_t i;
+
+    fprintf(stderr, "  %-8s ", label);
+    for(i = 0; i < len; i++)
+    {
+        unsigned char c = str[i];
+
+        if(c >= 0x20 && c < 0x7f)
+            fputc(c, stderr);
+        else
+            fprintf(stderr, "\\x%02x", c);
+    }
+    fputc('\n', stderr);
+
+    return;
+}
+
+static void fail(const char *what, const char *input, const char *expected, size_t expected_len,
+                 const char *got, size_t got_len)
+{
+    if(failures++ < 10)
+    {
+        fprintf(stderr, "escape: %s mismatch\n", what);
+        print_bytes("input", input, strlen(input));
+        print_bytes("expected", expected, expected_len);
+        print_bytes("got", got, got_len);
+    }
+
+    return;
+}
+
+int main(void)
+{
+    srand(1);
+    compare_random();
+    check_entities();
+    check_truncation();
+    check_escape();
+
+    if(failures)
+    {
+        fprintf(stderr, "escape: %d failures\n", failures);
+        return 1;
+    }
+#ifdef __SSE2__
+    printf("escape: ok (SSE2)\n");
+#else
+    printf("escape: ok\n");
+#endif
+
+    return 0;
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Extracts a small full-history file with --history, and with --as-of
+# two earlier times, and checks the versions kept against
+# history.expected.
+
+dir=`dirname $0`
+tmp=${TMPDIR:-/tmp}/osmrail-check.$$
+trap 'rm -f $tmp.*' 0
+
+./osmrail -H -o $tmp.latest.osm $dir/history.osm 2>/dev/null || exit 1
+./osmrail -T 2012-01-01T00:00:00Z -o $tmp.2012.osm $dir/history.osm 2>/dev/null || exit 1
+./osmrail -T 2010-06-01T00:00:00Z -o $tmp.2010.osm $dir/history.osm 2>/dev/null || exit 1
+cat $tmp.latest.osm $tmp.2012.osm $tmp.2010.osm > $tmp.out
+if ! diff $dir/history.expected $tmp.out; then
+    echo "history: wrong versions kept" >&2
+    exit 1
+fi
+echo "history: ok"
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Extracts the elements listed in ids.list, some of them missing, from a
+# made-up planet with --ids, plain and bzip2-compressed, and checks the
+# output against ids.expected. Then extracts them twice more with
+# --seek-cache, checking that the sample is kept and that the output of
+# the run that uses it is unchanged, and that it is not used once the
+# input has changed.
+
+dir=`dirname $0`
+tmp=${TMPDIR:-/tmp}/osmrail-check.$$
+trap 'rm -f $tmp.*' 0
+
+sh $dir/planet.sh > $tmp.planet.osm
+bzip2 -1 -c $tmp.planet.osm > $tmp.planet.osm.bz2 || exit 1
+
+./osmrail -I $dir/ids.list -o $tmp.osm $tmp.planet.osm 2>/dev/null || exit 1
+if ! diff $dir/ids.expected $tmp.osm; then
+    echo "ids: wrong elements from plain XML" >&2
+    exit 1
+fi
+./osmrail -I $dir/ids.list -o $tmp.osm $tmp.planet.osm.bz2 2>/dev/null || exit 1
+if ! diff $dir/ids.expected $tmp.osm; then
+    echo "ids: wrong elements from bzip2" >&2
+    exit 1
+fi
+
+for run in saved used; do
+    ./osmrail -I $dir/ids.list -k $tmp.seek -o $tmp.osm $tmp.planet.osm.bz2 2>/dev/null || exit 1
+    if [ ! -s $tmp.seek ]; then
+        echo "ids: no sample saved with --seek-cache" >&2
+        exit 1
+    fi
+    if ! diff $dir/ids.expected $tmp.osm; then
+        echo "ids: wrong elements with the sample $run" >&2
+        exit 1
+    fi
+done
+sh $dir/planet.sh 120000 | bzip2 -1 > $tmp.planet.osm.bz2
+./osmrail -I $dir/ids.list -o $tmp.expected $tmp.planet.osm.bz2 2>/dev/null || exit 1
+./osmrail -I $dir/ids.list -k $tmp.seek -o $tmp.osm $tmp.planet.osm.bz2 2>/dev/null || exit 1
+if ! cmp $tmp.expected $tmp.osm; then
+    echo "ids: sample of a changed input used" >&2
+    exit 1
+fi
+echo "ids: ok"
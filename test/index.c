@@ -0,0 +1,84 @@
+/*
+ * osmrail - OpenStreetMap filter for railway-related features
+ * Copyright (C) 2011 Paul D Kelly
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Looks up elements of an extract through the index written for it with
+ * osmrail -x, for test/index.sh. Each line of standard input names an
+ * element as in an --ids list, e.g. "w123", and the text of the element
+ * found with osm_index_find() is written to standard output, or a line
+ * saying it was not found. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "osm.h"
+
+int main(int argc, char **argv)
+{
+    struct osm_index *idx;
+    char query[64];
+    FILE *fp;
+    int ret = 0;
+
+    if(argc != 3)
+    {
+        fprintf(stderr, "Usage: %s <extract.osm> <index>\n", argv[0]);
+        return 1;
+    }
+    if( !(fp = fopen(argv[1], "rb")))
+    {
+        fprintf(stderr, "Unable to open extract <%s>\n", argv[1]);
+        return 1;
+    }
+    if( !(idx = osm_index_load(argv[2])))
+        return 1;
+
+    while(fgets(query, sizeof(query), stdin))
+    {
+        const char *types = "nwr", *t;
+        unsigned int id;
+        char *text;
+        size_t len;
+        int found;
+
+        query[strcspn(query, "\r\n")] = '\0';
+        if( !(t = strchr(types, query[0])) || query[0] == '\0' || sscanf(query + 1, "%u", &id) != 1)
+        {
+            fprintf(stderr, "Invalid query <%s>\n", query);
+            ret = 1;
+            continue;
+        }
+        if((found = osm_index_find(idx, fp, t - types, id, &text, &len)) < 0)
+        {
+            ret = 1;
+            break;
+        }
+        if(found == 0)
+        {
+            fwrite(text, 1, len, stdout);
+            free(text);
+        }
+        else
+            printf("%s not found\n", query);
+    }
+    osm_index_free(idx);
+    fclose(fp);
+
+    return ret;
+}
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Extracts a made-up planet with an index, looks up every element of the
+# extract through the index with test/index and checks that each reads
+# back as written, then checks the replies to the lookups in
+# index.queries, some of elements not in the extract, against
+# index.expected.
+
+dir=`dirname $0`
+tmp=${TMPDIR:-/tmp}/osmrail-check.$$
+trap 'rm -f $tmp.*' 0
+
+sh $dir/planet.sh > $tmp.planet.osm
+./osmrail -x $tmp.idx -o $tmp.osm $tmp.planet.osm 2>/dev/null || exit 1
+
+sed -n 's/^  <\([nwr]\)[a-z]* id="\([0-9]*\)".*/\1\2/p' $tmp.osm > $tmp.all
+test/index $tmp.osm $tmp.idx < $tmp.all > $tmp.found || exit 1
+if ! sed '1,2d;$d' $tmp.osm | cmp -s - $tmp.found; then
+    echo "index: elements not read back as written" >&2
+    exit 1
+fi
+
+test/index $tmp.osm $tmp.idx < $dir/index.queries > $tmp.out || exit 1
+if ! diff $dir/index.expected $tmp.out; then
+    echo "index: wrong replies" >&2
+    exit 1
+fi
+echo "index: ok"
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Writes the sample extract, and a made-up planet of several PBF blocks,
+# as PBF, reads them back and checks that the XML written from the PBF
+# is that written from the XML directly.
+
+dir=`dirname $0`
+tmp=${TMPDIR:-/tmp}/osmrail-check.$$
+trap 'rm -f $tmp.*' 0
+
+./osmrail -o $tmp.pbf $dir/sample.osm 2>/dev/null || exit 1
+./osmrail -o $tmp.osm $tmp.pbf 2>/dev/null || exit 1
+if ! diff $dir/sample.expected $tmp.osm; then
+    echo "pbf: wrong sample read back" >&2
+    exit 1
+fi
+
+sh $dir/planet.sh > $tmp.planet.osm
+./osmrail -o $tmp.xml.osm $tmp.planet.osm 2>/dev/null || exit 1
+./osmrail -o $tmp.pbf $tmp.planet.osm 2>/dev/null || exit 1
+./osmrail -o $tmp.osm $tmp.pbf 2>/dev/null || exit 1
+if ! cmp $tmp.xml.osm $tmp.osm; then
+    echo "pbf: wrong planet read back" >&2
+    exit 1
+fi
+echo "pbf: ok"
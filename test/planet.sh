@@ -0,0 +1,48 @@
+#!/bin/sh
+# Writes a made-up planet file, sorted by type and ID as planet files
+# are, to standard output: N nodes (default 60000) in a grid, a way
+# through every 5 nodes, every third of them a railway and the others
+# highways, and for every 50 ways a route=train relation of the first
+# 10 of them, with a stop node. The other highways are filtered out.
+
+awk -v n=${1:-60000} 'BEGIN {
+    print "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+    print "<osm version=\"0.6\" generator=\"planet.sh\">"
+    for(i = 1; i <= n; i++)
+    {
+        lat = 50 + (i % 997) / 1000
+        lon = -2 + int(i / 997) / 100
+        if(i % 1000 == 0)
+        {
+            printf " <node id=\"%d\" version=\"%d\" lat=\"%.7f\" lon=\"%.7f\">\n", i, i % 7 + 1, lat, lon
+            printf "  <tag k=\"railway\" v=\"station\"/>\n"
+            printf "  <tag k=\"name\" v=\"Station %d &amp; Yard\"/>\n", i / 1000
+            print " </node>"
+        }
+        else
+            printf " <node id=\"%d\" version=\"%d\" lat=\"%.7f\" lon=\"%.7f\"/>\n", i, i % 7 + 1, lat, lon
+    }
+    for(w = 1; w <= n / 5; w++)
+    {
+        printf " <way id=\"%d\" version=\"%d\">\n", w, w % 5 + 1
+        for(i = 5 * w - 4; i <= 5 * w; i++)
+            printf "  <nd ref=\"%d\"/>\n", i
+        if(w % 3 == 0)
+            print "  <tag k=\"railway\" v=\"rail\"/>"
+        else
+            print "  <tag k=\"highway\" v=\"track\"/>"
+        print " </way>"
+    }
+    for(r = 1; r <= n / 250; r++)
+    {
+        printf " <relation id=\"%d\" version=\"1\">\n", r
+        printf "  <member type=\"node\" ref=\"%d\" role=\"stop\"/>\n", 250 * r - 249
+        for(w = 50 * r - 49; w <= 50 * r - 40; w++)
+            printf "  <member type=\"way\" ref=\"%d\" role=\"\"/>\n", w
+        print "  <tag k=\"type\" v=\"route\"/>"
+        print "  <tag k=\"route\" v=\"train\"/>"
+        printf "  <tag k=\"name\" v=\"Line %d\"/>\n", r
+        print " </relation>"
+    }
+    print "</osm>"
+}'
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Writes the train routes of the sample extract, and of a small made-up
+# planet, with --routes and checks the GeoJSON against routes.expected,
+# then checks that the routes of the planet read from PBF are the same.
+
+dir=`dirname $0`
+tmp=${TMPDIR:-/tmp}/osmrail-check.$$
+trap 'rm -f $tmp.*' 0
+
+sh $dir/planet.sh 750 > $tmp.planet.osm
+./osmrail -l $tmp.sample.geojson -o $tmp.osm $dir/sample.osm 2>/dev/null || exit 1
+./osmrail -l $tmp.planet.geojson -o $tmp.osm $tmp.planet.osm 2>/dev/null || exit 1
+if ! cat $tmp.sample.geojson $tmp.planet.geojson | diff $dir/routes.expected -; then
+    echo "routes: wrong routes" >&2
+    exit 1
+fi
+
+./osmrail -o $tmp.pbf $tmp.planet.osm 2>/dev/null || exit 1
+./osmrail -l $tmp.geojson -o $tmp.osm $tmp.pbf 2>/dev/null || exit 1
+if ! cmp $tmp.planet.geojson $tmp.geojson; then
+    echo "routes: wrong routes from PBF" >&2
+    exit 1
+fi
+echo "routes: ok"
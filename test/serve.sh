@@ -0,0 +1,31 @@
+#!/bin/sh
+# Starts osmrail --serve on the sample extract, checks its replies to the
+# queries in serve.queries against serve.expected and then runs a short
+# load with osmload, which fails if any query gets an error.
+
+dir=`dirname $0`
+sock=${TMPDIR:-/tmp}/osmrail-check.$$
+out=${TMPDIR:-/tmp}/osmrail-check.$$.out
+
+rm -f $sock
+./osmrail -S $sock $dir/sample.osm 2>/dev/null &
+pid=$!
+trap 'kill $pid 2>/dev/null; rm -f $sock $out' 0
+
+tries=0
+while [ ! -S $sock ]; do
+    tries=`expr $tries + 1`
+    if [ $tries -gt 50 ] || ! kill -0 $pid 2>/dev/null; then
+        echo "serve: server did not start" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+./osmload -r $sock < $dir/serve.queries > $out || exit 1
+if ! diff $dir/serve.expected $out; then
+    echo "serve: wrong replies" >&2
+    exit 1
+fi
+./osmload -c 2 -n 1000 $sock > /dev/null || exit 1
+echo "serve: ok"